@@ -1,4 +1,5 @@
 #define FUSE_USE_VERSION 31
+#define _GNU_SOURCE         // for fallocate
 
 #include <stdio.h>
 #include <stdarg.h>
@@ -13,6 +14,17 @@
 #include <errno.h>
 #include <fuse.h>
 #include <sys/statvfs.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <stddef.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
 
 #define FSSIZE 10000000
 #define BLOCKSIZE 512
@@ -29,7 +41,125 @@
 #define ATTR_VOLUME_ID 0x08
 #define ATTR_DIRECTORY 0x10
 #define ATTR_ARCHIVE 0x20
-#define ATTR_DELETED 0xE5
+#define ATTR_DELETED ((char)0xE5)   // attributes is a plain char, so compare against the same type
+
+// The superblock sits at the end of the image, past the last block. Images written before it existed
+// have zeroes there, and are upgraded when they are loaded
+#define SUPERBLOCKMAGIC 0x54414643  // "CFAT"
+#define SUPERBLOCKOFFSET (FSSIZE - BLOCKSIZE)
+#define FSVERSION 6                 // newest version this build understands. images stay at the oldest one that reads them
+#define FEATURE_NAMEHASH 0x0001     // every directory entry carries a hash of its name
+#define FEATURE_ORPHANS 0x0002      // the superblock holds a list of chains still to be freed
+#define FEATURE_HOLES 0x0004        // chains may link to holes. needs version 2 to read
+#define FEATURE_PACKED 0x0008       // small files share blocks. needs version 3 to read
+#define FEATURE_COMPRESSED 0x0010   // chunks of files may be compressed. needs version 4 to read
+#define FEATURE_CHECKSUMS 0x0020    // blocks of file data have checksums. needs version 5 to write, so they're kept up to date
+#define FEATURE_SHARED 0x0040       // files may share blocks. needs version 6 to read
+
+// Chains detached by unlink and truncate wait in the superblock until they are freed. The records are
+// rewritten in an order that survives the program stopping at any point, which only needs the compiler
+// to keep the stores in order, since the mapping outlives the process
+#define MAXORPHANS 63               // slots that fit in the rest of the superblock
+#define ORPHANFATLINK USHRT_MAX     // ownerSlot of a chain cut off from the link after ownerBlock
+#define ORDERSTORES() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+
+// Holes in files. Blocks of a file that were never written have no storage, and a run of them is one
+// link in the file's chain, past the range of block numbers, to a slot in a table of holes. The table
+// sits in the space between the last block and the superblock, which was always left zeroed. The first
+// block of a file is always stored
+#define HOLETABLEOFFSET (MAXBLOCKS * sizeof(short) + MAXBLOCKS * BLOCKSIZE)
+#define MAXHOLES 16384              // slots in the hole table
+#define HOLEBASE 0x8000             // link to the first slot of the hole table
+#define ISHOLE(link) ((link) >= HOLEBASE && (link) < HOLEBASE + MAXHOLES)
+#define ZEROBUFFERSIZE (MAXIOBLOCKS * BLOCKSIZE)   // zeroes written for a hole at a time when exporting
+
+// Small files. A file of up to PACKMAXSIZE bytes shares a pack block with other small files instead of
+// having a block of its own. A pack block is cut into units, the first of which holds a bitmap of the
+// units in use, and a file's data takes a run of them. first_cluster_high marks the file as packed and
+// says which unit its data starts at, first_cluster_low says which block. An empty file takes no units
+// and no block. Packed files are only read where they are. Anything that changes one moves it back into
+// a block of its own first, and it is packed again once it's closed
+#define PACKMAGIC 0x4B415043        // "CPAK"
+#define PACKUNIT 16                 // bytes in a unit of a pack block
+#define PACKUNITS (BLOCKSIZE / PACKUNIT)   // units in a pack block, one bit each in the bitmap
+#define PACKMAXSIZE 256             // largest file that is packed
+#define PACKEDFILE 0x4000           // flag in first_cluster_high of a packed file
+#define PACKUNITMASK 0x00FF         // unit the data starts at, in first_cluster_high of a packed file
+#define ISPACKED(entry) (((entry)->first_cluster_high & PACKEDFILE) != 0)
+
+// Compressed files. A file marked for compression is cut into chunks of CHUNKBLOCKS blocks, each
+// compressed on its own, so any part of the file can be read by decompressing one chunk. A compressed
+// chunk keeps its data in its first blocks, in the LZ4 block format, and the rest of the chunk is a hole
+// in the chain whose compressedSize says how many bytes of data come before it. A snapshot or clone of the
+// file links to the data blocks through references instead, one starting at each chunk. Reads decompress
+// chunks where they are. Anything that changes a file turns the chunks it touches back into plain blocks
+// of its own first, and they are compressed again once the file is closed
+#define CHUNKBLOCKS 32              // blocks in a chunk
+#define CHUNKSIZE (CHUNKBLOCKS * BLOCKSIZE)
+#define COMPRESSEDFILE 0x2000       // flag in first_cluster_high of a file whose chunks are compressed
+#define ISCOMPRESSED(entry) (((entry)->first_cluster_high & COMPRESSEDFILE) != 0)
+#define COMPRESSEDIOSIZE (64 * CHUNKSIZE)   // bytes of a compressed file decompressed at a time when exporting
+#define LZHASHLOG 12                // bits of the hash of 4 bytes the compressor finds matches with
+#define LZMINMATCH 4                // shortest match
+#define LZLASTLITERALS 5            // bytes at the end of a chunk that are never part of a match
+#define LZMFLIMIT 12                // bytes at the end of a chunk a match can't start in
+
+// Checksums. Each block of file data has a CRC32C of its contents in a table after the hole table, set
+// wherever file data is written and checked as it's read. Blocks of directories go without, since their
+// entries are changed in place all over, and so does any block whose checksum comes out as 0, which is
+// how a block without one is marked. Images made before checksums existed don't get them
+#define CHECKSUMTABLEOFFSET (HOLETABLEOFFSET + MAXHOLES * sizeof(hole))
+#define VERIFYOFF 0                 // checksums are kept but not checked on reads
+#define VERIFYSAMPLED 1             // one block read in CHECKSUMSAMPLERATE is checked
+#define VERIFYALWAYS 2              // every block read is checked
+#define CHECKSUMSAMPLERATE 16
+#define SCRUBRANGE 256              // blocks a scrub worker takes at a time
+#define SCRUBBADCHECKSUM 1          // the block's data doesn't match its checksum
+#define SCRUBBADLINK 2              // the block's FAT entry points outside the image
+
+// Shared blocks. Files can share blocks that have the same data instead of each keeping a copy. A file
+// links to shared blocks through a reference: a hole in its chain whose compressedSize has REFERENCE set,
+// with the rest of it saying which block the run of shared blocks starts at. The block stays in the chain
+// it was first written in, if that file still has it, and a table after the checksums counts how many
+// more links each block has than that one, so it's only freed when the last of them goes. Anything that
+// changes a file gives it its own copies of the shared blocks it touches first, like compressed chunks
+// are expanded. Identical blocks are found through an index of their checksums kept in memory, which is
+// built from the files in the image the first time it's needed
+#define REFCOUNTTABLEOFFSET (CHECKSUMTABLEOFFSET + MAXBLOCKS * sizeof(unsigned int))
+#define REFERENCE 0x8000            // flag in compressedSize of a hole that stands for shared blocks
+#define ISREFERENCE(link) (ISHOLE(link) && (holes[(link) - HOLEBASE].compressedSize & REFERENCE))
+#define REFERENCEBLOCK(link) (holes[(link) - HOLEBASE].compressedSize & ~REFERENCE)   // first block it stands for
+#define MAXREFCOUNT UCHAR_MAX       // most extra links a block can have
+#define SHAREDBLOCK 0x7FFF          // FAT entry of a shared block that no chain runs through any more
+#define RESERVEDBLOCK 0x7FFE        // FAT entry of a block past the end of a volume that was shrunk
+#define DEDUPINDEXSIZE 32768        // slots in the index of block checksums, a power of 2
+
+// Snapshots. A snapshot is a copy of the directory tree as it was when it was taken, kept out of sight of
+// the live one. Its directories are copied, but its files link to the live files' blocks through
+// references, so only the first block of each file and the data of compressed chunks are copied, and
+// writing a live file afterwards gives it new blocks like any other shared block. A table after the
+// reference counts says where each snapshot's root directory is. Removing one marks it, and its entries
+// are then handed to the orphan list a few at a time
+#define SNAPSHOTTABLEOFFSET (REFCOUNTTABLEOFFSET + MAXBLOCKS)
+#define MAXSNAPSHOTS 32             // snapshots an image can hold
+#define SNAPSHOTLIVE 1              // state of a snapshot that can be read
+#define SNAPSHOTDELETING 2          // state of a snapshot being removed, or taken when the program stopped
+#define SNAPSHOTBATCH 64            // entries the worker removes from snapshots before letting callbacks in
+
+// Defragmentation. A file written a piece at a time, or while others were, ends up with its blocks spread
+// over the image. Defragmenting moves the blocks each file has to itself into one run of free blocks, in
+// file order. Blocks shared with other files stay put, since references and other chains point at them
+#define DEFRAGBATCH 256             // blocks the worker moves before letting callbacks in
+
+// Compaction. Every block in use slides down to the front of the image, keeping its order, and every link
+// to a block is rewritten to where it went: the FAT, the hole table, the entries and indexes of
+// directories and the snapshot table. The result is written to a new file beside the image and renamed
+// over it, like a transaction, so the free blocks at the end are never written and take no space
+#define COMPACTRANGE 256            // FAT entries, hole slots or directory blocks a worker takes at a time
+#define COMPACTDIRECTORY 1          // a block of a directory's entries
+#define COMPACTINDEXHEADER 2        // the first block of a directory's index
+#define COMPACTINDEXTABLE 3         // a block of an index's bucket table
+#define COMPACTINDEXBUCKET 4        // a bucket of an index
 
 
 typedef struct dirEntry {
@@ -37,7 +167,7 @@ typedef struct dirEntry {
     char attributes;             // attributes of the file or directory
     // char _reserved;           // reserved. FAT specs it, but i'm using it for an end bit
     char isLast;                 // flag to indicate if this is the last entry in the directory
-    char create_time_tenth;      // create time (tenths of second)
+    unsigned char name_hash;     // hash of the name, 0 if unknown. FAT keeps create time tenths here, which were never tracked
     short create_time;           // create time
     short create_date;           // create date
     short last_access_date;      // last access date
@@ -52,10 +182,345 @@ typedef struct block{
     char data[BLOCKSIZE];   //data of the block
 }block;
 
+typedef struct blockRange {
+    unsigned short start;        // first block of the run
+    unsigned short count;        // number of blocks in the run
+} blockRange;
+
+typedef struct hole {
+    unsigned int length;         // number of blocks of the file in the hole, 0 if the slot is free
+    unsigned short next;         // link after the hole, like a FAT entry
+    unsigned short compressedSize;   // bytes of compressed data before the hole if it ends a compressed chunk, else 0,
+                                     // or REFERENCE and the first block of the run if it stands for shared blocks
+} hole;
+
+typedef struct chunkCache {
+    unsigned short block;        // first block of the compressed chunk, 0 if nothing is cached
+    unsigned short compressedSize;   // bytes of compressed data it had
+    unsigned int generation;     // chunkGeneration when it was decompressed
+    char data[CHUNKSIZE];        // the chunk, decompressed
+} chunkCache;
+
+typedef struct dedupSlot {
+    unsigned int fingerprint;    // checksum of the block's data when it was put in the index
+    unsigned short block;        // the block, 0 if the slot is empty
+} dedupSlot;
+
+typedef struct snapshot {
+    char name[MAXFILENAME + 1];  // name of the snapshot, null terminated
+    unsigned short state;        // SNAPSHOTLIVE or SNAPSHOTDELETING, 0 if the slot is empty
+    unsigned short root;         // first block of its root directory
+    unsigned int created;        // when it was taken, in seconds since the epoch
+} snapshot;
+
+typedef struct scrubJob {
+    unsigned int nextBlock;      // first block of the next range for a worker to check, taken atomically
+    unsigned int numChecked;     // blocks with a checksum checked, updated atomically
+    unsigned int numBad;         // blocks found bad, updated atomically
+    unsigned char* bad;          // for each block, SCRUBBADCHECKSUM, SCRUBBADLINK or 0
+} scrubJob;
+
+typedef struct compactJob {
+    unsigned int nextRange;      // next range for a worker to rewrite, taken atomically
+    unsigned int numFATRanges;   // ranges of the FAT, numbered first
+    unsigned int numHoleRanges;  // ranges of the hole table, numbered after them
+    unsigned int numMetaBlocks;  // blocks of directories and indexes, in ranges after those
+    unsigned short* map;         // where each block in use went
+    unsigned short* metaBlocks;  // the directory and index blocks, where they were
+    unsigned char* metaKinds;    // COMPACTDIRECTORY and so on for each
+} compactJob;
+
+typedef struct packHeader {
+    unsigned int magic;          // PACKMAGIC
+    unsigned int used;           // bit i is set if unit i is in use. unit 0 is the header
+} packHeader;
+
+typedef struct orphan {
+    unsigned short head;         // first block of the chain still to be freed, 0 if the slot is empty
+    unsigned short ownerBlock;   // block holding the link the chain was cut from
+    unsigned short ownerSlot;    // directory entry in ownerBlock that pointed at the chain, or ORPHANFATLINK for the link after it
+    unsigned short lastFreed;    // block freed just before head, 0 if none has been yet
+} orphan;
+
+typedef struct superblock {
+    unsigned int magic;          // SUPERBLOCKMAGIC
+    unsigned short version;      // version of the format the image was last written with
+    unsigned short features;     // FEATURE_ flags in use on the image
+    orphan orphans[MAXORPHANS];  // chains detached from their files and not freed yet
+} superblock;
+
+#define DIRENTRIES (BLOCKSIZE / sizeof(dirEntry))   // number of directory entries in a block
+#define DIRCOMPACTTHRESHOLD DIRENTRIES              // dead slots a directory can hold before it is compacted
+#define MAXPENDINGCOMPACTIONS 64                    // directories that can wait for the compaction worker
+#define MAXPENDINGHOLES 256                         // runs of freed blocks that can wait to be punched out of the image
+#define ORPHANBATCH 1024                            // orphaned blocks the worker frees before letting callbacks in
+#define MAXIOBLOCKS 128                             // most contiguous blocks moved by one read or write of a host file
+#define MAXIOTHREADS 16                             // most threads moving host files during an import or extract
+#define COMMITCHUNKSIZE 4096                        // bytes of a transaction's image checked for zeroes and written at a time
+
+// Indexed directories. The entries stay in the directory's own blocks, so everything that walks a
+// directory still works, but an extendible hash keyed by name points at them. The index lives in its
+// own chain of blocks, and the first block of that chain is stored in the size field of the
+// directory's . entry (directories otherwise always have size 0)
+#define DIRINDEXMAGIC 0x58444943                    // "CIDX"
+#define DIRINDEXTHRESHOLD 8                         // blocks in a plain directory before it gets an index
+#define MAXINDEXTABLEBLOCKS 64                      // blocks the bucket table can span (depth 14)
+#define MAXINDEXFREESLOTS 64                        // deleted entries the index remembers for reuse
+#define TABLEENTRIES (BLOCKSIZE / sizeof(unsigned short))   // bucket pointers in a table block
+
+typedef struct dirIndexSlot {
+    unsigned short block;        // block of the directory holding the entry
+    unsigned short entry;        // index of the entry in the block
+} dirIndexSlot;
+
+typedef struct dirIndexHeader {
+    unsigned int magic;                                 // DIRINDEXMAGIC
+    unsigned int numEntries;                            // entries in the directory, not counting . and ..
+    unsigned int numDeleted;                            // deleted entries left in the directory
+    unsigned short globalDepth;                         // number of hash bits used by the bucket table
+    unsigned short lastIndexBlock;                      // last block in the index chain
+    unsigned short lastDirBlock;                        // block of the directory holding its last entry
+    unsigned short numFreeSlots;                        // number of remembered deleted entries
+    unsigned short tableBlocks[MAXINDEXTABLEBLOCKS];    // blocks holding the bucket table
+    dirIndexSlot freeSlots[MAXINDEXFREESLOTS];          // deleted entries that can be reused
+} dirIndexHeader;
+
+typedef struct dirIndexRef {
+    unsigned int hash;           // full hash of the entry's name
+    unsigned short block;        // block of the directory holding the entry
+    unsigned short entry;        // index of the entry in the block
+} dirIndexRef;
+
+#define BUCKETREFS ((BLOCKSIZE - 2 * sizeof(unsigned int)) / sizeof(dirIndexRef))
+
+typedef struct dirIndexBucket {
+    unsigned int localDepth;     // number of hash bits shared by every entry in the bucket
+    unsigned int count;          // number of refs in the bucket
+    dirIndexRef refs[BUCKETREFS];
+} dirIndexBucket;
+
+// Scanning a directory block. The first 16 bytes of an entry hold the name, attributes and isLast, so
+// one 16 byte compare per entry against a pattern answers "does the name match", "is it deleted" and
+// "is it the last entry" together. The kernels report one bit per entry, and a SIMD version is picked
+// for the running CPU the first time a block is scanned
+#define SCANPATTERNSIZE 16
+#define SCANATTRIBUTES MAXFILENAME              // offset of attributes in an entry
+#define SCANISLAST (MAXFILENAME + 1)            // offset of isLast in an entry
+#define SCANNAMEHASH (MAXFILENAME + 2)          // offset of name_hash in an entry
+
+typedef struct dirBlockMasks {
+    unsigned int match;          // bit i is set if the name of entry i matches
+    unsigned int deleted;        // bit i is set if entry i is deleted
+    unsigned int last;           // bit i is set if entry i is the last in the directory
+    int nonZero;                 // nonzero if any byte of the block is
+} dirBlockMasks;
+
+typedef struct dirBlockScan {
+    unsigned short match;        // first entry up to the last one whose name matches, or USHRT_MAX
+    unsigned short deleted;      // first deleted entry up to the last one, or USHRT_MAX
+    unsigned short last;         // entry marked as the last in the directory, or USHRT_MAX
+    unsigned short empty;        // 1 if the whole block is zeroes
+} dirBlockScan;
+
+// Importing a host directory tree. The tree is walked first without touching the image, then every
+// directory and file entry is created and every file's blocks are reserved in one pass, and finally a
+// pool of threads reads the files straight into their blocks. The entries of each host directory sit
+// next to each other in the list, so they are inserted into their directory together
+typedef struct importEntry {
+    char* hostPath;                  // path of the file or directory on the host
+    char name[MAXFILENAME + 1];      // name it gets in the image
+    int parent;                      // entry of the directory it goes in, or -1 for the destination
+    int isDirectory;                 // nonzero for directories
+    int isNew;                       // nonzero if the import created it, so it can't already hold a name
+    unsigned int size;               // size of the file when the tree was walked
+    dirEntry* entry;                 // its entry in the image, once created
+    unsigned short firstBlock;       // first block reserved for a file
+} importEntry;
+
+typedef struct importList {
+    importEntry* entries;            // files and directories to import, in walk order
+    unsigned int count;              // number of entries
+    unsigned int capacity;           // number of entries there's room for
+    unsigned long long numBlocks;    // blocks the files and directories will need, roughly
+    unsigned int nextEntry;          // next entry for a worker to read, taken atomically
+    unsigned int numFailed;          // files that couldn't be read, updated atomically
+} importList;
+
+// Extracting a directory tree. The host directories are made while the image is walked, then a pool of
+// threads writes the files straight from the mapping, and the directories get their times last, since
+// writing into a directory changes them
+typedef struct extractEntry {
+    dirEntry* entry;                 // file or directory in the image
+    char* hostPath;                  // where it goes on the host
+} extractEntry;
+
+typedef struct extractList {
+    extractEntry* entries;           // files and directories to extract, in walk order
+    unsigned int count;              // number of entries
+    unsigned int capacity;           // number of entries there's room for
+    unsigned int nextEntry;          // next entry for a worker to write, taken atomically
+    unsigned int numFailed;          // files that couldn't be written, updated atomically
+} extractList;
+
+// Tar archives. A ustar header fills one record, and member data is padded out to whole records, which
+// are the same size as a block, so data moves between the archive and the image a run of blocks at a time
+#define TARRECORDSIZE 512
+
+typedef struct tarHeader {
+    char name[100];                  // path, or its last part if prefix is used
+    char mode[8];                    // octal permissions
+    char uid[8];                     // octal owner
+    char gid[8];                     // octal group
+    char size[12];                   // octal size of the data
+    char mtime[12];                  // octal modification time
+    char checksum[8];                // octal sum of the header's bytes
+    char typeflag;                   // '0' file, '5' directory, 'L' long name for the next member
+    char linkname[100];              // target of a link
+    char magic[6];                   // "ustar"
+    char version[2];                 // "00"
+    char uname[32];                  // owner's name
+    char gname[32];                  // group's name
+    char devmajor[8];                // device numbers
+    char devminor[8];
+    char prefix[155];                // front of a path too long for name
+    char pad[12];                    // fills the record
+} tarHeader;
+
 // prototypes
 unsigned short allocateNewBlock(unsigned short currentBlockIndex);
+dirEntry* allocateDirectoryEntry(dirEntry* parentDir, char* name);
+unsigned short allocateIndexBlock(dirIndexHeader* header);
+void buildDirectoryIndex(dirEntry* dir);
+void dropDirectoryIndex(dirEntry* dir);
+int entryNameMatches(dirEntry* entry, char* name, unsigned char nameHash);
+dirIndexHeader* getDirectoryIndex(dirEntry* dir);
+unsigned int hashName(char* name);
+void indexDirectoryEntry(dirIndexHeader* header, dirEntry* entry);
+dirEntry* lookupIndexedEntry(dirIndexHeader* header, char* name);
+void unindexDirectoryEntry(dirIndexHeader* header, dirEntry* entry);
+void cancelDirectoryCompaction(unsigned short firstBlockIndex);
+void compactDirectory(unsigned short firstBlockIndex);
+void compactPendingDirectories();
+void* compactionWorker(void* arg);
+void freeBlockChain(unsigned short blockIndex);
+unsigned short* chainLink(unsigned short link);
+unsigned int chainSpan(unsigned short link);
+int releaseLink(unsigned short link);
+void releaseSharedBlocks(unsigned short firstBlock, unsigned int numBlocks);
+unsigned short allocateReference(unsigned short firstBlock, unsigned int numBlocks, unsigned short next);
+unsigned short allocateHole(unsigned int length, unsigned short next);
+int growFile(dirEntry* file, unsigned int newSize);
+unsigned short fileBlockForWrite(unsigned short* block, unsigned int* position, unsigned int index);
+int readFileData(dirEntry* file, char* buffer, unsigned int size, unsigned int offset);
+long long seekFileData(dirEntry* file, long long offset, int whence);
+unsigned int countFileBlocks(dirEntry* file);
+unsigned int findFreeRun(unsigned int numBlocks);
+int allocateFileRange(dirEntry* file, unsigned int firstIndex, unsigned int numBlocks);
+void zeroFileRange(dirEntry* file, unsigned long long offset, unsigned long long end);
+int punchFileRange(dirEntry* file, unsigned long long offset, unsigned long long end);
+int mapFile(char* intpath, dirEntry* parentDir);
+unsigned short allocatePackUnits(unsigned int numUnits, unsigned int* unit);
+void freePackUnits(dirEntry* file);
+char* packedFileData(dirEntry* file);
+int packFile(dirEntry* file);
+int unpackFile(dirEntry* file);
+unsigned int compressChunk(const char* source, unsigned int sourceSize, char* dest, unsigned int maxSize);
+int decompressChunk(const char* source, unsigned int sourceSize, char* dest, unsigned int destSize);
+unsigned int chunkDataSize(unsigned short link);
+char* loadChunk(unsigned short link, unsigned int compressedSize);
+int chunkIsShared(unsigned short link, unsigned int compressedSize);
+int expandChunk(unsigned short link, unsigned int compressedSize);
+int expandFileRange(dirEntry* file, unsigned long long offset, unsigned long long end);
+int unshareFileRange(dirEntry* file, unsigned long long offset, unsigned long long end);
+unsigned int compressFile(dirEntry* file);
+void packOrCompressFile(dirEntry* file);
+int compressPath(char* intpath, dirEntry* parentDir);
+unsigned int blockFingerprint(unsigned short block);
+int dedupSlotIsLive(dedupSlot* slot);
+void indexBlock(unsigned short block, unsigned int fingerprint);
+unsigned short findDuplicateBlock(unsigned short block, unsigned int fingerprint);
+unsigned int dedupFile(dirEntry* file, int share);
+unsigned int dedupDirectory(dirEntry* dir, int share, unsigned int* numBlocks);
+void buildDedupIndex();
+unsigned int countSharedBlocks(dirEntry* file);
+void dedupfs();
+snapshot* findSnapshot(char* name);
+unsigned int countSnapshotBlocks(dirEntry* dir);
+int appendCloneLink(unsigned short* first, unsigned short* last, unsigned short block, int share, int newReference);
+int cloneFileChain(dirEntry* file, unsigned short* first);
+int cloneFile(dirEntry* source, dirEntry* dest);
+int clonePath(char* sourcePath, char* destPath, dirEntry* parentDir);
+int cloneDirectory(dirEntry* source, dirEntry* dest);
+int takeSnapshot(char* name);
+int removeSnapshot(char* name);
+unsigned int removeSnapshotEntries(dirEntry* dir, unsigned int maxEntries);
+unsigned int deleteSnapshots(unsigned int maxEntries);
+void listSnapshots();
+void selectSnapshot(char* name);
+unsigned int countFileFragments(dirEntry* file);
+unsigned int defragFile(dirEntry* file);
+unsigned int defragDirectory(dirEntry* dir, unsigned int maxBlocks);
+unsigned long long readDirectoryFiles(dirEntry* dir, unsigned int* numFiles, unsigned int* numFragments);
+void defragfs();
+unsigned int crc32cScalar(unsigned int crc, const char* data, size_t length);
+#if defined(__x86_64__) || defined(__i386__)
+unsigned int crc32cSSE42(unsigned int crc, const char* data, size_t length);
+#elif defined(__aarch64__)
+unsigned int crc32cARMv8(unsigned int crc, const char* data, size_t length);
+#endif
+unsigned int selectCRC32C(unsigned int crc, const char* data, size_t length);
+void setBlockChecksum(unsigned short block);
+void clearBlockChecksum(unsigned short block);
+int verifyBlock(unsigned short block);
+void* scrubWorker(void* arg);
+void reportBadBlocks(dirEntry* dir, char* path, unsigned char* bad);
+unsigned int scrubfs();
+int orphanOwnerHoldsChain(orphan* record);
+void orphanChain(unsigned short firstBlockIndex, unsigned short ownerBlock, unsigned short ownerSlot);
+unsigned int freeOrphanBlocks(unsigned int maxBlocks);
+void recoverOrphans();
+int compareBlockRanges(const void* a, const void* b);
+unsigned int punchFreeBlocks(unsigned int firstBlockIndex, unsigned int endBlockIndex);
+void queueFreedBlocks(unsigned short firstBlockIndex, unsigned int numBlocks);
+void reclaimFreedBlocks();
+void trimfs();
+unsigned short compactedLink(unsigned short* map, unsigned short link);
+void collectMetaBlocks(dirEntry* dir, compactJob* job);
+void startCompactJob(compactJob* job, unsigned short* map);
+void rewriteLinks(compactJob* job, unsigned int numBlocks);
+void* compactWorker(void* arg);
+int compactfs(char* fsname);
+unsigned int parseVolumeSize(char* text);
+int resizefs(unsigned int numBlocks);
+void scheduleDirectoryCompaction(unsigned short firstBlockIndex);
 unsigned short findFreeBlock();
+unsigned int countFreeBlocks();
+int haveFreeBlock();
+unsigned int countZeroEntriesScalar(const unsigned short* table, unsigned int count);
+unsigned int findZeroEntryScalar(const unsigned short* table, unsigned int count);
+#if defined(__x86_64__) || defined(__i386__)
+unsigned int countZeroEntriesAVX2(const unsigned short* table, unsigned int count);
+unsigned int countZeroEntriesAVX512(const unsigned short* table, unsigned int count);
+unsigned int countZeroEntriesSSE2(const unsigned short* table, unsigned int count);
+unsigned int findZeroEntryAVX2(const unsigned short* table, unsigned int count);
+unsigned int findZeroEntryAVX512(const unsigned short* table, unsigned int count);
+unsigned int findZeroEntrySSE2(const unsigned short* table, unsigned int count);
+#endif
+void selectFATScan();
+unsigned int selectCountZeroEntries(const unsigned short* table, unsigned int count);
+unsigned int selectFindZeroEntry(const unsigned short* table, unsigned int count);
 unsigned short findLastEntryInBlock(unsigned short blockindex);
+void scanDirectoryBlock(unsigned short blockIndex, char* name, dirBlockScan* result);
+unsigned char nameHashByte(char* name);
+void checkSuperblock();
+void upgradeDirectoryHashes(unsigned short firstBlockIndex);
+void writeSuperblock();
+void scanDirectoryBlockScalar(block* blk, const unsigned char* pattern, unsigned int nameMask, dirBlockMasks* masks);
+#if defined(__x86_64__) || defined(__i386__)
+void scanDirectoryBlockAVX2(block* blk, const unsigned char* pattern, unsigned int nameMask, dirBlockMasks* masks);
+void scanDirectoryBlockSSE2(block* blk, const unsigned char* pattern, unsigned int nameMask, dirBlockMasks* masks);
+#endif
+void selectDirectoryBlockScan(block* blk, const unsigned char* pattern, unsigned int nameMask, dirBlockMasks* masks);
 unsigned short findLastBlockOfParent(short parentdirIndex);
 int getNumSubdirs(dirEntry* dir);
 int isDirectoryEmpty(dirEntry* entry);
@@ -65,22 +530,48 @@ dirEntry* findEntryInDirectory(dirEntry* parentDir, char* entryName);
 dirEntry* findParentFromPath(char* path, dirEntry* parentDir);
 dirEntry* getNextEntry(dirEntry* currentEntry, dirEntry* parentDirEntry);
 time_t convertFATDateTime(short date, short time);
-void _addDirectory(char* directoryName, dirEntry* parentDirEntry);
+dirEntry* _addDirectory(char* directoryName, dirEntry* parentDirEntry);
 void addDirectory(char* directoryPath, dirEntry* parentDirEntry);
 void _addFile(char* filename, char* intpath, dirEntry* parentDir);
-void addFile(char* filename, char* intpath, dirEntry* parentDir);
-void catFile(char* intpath, dirEntry* parentDir);
+dirEntry* addFileEntry(dirEntry* parentDir, char* filename, unsigned short firstBlock, unsigned int size);
+unsigned short allocateFileBlocks(unsigned int numBlocks);
+int readHostFile(int fd, unsigned short firstBlock, unsigned int size, off_t fileOffset);
+void importTree(char* hostDir, char* intpath, dirEntry* rootDir);
+void* importWorker(void* arg);
+void walkHostDirectory(char* hostDir, int parent, importList* list);
+int addFile(char* filename, char* intpath, dirEntry* parentDir);
+int catFile(char* intpath, dirEntry* parentDir);
 void convertDateTime(short time, short date, char* dateTimeStr);
 void createEmptyFile(char* filename, dirEntry* parent);
+void commitfs(char* fsname);
+void writeImageFile(char* fsname, off_t skipStart, off_t skipEnd);
 void createfs(char* fsname);
 void createRootDirectory();
-void _extractFile(dirEntry* file);
-void extractFile(char *intpath, dirEntry *parentDir);
+void _extractFile(dirEntry* file, char* outputDir);
+int extractFile(char* intpath, dirEntry* parentDir, char* outputDir);
+void extractTree(dirEntry* dir, char* hostDir);
+void* extractWorker(void* arg);
+void queueExtractEntry(extractList* list, dirEntry* entry, char* hostPath);
+void runWorkerPool(void* (*worker)(void*), void* arg, unsigned int numJobs);
+void setHostTimes(char* hostPath, dirEntry* entry);
+void walkExtractDirectory(dirEntry* dir, char* hostDir, extractList* list);
+int writeHostBuffer(int fd, char* buffer, size_t length, off_t fileOffset);
+int writeHostFile(int fd, dirEntry* file, off_t fileOffset);
+void exportTar(int fd, char* intpath, dirEntry* rootDir);
+void exportTarEntry(int fd, dirEntry* entry, char* path, unsigned int* numFiles, unsigned long long* numBytes);
+void importTar(int fd, char* intpath, dirEntry* rootDir);
+dirEntry* makeDirectoryPath(dirEntry* dir, char* path);
+unsigned long long parseTarNumber(char* field, int length);
+int readFully(int fd, char* buffer, size_t length);
+unsigned int tarChecksum(tarHeader* header);
+int writeFully(int fd, char* buffer, size_t length);
+int writeTarHeader(int fd, dirEntry* entry, char* path);
 void extract_filename(const char *filepath, char *filename);
 void extract_path(const char *filepath, char *path);
 void fsLoadedCheck();
 void formatfs();
 void getDateTime(short* seconds, char* tenths, short* date);
+void toFATDateTime(time_t when, short* seconds, short* date);
 void listDirectory(dirEntry* parentDir);
 void loadfs(char* fsname);
 void logMessage(const char* format, ...);
@@ -89,14 +580,34 @@ void initializeNewDirectory(dirEntry* newDir, dirEntry* parentDir);
 void _printDirectoryTree(dirEntry* parentDir, int depth);
 void printDirectoryTree(dirEntry* parentDir);
 void printUsage(char* progname);
-void removeDirectoryEntry(char* intpath, dirEntry* rootDir);
+int removeDirectoryEntry(char* intpath, dirEntry* rootDir);
+void runBatch(char* scriptPath, char* fsname, int transactional);
+int runShellCommand(char* command, char* fsname, dirEntry** root, dirEntry** currentDir);
 void setDirEntry(dirEntry* entry, char* name, char attributes,char create_time_tenth, short create_time, short create_date,
                  short last_access_date, short first_cluster_high, short last_write_time, short last_write_date,
                   short first_cluster_low, unsigned int size, char isLast);
-void writeBlockToFile(FILE* f, unsigned short block, unsigned short numBytes);
 
 // FUSE prototypes
+static int _fs_create(const char *path, mode_t mode, struct fuse_file_info *fi);
+static int _fs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi);
+static int _fs_getattr(const char *path, struct stat *st);
+static int _fs_getxattr(const char *path, const char *name, char *value, size_t size);
+static int _fs_mkdir(const char* path, mode_t mode);
+static int _fs_open(const char *path, struct fuse_file_info *fi);
+static int _fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+static int _fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
+static int _fs_release(const char *path, struct fuse_file_info *fi);
+static int _fs_rmdir(const char *path);
+static int _fs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags);
+static int _fs_statfs(const char *path, struct statvfs *st);
+static int _fs_truncate(const char *path, off_t size);
+static int _fs_unlink(const char *path);
+static int _fs_utimens(const char *path, const struct timespec tv[2]);
+static int _fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+
+// locked FUSE entry points
 static int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi);
+static int fs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi);
 static int fs_getattr(const char *path, struct stat *st);
 static int fs_getxattr(const char *path, const char *name, char *value, size_t size);
 static int fs_mkdir(const char* path, mode_t mode);
@@ -111,12 +622,83 @@ static int fs_truncate(const char *path, off_t size);
 static int fs_unlink(const char *path);
 static int fs_utimens(const char *path, const struct timespec tv[2]);
 static int fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+static void* fs_init(struct fuse_conn_info *conn);
+static void fs_destroy(void *private_data);
 
 // global variables
 char* fs = NULL;            //pointer to the memory mapped file system
 unsigned short* FAT = NULL; //pointer to the File Allocation Table
 block* blocks = NULL;       //pointer to the blocks of the file system
+superblock* sb = NULL;      //pointer to the superblock
+hole* holes = NULL;         //pointer to the hole table
+unsigned int* checksums = NULL; //pointer to the checksum table
+unsigned char* refcounts = NULL; //pointer to the reference count table
+snapshot* snapshots = NULL; //pointer to the snapshot table
 int verbose = 0;            //verbose flag
+int indexDirectories = 0;   //flag to create new directories with a name index
+int privateMapping = 0;     //flag to map images copy-on-write, so changes only reach the file through commitfs
+int punchHoles = 0;         //flag to punch freed blocks out of the image, keeping it sparse
+int compressFiles = 0;      //flag to compress new files
+int dedupFiles = 0;         //flag to share the blocks of files this run writes with identical ones
+int verifyChecksums = VERIFYALWAYS; //how often blocks are checked against their checksums as they're read
+int readOnly = 0;           //flag to refuse changes, set when a snapshot is being looked at
+unsigned short rootBlock = 0; //first block of the root directory paths start from: 0, or a snapshot's
+int fsfd = -1;              //descriptor of the mapped image
+
+// directory compaction
+unsigned short pendingCompactions[MAXPENDINGCOMPACTIONS];  // first blocks of directories waiting to be compacted
+int numPendingCompactions = 0;                             // number of directories in the queue
+int compactionWorkerRunning = 0;                           // flag to keep the compaction worker going
+pthread_t compactionThread;                                // compaction worker, only started when mounted
+pthread_cond_t compactionCond = PTHREAD_COND_INITIALIZER;  // signalled when a directory or freed blocks are queued
+pthread_mutex_t fsLock = PTHREAD_MUTEX_INITIALIZER;        // held by FUSE callbacks and background workers
+
+// freed blocks waiting to be punched out of the image, when punchHoles is set
+blockRange pendingHoles[MAXPENDINGHOLES];                  // runs of blocks freed since the last reclaim
+int numPendingHoles = 0;                                   // number of runs in the queue
+
+// chains in the superblock's orphan list
+int numOrphans = 0;                                        // number of slots in use
+
+// holes in files
+unsigned int freeHoleHint = 0;                             // slot after the last one handed out by allocateHole
+char zeroBuffer[ZEROBUFFERSIZE];                           // stands in for the data of holes
+
+// small files
+unsigned short packBlockHint = 0;                          // pack block small files go in first, 0 if there is none
+
+// compressed files
+unsigned int chunkGeneration = 1;                          // changes whenever a chunk is compressed or expanded
+__thread chunkCache loadedChunk;                           // last chunk each thread decompressed
+
+// checksums. the kernel starts at a selector, like the FAT scans
+unsigned int (*crc32c)(unsigned int, const char*, size_t) = selectCRC32C;
+unsigned int crc32cTable[8][256];                          // tables for the scalar kernel, filled by the selector
+__thread unsigned int checksumSampleCounter = 0;           // block reads since the last sampled check, per thread so
+                                                           // the extract and chunk workers don't race on it
+
+// deduplication
+dedupSlot dedupIndex[DEDUPINDEXSIZE];                       // blocks of plain files by checksum, open addressed
+unsigned int dedupIndexUsed = 0;                            // slots taken, including ones gone stale
+int dedupIndexBuilt = 0;                                    // set once the index has the files in the image
+unsigned char sharableBlocks[MAXBLOCKS];                    // set for blocks put in the index, cleared when handed out
+
+// snapshots
+int numDeletingSnapshots = 0;                               // snapshots marked for removal and not gone yet
+
+// defragmentation
+int defragOnline = 0;                                       // flag for the worker to defragment files while mounted
+unsigned int defragRate = 0;                                // MB/s the worker may move, 0 for no limit
+int defragPending = 0;                                      // set when files may have been written since the worker last found nothing to move
+
+// directory block scanning. starts at the selector, which swaps in the best kernel for the CPU on first use
+void (*scanDirectoryBlockKernel)(block*, const unsigned char*, unsigned int, dirBlockMasks*) = selectDirectoryBlockScan;
+
+// free block search. the kernels start at selectors too, and the search starts where the last one left off
+unsigned int (*findZeroEntry)(const unsigned short*, unsigned int) = selectFindZeroEntry;
+unsigned int (*countZeroEntries)(const unsigned short*, unsigned int) = selectCountZeroEntries;
+unsigned int freeBlockHint = 0;     // block after the last one handed out by findFreeBlock
+unsigned int volumeBlocks = MAXBLOCKS;  // blocks before the reserved ones at the end of the FAT
 
 
 // functions
@@ -131,8 +713,16 @@ void logMessage(const char* format, ...) {
 }
 
 void mapfs(FILE* filetomap) {
+    // finish any deferred work on the currently mapped file system first
+    if (fs != NULL) {
+        compactPendingDirectories();
+        deleteSnapshots(UINT_MAX);
+        freeOrphanBlocks(UINT_MAX);
+        reclaimFreedBlocks();
+    }
+
     // map the file system to the memory
-    fs = mmap(NULL, FSSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(filetomap), 0);
+    fs = mmap(NULL, FSSIZE, PROT_READ | PROT_WRITE, privateMapping ? MAP_PRIVATE : MAP_SHARED, fileno(filetomap), 0);
 
     // check if mmap failed
     if (fs == NULL) {
@@ -143,36 +733,379 @@ void mapfs(FILE* filetomap) {
     // set the pointers to the correct locations
     FAT = (unsigned short*)fs;
     blocks = (block*)(fs + MAXBLOCKS*sizeof(short));
+    sb = (superblock*)(fs + SUPERBLOCKOFFSET);
+    holes = (hole*)(fs + HOLETABLEOFFSET);
+    checksums = (unsigned int*)(fs + CHECKSUMTABLEOFFSET);
+    refcounts = (unsigned char*)(fs + REFCOUNTTABLEOFFSET);
+    snapshots = (snapshot*)(fs + SNAPSHOTTABLEOFFSET);
+    fsfd = fileno(filetomap);
+    freeBlockHint = 0;
+    freeHoleHint = 0;
+    packBlockHint = 0;
+    numOrphans = 0;
+    dedupIndexBuilt = 0;
+    rootBlock = 0;
+
+    // the volume ends where the run of reserved blocks at the end of the FAT starts
+    volumeBlocks = MAXBLOCKS;
+    while (volumeBlocks > 0 && FAT[volumeBlocks - 1] == RESERVEDBLOCK) {
+        volumeBlocks--;
+    }
+
+    // snapshots a stopped program was removing, or was still taking, are removed with the deferred work
+    numDeletingSnapshots = 0;
+    for (int i = 0; i < MAXSNAPSHOTS; i++) {
+        numDeletingSnapshots += snapshots[i].state == SNAPSHOTDELETING;
+    }
 
     logMessage("file system mapped to memory\n");
 }
 
-unsigned short findFreeBlock() {
-    unsigned short ret;
-    // iterate through the FAT to find a free block
-    for (ret = 0; ret < MAXBLOCKS; ret++) {
-        if (FAT[ret] == 0) {
-            return ret;
+// Kernels for scanning a table of unsigned shorts (the FAT) for zeroes. findZeroEntry returns the index of
+// the first zero, or count if there is none. countZeroEntries returns how many there are
+unsigned int findZeroEntryScalar(const unsigned short* table, unsigned int count) {
+    unsigned int i;
+    for (i = 0; i < count; i++) {
+        if (table[i] == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+unsigned int countZeroEntriesScalar(const unsigned short* table, unsigned int count) {
+    unsigned int zeroes = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        zeroes += table[i] == 0;
+    }
+    return zeroes;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+unsigned int findZeroEntrySSE2(const unsigned short* table, unsigned int count) {
+    // 8 entries per compare. movemask gives two bits per entry
+    unsigned int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        unsigned int zeroes = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)&table[i]), _mm_setzero_si128()));
+        if (zeroes) {
+            return i + __builtin_ctz(zeroes) / 2;
+        }
+    }
+    return i + findZeroEntryScalar(&table[i], count - i);
+}
+
+__attribute__((target("sse2,popcnt")))
+unsigned int countZeroEntriesSSE2(const unsigned short* table, unsigned int count) {
+    unsigned int zeroes = 0;
+    unsigned int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        zeroes += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)&table[i]), _mm_setzero_si128())));
+    }
+    return zeroes / 2 + countZeroEntriesScalar(&table[i], count - i);
+}
+
+__attribute__((target("avx2")))
+unsigned int findZeroEntryAVX2(const unsigned short* table, unsigned int count) {
+    // 16 entries per compare. allocated runs are long, so two compares are OR'd before checking
+    unsigned int i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i first = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)&table[i]), _mm256_setzero_si256());
+        __m256i second = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)&table[i + 16]), _mm256_setzero_si256());
+        if (!_mm256_testz_si256(_mm256_or_si256(first, second), _mm256_or_si256(first, second))) {
+            unsigned int zeroes = _mm256_movemask_epi8(first);
+            if (zeroes) {
+                return i + __builtin_ctz(zeroes) / 2;
+            }
+            return i + 16 + __builtin_ctz(_mm256_movemask_epi8(second)) / 2;
+        }
+    }
+    return i + findZeroEntryScalar(&table[i], count - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+unsigned int countZeroEntriesAVX2(const unsigned short* table, unsigned int count) {
+    // each zero entry is -1 after the compare, so subtracting the compare results counts them. the 16 bit
+    // lanes are summed at least every 32767 rounds, before they can overflow
+    __m256i total = _mm256_setzero_si256();
+    unsigned int zeroes = 0;
+    unsigned int i = 0;
+    while (i + 16 <= count) {
+        __m256i lanes = _mm256_setzero_si256();
+        for (unsigned int round = 0; round < 32767 && i + 16 <= count; round++, i += 16) {
+            lanes = _mm256_sub_epi16(lanes, _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)&table[i]), _mm256_setzero_si256()));
+        }
+        total = _mm256_add_epi32(total, _mm256_madd_epi16(lanes, _mm256_set1_epi16(1)));
+    }
+    total = _mm256_add_epi32(total, _mm256_permute2x128_si256(total, total, 0x01));
+    total = _mm256_add_epi32(total, _mm256_shuffle_epi32(total, 0x4E));
+    total = _mm256_add_epi32(total, _mm256_shuffle_epi32(total, 0xB1));
+    zeroes = _mm256_cvtsi256_si32(total);
+    return zeroes + countZeroEntriesScalar(&table[i], count - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+unsigned int findZeroEntryAVX512(const unsigned short* table, unsigned int count) {
+    // 32 entries per compare, straight into a mask register
+    unsigned int i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __mmask32 zeroes = _mm512_cmpeq_epi16_mask(_mm512_loadu_si512((const void*)&table[i]), _mm512_setzero_si512());
+        if (zeroes) {
+            return i + __builtin_ctz(zeroes);
+        }
+    }
+    return i + findZeroEntryScalar(&table[i], count - i);
+}
+
+__attribute__((target("avx512f,avx512bw,popcnt")))
+unsigned int countZeroEntriesAVX512(const unsigned short* table, unsigned int count) {
+    unsigned int zeroes = 0;
+    unsigned int i = 0;
+    for (; i + 32 <= count; i += 32) {
+        zeroes += __builtin_popcount(_mm512_cmpeq_epi16_mask(_mm512_loadu_si512((const void*)&table[i]), _mm512_setzero_si512()));
+    }
+    return zeroes + countZeroEntriesScalar(&table[i], count - i);
+}
+#endif
+
+void selectFATScan() {
+    // pick the widest kernels the CPU supports
+    findZeroEntry = findZeroEntryScalar;
+    countZeroEntries = countZeroEntriesScalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("popcnt")) {
+        findZeroEntry = findZeroEntryAVX512;
+        countZeroEntries = countZeroEntriesAVX512;
+    }
+    else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        findZeroEntry = findZeroEntryAVX2;
+        countZeroEntries = countZeroEntriesAVX2;
+    }
+    else if (__builtin_cpu_supports("sse2") && __builtin_cpu_supports("popcnt")) {
+        findZeroEntry = findZeroEntrySSE2;
+        countZeroEntries = countZeroEntriesSSE2;
+    }
+#endif
+}
+
+unsigned int selectFindZeroEntry(const unsigned short* table, unsigned int count) {
+    selectFATScan();
+    return findZeroEntry(table, count);
+}
+
+unsigned int selectCountZeroEntries(const unsigned short* table, unsigned int count) {
+    selectFATScan();
+    return countZeroEntries(table, count);
+}
+
+// CRC32C kernels, for block checksums. They take the checksum of the data before, or 0, and return the
+// checksum with length more bytes of data added
+unsigned int crc32cScalar(unsigned int crc, const char* data, size_t length) {
+    // slicing by 8: one lookup per byte, but eight of them independent of each other
+    const unsigned char* bytes = (const unsigned char*)data;   // next byte to add
+    crc = ~crc;
+
+    while (length >= 8) {
+        unsigned int low;                   // first 4 bytes, with the checksum so far folded in
+        unsigned int high;                  // next 4 bytes
+        memcpy(&low, bytes, sizeof(low));
+        memcpy(&high, bytes + 4, sizeof(high));
+        low ^= crc;
+        crc = crc32cTable[7][low & 0xFF] ^ crc32cTable[6][(low >> 8) & 0xFF] ^
+              crc32cTable[5][(low >> 16) & 0xFF] ^ crc32cTable[4][low >> 24] ^
+              crc32cTable[3][high & 0xFF] ^ crc32cTable[2][(high >> 8) & 0xFF] ^
+              crc32cTable[1][(high >> 16) & 0xFF] ^ crc32cTable[0][high >> 24];
+        bytes += 8;
+        length -= 8;
+    }
+    while (length > 0) {
+        crc = crc32cTable[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+        length--;
+    }
+
+    return ~crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+unsigned int crc32cSSE42(unsigned int crc, const char* data, size_t length) {
+    // the crc32 instruction adds 8 bytes a cycle, once the latency of the chain is covered
+    crc = ~crc;
+#if defined(__x86_64__)
+    while (length >= 8) {
+        unsigned long long word;            // next 8 bytes
+        memcpy(&word, data, sizeof(word));
+        crc = (unsigned int)_mm_crc32_u64(crc, word);
+        data += 8;
+        length -= 8;
+    }
+#endif
+    while (length >= 4) {
+        unsigned int word;                  // next 4 bytes
+        memcpy(&word, data, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+        data += 4;
+        length -= 4;
+    }
+    while (length > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+        length--;
+    }
+    return ~crc;
+}
+#elif defined(__aarch64__)
+__attribute__((target("arch=armv8-a+crc")))
+unsigned int crc32cARMv8(unsigned int crc, const char* data, size_t length) {
+    // ARMv8 has the same instructions as an extension
+    crc = ~crc;
+    while (length >= 8) {
+        unsigned long long word;            // next 8 bytes
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+        data += 8;
+        length -= 8;
+    }
+    while (length > 0) {
+        crc = __crc32cb(crc, *data++);
+        length--;
+    }
+    return ~crc;
+}
+#endif
+
+unsigned int selectCRC32C(unsigned int crc, const char* data, size_t length) {
+    // fill the tables, which the scalar kernel always needs, then swap in the instructions if the CPU
+    // has them
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int entry = i;             // remainder of the byte, a bit at a time
+        for (int bit = 0; bit < 8; bit++) {
+            entry = (entry >> 1) ^ (0x82F63B78 & -(entry & 1));
+        }
+        crc32cTable[0][i] = entry;
+    }
+    for (unsigned int i = 0; i < 256; i++) {
+        for (int slice = 1; slice < 8; slice++) {
+            crc32cTable[slice][i] = (crc32cTable[slice - 1][i] >> 8) ^ crc32cTable[0][crc32cTable[slice - 1][i] & 0xFF];
         }
     }
 
+    crc32c = crc32cScalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c = crc32cSSE42;
+    }
+#elif defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc32c = crc32cARMv8;
+    }
+#endif
+
+    return crc32c(crc, data, length);
+}
+
+void setBlockChecksum(unsigned short block) {
+    // record the checksum of a block of file data, after it's written
+    if (sb->features & FEATURE_CHECKSUMS) {
+        checksums[block] = crc32c(0, blocks[block].data, BLOCKSIZE);
+    }
+}
+
+void clearBlockChecksum(unsigned short block) {
+    // forget the checksum of a block, when it's handed out to be used for something else
+    if (sb->features & FEATURE_CHECKSUMS) {
+        checksums[block] = 0;
+    }
+}
+
+int verifyBlock(unsigned short block) {
+    // check a block of file data against its checksum as it's read, as often as verifyChecksums says.
+    // returns 0, or -EIO if they don't match
+    if (verifyChecksums == VERIFYOFF || !(sb->features & FEATURE_CHECKSUMS) || checksums[block] == 0) {
+        return 0;
+    }
+    // each thread samples its own reads, so the counter needs no lock
+    if (verifyChecksums == VERIFYSAMPLED && checksumSampleCounter++ % CHECKSUMSAMPLERATE != 0) {
+        return 0;
+    }
+    if (crc32c(0, blocks[block].data, BLOCKSIZE) == checksums[block]) {
+        return 0;
+    }
+
+    fprintf(stderr, "Block %d does not match its checksum\n", block);
+    return -EIO;
+}
+
+unsigned short findFreeBlock() {
+    unsigned int ret;
+    // search the FAT from where the last search left off, so the allocated blocks before it aren't
+    // rescanned every time, then wrap around to the start. Nothing past the end of the volume is free
+    if (freeBlockHint >= volumeBlocks) {
+        freeBlockHint = 0;
+    }
+
+    ret = freeBlockHint + findZeroEntry(&FAT[freeBlockHint], volumeBlocks - freeBlockHint);
+    if (ret == volumeBlocks) {
+        ret = findZeroEntry(FAT, freeBlockHint);
+    }
+
+    if (ret < volumeBlocks && FAT[ret] == 0) {
+        freeBlockHint = ret + 1;
+        clearBlockChecksum(ret);
+        sharableBlocks[ret] = 0;
+        return ret;
+    }
+
     // no free blocks found
     fprintf(stderr, "No free blocks found, exiting\n");
     exit(1);
 }
 
+unsigned int countFreeBlocks() {
+    // number of free blocks in the FAT
+    fsLoadedCheck();
+    return countZeroEntries(FAT, volumeBlocks);
+}
+
+int haveFreeBlock() {
+    // checks findFreeBlock has something to return, looking where it will first rather than counting them all
+    unsigned int start = freeBlockHint < volumeBlocks ? freeBlockHint : 0;    // where findFreeBlock starts
+
+    return findZeroEntry(&FAT[start], volumeBlocks - start) < volumeBlocks - start || findZeroEntry(FAT, start) < start;
+}
+
 void formatfs() {
+    long pageSize = sysconf(_SC_PAGESIZE);                          // size of a page of the mapping
+    long dataStart = (char*)&blocks[1] - fs;                        // first byte after the root directory block
+    long holeStart = (dataStart + pageSize - 1) / pageSize * pageSize;    // first page of the data blocks
+    long holeEnd = SUPERBLOCKOFFSET / pageSize * pageSize;          // page holding the superblock
+
     // check if the file system is mapped
     if (fs == NULL) {
         fprintf(stderr, "no fs mapped, format failed\n");
         exit(1);
     }
 
-    // clear the file system
-    bzero(fs, FSSIZE);
+    // clear the FAT, the root directory block and the superblock, up to the pages around them
+    bzero(fs, holeStart);
+    bzero(fs + holeEnd, FSSIZE - holeEnd);
+
+    // the data blocks are left as a hole in the file instead of being written with zeroes, so formatting
+    // costs the same whatever the size of the volume. a new image is a hole already, and anything else
+    // gets one punched, or is zeroed where the file system can't punch holes
+    if (holeEnd > holeStart && madvise(fs + holeStart, holeEnd - holeStart, MADV_REMOVE) == -1) {
+        logMessage("Could not punch a hole for the data blocks, zeroing them\n");
+        bzero(fs + holeStart, holeEnd - holeStart);
+    }
 
     // make block 0 the first and last block of root directory (for now). Using USHRT_MAX to indicate the end of the list
     FAT[0] = USHRT_MAX;
+    volumeBlocks = MAXBLOCKS;
+
+    // stamp the image with the current format. new images keep checksums from the start
+    sb->features = FEATURE_CHECKSUMS;
+    writeSuperblock();
     // printf("first free block is at %hu\n", findFreeBlock());
 
     logMessage("file system formatted\n");
@@ -192,7 +1125,9 @@ void setDirEntry(dirEntry* entry, char* name, char attributes,char create_time_t
 {
     strcpy(entry->name, name);
     entry->attributes = attributes;
-    entry->create_time_tenth = create_time_tenth;
+    // tenths of a second are never tracked, that byte holds the name's hash instead
+    (void) create_time_tenth;
+    entry->name_hash = nameHashByte(name);
     entry->create_time = create_time;
     entry->create_date = create_date;
     entry->last_access_date = last_access_date;
@@ -205,16 +1140,26 @@ void setDirEntry(dirEntry* entry, char* name, char attributes,char create_time_t
 }
 
 void getDateTime(short* seconds, char* tenths, short* date) {
+    // Tenths of a second
+    *tenths = 0; // Assuming we do not track tenths of a second
+
     // Get the current time
-    time_t now = time(NULL);
-    struct tm* currentTime = localtime(&now);
+    toFATDateTime(time(NULL), seconds, date);
+}
+
+void toFATDateTime(time_t when, short* seconds, short* date) {
+    struct tm* currentTime = localtime(&when);
+
+    // FAT dates start in 1980, so anything earlier is kept as the start of 1980
+    if (currentTime->tm_year < 80) {
+        *seconds = 0;
+        *date = (1 << 5) | 1;
+        return;
+    }
 
     // Seconds: count of 2-second increments
     *seconds = (currentTime->tm_sec / 2) & 0x1F; // 5 bits for seconds (0-29)
 
-    // Tenths of a second
-    *tenths = 0; // Assuming we do not track tenths of a second
-
     // Minutes
     short minutes = (currentTime->tm_min & 0x3F) << 5; // 6 bits for minutes (0-59)
 
@@ -307,10 +1252,11 @@ void createfs(char* fsname) {
         exit(1);
     }
 
-    // set the size and fill it with zeros
-    fseek(fsfile, FSSIZE-1, SEEK_SET);
-    fwrite("\0", 1, 1, fsfile);
-    fseek(fsfile, 0, SEEK_SET);
+    // set the size. the file is one big hole, which reads as zeroes without taking any space
+    if (ftruncate(fileno(fsfile), FSSIZE) == -1) {
+        fprintf(stderr, "Error sizing file system %s, exiting\n", fsname);
+        exit(1);
+    }
 
     // map and format the file system
     mapfs(fsfile);
@@ -337,9 +1283,133 @@ void loadfs(char* fsname) {
     // map the file system
     mapfs(fsfile);
 
+    // make sure this build understands the image, upgrading older ones
+    checkSuperblock();
+    recoverOrphans();
+
     logMessage("file system loaded\n");
 }
 
+void commitfs(char* fsname) {
+    // write a transaction's changes to the image
+    writeImageFile(fsname, 0, 0);
+}
+
+void writeImageFile(char* fsname, off_t skipStart, off_t skipEnd) {
+    char tempName[PATH_MAX];                // file the new image is written to
+    char dirName[PATH_MAX];                 // directory holding the image
+    static char zeroes[COMMITCHUNKSIZE];    // chunk of zeroes to compare against
+    struct stat fsStat;                     // stat of the image, for its permissions
+    off_t offset = 0;                       // offset of the chunk being written
+    int fd = -1;                            // descriptor of the new image
+
+    // write the mapping into a new file beside the image, then rename it over the image, so a crash
+    // part way through leaves either the old image or the new one. chunks of zeroes are left as holes, and
+    // so is everything from skipStart to skipEnd, without looking at it
+    snprintf(tempName, sizeof(tempName), "%s.commit", fsname);
+    fd = open(tempName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, FSSIZE) == -1) {
+        fprintf(stderr, "Error creating \"%s\", nothing was written\n", tempName);
+        exit(1);
+    }
+    if (stat(fsname, &fsStat) == 0) {
+        fchmod(fd, fsStat.st_mode & 07777);
+    }
+
+    while (offset < FSSIZE) {
+        size_t length = FSSIZE - offset < COMMITCHUNKSIZE ? FSSIZE - offset : COMMITCHUNKSIZE;
+
+        // step over the skipped range, and stop a chunk where it starts
+        if (offset >= skipStart && offset < skipEnd) {
+            offset = skipEnd;
+            continue;
+        }
+        if (offset < skipStart && offset + (off_t)length > skipStart) {
+            length = skipStart - offset;
+        }
+
+        if (memcmp(fs + offset, zeroes, length) != 0 && pwrite(fd, fs + offset, length, offset) != (ssize_t)length) {
+            fprintf(stderr, "Error writing \"%s\", nothing was written\n", tempName);
+            unlink(tempName);
+            exit(1);
+        }
+        offset += length;
+    }
+
+    if (fsync(fd) == -1 || close(fd) == -1 || rename(tempName, fsname) == -1) {
+        fprintf(stderr, "Error replacing \"%s\" with \"%s\", nothing was written\n", fsname, tempName);
+        unlink(tempName);
+        exit(1);
+    }
+
+    // make the rename itself durable
+    snprintf(dirName, sizeof(dirName), "%s", fsname);
+    fd = open(dirname(dirName), O_RDONLY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+
+    logMessage("Committed \"%s\"\n", fsname);
+}
+
+void writeSuperblock() {
+    // marks the image as being in the format this build writes
+    sb->magic = SUPERBLOCKMAGIC;
+    sb->features = (sb->features & (FEATURE_HOLES | FEATURE_PACKED | FEATURE_COMPRESSED | FEATURE_CHECKSUMS | FEATURE_SHARED)) |
+                   FEATURE_NAMEHASH | FEATURE_ORPHANS;
+
+    // only images with holes, packed files, compressed chunks, checksums or shared blocks need a build that
+    // understands them. the rest stay readable by older ones
+    sb->version = (sb->features & FEATURE_SHARED) ? 6 : (sb->features & FEATURE_CHECKSUMS) ? 5 :
+                  (sb->features & FEATURE_COMPRESSED) ? 4 : (sb->features & FEATURE_PACKED) ? 3 :
+                  (sb->features & FEATURE_HOLES) ? 2 : 1;
+}
+
+void upgradeDirectoryHashes(unsigned short firstBlockIndex) {
+    // gives every entry in a directory, and in the directories below it, a name hash
+    unsigned short currentBlockIndex = firstBlockIndex;   // index on the FAT of the current working block
+    int isLastEntry = 0;                                  // flag to indicate the end of the directory was read
+
+    while (currentBlockIndex != USHRT_MAX && !isLastEntry) {
+        for (unsigned int i = 0; i < DIRENTRIES && !isLastEntry; i++) {
+            dirEntry* entry = (dirEntry*)&blocks[currentBlockIndex].data[i * sizeof(dirEntry)];
+            isLastEntry = entry->isLast == LASTENTRY;
+
+            entry->name_hash = nameHashByte(entry->name);
+
+            // go into subdirectories, but not back up through . and ..
+            if (entry->attributes == ATTR_DIRECTORY && strcmp(entry->name, ".") != 0 && strcmp(entry->name, "..") != 0 &&
+                entry->first_cluster_low != firstBlockIndex && (unsigned short)entry->first_cluster_low < MAXBLOCKS) {
+                upgradeDirectoryHashes(entry->first_cluster_low);
+            }
+        }
+        currentBlockIndex = FAT[currentBlockIndex];
+    }
+}
+
+void checkSuperblock() {
+    // check the superblock of a freshly loaded image
+    if (sb->magic != SUPERBLOCKMAGIC) {
+        // written before there was a superblock. the bytes there have always been unused
+        logMessage("Upgrading file system to version 1\n");
+        upgradeDirectoryHashes(0);
+        writeSuperblock();
+        return;
+    }
+
+    if (sb->version > FSVERSION) {
+        fprintf(stderr, "File system is version %d, this program only understands up to version %d, exiting\n", sb->version, FSVERSION);
+        exit(1);
+    }
+
+    // older versions get the features they lack added
+    if (!(sb->features & FEATURE_NAMEHASH)) {
+        upgradeDirectoryHashes(0);
+    }
+    writeSuperblock();
+}
+
 void printUsage(char* progname) {
     fprintf(stderr, "Usage: %s -f <somename.CFAT> [options]\n", progname);
     fprintf(stderr, "Options:\n");
@@ -351,10 +1421,32 @@ void printUsage(char* progname) {
     fprintf(stderr, "  -i <internal path> Specify the internal path in the file system for adding a file\n");
     fprintf(stderr, "  -r <internal path> Remove a file or directory from the file system\n");
     fprintf(stderr, "  -d <directory>     Add a directory to the file system\n");
-    fprintf(stderr, "  -e <internal path> Extract a file from the file system\n");
+    fprintf(stderr, "  -R <directory>     Import a host directory tree into the internal path given with -i (default: /)\n");
+    fprintf(stderr, "  -T                 Import a tar archive from standard input into the internal path given with -i (default: /)\n");
+    fprintf(stderr, "  -E <internal path> Export a file or directory tree to standard output as a tar archive\n");
+    fprintf(stderr, "  -x                 Index new directories by name, for directories with many entries\n");
+    fprintf(stderr, "  -z                 Compress the files this run adds or creates\n");
+    fprintf(stderr, "  -D                 Share the blocks of files this run writes with identical blocks already in the image\n");
+    fprintf(stderr, "  -u                 Share every block of file data in the image with identical ones, and report the savings\n");
+    fprintf(stderr, "  -n <name>          Take a snapshot of the whole file system, once the rest of the run is done\n");
+    fprintf(stderr, "  -N <name>          Remove a snapshot\n");
+    fprintf(stderr, "  -L                 List the snapshots\n");
+    fprintf(stderr, "  -S <name>          Look at a snapshot instead of the file system, read only, with -l, -e, -E or -m\n");
+    fprintf(stderr, "  -F                 Defragment the files, moving the blocks of each into one run, and report read speed before and after\n");
+    fprintf(stderr, "  -g <MB/s>          With -m, defragment files in the background, moving no more than MB/s (0: no limit)\n");
+    fprintf(stderr, "  -K                 Compact the image, moving every block in use to the front and leaving the rest out of the file\n");
+    fprintf(stderr, "  -Z <size>          Grow or shrink the volume to size bytes, or K, M or G with a suffix, moving the blocks past a new end\n");
+    fprintf(stderr, "  -e <internal path> Extract a file, or a directory and everything in it, from the file system\n");
+    fprintf(stderr, "  -o <directory>     Directory to extract files into (default: current directory)\n");
     fprintf(stderr, "  -h                 Display this help message\n");
     fprintf(stderr, "  -m <mountpoint>    Mount the file system to a directory\n");
     fprintf(stderr, "  -I                 Launch interactive mode\n");
+    fprintf(stderr, "  -b <script>        Run shell commands from a script, or - for standard input, in one session\n");
+    fprintf(stderr, "  -t                 With -b, write the script's changes only if every command succeeds\n");
+    fprintf(stderr, "  -p                 Punch freed blocks out of the image, so it takes less space on disk\n");
+    fprintf(stderr, "  -s                 Trim the image, punching out every free block\n");
+    fprintf(stderr, "  -C                 Scrub the image, checking every block of file data against its checksum\n");
+    fprintf(stderr, "  -k <mode>          Check blocks against their checksums when they're read: always (default), sampled or off\n");
     fprintf(stderr, "\nExamples:\n");
     fprintf(stderr, "  Create a new file system:\n");
     fprintf(stderr, "    %s -f myfilesystem.CFAT -c\n", progname);
@@ -366,8 +1458,14 @@ void printUsage(char* progname) {
     fprintf(stderr, "    %s -f myfilesystem.CFAT -r /myfolder/myfile.txt\n", progname);
     fprintf(stderr, "  Add a directory to the file system:\n");
     fprintf(stderr, "    %s -f myfilesystem.CFAT -d /myfolder\n", progname);
+    fprintf(stderr, "  Import a host directory tree:\n");
+    fprintf(stderr, "    %s -f myfilesystem.CFAT -R ~/photos -i /photos\n", progname);
+    fprintf(stderr, "  Copy a directory tree from one file system to another:\n");
+    fprintf(stderr, "    %s -f old.CFAT -E /photos | %s -f new.CFAT -T\n", progname, progname);
     fprintf(stderr, "  Extract a file from the file system:\n");
     fprintf(stderr, "    %s -f myfilesystem.CFAT -e /myfolder/myfile.txt\n", progname);
+    fprintf(stderr, "  Run a script of shell commands, all or nothing:\n");
+    fprintf(stderr, "    %s -f myfilesystem.CFAT -t -b provision.txt\n", progname);
     fprintf(stderr, "  Mount the file system to a directory:\n");
     fprintf(stderr, "    %s -f myfilesystem.CFAT -m /mnt/myfilesystem\n", progname);
     fprintf(stderr, "\n");
@@ -379,11 +1477,158 @@ void printUsage(char* progname) {
     exit(1);
 }
 
+void scanDirectoryBlockScalar(block* blk, const unsigned char* pattern, unsigned int nameMask, dirBlockMasks* masks) {
+    // one entry at a time, checking the stored hash and then the name as two words. used when the CPU
+    // has nothing better
+    const unsigned long long* words = (const unsigned long long*)blk->data;
+    unsigned long long target[2];               // the pattern as two words
+    unsigned long long nameBytes[2] = {0, 0};   // bytes of the two words that hold the name
+    unsigned int match = 0, deleted = 0, last = 0;
+    unsigned long long nonZero = 0;
+
+    memcpy(target, pattern, SCANPATTERNSIZE);
+    for (int i = 0; i < SCANPATTERNSIZE; i++) {
+        if (nameMask & (1u << i)) {
+            ((unsigned char*)nameBytes)[i] = 0xFF;
+        }
+    }
+
+    for (unsigned int i = 0; i < DIRENTRIES; i++) {
+        const unsigned long long* entry = &words[i * sizeof(dirEntry) / sizeof(unsigned long long)];
+        const unsigned char* entryBytes = (const unsigned char*)entry;
+
+        // entries with a different stored hash can't match. those without one have their name compared
+        if (entryBytes[SCANNAMEHASH] == pattern[SCANNAMEHASH] || entryBytes[SCANNAMEHASH] == 0) {
+            match |= (unsigned int)((((entry[0] ^ target[0]) & nameBytes[0]) | ((entry[1] ^ target[1]) & nameBytes[1])) == 0) << i;
+        }
+        deleted |= (unsigned int)(entryBytes[SCANATTRIBUTES] == pattern[SCANATTRIBUTES]) << i;
+        last |= (unsigned int)(entryBytes[SCANISLAST] == pattern[SCANISLAST]) << i;
+        nonZero |= entry[0] | entry[1] | entry[2] | entry[3];
+    }
+
+    masks->match = match;
+    masks->deleted = deleted;
+    masks->last = last;
+    masks->nonZero = nonZero != 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void scanDirectoryBlockSSE2(block* blk, const unsigned char* pattern, unsigned int nameMask, dirBlockMasks* masks) {
+    // one entry per compare, and the whole block is OR'd together on the way to spot an empty one. a
+    // name matches if its bytes do and the stored hash does (or is 0)
+    __m128i target = _mm_loadu_si128((const __m128i*)pattern);
+    __m128i nonZero = _mm_setzero_si128();
+    unsigned int match = 0, deleted = 0, last = 0;
+
+    for (unsigned int i = 0; i < DIRENTRIES; i++) {
+        __m128i head = _mm_loadu_si128((const __m128i*)&blk->data[i * sizeof(dirEntry)]);
+        __m128i tail = _mm_loadu_si128((const __m128i*)&blk->data[i * sizeof(dirEntry) + 16]);
+        unsigned int same = _mm_movemask_epi8(_mm_cmpeq_epi8(head, target));
+        unsigned int zero = _mm_movemask_epi8(_mm_cmpeq_epi8(head, _mm_setzero_si128()));
+
+        nonZero = _mm_or_si128(nonZero, _mm_or_si128(head, tail));
+        match |= (unsigned int)((same & nameMask) == nameMask && ((same | zero) >> SCANNAMEHASH) & 1) << i;
+        deleted |= ((same >> SCANATTRIBUTES) & 1) << i;
+        last |= ((same >> SCANISLAST) & 1) << i;
+    }
+
+    masks->match = match;
+    masks->deleted = deleted;
+    masks->last = last;
+    masks->nonZero = _mm_movemask_epi8(_mm_cmpeq_epi8(nonZero, _mm_setzero_si128())) != 0xFFFF;
+}
+
+__attribute__((target("avx2")))
+void scanDirectoryBlockAVX2(block* blk, const unsigned char* pattern, unsigned int nameMask, dirBlockMasks* masks) {
+    // a 32 byte load is a whole entry. the heads of two entries are packed into one register so each
+    // compare covers a pair of entries. a name matches if its bytes do and the stored hash does (or is 0)
+    __m256i target = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)pattern));
+    __m256i nonZero = _mm256_setzero_si256();
+    unsigned int pairMask = nameMask | (nameMask << 16);
+    unsigned int match = 0, deleted = 0, last = 0;
+
+    for (unsigned int i = 0; i < DIRENTRIES; i += 2) {
+        __m256i first = _mm256_loadu_si256((const __m256i*)&blk->data[i * sizeof(dirEntry)]);
+        __m256i second = _mm256_loadu_si256((const __m256i*)&blk->data[(i + 1) * sizeof(dirEntry)]);
+        __m256i heads = _mm256_permute2x128_si256(first, second, 0x20);
+        unsigned int same = _mm256_movemask_epi8(_mm256_cmpeq_epi8(heads, target));
+        unsigned int zero = _mm256_movemask_epi8(_mm256_cmpeq_epi8(heads, _mm256_setzero_si256()));
+        unsigned int hashes = ((same | zero) >> SCANNAMEHASH) & 0x10001;
+        unsigned int names = ((same & pairMask) ^ pairMask) | ((hashes ^ 0x10001) << SCANNAMEHASH);
+
+        nonZero = _mm256_or_si256(nonZero, _mm256_or_si256(first, second));
+        match |= ((unsigned int)((names & 0xFFFF) == 0) | ((unsigned int)((names >> 16) == 0) << 1)) << i;
+        deleted |= (((same >> SCANATTRIBUTES) & 1) | ((same >> (SCANATTRIBUTES + 15)) & 2)) << i;
+        last |= (((same >> SCANISLAST) & 1) | ((same >> (SCANISLAST + 15)) & 2)) << i;
+    }
+
+    masks->match = match;
+    masks->deleted = deleted;
+    masks->last = last;
+    masks->nonZero = !_mm256_testz_si256(nonZero, nonZero);
+}
+#endif
+
+void selectDirectoryBlockScan(block* blk, const unsigned char* pattern, unsigned int nameMask, dirBlockMasks* masks) {
+    // pick the best kernel the CPU supports, then run it
+    scanDirectoryBlockKernel = scanDirectoryBlockScalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scanDirectoryBlockKernel = scanDirectoryBlockAVX2;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        scanDirectoryBlockKernel = scanDirectoryBlockSSE2;
+    }
+#endif
+    scanDirectoryBlockKernel(blk, pattern, nameMask, masks);
+}
+
+void scanDirectoryBlock(unsigned short blockIndex, char* name, dirBlockScan* result) {
+    // scans a directory block in one pass for the end of the directory, the first deleted entry and,
+    // if a name is given, the first entry with that name. entries past the last one are ignored
+    unsigned char pattern[SCANPATTERNSIZE] = {0};   // what the first 16 bytes of a wanted entry look like
+    unsigned int nameMask = 0;                      // bytes of the pattern that make up the name
+    unsigned int upToLast = 0;                      // bits of the entries up to the last one
+    dirBlockMasks masks;                            // per entry results from the kernel
+
+    // check if the block index in the FAT is valid
+    if (blockIndex >= MAXBLOCKS) {
+        fprintf(stderr, "Invalid block index, cannot scan directory block\n");
+        exit(1);
+    }
+
+    // compare the name up to and including its terminator, like entryNameMatches. names that use all
+    // MAXFILENAME characters have no terminator in the entry
+    if (name != NULL) {
+        size_t length = strnlen(name, MAXFILENAME);
+        size_t compared = length < MAXFILENAME ? length + 1 : MAXFILENAME;
+        memcpy(pattern, name, length);
+        nameMask = (1u << compared) - 1;
+        pattern[SCANNAMEHASH] = nameHashByte(name);
+    }
+    pattern[SCANATTRIBUTES] = (unsigned char)ATTR_DELETED;
+    pattern[SCANISLAST] = LASTENTRY;
+
+    scanDirectoryBlockKernel(&blocks[blockIndex], pattern, nameMask, &masks);
+
+    // only entries up to the last one are part of the directory
+    upToLast = masks.last ? (masks.last & -masks.last) * 2 - 1 : (1u << DIRENTRIES) - 1;
+    if (name == NULL) {
+        masks.match = 0;
+    }
+
+    result->match = (masks.match & upToLast) ? __builtin_ctz(masks.match & upToLast) : USHRT_MAX;
+    result->deleted = (masks.deleted & upToLast) ? __builtin_ctz(masks.deleted & upToLast) : USHRT_MAX;
+    result->last = masks.last ? __builtin_ctz(masks.last) : USHRT_MAX;
+    result->empty = !masks.nonZero;
+}
+
 unsigned short findLastEntryInBlock(unsigned short blockindex) {
     // returns the index of the last directory entry in the block
     // if none are found, returns USHRT_MAX
-
-    int bitsFound = 0;  // number of bits found in the block
+    dirBlockScan scan;      // results of scanning the block
 
     // check if the file system is loaded
     fsLoadedCheck();
@@ -394,26 +1639,15 @@ unsigned short findLastEntryInBlock(unsigned short blockindex) {
         exit(1);
     }
 
-    // get the pointer to the block
-    block* blk = &blocks[blockindex];
-
-    // iterate through the block to check if the last entry in the list can be found
-    for (int i = 0; i < BLOCKSIZE; i += sizeof(dirEntry)) {
-        dirEntry* entry = (dirEntry*)&blk->data[i];
-        if (entry->isLast == LASTENTRY) {
-            return i / sizeof(dirEntry);
-        }
-    }
+    // look for the last entry and an empty block in one pass
+    scanDirectoryBlock(blockindex, NULL, &scan);
 
-    // check if it's an empty block
-    for (int i = 0; i < BLOCKSIZE; i++) {
-        if (blk->data[i] != 0) {
-            bitsFound++;
-        }
+    if (scan.last != USHRT_MAX) {
+        return scan.last;
     }
 
-    // if no bits are found, return 0
-    if (bitsFound == 0) {
+    // if it's an empty block, return 0
+    if (scan.empty) {
         return 0;
     }
 
@@ -437,1146 +1671,5988 @@ unsigned short findLastBlockOfParent(short parentdirIndex) {
     return currentBlockIndex;
 }
 
-void initializeNewDirectory(dirEntry* newDir, dirEntry* parentDir) {
-    short newDirBlockIndex = USHRT_MAX;       // index on the FAT of new dir block
-    short parentDirBlockIndex = USHRT_MAX;    // index on the FAT of parent dir block
-    block* newDirBlock = NULL;                // pointer to the new dir block
-    block* parentDirBlock = NULL;             // pointer to the parent dir block
-    dirEntry* dotEntry = NULL;                // pointer to the . entry in the new dir block
-    dirEntry* dotdotEntry = NULL;             // pointer to the .. entry in the new dir block
-
-    // set the block indexes
-    newDirBlockIndex = newDir->first_cluster_low;
-    parentDirBlockIndex = parentDir->first_cluster_low;
-
-    // set the block pointers
-    newDirBlock = &blocks[newDirBlockIndex];
-    parentDirBlock = &blocks[parentDirBlockIndex];
-
-    // set the pointers to the . and .. entries in the new directory block
-    dotEntry = (dirEntry*)&newDirBlock->data[0];
-    dotdotEntry = dotEntry + 1;
-
-    // zero the block
-    bzero(newDirBlock, BLOCKSIZE);
-
-    logMessage("New directory block zeroed\n");
+void freeBlockChain(unsigned short blockIndex) {
+    unsigned short runStart = blockIndex;   // first block of the run of adjacent blocks being freed
+    unsigned int runLength = 0;             // number of blocks in the run
 
-    // set the . entry
-    setDirEntry(dotEntry, ".", ATTR_DIRECTORY, newDir->create_time_tenth, newDir->create_time, newDir->create_date,
-                newDir->last_access_date, newDir->first_cluster_high, newDir->last_write_time, newDir->last_write_date,
-                newDir->first_cluster_low, newDir->size, NOTLASTENTRY);
+    // return every block in the chain starting at blockIndex to the FAT, handing the freed blocks on a
+    // run at a time so they can be punched out of the image
+    while (blockIndex != USHRT_MAX) {
+        unsigned short nextBlock = *chainLink(blockIndex);
 
-    // set the .. entry
-    setDirEntry(dotdotEntry, "..", ATTR_DIRECTORY, parentDir->create_time_tenth, parentDir->create_time, parentDir->create_date,
-                parentDir->last_access_date, parentDir->first_cluster_high, parentDir->last_write_time, parentDir->last_write_date,
-                parentDir->first_cluster_low, parentDir->size, LASTENTRY);
+        // holes, references and blocks still shared have no blocks to hand on
+        if (!releaseLink(blockIndex)) {
+            blockIndex = nextBlock;
+            continue;
+        }
 
-    logMessage("Set . and .. entries in new directory block\n");
+        if (runLength > 0 && blockIndex != runStart + runLength) {
+            queueFreedBlocks(runStart, runLength);
+            runStart = blockIndex;
+            runLength = 0;
+        }
+        if (runLength == 0) {
+            runStart = blockIndex;
+        }
+        runLength++;
 
-    logMessage("New directory finished initializing\n");
+        blockIndex = nextBlock;
+    }
+    queueFreedBlocks(runStart, runLength);
 }
 
-void _addDirectory(char* directoryName, dirEntry* parentDirEntry) {
-    unsigned short currentBlockIndex = USHRT_MAX;     // index on the FAT of the current working block
-    unsigned short finalDirIndex = USHRT_MAX;         // directory # of the last entry in the block. not the index
-    unsigned short newEntryIndex = USHRT_MAX;         // index on block->data for new entry
-    unsigned short parentBlockIndex = USHRT_MAX;      // index on the FAT of the parent directory
-    block* currentBlockPtr = NULL;                    // pointer to the current block
-    dirEntry* newDirEntry = NULL;                     // pointer to the new directory entry
-    dirEntry* previousEntry = NULL;                   // pointer to the previous entry in the block
+unsigned short* chainLink(unsigned short link) {
+    // the link that comes after link in its chain: the FAT entry of a block, or the next field of a hole
+    return ISHOLE(link) ? &holes[link - HOLEBASE].next : &FAT[link];
+}
 
-    // check if the file system is loaded
-    fsLoadedCheck();
+unsigned int chainSpan(unsigned short link) {
+    // number of blocks of a file that one link of its chain stands for, 0 for a hole that has been freed
+    return ISHOLE(link) ? holes[link - HOLEBASE].length : 1;
+}
 
-    logMessage("Attempting to add directory\n");
+int releaseLink(unsigned short link) {
+    // give a block back to the FAT, or a hole back to the hole table. A block other links still share is
+    // only cut out of the chain, and a reference lets go of the blocks it stands for. Each is done so that a
+    // program stopped in the middle leaves blocks that can't be freed rather than ones freed twice. returns
+    // 1 if link was a block and is now free
+    if (ISREFERENCE(link)) {
+        unsigned short firstBlock = REFERENCEBLOCK(link);           // first block it stands for
+        unsigned int numBlocks = holes[link - HOLEBASE].length;     // number of them
+
+        holes[link - HOLEBASE].length = 0;
+        ORDERSTORES();
+        releaseSharedBlocks(firstBlock, numBlocks);
+        return 0;
+    }
+    if (ISHOLE(link)) {
+        holes[link - HOLEBASE].length = 0;
+        return 0;
+    }
+    if (refcounts[link] > 0) {
+        FAT[link] = SHAREDBLOCK;
+        ORDERSTORES();
+        refcounts[link]--;
+        return 0;
+    }
 
-    // get the parent block index from the parent directory entry
-    parentBlockIndex = parentDirEntry->first_cluster_low;
+    FAT[link] = 0;
+    return 1;
+}
 
-    // traverse the FAT to find the last block of the parent directory
-    currentBlockIndex = findLastBlockOfParent(parentBlockIndex);
-    currentBlockPtr = &blocks[currentBlockIndex];
-    logMessage("Found last block of parent directory\n");
+void releaseSharedBlocks(unsigned short firstBlock, unsigned int numBlocks) {
+    // drop a reference's link to each of a run of shared blocks, freeing the ones it was the last link to
+    unsigned short runStart = firstBlock;   // first block of the run of freed blocks
+    unsigned int runLength = 0;             // number of blocks in it
 
-    // find the final dir entry in the last block of the parent directory
-    finalDirIndex = findLastEntryInBlock(currentBlockIndex);
+    for (unsigned short block = firstBlock; block < firstBlock + numBlocks; block++) {
+        if (refcounts[block] > 0) {
+            refcounts[block]--;
+            queueFreedBlocks(runStart, runLength);
+            runLength = 0;
+            continue;
+        }
 
-    // check if there is space in the parent directory
-    if (finalDirIndex == USHRT_MAX) {
-        fprintf(stderr, "No space left in parent directory, cannot add directory\n");
-        exit(1);
+        FAT[block] = 0;
+        if (runLength == 0) {
+            runStart = block;
+        }
+        runLength++;
     }
+    queueFreedBlocks(runStart, runLength);
+}
 
-    // check if the name is too long
-    if (strlen(directoryName) > MAXFILENAME) {
-        fprintf(stderr, "Directory name is too long, cannot add directory\n");
-        exit(1);
-    }
+unsigned short allocateReference(unsigned short firstBlock, unsigned int numBlocks, unsigned short next) {
+    // take a slot in the hole table for a link to numBlocks shared blocks from firstBlock on, returning
+    // the link to put in the chain, or USHRT_MAX if the table is full. The blocks are counted by the caller
+    unsigned short link = allocateHole(numBlocks, next);     // the reference
 
-    // check if the directory name already exists. TODO
-    if (findEntryInDirectory(parentDirEntry, directoryName) != NULL) {
-        fprintf(stderr, "Directory, %s, already exists, cannot add directory\n", directoryName);
-        exit(1);
+    if (link == USHRT_MAX) {
+        return USHRT_MAX;
     }
+    holes[link - HOLEBASE].compressedSize = REFERENCE | firstBlock;
 
-    // get the pointer to the last entry in the block
-    if (finalDirIndex == (BLOCKSIZE / sizeof(dirEntry) - 1)) {
-        // No space left in block. Last entry is at the end of the block
-
-        // get the pointer to the current last entry in the block
-        previousEntry = (dirEntry*)&blocks[currentBlockIndex].data[finalDirIndex * sizeof(dirEntry)];
+    // builds that don't know about shared blocks would read the reference as a hole, and free the blocks
+    // under the other files
+    if (!(sb->features & FEATURE_SHARED)) {
+        sb->features |= FEATURE_SHARED;
+        writeSuperblock();
+    }
 
-        // find a free block, and update the FAT
-        currentBlockIndex = allocateNewBlock(currentBlockIndex);
+    return link;
+}
 
-        // get the pointer to the new entry in the block
-        newDirEntry = (dirEntry*)&blocks[currentBlockIndex];
+unsigned short allocateHole(unsigned int length, unsigned short next) {
+    // take a slot in the hole table for length blocks of a file that have no storage, returning the link
+    // to put in the chain, or USHRT_MAX if the table is full
+    for (unsigned int i = 0; i < MAXHOLES; i++) {
+        unsigned int slot = (freeHoleHint + i) % MAXHOLES;   // slot being looked at
+
+        if (holes[slot].length == 0) {
+            holes[slot].next = next;
+            holes[slot].length = length;
+            holes[slot].compressedSize = 0;
+            freeHoleHint = slot + 1;
+
+            // builds that don't know about holes would follow the link off the end of the FAT
+            if (!(sb->features & FEATURE_HOLES)) {
+                sb->features |= FEATURE_HOLES;
+                writeSuperblock();
+            }
 
-        logMessage("Block full. Allocating free block for new directory\n");
+            return HOLEBASE + slot;
+        }
     }
-    else {
-        // Have space left
 
-        // Get the index of the new entry in the block
-        newEntryIndex = (finalDirIndex * sizeof(dirEntry)) + sizeof(dirEntry);
-
-        // set the pointer to the next space after the last entry
-        newDirEntry = (dirEntry*)&blocks[currentBlockIndex].data[newEntryIndex];
+    logMessage("Hole table full\n");
+    return USHRT_MAX;
+}
 
-        // set the pointer to the current last entry in the block
-        previousEntry = (dirEntry*)&blocks[currentBlockIndex].data[finalDirIndex * sizeof(dirEntry)];
+int growFile(dirEntry* file, unsigned int newSize) {
+    // make a file newSize bytes long without storing anything for the new part. What's left of the block
+    // the file ended in is cleared, and the blocks after it become a hole at the end of the chain, so it
+    // takes one walk of the chain however much the file grows. returns 0, or -ENOSPC if no hole is free
+    unsigned short link = file->first_cluster_low;                   // link being looked at
+    unsigned int position = 0;                                       // block of the file link starts at
+    unsigned int tailBlock = file->size / BLOCKSIZE;                 // block the old end of the file is in
+    unsigned int numBlocks = (newSize + BLOCKSIZE - 1) / BLOCKSIZE;  // blocks the file needs
 
-        logMessage("Space left in block. Adding directory to current block\n");
+    // clear everything stored past the old end, since it may be left over from an earlier file
+    while (1) {
+        if (!ISHOLE(link) && position >= tailBlock) {
+            unsigned int start = position == tailBlock ? file->size % BLOCKSIZE : 0;
+            bzero(&blocks[link].data[start], BLOCKSIZE - start);
+            setBlockChecksum(link);
+        }
+        position += chainSpan(link);
+        if (*chainLink(link) == USHRT_MAX) {
+            break;
+        }
+        link = *chainLink(link);
     }
 
-    // update the current last entry in the block to indicate that it is not the last entry
-    previousEntry->isLast = NOTLASTENTRY;
+    // add the missing blocks as a hole, or lengthen the hole the file already ends in
+    if (numBlocks > position) {
+        if (ISHOLE(link) && !ISREFERENCE(link)) {
+            holes[link - HOLEBASE].length += numBlocks - position;
+        }
+        else {
+            unsigned short newHole = allocateHole(numBlocks - position, USHRT_MAX);
+            if (newHole == USHRT_MAX) {
+                return -ENOSPC;
+            }
+            *chainLink(link) = newHole;
+        }
+    }
 
-    // allocate a new block for the new directory's data
-    unsigned short newDirBlock = findFreeBlock();
-    FAT[newDirBlock] = USHRT_MAX;
+    logMessage("Grew file to %u bytes, %u blocks\n", newSize, numBlocks);
+    file->size = newSize;
+    return 0;
+}
 
-    // get current date time for create and last write
-    short create_time = 0;
-    char create_time_tenth = 0;
-    short create_date = 0;
-    getDateTime(&create_time, &create_time_tenth, &create_date);
+unsigned short fileBlockForWrite(unsigned short* block, unsigned int* position, unsigned int index) {
+    // find the block holding block index of a file, giving it storage if it's in a hole or past the end of
+    // the chain. The search starts at *block, which holds block *position of the file, no later than index,
+    // and both are left at the block returned so the next call can carry on from there. A hole is never
+    // followed by another one. References are stepped over, since shared blocks are given storage of the
+    // file's own before they're written. returns USHRT_MAX if there is no free block, if a hole has to be
+    // split and the hole table is full, or if the block is shared
+    unsigned short current = *block;                // link being looked at, a block or a reference
+    unsigned int currentPosition = *position;       // last block of the file current holds
+
+    while (currentPosition < index) {
+        unsigned short next = *chainLink(current);  // link after the current one
+        unsigned short newBlock = 0;            // block given storage
+
+        // past the end of the chain. anything skipped over becomes a hole
+        if (next == USHRT_MAX) {
+            unsigned short gap = USHRT_MAX;     // hole in front of the new block, if there is one
+
+            if (!haveFreeBlock()) {
+                return USHRT_MAX;
+            }
+            if (index - currentPosition > 1 && (gap = allocateHole(index - currentPosition - 1, USHRT_MAX)) == USHRT_MAX) {
+                return USHRT_MAX;
+            }
+            newBlock = findFreeBlock();
+            bzero(blocks[newBlock].data, BLOCKSIZE);
+            setBlockChecksum(newBlock);
+            FAT[newBlock] = USHRT_MAX;
+            if (gap != USHRT_MAX) {
+                holes[gap - HOLEBASE].next = newBlock;
+                *chainLink(current) = gap;
+            }
+            else {
+                *chainLink(current) = newBlock;
+            }
 
-    // calculate the cluster number of the new directory
-    short clusterHigh = (newDirBlock >> 16) & 0xFFFF;
-    short clusterLow = newDirBlock & 0xFFFF;
+            current = newBlock;
+            currentPosition = index;
+            break;
+        }
 
-    // set the values of the new directory entry
-    setDirEntry(newDirEntry, directoryName, ATTR_DIRECTORY,
-                create_time_tenth, create_time, create_date, create_date,
-                clusterHigh, create_time, create_date,
-                clusterLow, 0, LASTENTRY);
+        if (ISREFERENCE(next)) {
+            if (index <= currentPosition + chainSpan(next)) {
+                return USHRT_MAX;
+            }
+            current = next;
+            currentPosition += chainSpan(next);
+            continue;
+        }
 
-    // set the last entry in the block to indicate that it is the last entry
-    newDirEntry->isLast = LASTENTRY;
+        if (ISHOLE(next)) {
+            hole* nextHole = &holes[next - HOLEBASE];                         // hole after the current block
+            unsigned int holeEnd = currentPosition + nextHole->length;       // last block of the file in the hole
 
-    // initialize the new directory block
-    initializeNewDirectory(newDirEntry, parentDirEntry);
+            // the hole ends the chain and the block is past it. lengthen the hole and put the block after it
+            if (index > holeEnd && nextHole->next == USHRT_MAX) {
+                if (!haveFreeBlock()) {
+                    return USHRT_MAX;
+                }
+                newBlock = findFreeBlock();
+                bzero(blocks[newBlock].data, BLOCKSIZE);
+                setBlockChecksum(newBlock);
+                FAT[newBlock] = USHRT_MAX;
+                nextHole->length = index - currentPosition - 1;
+                nextHole->next = newBlock;
 
-    logMessage("New directory added\n");
-}
+                current = newBlock;
+                currentPosition = index;
+                break;
+            }
 
-void addDirectory(char* directoryPath, dirEntry* parentDirEntry) {
-    char* token;                            // token for strtok
-    char path[MAXPATH];                     // maximum path size
-    dirEntry* currentDir = parentDirEntry;  // start from the root directory
+            // the block is in the hole. split it around the block, dropping the parts that are empty
+            if (index <= holeEnd) {
+                unsigned int before = index - currentPosition - 1;           // blocks of the hole in front
+                unsigned int after = holeEnd - index;                         // blocks of the hole behind
+                unsigned short afterHole = USHRT_MAX;                        // new hole for the part behind
 
-    // copy the directory path to a local variable
-    strcpy(path, directoryPath);
+                if (!haveFreeBlock()) {
+                    return USHRT_MAX;
+                }
+                if (before > 0 && after > 0 && (afterHole = allocateHole(after, nextHole->next)) == USHRT_MAX) {
+                    return USHRT_MAX;
+                }
+                newBlock = findFreeBlock();
+                bzero(blocks[newBlock].data, BLOCKSIZE);
+                setBlockChecksum(newBlock);
+
+                if (before > 0) {
+                    FAT[newBlock] = after > 0 ? afterHole : nextHole->next;
+                    nextHole->length = before;
+                    nextHole->next = newBlock;
+                }
+                else {
+                    FAT[newBlock] = after > 0 ? next : nextHole->next;
+                    nextHole->length = after;           // frees the hole if nothing is left of it
+                    *chainLink(current) = newBlock;
+                }
 
-    // tokenize the path and create directories as needed
-    token = strtok(path, "/");
-    while (token != NULL) {
-        dirEntry* foundEntry = findEntryInDirectory(currentDir, token);
-        if (foundEntry == NULL) {
-            // directory does not exist, create it
-            _addDirectory(token, currentDir);
-            foundEntry = findEntryInDirectory(currentDir, token);
+                current = newBlock;
+                currentPosition = index;
+                break;
+            }
+
+            // step over the hole, to the link after it
+            current = nextHole->next;
+            currentPosition = holeEnd + chainSpan(current);
+            if (ISREFERENCE(current) && currentPosition >= index) {
+                return USHRT_MAX;
+            }
+            continue;
         }
-        // move to the next directory in the path
-        currentDir = foundEntry;
-        token = strtok(NULL, "/");
+
+        current = next;
+        currentPosition++;
     }
+
+    *block = current;
+    *position = currentPosition;
+    return current;
 }
 
-dirEntry* getNextEntry(dirEntry* currentEntry, dirEntry* parentDirEntry) {
-    unsigned short isLast;              // flag to indicate if the current entry is the last entry in the BLOCK, NOT DIR
-    unsigned short currentBlockIndex;   // index on the FAT of the current working block
-    unsigned short currentEntryIndex;   // index of the current entry in the block
-    unsigned short entryFound;          // flag to indicate if the entry was found in the block
-    block* currentBlock;                // pointer to the current block
-    dirEntry* nextEntry;                // pointer to the next entry in the block
+int readFileData(dirEntry* file, char* buffer, unsigned int size, unsigned int offset) {
+    // copy up to size bytes of a file, from offset, into buffer. Holes read as zeroes, and compressed
+    // chunks are decompressed. returns the number of bytes copied, which is less than size at the end of
+    // the file, or -EIO if a block read is corrupt
+    unsigned short link = file->first_cluster_low;      // link being read
+    unsigned long long position = 0;                    // block of the file link starts at
+    unsigned int bytesRead = 0;                         // bytes copied so far
+    unsigned short chunkStart = USHRT_MAX;              // last block passed that starts a chunk
+    unsigned long long chunkPosition = 0;               // block of the file it's at
+
+    if (offset >= file->size) {
+        return 0;
+    }
+    if (size > file->size - offset) {
+        size = file->size - offset;
+    }
 
-    // check if the file system is loaded
-    fsLoadedCheck();
+    // a packed file is all in one place
+    if (ISPACKED(file)) {
+        if (verifyBlock(file->first_cluster_low) != 0) {
+            return -EIO;
+        }
+        memcpy(buffer, packedFileData(file) + offset, size);
+        return size;
+    }
 
-    // early return if it's the last entry in the directory
-    if (currentEntry->isLast == LASTENTRY) {
-        logMessage("Error: Current entry is the last in the directory. No next entry available.\n");
-        return NULL;
+    // skip the links that end before the offset
+    while (link != USHRT_MAX && (position + chainSpan(link)) * BLOCKSIZE <= offset) {
+        if ((!ISHOLE(link) || ISREFERENCE(link)) && position % CHUNKBLOCKS == 0) {
+            chunkStart = link;
+            chunkPosition = position;
+        }
+        position += chainSpan(link);
+        link = *chainLink(link);
     }
 
-    // logMessage("Starting search for the next directory entry after '%s'.\n", currentEntry->name);
+    // a compressed chunk can only be read from its start
+    if (ISCOMPRESSED(file) && chunkStart != USHRT_MAX && chunkPosition == offset / CHUNKSIZE * CHUNKBLOCKS &&
+        chunkDataSize(chunkStart) > 0) {
+        link = chunkStart;
+        position = chunkPosition;
+    }
 
-    // get the working block
-    currentBlockIndex = parentDirEntry->first_cluster_low;
-    currentBlock = &blocks[currentBlockIndex];
+    while (bytesRead < size && link != USHRT_MAX) {
+        unsigned long long start = offset + bytesRead - position * BLOCKSIZE;   // where to start in the link
+        unsigned long long numBytes = chainSpan(link) * (unsigned long long)BLOCKSIZE - start;
+        unsigned int compressedSize = 0;        // bytes of data, if the link starts a compressed chunk
 
-    // logMessage("\tSearching in the block starting at index %u.\n", currentBlockIndex);
+        if (ISCOMPRESSED(file) && (!ISHOLE(link) || ISREFERENCE(link)) && position % CHUNKBLOCKS == 0) {
+            compressedSize = chunkDataSize(link);
+        }
 
-    // find the current entry in the block
-    entryFound = 0;
-    while (entryFound == 0) {
-        // search for the entry's index in the block by name
-        for (currentEntryIndex = 0; currentEntryIndex < BLOCKSIZE; currentEntryIndex += sizeof(dirEntry)) {
-            nextEntry = (dirEntry*)&currentBlock->data[currentEntryIndex];
-            char* entryName = nextEntry->name;
+        // a compressed chunk is decompressed whole, and its chain skipped
+        if (compressedSize > 0) {
+            char* chunk = loadChunk(link, compressedSize);         // the chunk, decompressed
+            unsigned long long chunkEnd = position + CHUNKBLOCKS;   // block of the file after it
 
-            // compare the names of the entries
-            if (strcmp(entryName, currentEntry->name) == 0) {
-                // found the entry
-                // logMessage("\tEntry '%s' found in block at index %u.\n", entryName, currentEntryIndex);
-                entryFound = 1;
-                break;
+            if (chunk == NULL) {
+                return -EIO;
+            }
+            numBytes = CHUNKSIZE - start;
+            if (numBytes > size - bytesRead) {
+                numBytes = size - bytesRead;
             }
+            memcpy(buffer + bytesRead, chunk + start, numBytes);
+            bytesRead += numBytes;
+            while (link != USHRT_MAX && position < chunkEnd) {
+                position += chainSpan(link);
+                link = *chainLink(link);
+            }
+            continue;
         }
 
-        // check if the entry was found in the block
-        if (entryFound == 0) {
-            // check if there's another block to search
-            if (FAT[currentBlockIndex] == USHRT_MAX) {
-                // no more blocks in the directory
-                logMessage("\tError: Entry '%s' not found in block. No more blocks in directory.\n", currentEntry->name);
-                return NULL;
+        if (numBytes > size - bytesRead) {
+            numBytes = size - bytesRead;
+        }
+        if (ISREFERENCE(link)) {
+            // the shared blocks are a run, so they're copied in one go
+            unsigned short firstBlock = REFERENCEBLOCK(link);
+            for (unsigned long long i = start / BLOCKSIZE; i <= (start + numBytes - 1) / BLOCKSIZE; i++) {
+                if (verifyBlock(firstBlock + i) != 0) {
+                    return -EIO;
+                }
             }
-            // get the next block in the FAT
-            // logMessage("\tEntry '%s' not found in current block. Moving to next block in FAT.\n", currentEntry->name);
-            currentBlockIndex = FAT[currentBlockIndex];
-            currentBlock = &blocks[currentBlockIndex];
-            // logMessage("\tSearching in the new block starting at index %u.\n", currentBlockIndex);
+            memcpy(buffer + bytesRead, blocks[firstBlock].data + start, numBytes);
+        }
+        else if (ISHOLE(link)) {
+            memset(buffer + bytesRead, 0, numBytes);
+        }
+        else if (verifyBlock(link) != 0) {
+            return -EIO;
+        }
+        else {
+            memcpy(buffer + bytesRead, blocks[link].data + start, numBytes);
         }
-    }
 
-    // last entry in block?
-    if (currentEntryIndex == BLOCKSIZE - sizeof(dirEntry)) {
-        isLast = LASTENTRY;
-    }
-    else {
-        isLast = NOTLASTENTRY;
+        bytesRead += numBytes;
+        position += chainSpan(link);
+        link = *chainLink(link);
     }
 
-    // if not last entry in block, return the next entry
-    if (isLast == NOTLASTENTRY) {
-        // return the next entry in the block
-        nextEntry = (dirEntry*)&currentBlock->data[currentEntryIndex + sizeof(dirEntry)];
-        // logMessage("\tNext entry '%s' found in the current block.\n", nextEntry->name);
-
-        return nextEntry;
-    }
+    return bytesRead;
+}
 
-    // current entry is the last in the block
-    // get the next block in the FAT
-    currentBlockIndex = FAT[currentBlockIndex];
-    currentEntryIndex = 0;
+long long seekFileData(dirEntry* file, long long offset, int whence) {
+    // what lseek does with SEEK_DATA or SEEK_HOLE: the first offset from offset on that has data, or that
+    // is in a hole. The end of the file counts as a hole. returns -ENXIO if there's no such offset
+    unsigned short link = file->first_cluster_low;      // link being looked at
+    unsigned long long position = 0;                    // block of the file link starts at
 
-    // check if current block is the last
-    if (currentBlockIndex == USHRT_MAX) {
-        return NULL;
-        logMessage("\tError: Reached the last block in FAT. No next entry available.\n");
+    if (offset < 0 || offset >= file->size) {
+        return -ENXIO;
     }
 
-    // get the entry
-    nextEntry = (dirEntry*)&blocks[currentBlockIndex].data[currentEntryIndex];
-    logMessage("\tNext entry '%s' found in the next block at index %u.\n", nextEntry->name, currentBlockIndex);
-
-    // return the entry
-    return nextEntry;
-}
+    // a packed file has no holes
+    if (ISPACKED(file)) {
+        return whence == SEEK_HOLE ? file->size : offset;
+    }
 
-// helper function to convert the date and time to a human-readable format
-void convertDateTime(short time, short date, char* dateTimeStr) {
-    // extract components from the date and time fields
-    int seconds = (time & 0x1F) * 2;
-    int minutes = (time >> 5) & 0x3F;
-    int hours = (time >> 11) & 0x1F;
+    while (link != USHRT_MAX) {
+        unsigned long long end = (position + chainSpan(link)) * BLOCKSIZE;   // offset just past the link
+        int isData = !ISHOLE(link) || holes[link - HOLEBASE].compressedSize > 0;   // the rest of a compressed chunk is data
 
-    int day = date & 0x1F;
-    int month = (date >> 5) & 0x0F;
-    int year = ((date >> 9) & 0x7F) + 1980;
+        if (end > (unsigned long long)offset && isData == (whence != SEEK_HOLE)) {
+            return (long long)(position * BLOCKSIZE) > offset ? (long long)(position * BLOCKSIZE) : offset;
+        }
+        position += chainSpan(link);
+        link = *chainLink(link);
+    }
 
-    // format the date and time as a string
-    sprintf(dateTimeStr, "%04d-%02d-%02d %02d:%02d:%02d", year, month, day, hours, minutes, seconds);
+    // ran off the end of the chain
+    if (whence == SEEK_HOLE) {
+        return file->size;
+    }
+    return -ENXIO;
 }
 
-void listDirectory(dirEntry* parentDir) {
-    unsigned short currentDirBlockIndex = USHRT_MAX;     // index on the FAT of the current working block
-    block* currentDirBlock = NULL;                       // pointer to the current directory block
-    dirEntry* currentDirEntry = NULL;                    // pointer to the current directory entry
-    unsigned short currentDirEntryIndex = USHRT_MAX;     // index of the current directory entry in the block
-    char dateTimeStr[20];                                // string to hold the formatted date and time
+unsigned int countFileBlocks(dirEntry* file) {
+    // number of blocks a file has storage for, leaving out its holes. Shared blocks count for every file
+    // that has them
+    unsigned short link = file->first_cluster_low;      // link being looked at
+    unsigned int numBlocks = 0;                         // blocks counted so far
 
-    // check if the file system is loaded
-    fsLoadedCheck();
+    // a packed file only has part of a block
+    if (ISPACKED(file)) {
+        return 0;
+    }
 
-    // print the header
-    printf("%-12s %-20s %-10s\n", "Name", "Date Modified", "Size");
-    printf("%-12s %-20s %-10s\n", "------------", "-------------------", "----------");
+    while (link != USHRT_MAX) {
+        numBlocks += !ISHOLE(link) ? 1 : ISREFERENCE(link) ? chainSpan(link) : 0;
+        link = *chainLink(link);
+    }
 
-    // set the current block index to the first cluster of the parent directory
-    currentDirBlockIndex = parentDir->first_cluster_low;
+    return numBlocks;
+}
 
-    // get the pointer to the current directory block
-    currentDirBlock = &blocks[currentDirBlockIndex];
+unsigned int findFreeRun(unsigned int numBlocks) {
+    // first block of a run of at least numBlocks free blocks, preferring one from where the last search
+    // left off. If no run is that long, the longest there is. returns MAXBLOCKS if nothing is free
+    unsigned int block = 0;                 // block being looked at
+    unsigned int firstFit = MAXBLOCKS;      // first long enough run anywhere
+    unsigned int longest = MAXBLOCKS;       // start of the longest run
+    unsigned int longestLength = 0;         // length of the longest run
 
-    // set the pointer to the first entry in the block
-    currentDirEntryIndex = 0;
-    currentDirEntry = (dirEntry*)&currentDirBlock->data[currentDirEntryIndex];
+    while (block < MAXBLOCKS) {
+        unsigned int runStart = block + findZeroEntry(&FAT[block], MAXBLOCKS - block);   // first free block
+        unsigned int runEnd = runStart;                                                 // block after the run
 
-    // iterate through the directory entries in the block until the last entry is found
-    while (currentDirEntry->isLast != LASTENTRY && currentDirEntry != NULL) {
-        // don't print the . and .. entries
-        if (strcmp(currentDirEntry->name, "..") == 0 || strcmp(currentDirEntry->name, ".") == 0) {
-            currentDirEntry = getNextEntry(currentDirEntry, parentDir);
-            continue;
+        if (runStart >= MAXBLOCKS) {
+            break;
+        }
+        while (runEnd < MAXBLOCKS && FAT[runEnd] == 0) {
+            runEnd++;
         }
 
-        // don't print the deleted entries
-        if (currentDirEntry->name[0] == 0x5F || currentDirEntry->attributes == ATTR_DELETED) {
-            currentDirEntry = getNextEntry(currentDirEntry, parentDir);
-            continue;
+        if (runEnd - runStart >= numBlocks) {
+            if (runStart >= freeBlockHint) {
+                return runStart;
+            }
+            if (firstFit == MAXBLOCKS) {
+                firstFit = runStart;
+            }
         }
+        if (runEnd - runStart > longestLength) {
+            longest = runStart;
+            longestLength = runEnd - runStart;
+        }
+        block = runEnd;
+    }
 
-        // convert the date and time to a readable format
-        convertDateTime(currentDirEntry->last_write_time, currentDirEntry->last_write_date, dateTimeStr);
+    return firstFit != MAXBLOCKS ? firstFit : longest;
+}
 
-        // print the entry name
-        char name[12] = {0};
-        strncpy(name, currentDirEntry->name, 11);
-        if (currentDirEntry->attributes == ATTR_DIRECTORY) {
-            printf("%-12s %-20s %-10s\n", strcat(name, "/"), dateTimeStr, "0");
-        } else {
-            printf("%-12s %-20s %-10u\n", currentDirEntry->name, dateTimeStr, currentDirEntry->size);
+int allocateFileRange(dirEntry* file, unsigned int firstIndex, unsigned int numBlocks) {
+    // give blocks firstIndex to firstIndex + numBlocks - 1 of a file storage, filling holes and adding
+    // blocks past the end of the chain. The new blocks are cleared and taken from one free run when there
+    // is one long enough. returns 0, -ENOSPC if there aren't enough free blocks, or if a hole has to be
+    // split and the hole table is full
+    unsigned short link = file->first_cluster_low;      // link being looked at
+    unsigned int position = 0;                          // block of the file link starts at
+    unsigned int endIndex = firstIndex + numBlocks;     // block after the range
+    unsigned int numMissing = 0;                        // blocks in the range without storage
+    unsigned short block = file->first_cluster_low;     // where fileBlockForWrite carries on from
+    unsigned int blockPosition = 0;                     // block of the file that is
+
+    // count the blocks of the range in holes or past the end of the chain
+    while (link != USHRT_MAX) {
+        unsigned int linkEnd = position + chainSpan(link);
+
+        if (ISHOLE(link) && !ISREFERENCE(link) && linkEnd > firstIndex && position < endIndex) {
+            numMissing += (linkEnd < endIndex ? linkEnd : endIndex) - (position > firstIndex ? position : firstIndex);
         }
+        position = linkEnd;
+        link = *chainLink(link);
+    }
+    if (endIndex > position) {
+        numMissing += endIndex - (position > firstIndex ? position : firstIndex);
+    }
 
-        // get the next entry in the directory
-        currentDirEntry = getNextEntry(currentDirEntry, parentDir);
+    if (numMissing > countFreeBlocks()) {
+        return -ENOSPC;
     }
 
-    // make sure we still have a currentDirEntry
-    if (currentDirEntry == NULL) {
+    // start allocating at a run that fits them all, then give each block storage in turn
+    if (numMissing > 0) {
+        freeBlockHint = findFreeRun(numMissing);
+        for (unsigned int i = firstIndex; i < endIndex; i++) {
+            if (fileBlockForWrite(&block, &blockPosition, i) == USHRT_MAX) {
+                return -ENOSPC;
+            }
+        }
+    }
+
+    logMessage("Allocated %u blocks for blocks %u-%u of the file\n", numMissing, firstIndex, endIndex - 1);
+    return 0;
+}
+
+void zeroFileRange(dirEntry* file, unsigned long long offset, unsigned long long end) {
+    // clear bytes offset to end of a file where they are stored. holes already read as zeroes
+    unsigned short link = file->first_cluster_low;      // link being looked at
+    unsigned long long position = 0;                    // block of the file link starts at
+
+    if (offset >= end) {
         return;
     }
 
-    // don't print the . and .. entries
-    if (strcmp(currentDirEntry->name, "..") == 0 || strcmp(currentDirEntry->name, ".") == 0) {
-        return; // we can return here because we know that we are at the last entry
+    while (link != USHRT_MAX && position * BLOCKSIZE < end) {
+        unsigned long long linkStart = position * BLOCKSIZE;     // first byte of the file in the link
+        unsigned long long linkEnd = linkStart + BLOCKSIZE;      // byte after the link, if it's a block
+
+        if (!ISHOLE(link) && linkEnd > offset) {
+            unsigned long long from = offset > linkStart ? offset - linkStart : 0;
+            unsigned long long to = end < linkEnd ? end - linkStart : BLOCKSIZE;
+            memset(blocks[link].data + from, 0, to - from);
+            setBlockChecksum(link);
+        }
+        position += chainSpan(link);
+        link = *chainLink(link);
     }
+}
 
-    // don't print the deleted entries
-    if (currentDirEntry->name[0] == 0x5F || currentDirEntry->attributes == ATTR_DELETED) {
-        return; // we can return here because we know that we are at the last entry
+int punchFileRange(dirEntry* file, unsigned long long offset, unsigned long long end) {
+    // make bytes offset to end of a file read as zeroes, giving up the storage of the whole blocks in the
+    // range. They join the holes on either side, so holes never end up next to each other. The first block
+    // is always stored, so it is only cleared. returns 0, or -ENOSPC if the hole table is full
+    unsigned long long firstIndex = (offset + BLOCKSIZE - 1) / BLOCKSIZE;   // first whole block in the range
+    unsigned long long endIndex = end / BLOCKSIZE;                         // block after the last whole one
+    unsigned short previous = file->first_cluster_low;                     // link in front of current
+    unsigned short current = FAT[previous];                                // link being looked at
+    unsigned long long position = 1;                                       // block of the file current starts at
+    unsigned int numFreed = 0;                                             // number of blocks freed
+
+    // clear the parts of blocks at either end, and all of the first block if it's in the range
+    if (firstIndex >= endIndex) {
+        zeroFileRange(file, offset, end);
+        return 0;
+    }
+    zeroFileRange(file, offset, firstIndex * BLOCKSIZE);
+    zeroFileRange(file, endIndex * BLOCKSIZE, end);
+    if (firstIndex == 0) {
+        zeroFileRange(file, 0, BLOCKSIZE);
+        firstIndex = 1;
     }
 
-    // convert the last write date and time to a human-readable format
-    convertDateTime(currentDirEntry->last_write_time, currentDirEntry->last_write_date, dateTimeStr);
+    while (current != USHRT_MAX && position < endIndex) {
+        unsigned short next = *chainLink(current);      // link after the current one
 
-    // print the last entry in the block
-    char name[12] = {0};
-    strncpy(name, currentDirEntry->name, 11);
-    if (currentDirEntry->attributes == ATTR_DIRECTORY) {
-        printf("%-12s %-20s %-10s\n", strcat(name, "/"), dateTimeStr, "0");
-    } else {
-        printf("%-12s %-20s %-10u\n", currentDirEntry->name, dateTimeStr, currentDirEntry->size);
+        if (ISHOLE(current) || position < firstIndex) {
+            previous = current;
+            position += chainSpan(current);
+            current = next;
+            continue;
+        }
+
+        // the block becomes part of the hole in front of it, or a hole of its own
+        if (ISHOLE(previous) && !ISREFERENCE(previous)) {
+            holes[previous - HOLEBASE].length++;
+            holes[previous - HOLEBASE].next = next;
+        }
+        else {
+            unsigned short newHole = allocateHole(1, next);
+            if (newHole == USHRT_MAX) {
+                return -ENOSPC;
+            }
+            *chainLink(previous) = newHole;
+            previous = newHole;
+        }
+        if (releaseLink(current)) {
+            queueFreedBlocks(current, 1);
+        }
+        numFreed++;
+        position++;
+
+        // and takes in the hole behind it
+        if (ISHOLE(next) && !ISREFERENCE(next)) {
+            holes[previous - HOLEBASE].length += holes[next - HOLEBASE].length;
+            holes[previous - HOLEBASE].next = holes[next - HOLEBASE].next;
+            position += holes[next - HOLEBASE].length;
+            holes[next - HOLEBASE].length = 0;
+        }
+        current = holes[previous - HOLEBASE].next;
     }
-}
 
+    logMessage("Punched %u blocks out of the file\n", numFreed);
+    return 0;
+}
 
-void _printDirectoryTree(dirEntry* parentDir, int depth) {
-    unsigned short currentDirBlockIndex = USHRT_MAX;     // index on the FAT of the current working block
-    block* currentDirBlock = NULL;                       // pointer to the current directory block
-    dirEntry* currentDirEntry = NULL;                    // pointer to the current directory entry
-    unsigned short currentDirEntryIndex = USHRT_MAX;     // index of the current directory entry in the block
+int mapFile(char* intpath, dirEntry* parentDir) {
+    // print where a file has data and where it has holes, like xfs_io's seek -a
+    dirEntry* file = findEntryFromPath(intpath, parentDir);   // file to map
+    long long offset = 0;                                     // start of the next extent
 
     // check if the file system is loaded
     fsLoadedCheck();
 
-    // set the current block index to the first cluster of the parent directory
-    currentDirBlockIndex = parentDir->first_cluster_low;
-
-    // get the pointer to the current directory block
-    currentDirBlock = &blocks[currentDirBlockIndex];
+    if (file == NULL || file->attributes == ATTR_DIRECTORY) {
+        fprintf(stderr, "File \"%s\" does not exist\n", intpath);
+        return -1;
+    }
 
-    // set the pointer to the first entry in the block
-    currentDirEntryIndex = 0;
-    currentDirEntry = (dirEntry*)&currentDirBlock->data[currentDirEntryIndex];
+    if (ISPACKED(file) && file->size > 0) {
+        printf("%s: %u bytes, packed in block %d\n", intpath, file->size, file->first_cluster_low);
+        return 0;
+    }
+    printf("%s: %u bytes, %u blocks stored%s, %u shared, %u fragments\n", intpath, file->size, countFileBlocks(file),
+           ISCOMPRESSED(file) ? ", compressed" : "", countSharedBlocks(file), countFileFragments(file));
+    while (offset < file->size) {
+        long long dataStart = seekFileData(file, offset, SEEK_DATA);   // next data at or after offset
+        long long holeStart = 0;                                       // next hole at or after offset
 
-    // iterate through the directory entries in the block until the last entry is found
-    while (currentDirEntry->isLast != LASTENTRY && currentDirEntry != NULL) {
-        logMessage("Current entry: %s\n", currentDirEntry->name);
-        // don't print the . and .. entries and get the next entry
-        if (strcmp(currentDirEntry->name, "..") == 0 || strcmp(currentDirEntry->name, ".") == 0) {
-            currentDirEntry = getNextEntry(currentDirEntry, parentDir);
-            logMessage("Got next entry, %s\n", currentDirEntry->name);
+        if (dataStart != offset) {
+            long long holeEnd = dataStart < 0 ? file->size : dataStart;
+            printf("  hole %lld-%lld\n", offset, holeEnd - 1);
+            offset = holeEnd;
             continue;
         }
+        holeStart = seekFileData(file, offset, SEEK_HOLE);
+        printf("  data %lld-%lld\n", offset, holeStart - 1);
+        offset = holeStart;
+    }
 
-        // don't print the deleted entries
-        if (currentDirEntry->name[0] == 0x5F || currentDirEntry->attributes == ATTR_DELETED) {
-            currentDirEntry = getNextEntry(currentDirEntry, parentDir);
-            logMessage("Got next entry, %s\n", currentDirEntry->name);
+    return 0;
+}
+
+unsigned short allocatePackUnits(unsigned int numUnits, unsigned int* unit) {
+    // find a run of numUnits free units in a pack block, starting a new pack block if the one small files
+    // are going in has no room. returns the block, with the first unit of the run in *unit, or USHRT_MAX
+    // if there are no free blocks
+    unsigned int mask = (1u << numUnits) - 1;      // bits of a run of numUnits units
+    packHeader* header = NULL;                     // header of the pack block
+
+    if (packBlockHint != 0) {
+        header = (packHeader*)blocks[packBlockHint].data;
+        for (unsigned int i = 1; i + numUnits <= PACKUNITS; i++) {
+            if ((header->used & (mask << i)) == 0) {
+                header->used |= mask << i;
+                *unit = i;
+                return packBlockHint;
+            }
+        }
+    }
+
+    if (!haveFreeBlock()) {
+        return USHRT_MAX;
+    }
+
+    // start a new pack block, with the run at the front
+    packBlockHint = findFreeBlock();
+    FAT[packBlockHint] = USHRT_MAX;
+    bzero(blocks[packBlockHint].data, BLOCKSIZE);
+    header = (packHeader*)blocks[packBlockHint].data;
+    header->magic = PACKMAGIC;
+    header->used = 1 | mask << 1;
+    *unit = 1;
+
+    logMessage("Started pack block %d\n", packBlockHint);
+    return packBlockHint;
+}
+
+void freePackUnits(dirEntry* file) {
+    // give back the units a packed file's data takes, and the pack block with them once it holds nothing else
+    unsigned short packBlock = file->first_cluster_low;                    // block holding the data
+    unsigned int numUnits = (file->size + PACKUNIT - 1) / PACKUNIT;        // units the data takes
+    unsigned int unit = file->first_cluster_high & PACKUNITMASK;           // first of them
+    packHeader* header = (packHeader*)blocks[packBlock].data;              // header of the pack block
+
+    // an empty file has nothing to give back
+    if (numUnits == 0) {
+        return;
+    }
+
+    header->used &= ~(((1u << numUnits) - 1) << unit);
+
+    // the next small file goes where there's now room, unless the block is empty and can be freed
+    if (header->used == 1) {
+        bzero(header, sizeof(packHeader));
+        FAT[packBlock] = 0;
+        queueFreedBlocks(packBlock, 1);
+        if (packBlockHint == packBlock) {
+            packBlockHint = 0;
+        }
+        logMessage("Freed pack block %d\n", packBlock);
+    }
+    else {
+        packBlockHint = packBlock;
+        setBlockChecksum(packBlock);
+    }
+}
+
+char* packedFileData(dirEntry* file) {
+    // where the data of a packed file is
+    return blocks[file->first_cluster_low].data + (file->first_cluster_high & PACKUNITMASK) * PACKUNIT;
+}
+
+int packFile(dirEntry* file) {
+    // move a small file out of its own block into a pack block. Files that are too big, that have storage
+    // past their first block, or that are packed already are left as they are, as is everything when no
+    // block is free for a new pack block. returns 1 if the file was packed
+    unsigned short fileBlock = file->first_cluster_low;                    // block the file is in now
+    unsigned int numUnits = (file->size + PACKUNIT - 1) / PACKUNIT;        // units its data needs
+    unsigned short packBlock = 0;                                          // block it's moved to, none if empty
+    unsigned int unit = 0;                                                 // first unit of its data there
+
+    if (ISPACKED(file) || (file->attributes & ATTR_DIRECTORY) || file->size > PACKMAXSIZE || FAT[fileBlock] != USHRT_MAX) {
+        return 0;
+    }
+
+    // copy the data over, clearing what's left of the last unit, which may hold an earlier file's data
+    if (numUnits > 0) {
+        packBlock = allocatePackUnits(numUnits, &unit);
+        if (packBlock == USHRT_MAX) {
+            return 0;
+        }
+        memcpy(blocks[packBlock].data + unit * PACKUNIT, blocks[fileBlock].data, file->size);
+        bzero(blocks[packBlock].data + unit * PACKUNIT + file->size, numUnits * PACKUNIT - file->size);
+        setBlockChecksum(packBlock);
+    }
+
+    // builds that don't know about packed files would take the pack block for the file's own
+    if (!(sb->features & FEATURE_PACKED)) {
+        sb->features |= FEATURE_PACKED;
+        writeSuperblock();
+    }
+
+    file->first_cluster_high = (file->first_cluster_high & COMPRESSEDFILE) | PACKEDFILE | unit;
+    file->first_cluster_low = packBlock;
+    if (releaseLink(fileBlock)) {
+        queueFreedBlocks(fileBlock, 1);
+    }
+
+    // the next file written most likely gets the same block, so small files being written one after
+    // another don't walk the allocator across the image, leaving their pack blocks far apart
+    if (freeBlockHint == (unsigned int)fileBlock + 1) {
+        freeBlockHint = fileBlock;
+    }
+
+    logMessage("Packed %u bytes into block %d at unit %u\n", file->size, packBlock, unit);
+    return 1;
+}
+
+int unpackFile(dirEntry* file) {
+    // move a packed file into a block of its own, so it can be changed like any other file. returns 0, or
+    // -ENOSPC if no block is free
+    unsigned short fileBlock = USHRT_MAX;          // block the file gets
+
+    if (!ISPACKED(file)) {
+        return 0;
+    }
+    if (!haveFreeBlock()) {
+        return -ENOSPC;
+    }
+
+    fileBlock = findFreeBlock();
+    FAT[fileBlock] = USHRT_MAX;
+    bzero(blocks[fileBlock].data, BLOCKSIZE);
+    if (file->size > 0) {
+        memcpy(blocks[fileBlock].data, packedFileData(file), file->size);
+    }
+    setBlockChecksum(fileBlock);
+    freePackUnits(file);
+
+    file->first_cluster_high &= COMPRESSEDFILE;
+    file->first_cluster_low = fileBlock;
+
+    logMessage("Unpacked %u bytes into block %d\n", file->size, fileBlock);
+    return 0;
+}
+
+unsigned int compressChunk(const char* source, unsigned int sourceSize, char* dest, unsigned int maxSize) {
+    // compress sourceSize bytes into dest in the LZ4 block format, returning the compressed size, or 0 if
+    // that would take more than maxSize bytes. Matches are found through a table of where each hash of 4
+    // bytes was last seen, and the search steps further apart the longer it goes without finding one, so
+    // data that doesn't compress is given up on quickly
+    const unsigned char* src = (const unsigned char*)source;                      // start of the data
+    const unsigned char* ip = src;                                                // next byte to find a match at
+    const unsigned char* anchor = src;                                            // first byte not written out yet
+    const unsigned char* matchLimit = src + sourceSize - LZLASTLITERALS;          // matches end before this
+    const unsigned char* searchLimit = src + sourceSize - LZMFLIMIT;              // and start before this
+    unsigned char* op = (unsigned char*)dest;                                     // next byte of output
+    unsigned char* opEnd = op + maxSize;                                          // end of the room for output
+    unsigned short table[1 << LZHASHLOG];                                         // last position of each hash
+    unsigned int misses = 0;                                                      // positions tried since the last match
+    unsigned int literalLength = 0;                                               // bytes to copy as they are
+    unsigned char* token = NULL;                                                  // token of the sequence being written
+
+    // every hash starts out pointing at the first byte, which is checked like any other candidate
+    memset(table, 0, sizeof(table));
+
+    while (sourceSize > LZMFLIMIT && ip < searchLimit) {
+        unsigned int sequence;                  // the 4 bytes at ip
+        unsigned int hash;                      // their hash
+        const unsigned char* match = NULL;      // earlier position with the same hash
+        unsigned int matchLength = LZMINMATCH;  // bytes the match covers
+        unsigned int length = 0;                // what's left of a length to write out
+
+        memcpy(&sequence, ip, sizeof(sequence));
+        hash = (sequence * 2654435761u) >> (32 - LZHASHLOG);
+        match = src + table[hash];
+        table[hash] = ip - src;
+
+        if (match >= ip || ip - match > USHRT_MAX || memcmp(match, ip, LZMINMATCH) != 0) {
+            ip += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+
+        // take in matching bytes on either side
+        while (ip > anchor && match > src && ip[-1] == match[-1]) {
+            ip--;
+            match--;
+        }
+        while (ip + matchLength < matchLimit && ip[matchLength] == match[matchLength]) {
+            matchLength++;
+        }
+
+        // the sequence is a token, the literals before the match, the offset back to it, and whatever
+        // doesn't fit of either length in the token
+        literalLength = ip - anchor;
+        if (op + 1 + literalLength / 255 + 1 + literalLength + 2 + (matchLength - LZMINMATCH) / 255 + 1 > opEnd) {
+            return 0;
+        }
+        token = op++;
+        *token = (literalLength < 15 ? literalLength : 15) << 4;
+        for (length = literalLength; length >= 15; length -= 255) {
+            *op++ = length - 15 < 255 ? length - 15 : 255;
+            if (length - 15 < 255) {
+                break;
+            }
+        }
+        memcpy(op, anchor, literalLength);
+        op += literalLength;
+        *op++ = (ip - match) & 0xFF;
+        *op++ = (ip - match) >> 8;
+        *token |= matchLength - LZMINMATCH < 15 ? matchLength - LZMINMATCH : 15;
+        for (length = matchLength - LZMINMATCH; length >= 15; length -= 255) {
+            *op++ = length - 15 < 255 ? length - 15 : 255;
+            if (length - 15 < 255) {
+                break;
+            }
+        }
+
+        ip += matchLength;
+        anchor = ip;
+    }
+
+    // the rest is written as literals
+    literalLength = src + sourceSize - anchor;
+    if (op + 1 + literalLength / 255 + 1 + literalLength > opEnd) {
+        return 0;
+    }
+    token = op++;
+    *token = (literalLength < 15 ? literalLength : 15) << 4;
+    for (unsigned int length = literalLength; length >= 15; length -= 255) {
+        *op++ = length - 15 < 255 ? length - 15 : 255;
+        if (length - 15 < 255) {
+            break;
+        }
+    }
+    memcpy(op, anchor, literalLength);
+    op += literalLength;
+
+    return op - (unsigned char*)dest;
+}
+
+int decompressChunk(const char* source, unsigned int sourceSize, char* dest, unsigned int destSize) {
+    // decompress LZ4 block data into dest, returning the number of bytes it held, or -1 if it's corrupt.
+    // Every length and offset is checked, so a damaged chunk can't write outside dest
+    const unsigned char* ip = (const unsigned char*)source;       // next byte of input
+    const unsigned char* ipEnd = ip + sourceSize;                  // end of the input
+    unsigned char* op = (unsigned char*)dest;                      // next byte of output
+    unsigned char* opEnd = op + destSize;                          // end of the room for output
+
+    while (ip < ipEnd) {
+        unsigned int token = *ip++;             // lengths of the literals and the match
+        size_t literalLength = token >> 4;      // bytes copied from the input
+        size_t matchLength = token & 15;        // bytes copied from earlier output, less LZMINMATCH
+        size_t offset = 0;                      // how far back the match is
+        unsigned char* match = NULL;            // where it is
+
+        if (literalLength == 15) {
+            unsigned int extra = 255;
+            while (extra == 255 && ip < ipEnd) {
+                extra = *ip++;
+                literalLength += extra;
+            }
+        }
+        if (literalLength > (size_t)(ipEnd - ip) || literalLength > (size_t)(opEnd - op)) {
+            return -1;
+        }
+
+        // short runs of literals are copied 16 bytes at once when there's room, since a fixed size copy
+        // is a couple of instructions. whatever is copied past the run gets written over
+        if (literalLength <= 16 && ipEnd - ip >= 16 && opEnd - op >= 16) {
+            memcpy(op, ip, 16);
+        }
+        else {
+            memcpy(op, ip, literalLength);
+        }
+        op += literalLength;
+        ip += literalLength;
+
+        // the last sequence has no match
+        if (ip == ipEnd) {
+            break;
+        }
+
+        if (ipEnd - ip < 2) {
+            return -1;
+        }
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (matchLength == 15) {
+            unsigned int extra = 255;
+            while (extra == 255 && ip < ipEnd) {
+                extra = *ip++;
+                matchLength += extra;
+            }
+        }
+        matchLength += LZMINMATCH;
+        if (offset == 0 || offset > (size_t)(op - (unsigned char*)dest) || matchLength > (size_t)(opEnd - op)) {
+            return -1;
+        }
+
+        // the match can overlap the bytes it produces. far enough back it's copied 8 bytes at a time,
+        // running over its end when there's room, like the literals
+        match = op - offset;
+        if (offset >= 8 && (size_t)(opEnd - op) >= matchLength + 8) {
+            unsigned char* matchEnd = op + matchLength;     // byte after the match
+            do {
+                memcpy(op, match, 8);
+                op += 8;
+                match += 8;
+            } while (op < matchEnd);
+            op = matchEnd;
+            continue;
+        }
+        while (matchLength > 0) {
+            *op++ = *match++;
+            matchLength--;
+        }
+    }
+
+    return op - (unsigned char*)dest;
+}
+
+unsigned int chunkDataSize(unsigned short link) {
+    // bytes of compressed data in the chunk that starts at link, or 0 if it isn't compressed. The data
+    // of a compressed chunk, in blocks of the file's own or shared through references, is always followed
+    // by the hole that makes up the rest of it
+    unsigned int numBlocks = 0;             // blocks of the chunk looked at
+
+    while (numBlocks < CHUNKBLOCKS && link != USHRT_MAX) {
+        if (ISHOLE(link) && !ISREFERENCE(link)) {
+            return holes[link - HOLEBASE].compressedSize;
+        }
+        numBlocks += chainSpan(link);
+        link = *chainLink(link);
+    }
+
+    return 0;
+}
+
+char* loadChunk(unsigned short link, unsigned int compressedSize) {
+    // decompress the chunk that starts at link, returning it, or NULL if the data is corrupt or fails its
+    // checksums. It stays
+    // good until the thread loads another chunk, and the last one each thread loaded is kept, so reading
+    // a chunk a piece at a time only decompresses it once
+    static __thread char gathered[CHUNKSIZE];       // the compressed data, if it isn't in adjacent blocks
+    unsigned short dataBlocks[CHUNKBLOCKS] = {0};   // blocks the data is in, in order
+    char* data = NULL;                              // where the compressed data is
+    unsigned short dataLink = link;                 // link of the chunk being looked at
+    unsigned int numBlocks = (compressedSize + BLOCKSIZE - 1) / BLOCKSIZE;   // blocks the data takes
+    unsigned int numFound = 0;                      // blocks of the data found so far
+    int numBytes = 0;                               // bytes decompressed
+
+    if (loadedChunk.block == link && loadedChunk.compressedSize == compressedSize && loadedChunk.generation == chunkGeneration) {
+        return loadedChunk.data;
+    }
+    if (compressedSize == 0 || compressedSize > CHUNKSIZE) {
+        return NULL;
+    }
+
+    // find the data's blocks, the chunk's own or the ones its references stand for
+    while (numFound < numBlocks) {
+        if (dataLink == USHRT_MAX || (ISHOLE(dataLink) && !ISREFERENCE(dataLink))) {
+            return NULL;
+        }
+        for (unsigned int i = 0; i < chainSpan(dataLink) && numFound < numBlocks; i++) {
+            dataBlocks[numFound++] = ISREFERENCE(dataLink) ? REFERENCEBLOCK(dataLink) + i : dataLink;
+        }
+        dataLink = *chainLink(dataLink);
+    }
+
+    // the data is read straight from the mapping when its blocks follow each other, like they usually do.
+    // each block is checked on the way
+    data = blocks[dataBlocks[0]].data;
+    for (unsigned int i = 0; i < numBlocks; i++) {
+        if (verifyBlock(dataBlocks[i]) != 0) {
+            return NULL;
+        }
+        if (i > 0 && dataBlocks[i] != dataBlocks[i - 1] + 1) {
+            data = gathered;
+        }
+    }
+    if (data == gathered) {
+        for (unsigned int i = 0; i < numBlocks; i++) {
+            memcpy(gathered + i * BLOCKSIZE, blocks[dataBlocks[i]].data, BLOCKSIZE);
+        }
+    }
+
+    loadedChunk.block = 0;
+    numBytes = decompressChunk(data, compressedSize, loadedChunk.data, CHUNKSIZE);
+    if (numBytes < 0) {
+        logMessage("Compressed chunk at block %d is corrupt\n", link);
+        return NULL;
+    }
+    bzero(loadedChunk.data + numBytes, CHUNKSIZE - numBytes);
+
+    loadedChunk.block = link;
+    loadedChunk.compressedSize = compressedSize;
+    loadedChunk.generation = chunkGeneration;
+    return loadedChunk.data;
+}
+
+int chunkIsShared(unsigned short link, unsigned int compressedSize) {
+    // checks whether any of the data of the compressed chunk that starts at link is shared with another
+    // file, in a block with other links or through a reference
+    unsigned int numBlocks = (compressedSize + BLOCKSIZE - 1) / BLOCKSIZE;   // blocks the data takes
+
+    for (unsigned int i = 0; i < numBlocks && link != USHRT_MAX; i += chainSpan(link), link = *chainLink(link)) {
+        if (ISREFERENCE(link) || (!ISHOLE(link) && refcounts[link] > 0)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int expandChunk(unsigned short link, unsigned int compressedSize) {
+    // turn the compressed chunk that starts at link back into plain blocks, giving the hole after its data
+    // blocks again. The data has to be in blocks of the file's own, which it's written over. returns 0, -ENOSPC if there aren't enough free blocks, or -EIO if the data is corrupt
+    unsigned int numDataBlocks = (compressedSize + BLOCKSIZE - 1) / BLOCKSIZE;   // blocks the data takes
+    unsigned short lastDataBlock = link;            // last of them
+    hole* tail = NULL;                              // hole making up the rest of the chunk
+    unsigned int tailLength = 0;                    // blocks in it
+    unsigned short block = link;                    // where fileBlockForWrite carries on from
+    unsigned int position = 0;                      // block of the chunk that is
+    char* data = NULL;                              // the chunk, decompressed
+
+    for (unsigned int i = 1; i < numDataBlocks; i++) {
+        lastDataBlock = FAT[lastDataBlock];
+    }
+    tail = &holes[FAT[lastDataBlock] - HOLEBASE];
+    tailLength = tail->length;
+
+    data = loadChunk(link, compressedSize);
+    if (data == NULL) {
+        return -EIO;
+    }
+    if (tailLength > countFreeBlocks()) {
+        return -ENOSPC;
+    }
+
+    // the hole is filled from the front, so it never has to be split. the blocks are taken from one run
+    // when there is one
+    tail->compressedSize = 0;
+    freeBlockHint = findFreeRun(tailLength);
+    for (unsigned int i = 1; i <= numDataBlocks + tailLength - 1; i++) {
+        if (fileBlockForWrite(&block, &position, i) == USHRT_MAX) {
+            return -ENOSPC;
+        }
+    }
+
+    // then the whole chunk is written out. the decompressed copy doesn't live in the image, so it's safe
+    // to write over the compressed data
+    block = link;
+    for (unsigned int i = 0; i < numDataBlocks + tailLength; i++) {
+        memcpy(blocks[block].data, data + i * BLOCKSIZE, BLOCKSIZE);
+        setBlockChecksum(block);
+        block = FAT[block];
+    }
+    chunkGeneration++;
+
+    logMessage("Expanded chunk at block %d from %u bytes\n", link, compressedSize);
+    return 0;
+}
+
+int expandFileRange(dirEntry* file, unsigned long long offset, unsigned long long end) {
+    // turn the compressed chunks of a file overlapping bytes offset to end back into plain blocks, and give
+    // it its own copies of the shared blocks there, so they can be changed like any other part of the file.
+    // returns 0, or what expandChunk or unshareFileRange failed with
+    unsigned short* previous = (unsigned short*)&file->first_cluster_low;   // link to the one being looked at
+    unsigned short link = file->first_cluster_low;                          // link being looked at
+    unsigned long long position = 0;                                        // block of the file link starts at
+    int res = 0;                                                            // result
+
+    if (ISPACKED(file)) {
+        return 0;
+    }
+
+    while (ISCOMPRESSED(file) && link != USHRT_MAX && position * BLOCKSIZE < end) {
+        if ((!ISHOLE(link) || ISREFERENCE(link)) && position % CHUNKBLOCKS == 0 && (position + CHUNKBLOCKS) * BLOCKSIZE > offset) {
+            unsigned int compressedSize = chunkDataSize(link);     // bytes of data, if it's compressed
+
+            // the chunk is expanded over its data, so the file needs its own copy of any of it that's shared
+            if (compressedSize > 0 && chunkIsShared(link, compressedSize)) {
+                res = unshareFileRange(file, position * BLOCKSIZE,
+                                       (position + (compressedSize + BLOCKSIZE - 1) / BLOCKSIZE) * BLOCKSIZE);
+                if (res != 0) {
+                    return res;
+                }
+                link = *previous;
+            }
+            if (compressedSize > 0 && (res = expandChunk(link, compressedSize)) != 0) {
+                return res;
+            }
+        }
+        position += chainSpan(link);
+        previous = chainLink(link);
+        link = *previous;
+    }
+
+    return unshareFileRange(file, offset, end);
+}
+
+int unshareFileRange(dirEntry* file, unsigned long long offset, unsigned long long end) {
+    // give a file copies of its own of the shared blocks overlapping bytes offset to end, so changing them
+    // doesn't change the other files. A reference is split around the part of it in the range, and the
+    // copies are taken from one free run when there is one. returns 0, or -ENOSPC if there aren't enough
+    // free blocks or the hole table is full
+    unsigned long long firstIndex = offset / BLOCKSIZE;                     // first block in the range
+    unsigned long long endIndex = (end + BLOCKSIZE - 1) / BLOCKSIZE;        // block after the last one
+    unsigned short* previous = (unsigned short*)&file->first_cluster_low;   // link to the one being looked at
+    unsigned short link = file->first_cluster_low;                          // link being looked at
+    unsigned long long position = 0;                                        // block of the file link starts at
+
+    if (!(sb->features & FEATURE_SHARED) || ISPACKED(file) || offset >= end) {
+        return 0;
+    }
+
+    while (link != USHRT_MAX && position < endIndex) {
+        unsigned long long linkEnd = position + chainSpan(link);    // block after the link
+
+        // a shared block the file still has in its chain is swapped for a copy, and stays for the others
+        if (!ISHOLE(link) && refcounts[link] > 0 && linkEnd > firstIndex) {
+            unsigned short copy = USHRT_MAX;    // the file's own copy
+
+            if (!haveFreeBlock()) {
+                return -ENOSPC;
+            }
+            copy = findFreeBlock();
+            memcpy(blocks[copy].data, blocks[link].data, BLOCKSIZE);
+            setBlockChecksum(copy);
+            FAT[copy] = FAT[link];
+            *previous = copy;
+            releaseLink(link);
+            link = copy;
+        }
+
+        // the part of a reference in the range is copied, keeping the parts on either side as references
+        else if (ISREFERENCE(link) && linkEnd > firstIndex) {
+            hole* reference = &holes[link - HOLEBASE];                                  // the reference
+            unsigned short firstBlock = REFERENCEBLOCK(link);                          // first block it stands for
+            unsigned long long from = position > firstIndex ? position : firstIndex;    // first block to copy
+            unsigned long long to = linkEnd < endIndex ? linkEnd : endIndex;            // block after the last
+            unsigned int before = from - position;                                      // blocks kept in front
+            unsigned int after = linkEnd - to;                                          // and behind
+            unsigned short afterLink = reference->next;                                // what comes after the copies
+            unsigned short copy = USHRT_MAX;                                            // copy being made
+            unsigned short lastCopy = USHRT_MAX;                                        // copy made before it
+
+            if (to - from > countFreeBlocks()) {
+                return -ENOSPC;
+            }
+            if (before > 0 && after > 0) {
+                afterLink = allocateReference(firstBlock + (to - position), after, reference->next);
+                if (afterLink == USHRT_MAX) {
+                    return -ENOSPC;
+                }
+            }
+            else if (after > 0) {
+                reference->compressedSize = REFERENCE | (firstBlock + (to - position));
+                reference->length = after;
+                afterLink = link;
+            }
+
+            // make the copies, chained one after the other
+            freeBlockHint = findFreeRun(to - from);
+            for (unsigned long long i = from; i < to; i++) {
+                copy = findFreeBlock();
+                memcpy(blocks[copy].data, blocks[firstBlock + (i - position)].data, BLOCKSIZE);
+                setBlockChecksum(copy);
+                FAT[copy] = USHRT_MAX;
+                if (lastCopy == USHRT_MAX) {
+                    if (before > 0) {
+                        reference->next = copy;
+                    }
+                    else {
+                        *previous = copy;
+                    }
+                }
+                else {
+                    FAT[lastCopy] = copy;
+                }
+                lastCopy = copy;
+            }
+            FAT[lastCopy] = afterLink;
+
+            // the reference in front keeps what's left of it, and the copied blocks lose a link
+            if (before > 0) {
+                reference->length = before;
+            }
+            else if (after == 0) {
+                reference->length = 0;
+            }
+            releaseSharedBlocks(firstBlock + (from - position), to - from);
+
+            link = lastCopy;
+            linkEnd = to;
+        }
+
+        previous = chainLink(link);
+        position = linkEnd;
+        link = *previous;
+    }
+
+    return 0;
+}
+
+unsigned int compressFile(dirEntry* file) {
+    // compress every chunk of a file that is all plain blocks of its own, returning the number of blocks
+    // that freed. A chunk is only kept compressed if that saves a block, and is left alone when a hole
+    // comes straight after it, since holes can't sit next to each other
+    static char gathered[CHUNKSIZE];                    // a chunk whose blocks aren't adjacent
+    static char compressed[CHUNKSIZE];                  // a chunk, compressed
+    unsigned short link = file->first_cluster_low;      // link being looked at
+    unsigned int position = 0;                          // block of the file link starts at
+    unsigned int fileBlocks = (file->size + BLOCKSIZE - 1) / BLOCKSIZE;   // blocks the file's size takes
+    unsigned int numFreed = 0;                          // blocks freed so far
+
+    if (!ISCOMPRESSED(file) || ISPACKED(file)) {
+        return 0;
+    }
+
+    while (link != USHRT_MAX) {
+        unsigned int numBlocks = fileBlocks - position < CHUNKBLOCKS ? fileBlocks - position : CHUNKBLOCKS;
+        unsigned short block = link;            // block of the chunk being looked at
+        unsigned short after = USHRT_MAX;       // link after the chunk
+        unsigned int stored = 0;                // blocks of the chunk with storage, in a row from its start
+        int adjacent = 1;                       // set while the chunk's blocks follow each other
+        char* data = blocks[link].data;         // the chunk
+        unsigned int chunkSize = 0;             // bytes of the file in it
+        unsigned int compressedSize = 0;        // and once compressed
+        unsigned int numDataBlocks = 0;         // blocks the compressed data takes
+        unsigned short tail = USHRT_MAX;        // hole for the rest of the chunk
+
+        if (ISHOLE(link) || position % CHUNKBLOCKS != 0 || position >= fileBlocks || numBlocks < 2) {
+            position += chainSpan(link);
+            link = *chainLink(link);
+            continue;
+        }
+
+        // the chunk has to be all blocks, up to the end of the file if it's the last one
+        while (stored < numBlocks && block != USHRT_MAX && !ISHOLE(block) && refcounts[block] == 0) {
+            stored++;
+            after = FAT[block];
+            adjacent = adjacent && (stored == numBlocks || after == block + 1);
+            if (stored < numBlocks) {
+                block = after;
+            }
+        }
+        if (stored < numBlocks || ISHOLE(after) || (numBlocks < CHUNKBLOCKS && after != USHRT_MAX)) {
+            position += chainSpan(link);
+            link = *chainLink(link);
+            continue;
+        }
+
+        // compress it, from the mapping if its blocks are adjacent
+        chunkSize = file->size - position * BLOCKSIZE < CHUNKSIZE ? file->size - position * BLOCKSIZE : CHUNKSIZE;
+        if (!adjacent) {
+            block = link;
+            for (unsigned int i = 0; i < numBlocks; i++) {
+                memcpy(gathered + i * BLOCKSIZE, blocks[block].data, BLOCKSIZE);
+                block = FAT[block];
+            }
+            data = gathered;
+        }
+        compressedSize = compressChunk(data, chunkSize, compressed, (numBlocks - 1) * BLOCKSIZE);
+        numDataBlocks = (compressedSize + BLOCKSIZE - 1) / BLOCKSIZE;
+        if (compressedSize == 0 || (tail = allocateHole(numBlocks - numDataBlocks, after)) == USHRT_MAX) {
+            position += numBlocks;
+            link = after;
+            continue;
+        }
+
+        // builds that don't know about compressed chunks would read the compressed data as it is
+        if (!(sb->features & FEATURE_COMPRESSED)) {
+            sb->features |= FEATURE_COMPRESSED;
+            writeSuperblock();
+        }
+
+        // write the data over the front of the chunk and free the rest, putting the hole in its place
+        holes[tail - HOLEBASE].compressedSize = compressedSize;
+        block = link;
+        for (unsigned int i = 0; i < numDataBlocks; i++) {
+            unsigned int numBytes = compressedSize - i * BLOCKSIZE < BLOCKSIZE ? compressedSize - i * BLOCKSIZE : BLOCKSIZE;
+            memcpy(blocks[block].data, compressed + i * BLOCKSIZE, numBytes);
+            bzero(blocks[block].data + numBytes, BLOCKSIZE - numBytes);
+            setBlockChecksum(block);
+            sharableBlocks[block] = 0;
+            if (i < numDataBlocks - 1) {
+                block = FAT[block];
+            }
+        }
+        for (unsigned short freed = FAT[block]; freed != after; ) {
+            unsigned short next = FAT[freed];
+            FAT[freed] = 0;
+            queueFreedBlocks(freed, 1);
+            freed = next;
+        }
+        FAT[block] = tail;
+        chunkGeneration++;
+        numFreed += numBlocks - numDataBlocks;
+
+        position += numBlocks;
+        link = after;
+    }
+
+    if (numFreed > 0) {
+        logMessage("Compressed file, freeing %u blocks\n", numFreed);
+    }
+    return numFreed;
+}
+
+void packOrCompressFile(dirEntry* file) {
+    // store a file that was just written in as little space as it can take: a small file is packed, a
+    // file marked for compression has its chunks compressed, and with dedup on the blocks of any other
+    // file are shared with identical ones
+    if (!packFile(file)) {
+        compressFile(file);
+        if (dedupFiles) {
+            dedupFile(file, 1);
+        }
+    }
+}
+
+int compressPath(char* intpath, dirEntry* parentDir) {
+    // mark a file for compression and compress it now, saying how much it saved
+    dirEntry* file = findEntryFromPath(intpath, parentDir);   // file to compress
+    unsigned int before = 0;                                  // blocks it had stored
+    unsigned int numFreed = 0;                                // blocks compressing it freed
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    if (file == NULL || (file->attributes & ATTR_DIRECTORY)) {
+        fprintf(stderr, "File \"%s\" does not exist\n", intpath);
+        return -1;
+    }
+
+    file->first_cluster_high |= COMPRESSEDFILE;
+    if (ISPACKED(file)) {
+        printf("%s: %u bytes, packed\n", intpath, file->size);
+        return 0;
+    }
+    before = countFileBlocks(file);
+    numFreed = compressFile(file);
+    printf("%s: %u bytes, %u blocks stored, was %u\n", intpath, file->size, before - numFreed, before);
+
+    return 0;
+}
+
+unsigned int blockFingerprint(unsigned short block) {
+    // checksum of a block's data, from the table when the image keeps one
+    if ((sb->features & FEATURE_CHECKSUMS) && checksums[block] != 0) {
+        return checksums[block];
+    }
+    return crc32c(0, blocks[block].data, BLOCKSIZE);
+}
+
+int dedupSlotIsLive(dedupSlot* slot) {
+    // whether the block in an index slot still has the data it was put in with. Blocks handed out since
+    // aren't sharable any more, and blocks written since have another checksum
+    unsigned short block = slot->block;     // block in the slot
+
+    return FAT[block] != 0 && sharableBlocks[block] && blockFingerprint(block) == slot->fingerprint;
+}
+
+void indexBlock(unsigned short block, unsigned int fingerprint) {
+    // put a block of a plain file in the index of checksums, so later blocks with the same data can share
+    // it. When the index fills up, the slots that have gone stale are cleared out
+    unsigned int slot = fingerprint & (DEDUPINDEXSIZE - 1);    // slot being looked at
+
+    if (dedupIndexUsed >= DEDUPINDEXSIZE / 4 * 3) {
+        static dedupSlot live[DEDUPINDEXSIZE];  // slots still live, to put back
+        unsigned int numLive = 0;               // number of them
+
+        for (unsigned int i = 0; i < DEDUPINDEXSIZE; i++) {
+            if (dedupIndex[i].block != 0 && dedupSlotIsLive(&dedupIndex[i])) {
+                live[numLive++] = dedupIndex[i];
+            }
+        }
+        memset(dedupIndex, 0, sizeof(dedupIndex));
+        dedupIndexUsed = 0;
+        for (unsigned int i = 0; i < numLive; i++) {
+            unsigned int liveSlot = live[i].fingerprint & (DEDUPINDEXSIZE - 1);
+            while (dedupIndex[liveSlot].block != 0) {
+                if (dedupIndex[liveSlot].block == live[i].block) {
+                    break;
+                }
+                liveSlot = (liveSlot + 1) & (DEDUPINDEXSIZE - 1);
+            }
+            if (dedupIndex[liveSlot].block == 0) {
+                dedupIndex[liveSlot] = live[i];
+                dedupIndexUsed++;
+            }
+        }
+        logMessage("Pruned the dedup index to %u blocks\n", dedupIndexUsed);
+    }
+
+    while (dedupIndex[slot].block != 0) {
+        if (dedupIndex[slot].block == block && dedupIndex[slot].fingerprint == fingerprint) {
+            sharableBlocks[block] = 1;
+            return;
+        }
+        slot = (slot + 1) & (DEDUPINDEXSIZE - 1);
+    }
+    dedupIndex[slot].block = block;
+    dedupIndex[slot].fingerprint = fingerprint;
+    dedupIndexUsed++;
+    sharableBlocks[block] = 1;
+}
+
+unsigned short findDuplicateBlock(unsigned short block, unsigned int fingerprint) {
+    // another block in the index with the same data as block, that can take another link, or USHRT_MAX
+    // if there's none. The data is compared, since different data can have the same checksum
+    unsigned int slot = fingerprint & (DEDUPINDEXSIZE - 1);    // slot being looked at
+
+    for (; dedupIndex[slot].block != 0; slot = (slot + 1) & (DEDUPINDEXSIZE - 1)) {
+        unsigned short candidate = dedupIndex[slot].block;     // block in the slot
+
+        if (dedupIndex[slot].fingerprint == fingerprint && candidate != block && refcounts[candidate] < MAXREFCOUNT &&
+            dedupSlotIsLive(&dedupIndex[slot]) && memcmp(blocks[candidate].data, blocks[block].data, BLOCKSIZE) == 0) {
+            return candidate;
+        }
+    }
+
+    return USHRT_MAX;
+}
+
+unsigned int dedupFile(dirEntry* file, int share) {
+    // share each full block of a plain file that has the same data as a block in the index, freeing its
+    // own, and put the rest in the index. Shared blocks that follow each other become one reference. The
+    // first block always stays, since chains start with a block. With share clear the blocks are only put
+    // in the index. returns the number of blocks freed
+    unsigned short previous = USHRT_MAX;                // link in front of the one being looked at
+    unsigned short link = file->first_cluster_low;      // link being looked at
+    unsigned int position = 0;                          // block of the file link starts at
+    unsigned int numFullBlocks = file->size / BLOCKSIZE; // blocks the file fills
+    unsigned int numFreed = 0;                          // blocks freed so far
+
+    if (ISPACKED(file) || ISCOMPRESSED(file) || (file->attributes & ATTR_DIRECTORY)) {
+        return 0;
+    }
+    if (!dedupIndexBuilt) {
+        buildDedupIndex();
+    }
+
+    while (link != USHRT_MAX && position < numFullBlocks) {
+        unsigned short next = *chainLink(link);         // link after it
+
+        // the blocks a reference stands for are plain data too, and can be shared again
+        if (ISREFERENCE(link)) {
+            for (unsigned int i = 0; i < chainSpan(link) && position + i < numFullBlocks; i++) {
+                indexBlock(REFERENCEBLOCK(link) + i, blockFingerprint(REFERENCEBLOCK(link) + i));
+            }
+        }
+
+        else if (!ISHOLE(link)) {
+            unsigned int fingerprint = blockFingerprint(link);     // checksum of its data
+            unsigned short duplicate = USHRT_MAX;                   // block with the same data
+
+            if (share && previous != USHRT_MAX && refcounts[link] == 0) {
+                duplicate = findDuplicateBlock(link, fingerprint);
+            }
+
+            // link to the duplicate instead, through the reference in front if it leads up to it
+            if (duplicate != USHRT_MAX) {
+                unsigned short reference = previous;            // reference standing for the duplicate
+
+                refcounts[duplicate]++;
+                if (ISREFERENCE(previous) && REFERENCEBLOCK(previous) + chainSpan(previous) == duplicate) {
+                    holes[previous - HOLEBASE].length++;
+                    holes[previous - HOLEBASE].next = next;
+                }
+                else {
+                    reference = allocateReference(duplicate, 1, next);
+                    if (reference == USHRT_MAX) {
+                        refcounts[duplicate]--;
+                        break;
+                    }
+                    *chainLink(previous) = reference;
+                }
+                FAT[link] = 0;
+                queueFreedBlocks(link, 1);
+                numFreed++;
+
+                previous = reference;
+                position++;
+                link = next;
+                continue;
+            }
+
+            indexBlock(link, fingerprint);
+        }
+
+        previous = link;
+        position += chainSpan(link);
+        link = next;
+    }
+
+    if (numFreed > 0) {
+        logMessage("Shared %u blocks of the file with others\n", numFreed);
+    }
+    return numFreed;
+}
+
+unsigned int dedupDirectory(dirEntry* dir, int share, unsigned int* numBlocks) {
+    // run dedupFile on every file under dir, adding up the blocks they store in numBlocks. returns the
+    // number of blocks freed
+    dirEntry* currentEntry = (dirEntry*)&blocks[dir->first_cluster_low];   // entry being looked at
+    unsigned int numFreed = 0;                                              // blocks freed so far
+
+    while (currentEntry != NULL) {
+        char name[MAXFILENAME + 1] = {0};   // name of the entry, null terminated
+
+        strncpy(name, currentEntry->name, MAXFILENAME);
+
+        // skip . and .., deleted entries and empty slots
+        if (name[0] == 0 || name[0] == 0x5F || currentEntry->attributes == ATTR_DELETED ||
+            strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            currentEntry = getNextEntry(currentEntry, dir);
+            continue;
+        }
+
+        if (currentEntry->attributes & ATTR_DIRECTORY) {
+            numFreed += dedupDirectory(currentEntry, share, numBlocks);
+        }
+        else {
+            numFreed += dedupFile(currentEntry, share);
+            *numBlocks += countFileBlocks(currentEntry);
+        }
+
+        currentEntry = getNextEntry(currentEntry, dir);
+    }
+
+    return numFreed;
+}
+
+void buildDedupIndex() {
+    // put the blocks of every plain file in the image in the index, the first time it's needed
+    unsigned int numBlocks = 0;             // blocks the files store
+
+    memset(dedupIndex, 0, sizeof(dedupIndex));
+    memset(sharableBlocks, 0, sizeof(sharableBlocks));
+    dedupIndexUsed = 0;
+    dedupIndexBuilt = 1;
+    dedupDirectory((dirEntry*)&blocks[0], 0, &numBlocks);
+
+    logMessage("Indexed %u blocks for dedup\n", dedupIndexUsed);
+}
+
+unsigned int countSharedBlocks(dirEntry* file) {
+    // number of a file's blocks that other links share
+    unsigned short link = file->first_cluster_low;      // link being looked at
+    unsigned int numShared = 0;                         // shared blocks counted so far
+
+    if (ISPACKED(file)) {
+        return 0;
+    }
+
+    while (link != USHRT_MAX) {
+        numShared += ISREFERENCE(link) ? chainSpan(link) : (!ISHOLE(link) && refcounts[link] > 0);
+        link = *chainLink(link);
+    }
+
+    return numShared;
+}
+
+void dedupfs() {
+    // share every block of file data in the image with the others that have the same data, saying how
+    // much that saved and how long it took
+    unsigned int numBlocks = 0;             // blocks the files store, counting shared ones for each
+    unsigned int numFreed = 0;              // blocks freed
+    unsigned long long numLinks = 0;        // extra links to shared blocks, each a block saved
+    struct timespec start, end;             // when the pass started and finished
+    double seconds = 0;                     // how long it took
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    // finish freeing the chains of removed files and snapshots first, so the links they still hold don't count
+    deleteSnapshots(UINT_MAX);
+    freeOrphanBlocks(UINT_MAX);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(dedupIndex, 0, sizeof(dedupIndex));
+    memset(sharableBlocks, 0, sizeof(sharableBlocks));
+    dedupIndexUsed = 0;
+    dedupIndexBuilt = 1;
+
+    // snapshots are only indexed and counted, since they can't be changed, and the live files share with them
+    for (int i = 0; i < MAXSNAPSHOTS; i++) {
+        if (snapshots[i].state == SNAPSHOTLIVE) {
+            dedupDirectory((dirEntry*)&blocks[snapshots[i].root], 0, &numBlocks);
+        }
+    }
+    numFreed = dedupDirectory((dirEntry*)&blocks[0], 1, &numBlocks);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    for (unsigned int i = 0; i < MAXBLOCKS; i++) {
+        numLinks += refcounts[i];
+    }
+    printf("Freed %u blocks in %.3f s. %u blocks of file data are stored in %llu: %.2fx\n", numFreed, seconds,
+           numBlocks, numBlocks - numLinks, numBlocks > numLinks ? (double)numBlocks / (numBlocks - numLinks) : 1.0);
+}
+
+snapshot* findSnapshot(char* name) {
+    // the snapshot called name that can be read, or NULL if there's none
+    for (int i = 0; i < MAXSNAPSHOTS; i++) {
+        if (snapshots[i].state == SNAPSHOTLIVE && strncmp(snapshots[i].name, name, MAXFILENAME) == 0) {
+            return &snapshots[i];
+        }
+    }
+
+    return NULL;
+}
+
+unsigned int countSnapshotBlocks(dirEntry* dir) {
+    // most blocks a snapshot of the tree under dir can take: its directories, the first block of each
+    // file and a pack block for each small file
+    dirEntry* currentEntry = (dirEntry*)&blocks[dir->first_cluster_low];   // entry being looked at
+    unsigned int numBlocks = 0;                                             // blocks counted so far
+
+    for (unsigned short link = dir->first_cluster_low; link != USHRT_MAX; link = FAT[link]) {
+        numBlocks++;
+    }
+
+    while (currentEntry != NULL) {
+        char name[MAXFILENAME + 1] = {0};   // name of the entry, null terminated
+
+        strncpy(name, currentEntry->name, MAXFILENAME);
+
+        // skip . and .., deleted entries and empty slots
+        if (name[0] == 0 || name[0] == 0x5F || currentEntry->attributes == ATTR_DELETED ||
+            strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            currentEntry = getNextEntry(currentEntry, dir);
+            continue;
+        }
+
+        if (currentEntry->attributes & ATTR_DIRECTORY) {
+            numBlocks += countSnapshotBlocks(currentEntry);
+        }
+        else if (ISPACKED(currentEntry)) {
+            numBlocks += currentEntry->size > 0;
+        }
+        else {
+            numBlocks++;
+        }
+
+        currentEntry = getNextEntry(currentEntry, dir);
+    }
+
+    return numBlocks;
+}
+
+int appendCloneLink(unsigned short* first, unsigned short* last, unsigned short block, int share, int newReference) {
+    // add a block of a file to the end of the chain being built for its copy, linking to it through a
+    // reference if share is set and it can take another link, and copying it otherwise. Shared blocks
+    // that follow the ones the last reference stands for go in that reference, unless newReference is
+    // set. returns 0, or -ENOSPC if there's no block or hole slot left
+    unsigned short link = USHRT_MAX;        // link added to the chain
+
+    if (share && refcounts[block] < MAXREFCOUNT) {
+        refcounts[block]++;
+        if (!newReference && *last != USHRT_MAX && ISREFERENCE(*last) && REFERENCEBLOCK(*last) + chainSpan(*last) == block) {
+            holes[*last - HOLEBASE].length++;
+            return 0;
+        }
+        link = allocateReference(block, 1, USHRT_MAX);
+        if (link == USHRT_MAX) {
+            refcounts[block]--;
+            return -ENOSPC;
+        }
+    }
+    else {
+        if (!haveFreeBlock()) {
+            return -ENOSPC;
+        }
+        link = findFreeBlock();
+        memcpy(blocks[link].data, blocks[block].data, BLOCKSIZE);
+        checksums[link] = checksums[block];
+        FAT[link] = USHRT_MAX;
+    }
+
+    if (*last == USHRT_MAX) {
+        *first = link;
+    }
+    else {
+        *chainLink(*last) = link;
+    }
+    *last = link;
+    return 0;
+}
+
+int cloneFileChain(dirEntry* file, unsigned short* first) {
+    // build the chain of a file's copy, for a snapshot or a clone, putting its first link in *first. Its blocks are
+    // shared, apart from the first, which a chain has to start with. Holes are copied, and references to
+    // blocks the file shares get references of their own. The data of a compressed chunk is shared too,
+    // through a reference that starts where the chunk does, so reads still find the chunk's start at a link.
+    // returns 0, or -ENOSPC, with nothing left allocated
+    unsigned short link = file->first_cluster_low;      // link being copied
+    unsigned short last = USHRT_MAX;                    // last link of the copy so far
+    unsigned long long position = 0;                    // block of the file link starts at
+    int res = 0;                                        // result of adding a link
+
+    *first = USHRT_MAX;
+    while (link != USHRT_MAX && res == 0) {
+        int chunkStart = ISCOMPRESSED(file) && (!ISHOLE(link) || ISREFERENCE(link)) && position % CHUNKBLOCKS == 0 &&
+                         chunkDataSize(link) > 0;      // set if link starts a compressed chunk
+
+        if (ISREFERENCE(link)) {
+            for (unsigned int i = 0; i < chainSpan(link) && res == 0; i++) {
+                res = appendCloneLink(first, &last, REFERENCEBLOCK(link) + i, 1, chunkStart && i == 0);
+            }
+        }
+        else if (ISHOLE(link)) {
+            unsigned short newHole = allocateHole(holes[link - HOLEBASE].length, USHRT_MAX);   // copy of it
+
+            if (newHole == USHRT_MAX) {
+                res = -ENOSPC;
+                break;
+            }
+            holes[newHole - HOLEBASE].compressedSize = holes[link - HOLEBASE].compressedSize;
+            if (last == USHRT_MAX) {
+                *first = newHole;
+            }
+            else {
+                *chainLink(last) = newHole;
+            }
+            last = newHole;
+        }
+        else {
+            res = appendCloneLink(first, &last, link, position > 0, chunkStart);
+        }
+
+        position += chainSpan(link);
+        link = *chainLink(link);
+    }
+
+    if (res != 0) {
+        freeBlockChain(*first);
+        *first = USHRT_MAX;
+    }
+
+    // chunks are cached by the link they start at, and the hole slots of references get handed out again
+    if (ISCOMPRESSED(file)) {
+        chunkGeneration++;
+    }
+    return res;
+}
+
+int cloneFile(dirEntry* source, dirEntry* dest) {
+    // make dest a copy of source, sharing its blocks the way a snapshot does, so nothing is read or
+    // written through the kernel and later writes to either give that file its own copies. What can't be
+    // shared is copied from block to block in the image. dest's old storage is freed in the background.
+    // returns 0, -EISDIR if either is a directory, -EINVAL if they're the same file, or -ENOSPC
+    unsigned short first = USHRT_MAX;       // first link of the copy's chain, or its pack block
+    unsigned int unit = 0;                  // first unit of the copy's data, for a packed file
+    unsigned short oldFirst = dest->first_cluster_low;                          // dest's old storage
+    unsigned short ownerBlock = ((char*)dest - (char*)blocks) / BLOCKSIZE;       // block dest's entry is in
+    short create_time = 0;                  // time now, for the write time
+    char create_time_tenth = 0;             // tenths of a second now, unused
+    short create_date = 0;                  // date now
+    int res = 0;                            // result of copying the chain
+
+    if ((source->attributes & ATTR_DIRECTORY) || (dest->attributes & ATTR_DIRECTORY)) {
+        return -EISDIR;
+    }
+    if (source == dest) {
+        return -EINVAL;
+    }
+
+    // a packed file is small enough to just copy, into units of its own
+    if (ISPACKED(source)) {
+        unsigned int numUnits = (source->size + PACKUNIT - 1) / PACKUNIT;     // units it takes
+
+        first = 0;
+        if (numUnits > 0) {
+            first = allocatePackUnits(numUnits, &unit);
+            if (first == USHRT_MAX) {
+                return -ENOSPC;
+            }
+            memcpy(blocks[first].data + unit * PACKUNIT, packedFileData(source), numUnits * PACKUNIT);
+            setBlockChecksum(first);
+        }
+    }
+    else {
+        res = cloneFileChain(source, &first);
+        if (res != 0) {
+            return res;
+        }
+    }
+
+    // the old storage is recorded before dest stops pointing at it, like a removal
+    if (ISPACKED(dest)) {
+        freePackUnits(dest);
+    }
+    else {
+        orphanChain(oldFirst, ownerBlock, ((char*)dest - blocks[ownerBlock].data) / sizeof(dirEntry));
+    }
+    dest->first_cluster_high = ISPACKED(source) ? (unsigned short)((source->first_cluster_high & ~PACKUNITMASK) | unit) : (unsigned short)source->first_cluster_high;
+    dest->first_cluster_low = first;
+    dest->size = source->size;
+
+    getDateTime(&create_time, &create_time_tenth, &create_date);
+    dest->last_write_time = create_time;
+    dest->last_write_date = create_date;
+    dest->last_access_date = create_date;
+
+    logMessage("Cloned %u bytes into block %d\n", dest->size, first);
+    return 0;
+}
+
+int clonePath(char* sourcePath, char* destPath, dirEntry* parentDir) {
+    // make the file at destPath a copy of the one at sourcePath, creating it if it doesn't exist. returns
+    // 0, -ENOENT if either the source or the destination's directory doesn't exist, -ENAMETOOLONG if the
+    // destination's name is too long, or what cloneFile failed with
+    dirEntry* source = findEntryFromPath(sourcePath, parentDir);    // file to copy
+    dirEntry* dest = NULL;                                          // file to copy it to
+    dirEntry* destDir = NULL;                                       // directory dest goes in
+    char destDirPath[MAXPATH];                                      // path of that directory
+    char destName[MAXPATH];                                         // name of dest in it
+
+    if (source == NULL) {
+        return -ENOENT;
+    }
+    if (source->attributes & ATTR_DIRECTORY) {
+        return -EISDIR;
+    }
+
+    dest = findEntryFromPath(destPath, parentDir);
+    if (dest == NULL) {
+        extract_path(destPath, destDirPath);
+        extract_filename(destPath, destName);
+        destDir = findParentFromPath(destDirPath, parentDir);
+        if (destDir == NULL) {
+            return -ENOENT;
+        }
+        if (strlen(destName) > MAXFILENAME) {
+            return -ENAMETOOLONG;
+        }
+        createEmptyFile(destName, destDir);
+        dest = findEntryInDirectory(destDir, destName);
+        if (dest == NULL) {
+            return -ENOENT;
+        }
+    }
+
+    return cloneFile(source, dest);
+}
+
+int cloneDirectory(dirEntry* source, dirEntry* dest) {
+    // copy every entry under source into the empty directory dest, for a snapshot. returns 0, or -ENOSPC
+    dirEntry* currentEntry = (dirEntry*)&blocks[source->first_cluster_low];    // entry being copied
+    int res = 0;                                                                // result of copying it
+
+    while (currentEntry != NULL && res == 0) {
+        char name[MAXFILENAME + 1] = {0};   // name of the entry, null terminated
+        dirEntry* copy = NULL;              // its copy in dest
+        char isLast = 0;                    // isLast flag the copy's slot was given
+        unsigned short first = USHRT_MAX;   // first link of the copy's chain
+        unsigned int unit = 0;              // first unit of the copy's data, for a packed file
+
+        strncpy(name, currentEntry->name, MAXFILENAME);
+
+        // skip . and .., deleted entries and empty slots
+        if (name[0] == 0 || name[0] == 0x5F || currentEntry->attributes == ATTR_DELETED ||
+            strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            currentEntry = getNextEntry(currentEntry, source);
+            continue;
+        }
+
+        // the storage is set up before the entry, so a copy that fails leaves nothing behind
+        if (currentEntry->attributes & ATTR_DIRECTORY) {
+            if (!haveFreeBlock()) {
+                res = -ENOSPC;
+                break;
+            }
+            first = findFreeBlock();
+            FAT[first] = USHRT_MAX;
+        }
+        else if (ISPACKED(currentEntry)) {
+            unsigned int numUnits = (currentEntry->size + PACKUNIT - 1) / PACKUNIT;   // units it takes
+
+            first = 0;
+            if (numUnits > 0) {
+                first = allocatePackUnits(numUnits, &unit);
+                if (first == USHRT_MAX) {
+                    res = -ENOSPC;
+                    break;
+                }
+                memcpy(blocks[first].data + unit * PACKUNIT, packedFileData(currentEntry), numUnits * PACKUNIT);
+                setBlockChecksum(first);
+            }
+        }
+        else {
+            res = cloneFileChain(currentEntry, &first);
+            if (res != 0) {
+                break;
+            }
+        }
+
+        copy = allocateDirectoryEntry(dest, name);
+        isLast = copy->isLast;
+        *copy = *currentEntry;
+        copy->isLast = isLast;
+        copy->first_cluster_low = first;
+        if (ISPACKED(currentEntry)) {
+            copy->first_cluster_high = (currentEntry->first_cluster_high & ~PACKUNITMASK) | unit;
+        }
+
+        if (currentEntry->attributes & ATTR_DIRECTORY) {
+            copy->size = 0;
+            initializeNewDirectory(copy, dest);
+            res = cloneDirectory(currentEntry, copy);
+        }
+
+        currentEntry = getNextEntry(currentEntry, source);
+    }
+
+    return res;
+}
+
+int takeSnapshot(char* name) {
+    // take a snapshot of the whole tree called name. It's marked for removal until it's complete, so one a
+    // stopped program left half taken is cleaned up. returns 0, -EEXIST if there's one with that name,
+    // -EINVAL if the name is too long, or -ENOSPC if the image or the table is full
+    snapshot* slot = NULL;                  // slot in the table for it
+    dirEntry rootEntry;                     // entry standing for its root directory
+    struct timespec start, end;             // when taking it started and finished
+    int res = 0;                            // result of copying the tree
+
+    if (strlen(name) == 0 || strlen(name) > MAXFILENAME) {
+        return -EINVAL;
+    }
+    if (findSnapshot(name) != NULL) {
+        return -EEXIST;
+    }
+    for (int i = 0; i < MAXSNAPSHOTS && slot == NULL; i++) {
+        if (snapshots[i].state == 0) {
+            slot = &snapshots[i];
+        }
+    }
+    if (slot == NULL || countSnapshotBlocks((dirEntry*)&blocks[0]) > countFreeBlocks()) {
+        return -ENOSPC;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // the root directory, with the live root's times
+    rootEntry = *(dirEntry*)&blocks[0];
+    rootEntry.first_cluster_low = findFreeBlock();
+    rootEntry.size = 0;
+    FAT[rootEntry.first_cluster_low] = USHRT_MAX;
+    initializeNewDirectory(&rootEntry, &rootEntry);
+
+    bzero(slot, sizeof(snapshot));
+    strncpy(slot->name, name, MAXFILENAME);
+    slot->root = rootEntry.first_cluster_low;
+    slot->created = time(NULL);
+    ORDERSTORES();
+    slot->state = SNAPSHOTDELETING;
+    ORDERSTORES();
+
+    res = cloneDirectory((dirEntry*)&blocks[0], (dirEntry*)&blocks[slot->root]);
+    if (res != 0) {
+        logMessage("Ran out of space taking snapshot %s, removing it\n", name);
+        numDeletingSnapshots++;
+        deleteSnapshots(UINT_MAX);
+        return res;
+    }
+    ORDERSTORES();
+    slot->state = SNAPSHOTLIVE;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    logMessage("Took snapshot %s in %.3f ms\n", name,
+               ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / 1e6);
+    return 0;
+}
+
+int removeSnapshot(char* name) {
+    // mark a snapshot for removal. Its entries are removed in the background when mounted, and before the
+    // program exits otherwise. returns 0, or -ENOENT if there's no snapshot called name
+    snapshot* slot = findSnapshot(name);    // the snapshot
+
+    if (slot == NULL) {
+        return -ENOENT;
+    }
+
+    slot->state = SNAPSHOTDELETING;
+    numDeletingSnapshots++;
+    pthread_cond_signal(&compactionCond);
+
+    logMessage("Snapshot %s marked for removal\n", name);
+    return 0;
+}
+
+unsigned int removeSnapshotEntries(dirEntry* dir, unsigned int maxEntries) {
+    // remove up to maxEntries entries from under a directory of a snapshot, deepest first, handing their
+    // chains to the orphan list. returns the number removed
+    dirEntry* currentEntry = NULL;          // entry being looked at
+    unsigned int numRemoved = 0;            // entries removed so far
+
+    // the snapshot's directories are only walked from here on, and an index would keep counting the
+    // entries removed
+    dropDirectoryIndex(dir);
+
+    currentEntry = (dirEntry*)&blocks[dir->first_cluster_low];
+    while (currentEntry != NULL && numRemoved < maxEntries) {
+        char name[MAXFILENAME + 1] = {0};   // name of the entry, null terminated
+        unsigned short blockIndex = ((char*)currentEntry - (char*)blocks) / BLOCKSIZE;   // block it's in
+
+        strncpy(name, currentEntry->name, MAXFILENAME);
+
+        // skip . and .., deleted entries and empty slots
+        if (name[0] == 0 || name[0] == 0x5F || currentEntry->attributes == ATTR_DELETED ||
+            strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            currentEntry = getNextEntry(currentEntry, dir);
+            continue;
+        }
+
+        // a directory goes once everything in it has, which it has if removing them didn't use up the
+        // entries left to remove
+        if (currentEntry->attributes & ATTR_DIRECTORY) {
+            numRemoved += removeSnapshotEntries(currentEntry, maxEntries - numRemoved);
+            if (numRemoved >= maxEntries) {
+                break;
+            }
+        }
+
+        if (!ISPACKED(currentEntry)) {
+            orphanChain(currentEntry->first_cluster_low, blockIndex, (((char*)currentEntry - blocks[blockIndex].data) / sizeof(dirEntry)));
+        }
+        currentEntry->attributes = ATTR_DELETED;
+        currentEntry->name[0] = '_';
+        if (ISPACKED(currentEntry)) {
+            freePackUnits(currentEntry);
+        }
+        numRemoved++;
+
+        currentEntry = getNextEntry(currentEntry, dir);
+    }
+
+    return numRemoved;
+}
+
+unsigned int deleteSnapshots(unsigned int maxEntries) {
+    // remove up to maxEntries entries from the snapshots marked for removal, and the snapshots themselves
+    // once they're empty. returns the number of entries removed
+    unsigned int numRemoved = 0;            // entries removed so far
+
+    for (int i = 0; i < MAXSNAPSHOTS && numDeletingSnapshots > 0 && numRemoved < maxEntries; i++) {
+        snapshot* slot = &snapshots[i];     // snapshot being looked at
+        unsigned short root = slot->root;   // first block of its root directory
+
+        if (slot->state != SNAPSHOTDELETING) {
+            continue;
+        }
+
+        numRemoved += removeSnapshotEntries((dirEntry*)&blocks[root], maxEntries - numRemoved);
+        if (numRemoved >= maxEntries) {
+            continue;
+        }
+
+        // the slot is given back before the root's blocks, so a program stopped in between only loses them
+        logMessage("Snapshot %s removed\n", slot->name);
+        bzero(slot, sizeof(snapshot));
+        ORDERSTORES();
+        numDeletingSnapshots--;
+        freeBlockChain(root);
+    }
+
+    return numRemoved;
+}
+
+void listSnapshots() {
+    // print the snapshots in the image, and when they were taken
+    int numSnapshots = 0;                   // snapshots printed so far
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    for (int i = 0; i < MAXSNAPSHOTS; i++) {
+        char created[64];                   // when it was taken
+        time_t when = snapshots[i].created; // the same, in seconds
+
+        if (snapshots[i].state == 0) {
+            continue;
+        }
+        strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S", localtime(&when));
+        printf("%-11.11s  %s%s\n", snapshots[i].name, created,
+               snapshots[i].state == SNAPSHOTDELETING ? "  (being removed)" : "");
+        numSnapshots++;
+    }
+
+    if (numSnapshots == 0) {
+        printf("No snapshots\n");
+    }
+}
+
+void selectSnapshot(char* name) {
+    // make paths start from a snapshot's root directory instead of the live one, and refuse changes
+    snapshot* slot = NULL;                  // the snapshot
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    slot = findSnapshot(name);
+    if (slot == NULL) {
+        fprintf(stderr, "Snapshot %s does not exist, exiting\n", name);
+        exit(1);
+    }
+
+    rootBlock = slot->root;
+    readOnly = 1;
+    logMessage("Using snapshot %s, at block %d\n", name, rootBlock);
+}
+
+unsigned int countFileFragments(dirEntry* file) {
+    // number of runs of adjacent blocks a file's data is stored in, which is how many seeks reading it
+    // takes. Holes don't break a run, and the blocks a reference stands for are a run of their own
+    unsigned short link = file->first_cluster_low;      // link being looked at
+    unsigned int next = UINT_MAX;                       // block that would carry on the current run
+    unsigned int numFragments = 0;                      // runs counted so far
+
+    // a packed file is all in one place
+    if (ISPACKED(file)) {
+        return file->size > 0;
+    }
+
+    while (link != USHRT_MAX) {
+        if (ISREFERENCE(link)) {
+            numFragments += REFERENCEBLOCK(link) != next;
+            next = REFERENCEBLOCK(link) + chainSpan(link);
+        }
+        else if (!ISHOLE(link)) {
+            numFragments += link != next;
+            next = link + 1;
+        }
+        link = *chainLink(link);
+    }
+
+    return numFragments;
+}
+
+unsigned int defragFile(dirEntry* file) {
+    // move the blocks a file has to itself into one run of free blocks, in file order. Each block is copied
+    // before the link to it is switched over and the old one freed, so anything reading the file finds the
+    // same data all along, and a program stopped in the middle leaves at most one block that can't be
+    // freed. returns the number of blocks moved, 0 if they're already in order or no free run is long enough
+    unsigned short* previous = (unsigned short*)&file->first_cluster_low;  // link to the block being looked at
+    unsigned short link = file->first_cluster_low;                         // block being looked at
+    unsigned int numBlocks = 0;                                            // blocks the file has to itself
+    unsigned int next = UINT_MAX;                                          // where the next one goes to be in order
+    int inOrder = 1;                                                       // flag for all of them being in order
+    unsigned int runStart = 0;                                             // first block of the run they move to
+
+    // a packed file is all in one place, and directories are moved by compaction
+    if (ISPACKED(file) || (file->attributes & ATTR_DIRECTORY)) {
+        return 0;
+    }
+
+    for (link = file->first_cluster_low; link != USHRT_MAX; link = *chainLink(link)) {
+        if (ISHOLE(link) || refcounts[link] > 0) {
+            continue;
+        }
+        inOrder = inOrder && (numBlocks == 0 || link == next);
+        next = link + 1;
+        numBlocks++;
+    }
+    if (inOrder) {
+        return 0;
+    }
+
+    // findFreeRun settles for the longest run when none is long enough, and moving into that doesn't help
+    runStart = findFreeRun(numBlocks);
+    if (runStart == MAXBLOCKS || runStart + numBlocks > MAXBLOCKS) {
+        return 0;
+    }
+    for (unsigned int i = 0; i < numBlocks; i++) {
+        if (FAT[runStart + i] != 0) {
+            return 0;
+        }
+    }
+
+    logMessage("Moving %u blocks of %.11s to %u-%u\n", numBlocks, file->name, runStart, runStart + numBlocks - 1);
+
+    freeBlockHint = runStart;
+    link = *previous;
+    while (link != USHRT_MAX) {
+        if (!ISHOLE(link) && refcounts[link] == 0) {
+            unsigned short copy = findFreeBlock();     // where the block goes
+
+            memcpy(blocks[copy].data, blocks[link].data, BLOCKSIZE);
+            checksums[copy] = checksums[link];
+            FAT[copy] = FAT[link];
+            ORDERSTORES();
+            *previous = copy;
+            ORDERSTORES();
+
+            // the copy takes the old block's place in the dedup index
+            if (sharableBlocks[link]) {
+                sharableBlocks[link] = 0;
+                indexBlock(copy, blockFingerprint(copy));
+            }
+            FAT[link] = 0;
+            queueFreedBlocks(link, 1);
+            link = copy;
+        }
+        previous = chainLink(link);
+        link = *previous;
+    }
+
+    // chunks are cached by the block they start at, which may be handed out again
+    if (ISCOMPRESSED(file)) {
+        chunkGeneration++;
+    }
+
+    return numBlocks;
+}
+
+unsigned int defragDirectory(dirEntry* dir, unsigned int maxBlocks) {
+    // run defragFile on the files under dir until maxBlocks blocks have been moved. returns the number of
+    // blocks moved
+    dirEntry* currentEntry = (dirEntry*)&blocks[dir->first_cluster_low];   // entry being looked at
+    unsigned int numMoved = 0;                                              // blocks moved so far
+
+    while (currentEntry != NULL && numMoved < maxBlocks) {
+        char name[MAXFILENAME + 1] = {0};   // name of the entry, null terminated
+
+        strncpy(name, currentEntry->name, MAXFILENAME);
+
+        // skip . and .., deleted entries and empty slots
+        if (name[0] == 0 || name[0] == 0x5F || currentEntry->attributes == ATTR_DELETED ||
+            strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            currentEntry = getNextEntry(currentEntry, dir);
+            continue;
+        }
+
+        if (currentEntry->attributes & ATTR_DIRECTORY) {
+            numMoved += defragDirectory(currentEntry, maxBlocks - numMoved);
+        }
+        else {
+            numMoved += defragFile(currentEntry);
+        }
+
+        currentEntry = getNextEntry(currentEntry, dir);
+    }
+
+    return numMoved;
+}
+
+unsigned long long readDirectoryFiles(dirEntry* dir, unsigned int* numFiles, unsigned int* numFragments) {
+    // read every file under dir, to time how fast the image reads, adding up the files and the runs their
+    // blocks are in. returns the number of bytes read
+    static char buffer[COMPRESSEDIOSIZE];                                   // where the data is read to
+    dirEntry* currentEntry = (dirEntry*)&blocks[dir->first_cluster_low];   // entry being looked at
+    unsigned long long numBytes = 0;                                        // bytes read so far
+
+    while (currentEntry != NULL) {
+        char name[MAXFILENAME + 1] = {0};   // name of the entry, null terminated
+
+        strncpy(name, currentEntry->name, MAXFILENAME);
+
+        // skip . and .., deleted entries and empty slots
+        if (name[0] == 0 || name[0] == 0x5F || currentEntry->attributes == ATTR_DELETED ||
+            strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            currentEntry = getNextEntry(currentEntry, dir);
+            continue;
+        }
+
+        if (currentEntry->attributes & ATTR_DIRECTORY) {
+            numBytes += readDirectoryFiles(currentEntry, numFiles, numFragments);
+        }
+        else {
+            unsigned int offset = 0;    // how far into the file has been read
+            int bytesRead = 0;          // bytes the last read got
+
+            while ((bytesRead = readFileData(currentEntry, buffer, COMPRESSEDIOSIZE, offset)) > 0) {
+                offset += bytesRead;
+            }
+            numBytes += offset;
+            (*numFiles)++;
+            *numFragments += countFileFragments(currentEntry);
+        }
+
+        currentEntry = getNextEntry(currentEntry, dir);
+    }
+
+    return numBytes;
+}
+
+void defragfs() {
+    // move the blocks of every file into one run each, saying how fragmented the files were and how fast
+    // they read before and after
+    dirEntry* root = NULL;                  // root directory
+    unsigned int numFiles = 0;              // files in the image
+    unsigned int fragmentsBefore = 0;       // runs their blocks were in before
+    unsigned int fragmentsAfter = 0;        // and after
+    unsigned long long numBytes = 0;        // bytes of file data read each time
+    unsigned int numMoved = 0;              // blocks moved
+    unsigned int passMoved = 0;             // blocks moved by the last pass
+    struct timespec start, end;             // when each step started and finished
+    double readBefore = 0, readAfter = 0;   // how long reading the files took
+    double seconds = 0;                     // how long moving the blocks took
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+    root = (dirEntry*)&blocks[rootBlock];
+
+    // free what removed files and snapshots still hold first, so their blocks can be moved into
+    deleteSnapshots(UINT_MAX);
+    freeOrphanBlocks(UINT_MAX);
+
+    // read everything once first, so both timings start with the image in memory
+    readDirectoryFiles(root, &numFiles, &fragmentsBefore);
+    numFiles = 0;
+    fragmentsBefore = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    numBytes = readDirectoryFiles(root, &numFiles, &fragmentsBefore);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    readBefore = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    // blocks freed by moving one file can make a run long enough for another, so go again until nothing
+    // moves. a file that has been moved is in order, so this ends
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while ((passMoved = defragDirectory(root, UINT_MAX)) > 0) {
+        numMoved += passMoved;
+    }
+    reclaimFreedBlocks();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    numFiles = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    readDirectoryFiles(root, &numFiles, &fragmentsAfter);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    readAfter = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("Moved %u blocks in %.3f s. %u files were in %u fragments, now %u\n", numMoved, seconds, numFiles,
+           fragmentsBefore, fragmentsAfter);
+    printf("Reading %.1f MB took %.3f s before (%.0f MB/s) and %.3f s after (%.0f MB/s)\n", numBytes / 1e6,
+           readBefore, readBefore > 0 ? numBytes / 1e6 / readBefore : 0, readAfter,
+           readAfter > 0 ? numBytes / 1e6 / readAfter : 0);
+}
+
+dirEntry* allocateDirectoryEntry(dirEntry* parentDir, char* name) {
+    // returns a zeroed slot for a new entry in the parent directory, named and with its isLast flag already
+    // set. deleted entries before the end of the directory are reused first, otherwise the entry is appended
+    // after the current last entry. indexed directories take both from the index instead of walking
+    unsigned short currentBlockIndex = USHRT_MAX;     // index on the FAT of the current working block
+    unsigned short finalDirIndex = USHRT_MAX;         // directory # of the last entry in the block. not the index
+    unsigned short blocksWalked = 0;                  // number of directory blocks walked to find the end
+    dirEntry* previousEntry = NULL;                   // pointer to the current last entry in the directory
+    dirEntry* newEntry = NULL;                        // pointer to the slot for the new entry
+    dirIndexHeader* header = NULL;                    // index of the parent directory, if it has one
+    dirBlockScan scan;                                // results of scanning the current block
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    header = getDirectoryIndex(parentDir);
+    if (header != NULL) {
+        // reuse a deleted entry the index remembered. skip any that have been reused or compacted away
+        while (header->numFreeSlots > 0) {
+            dirIndexSlot slot = header->freeSlots[--header->numFreeSlots];
+            dirEntry* entry = (dirEntry*)&blocks[slot.block].data[slot.entry * sizeof(dirEntry)];
+
+            if (FAT[slot.block] != 0 && entry->attributes == ATTR_DELETED) {
+                char isLast = entry->isLast;
+
+                bzero(entry, sizeof(dirEntry));
+                entry->isLast = isLast;
+                header->numDeleted--;
+
+                logMessage("Reusing deleted entry %d in block %d\n", slot.entry, slot.block);
+                newEntry = entry;
+                break;
+            }
+        }
+
+        // otherwise append, starting from the block the index says holds the last entry
+        if (newEntry == NULL) {
+            currentBlockIndex = header->lastDirBlock;
+            finalDirIndex = findLastEntryInBlock(currentBlockIndex);
+        }
+    }
+
+    if (newEntry == NULL && (header == NULL || finalDirIndex == USHRT_MAX)) {
+        // walk the directory until the block holding the last entry, looking for a deleted entry to reuse
+        currentBlockIndex = parentDir->first_cluster_low;
+        while (1) {
+            scanDirectoryBlock(currentBlockIndex, NULL, &scan);
+            finalDirIndex = scan.last != USHRT_MAX ? scan.last : (scan.empty ? 0 : USHRT_MAX);
+            blocksWalked++;
+
+            if (header == NULL && scan.deleted != USHRT_MAX) {
+                dirEntry* entry = (dirEntry*)&blocks[currentBlockIndex].data[scan.deleted * sizeof(dirEntry)];
+                char isLast = entry->isLast;
+
+                // reuse the slot, keeping its place in the directory
+                bzero(entry, sizeof(dirEntry));
+                entry->isLast = isLast;
+
+                logMessage("Reusing deleted entry %d in block %d\n", scan.deleted, currentBlockIndex);
+                newEntry = entry;
+            }
+
+            // stop at a reused entry or the block holding the last entry
+            if (newEntry != NULL || finalDirIndex != USHRT_MAX) {
+                break;
+            }
+
+            // check if there's another block to search
+            if (FAT[currentBlockIndex] == USHRT_MAX) {
+                fprintf(stderr, "No last entry found in parent directory, cannot add entry\n");
+                exit(1);
+            }
+            currentBlockIndex = FAT[currentBlockIndex];
+        }
+    }
+
+    if (newEntry == NULL) {
+        // get the pointer to the current last entry in the directory
+        previousEntry = (dirEntry*)&blocks[currentBlockIndex].data[finalDirIndex * sizeof(dirEntry)];
+
+        if (finalDirIndex == DIRENTRIES - 1) {
+            // no space left in block. last entry is at the end of the block
+
+            if (FAT[currentBlockIndex] != USHRT_MAX) {
+                // a block left over past the end of the directory (not compacted yet), use that
+                currentBlockIndex = FAT[currentBlockIndex];
+            }
+            else {
+                // find a free block, and update the FAT
+                currentBlockIndex = allocateNewBlock(currentBlockIndex);
+            }
+
+            // start the block clean, so nothing stale is read as an entry
+            bzero(&blocks[currentBlockIndex], BLOCKSIZE);
+
+            // get the pointer to the new entry in the new block
+            newEntry = (dirEntry*)&blocks[currentBlockIndex];
+
+            logMessage("Block full. Using block %d for new entry\n", currentBlockIndex);
+        }
+        else {
+            // have space left in block
+
+            // set the pointer to the next space after the last entry
+            newEntry = previousEntry + 1;
+            bzero(newEntry, sizeof(dirEntry));
+
+            logMessage("Space left in block. Adding entry to block %d\n", currentBlockIndex);
+        }
+
+        // the new entry is now the last entry in the directory
+        previousEntry->isLast = NOTLASTENTRY;
+        newEntry->isLast = LASTENTRY;
+
+        if (header != NULL) {
+            header->lastDirBlock = currentBlockIndex;
+        }
+    }
+
+    // name the entry so it can be indexed. the caller fills in the rest. every path above zeroed the slot,
+    // so a name as long as the field needs no terminator
+    memcpy(newEntry->name, name, strnlen(name, MAXFILENAME));
+
+    if (header != NULL) {
+        indexDirectoryEntry(header, newEntry);
+    }
+    else if (blocksWalked >= DIRINDEXTHRESHOLD) {
+        // the directory has grown big enough that walking it costs more than keeping an index
+        buildDirectoryIndex(parentDir);
+    }
+
+    return newEntry;
+}
+
+unsigned int hashName(char* name) {
+    // FNV-1a over the name, which is at most MAXFILENAME characters and may not be null terminated
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < MAXFILENAME && name[i] != '\0'; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+unsigned char nameHashByte(char* name) {
+    // the name's hash folded into the byte kept in its entry. never 0, which means no hash is stored
+    unsigned int hash = hashName(name);
+    unsigned char folded = hash ^ (hash >> 8) ^ (hash >> 16) ^ (hash >> 24);
+    return folded ? folded : 1;
+}
+
+int entryNameMatches(dirEntry* entry, char* name, unsigned char nameHash) {
+    // the stored hash rules out most entries without touching the name. entries without one are compared
+    if (entry->name_hash != 0 && entry->name_hash != nameHash) {
+        return 0;
+    }
+    // names that use all MAXFILENAME characters have no terminator in the entry, so don't read past it
+    return strncmp(entry->name, name, MAXFILENAME) == 0;
+}
+
+dirIndexHeader* getDirectoryIndex(dirEntry* dir) {
+    // returns the index of a directory, or NULL for a plain directory
+    dirEntry* dotEntry = (dirEntry*)&blocks[dir->first_cluster_low];
+    dirIndexHeader* header = NULL;
+
+    if (strcmp(dotEntry->name, ".") != 0 || dotEntry->size == 0 || dotEntry->size >= MAXBLOCKS) {
+        return NULL;
+    }
+
+    header = (dirIndexHeader*)&blocks[dotEntry->size];
+    if (header->magic != DIRINDEXMAGIC) {
+        return NULL;
+    }
+
+    return header;
+}
+
+unsigned short allocateIndexBlock(dirIndexHeader* header) {
+    // adds a zeroed block to the end of the index chain
+    unsigned short newBlock = allocateNewBlock(header->lastIndexBlock);
+    bzero(&blocks[newBlock], BLOCKSIZE);
+    header->lastIndexBlock = newBlock;
+    return newBlock;
+}
+
+unsigned short* getTableEntry(dirIndexHeader* header, unsigned int i) {
+    // returns a pointer to bucket pointer i of the table
+    unsigned short* table = (unsigned short*)&blocks[header->tableBlocks[i / TABLEENTRIES]];
+    return &table[i % TABLEENTRIES];
+}
+
+void indexDirectoryEntry(dirIndexHeader* header, dirEntry* entry) {
+    // adds an entry to the index, splitting its bucket (and doubling the table) as needed
+    unsigned int hash = hashName(entry->name);
+    long entryOffset = (char*)entry - (char*)blocks;
+    dirIndexBucket* bucket = NULL;
+    unsigned short bucketBlock = USHRT_MAX;
+
+    while (1) {
+        bucketBlock = *getTableEntry(header, hash & ((1u << header->globalDepth) - 1));
+        bucket = (dirIndexBucket*)&blocks[bucketBlock];
+
+        // room in the bucket, done
+        if (bucket->count < BUCKETREFS) {
+            break;
+        }
+
+        // bucket is full. if it is already split as far as the table goes, double the table first
+        if (bucket->localDepth == header->globalDepth) {
+            unsigned int tableSize = 1u << header->globalDepth;
+
+            if (tableSize * 2 > MAXINDEXTABLEBLOCKS * TABLEENTRIES) {
+                fprintf(stderr, "Directory index is full, cannot add entry\n");
+                exit(1);
+            }
+
+            // make sure there are table blocks for the top half, then copy the bottom half into it
+            for (unsigned int i = tableSize / TABLEENTRIES; i < (tableSize * 2 + TABLEENTRIES - 1) / TABLEENTRIES; i++) {
+                if (header->tableBlocks[i] == 0) {
+                    header->tableBlocks[i] = allocateIndexBlock(header);
+                }
+            }
+            for (unsigned int i = 0; i < tableSize; i++) {
+                *getTableEntry(header, i + tableSize) = *getTableEntry(header, i);
+            }
+            header->globalDepth++;
+
+            logMessage("Directory index table doubled to depth %d\n", header->globalDepth);
+        }
+
+        // split the bucket on its next hash bit
+        unsigned short newBucketBlock = allocateIndexBlock(header);
+        dirIndexBucket* newBucket = (dirIndexBucket*)&blocks[newBucketBlock];
+        unsigned int splitBit = 1u << bucket->localDepth;
+        unsigned int kept = 0;
+
+        bucket->localDepth++;
+        newBucket->localDepth = bucket->localDepth;
+        for (unsigned int i = 0; i < bucket->count; i++) {
+            if (bucket->refs[i].hash & splitBit) {
+                newBucket->refs[newBucket->count++] = bucket->refs[i];
+            } else {
+                bucket->refs[kept++] = bucket->refs[i];
+            }
+        }
+        bucket->count = kept;
+
+        // point the half of the table entries that have the bit set at the new bucket
+        for (unsigned int i = 0; i < (1u << header->globalDepth); i++) {
+            unsigned short* tableEntry = getTableEntry(header, i);
+            if (*tableEntry == bucketBlock && (i & splitBit)) {
+                *tableEntry = newBucketBlock;
+            }
+        }
+    }
+
+    // add the ref
+    bucket->refs[bucket->count].hash = hash;
+    bucket->refs[bucket->count].block = entryOffset / BLOCKSIZE;
+    bucket->refs[bucket->count].entry = (entryOffset % BLOCKSIZE) / sizeof(dirEntry);
+    bucket->count++;
+    header->numEntries++;
+}
+
+void unindexDirectoryEntry(dirIndexHeader* header, dirEntry* entry) {
+    // removes an entry from the index and remembers its slot for reuse. call before the name is changed
+    unsigned int hash = hashName(entry->name);
+    long entryOffset = (char*)entry - (char*)blocks;
+    unsigned short block = entryOffset / BLOCKSIZE;
+    unsigned short entryIndex = (entryOffset % BLOCKSIZE) / sizeof(dirEntry);
+    dirIndexBucket* bucket = (dirIndexBucket*)&blocks[*getTableEntry(header, hash & ((1u << header->globalDepth) - 1))];
+
+    for (unsigned int i = 0; i < bucket->count; i++) {
+        if (bucket->refs[i].block == block && bucket->refs[i].entry == entryIndex) {
+            bucket->refs[i] = bucket->refs[--bucket->count];
+            header->numEntries--;
+            break;
+        }
+    }
+
+    header->numDeleted++;
+    if (header->numFreeSlots < MAXINDEXFREESLOTS) {
+        header->freeSlots[header->numFreeSlots].block = block;
+        header->freeSlots[header->numFreeSlots].entry = entryIndex;
+        header->numFreeSlots++;
+    }
+}
+
+dirEntry* lookupIndexedEntry(dirIndexHeader* header, char* name) {
+    // finds an entry through the index, or returns NULL
+    unsigned int hash = hashName(name);
+    dirIndexBucket* bucket = (dirIndexBucket*)&blocks[*getTableEntry(header, hash & ((1u << header->globalDepth) - 1))];
+
+    for (unsigned int i = 0; i < bucket->count; i++) {
+        if (bucket->refs[i].hash == hash) {
+            dirEntry* entry = (dirEntry*)&blocks[bucket->refs[i].block].data[bucket->refs[i].entry * sizeof(dirEntry)];
+            if (entryNameMatches(entry, name, nameHashByte(name))) {
+                return entry;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+void buildDirectoryIndex(dirEntry* dir) {
+    // converts a plain directory into an indexed one
+    dirEntry* dotEntry = (dirEntry*)&blocks[dir->first_cluster_low];
+    dirEntry* entry = NULL;
+    dirIndexHeader* header = NULL;
+    unsigned short headerBlock = USHRT_MAX;
+    unsigned short bucketBlock = USHRT_MAX;
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    if (getDirectoryIndex(dir) != NULL) {
+        return;
+    }
+
+    // the header starts the index chain, followed by one table block and one bucket
+    headerBlock = findFreeBlock();
+    FAT[headerBlock] = USHRT_MAX;
+    bzero(&blocks[headerBlock], BLOCKSIZE);
+    header = (dirIndexHeader*)&blocks[headerBlock];
+    header->magic = DIRINDEXMAGIC;
+    header->lastIndexBlock = headerBlock;
+    header->tableBlocks[0] = allocateIndexBlock(header);
+    bucketBlock = allocateIndexBlock(header);
+    *getTableEntry(header, 0) = bucketBlock;
+
+    // index everything after . and ..
+    header->lastDirBlock = dir->first_cluster_low;
+    entry = getNextEntry(dotEntry + 1, dotEntry);
+    while (entry != NULL) {
+        long entryOffset = (char*)entry - (char*)blocks;
+
+        if (entry->attributes == ATTR_DELETED) {
+            header->numDeleted++;
+            if (header->numFreeSlots < MAXINDEXFREESLOTS) {
+                header->freeSlots[header->numFreeSlots].block = entryOffset / BLOCKSIZE;
+                header->freeSlots[header->numFreeSlots].entry = (entryOffset % BLOCKSIZE) / sizeof(dirEntry);
+                header->numFreeSlots++;
+            }
+        } else {
+            indexDirectoryEntry(header, entry);
+        }
+
+        if (entry->isLast == LASTENTRY) {
+            header->lastDirBlock = entryOffset / BLOCKSIZE;
+        }
+        entry = getNextEntry(entry, dotEntry);
+    }
+
+    // hook the index up to the directory
+    dotEntry->size = headerBlock;
+
+    logMessage("Built index for directory at block %d: %d entries\n", dir->first_cluster_low, header->numEntries);
+}
+
+void dropDirectoryIndex(dirEntry* dir) {
+    // turns an indexed directory back into a plain one, freeing the index
+    dirEntry* dotEntry = (dirEntry*)&blocks[dir->first_cluster_low];
+
+    if (getDirectoryIndex(dir) == NULL) {
+        return;
+    }
+
+    freeBlockChain(dotEntry->size);
+    dotEntry->size = 0;
+}
+
+void initializeNewDirectory(dirEntry* newDir, dirEntry* parentDir) {
+    short newDirBlockIndex = USHRT_MAX;       // index on the FAT of new dir block
+    short parentDirBlockIndex = USHRT_MAX;    // index on the FAT of parent dir block
+    block* newDirBlock = NULL;                // pointer to the new dir block
+    block* parentDirBlock = NULL;             // pointer to the parent dir block
+    dirEntry* dotEntry = NULL;                // pointer to the . entry in the new dir block
+    dirEntry* dotdotEntry = NULL;             // pointer to the .. entry in the new dir block
+
+    // set the block indexes
+    newDirBlockIndex = newDir->first_cluster_low;
+    parentDirBlockIndex = parentDir->first_cluster_low;
+
+    // set the block pointers
+    newDirBlock = &blocks[newDirBlockIndex];
+    parentDirBlock = &blocks[parentDirBlockIndex];
+
+    // set the pointers to the . and .. entries in the new directory block
+    dotEntry = (dirEntry*)&newDirBlock->data[0];
+    dotdotEntry = dotEntry + 1;
+
+    // zero the block
+    bzero(newDirBlock, BLOCKSIZE);
+
+    logMessage("New directory block zeroed\n");
+
+    // set the . entry
+    setDirEntry(dotEntry, ".", ATTR_DIRECTORY, 0, newDir->create_time, newDir->create_date,
+                newDir->last_access_date, newDir->first_cluster_high, newDir->last_write_time, newDir->last_write_date,
+                newDir->first_cluster_low, newDir->size, NOTLASTENTRY);
+
+    // set the .. entry
+    setDirEntry(dotdotEntry, "..", ATTR_DIRECTORY, 0, parentDir->create_time, parentDir->create_date,
+                parentDir->last_access_date, parentDir->first_cluster_high, parentDir->last_write_time, parentDir->last_write_date,
+                parentDir->first_cluster_low, 0, LASTENTRY);
+
+    logMessage("Set . and .. entries in new directory block\n");
+
+    logMessage("New directory finished initializing\n");
+}
+
+dirEntry* _addDirectory(char* directoryName, dirEntry* parentDirEntry) {
+    dirEntry* newDirEntry = NULL;                     // pointer to the new directory entry
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    logMessage("Attempting to add directory\n");
+
+    // check if the name is too long
+    if (strlen(directoryName) > MAXFILENAME) {
+        fprintf(stderr, "Directory name is too long, cannot add directory\n");
+        exit(1);
+    }
+
+    // check if the directory name already exists. TODO
+    if (findEntryInDirectory(parentDirEntry, directoryName) != NULL) {
+        fprintf(stderr, "Directory, %s, already exists, cannot add directory\n", directoryName);
+        exit(1);
+    }
+
+    // get a slot for the new entry in the parent directory
+    newDirEntry = allocateDirectoryEntry(parentDirEntry, directoryName);
+
+    // allocate a new block for the new directory's data
+    unsigned short newDirBlock = findFreeBlock();
+    FAT[newDirBlock] = USHRT_MAX;
+
+    // get current date time for create and last write
+    short create_time = 0;
+    char create_time_tenth = 0;
+    short create_date = 0;
+    getDateTime(&create_time, &create_time_tenth, &create_date);
+
+    // calculate the cluster number of the new directory
+    short clusterHigh = (newDirBlock >> 16) & 0xFFFF;
+    short clusterLow = newDirBlock & 0xFFFF;
+
+    // set the values of the new directory entry, keeping the slot's place in the directory
+    setDirEntry(newDirEntry, directoryName, ATTR_DIRECTORY,
+                create_time_tenth, create_time, create_date, create_date,
+                clusterHigh, create_time, create_date,
+                clusterLow, 0, newDirEntry->isLast);
+
+    // initialize the new directory block
+    initializeNewDirectory(newDirEntry, parentDirEntry);
+
+    // start it off indexed if asked to, instead of waiting for it to grow
+    if (indexDirectories) {
+        buildDirectoryIndex(newDirEntry);
+    }
+
+    logMessage("New directory added\n");
+
+    return newDirEntry;
+}
+
+void addDirectory(char* directoryPath, dirEntry* parentDirEntry) {
+    char* token;                            // token for strtok
+    char path[MAXPATH];                     // maximum path size
+    dirEntry* currentDir = parentDirEntry;  // start from the root directory
+
+    // copy the directory path to a local variable
+    strcpy(path, directoryPath);
+
+    // tokenize the path and create directories as needed
+    token = strtok(path, "/");
+    while (token != NULL) {
+        dirEntry* foundEntry = findEntryInDirectory(currentDir, token);
+        if (foundEntry == NULL) {
+            // directory does not exist, create it
+            foundEntry = _addDirectory(token, currentDir);
+        }
+        // move to the next directory in the path
+        currentDir = foundEntry;
+        token = strtok(NULL, "/");
+    }
+}
+
+dirEntry* getNextEntry(dirEntry* currentEntry, dirEntry* parentDirEntry) {
+    unsigned short currentBlockIndex;   // index on the FAT of the current working block
+    unsigned short currentEntryIndex;   // index of the current entry in the block
+    long entryOffset;                   // byte offset of the current entry from the start of the blocks
+    dirEntry* nextEntry;                // pointer to the next entry in the block
+
+    (void) parentDirEntry;
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    // early return if it's the last entry in the directory
+    if (currentEntry->isLast == LASTENTRY) {
+        logMessage("Error: Current entry is the last in the directory. No next entry available.\n");
+        return NULL;
+    }
+
+    // work out where the current entry lives from its address. Deleted entries can share a name
+    // (both "foo" and "boo" become "_oo"), so searching the directory by name is not reliable
+    entryOffset = (char*)currentEntry - (char*)blocks;
+    currentBlockIndex = entryOffset / BLOCKSIZE;
+    currentEntryIndex = entryOffset % BLOCKSIZE;
+
+    // if not last entry in block, return the next entry
+    if (currentEntryIndex < BLOCKSIZE - sizeof(dirEntry)) {
+        nextEntry = (dirEntry*)&blocks[currentBlockIndex].data[currentEntryIndex + sizeof(dirEntry)];
+        return nextEntry;
+    }
+
+    // current entry is the last in the block
+    // get the next block in the FAT
+    currentBlockIndex = FAT[currentBlockIndex];
+    currentEntryIndex = 0;
+
+    // check if current block is the last
+    if (currentBlockIndex == USHRT_MAX) {
+        logMessage("\tError: Reached the last block in FAT. No next entry available.\n");
+        return NULL;
+    }
+
+    // get the entry
+    nextEntry = (dirEntry*)&blocks[currentBlockIndex].data[currentEntryIndex];
+    logMessage("\tNext entry '%s' found in the next block at index %u.\n", nextEntry->name, currentBlockIndex);
+
+    // return the entry
+    return nextEntry;
+}
+
+// helper function to convert the date and time to a human-readable format
+void convertDateTime(short time, short date, char* dateTimeStr) {
+    // extract components from the date and time fields
+    int seconds = (time & 0x1F) * 2;
+    int minutes = (time >> 5) & 0x3F;
+    int hours = (time >> 11) & 0x1F;
+
+    int day = date & 0x1F;
+    int month = (date >> 5) & 0x0F;
+    int year = ((date >> 9) & 0x7F) + 1980;
+
+    // format the date and time as a string
+    sprintf(dateTimeStr, "%04d-%02d-%02d %02d:%02d:%02d", year, month, day, hours, minutes, seconds);
+}
+
+void listDirectory(dirEntry* parentDir) {
+    unsigned short currentDirBlockIndex = USHRT_MAX;     // index on the FAT of the current working block
+    block* currentDirBlock = NULL;                       // pointer to the current directory block
+    dirEntry* currentDirEntry = NULL;                    // pointer to the current directory entry
+    unsigned short currentDirEntryIndex = USHRT_MAX;     // index of the current directory entry in the block
+    char dateTimeStr[20];                                // string to hold the formatted date and time
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    // print the header
+    printf("%-12s %-20s %-10s\n", "Name", "Date Modified", "Size");
+    printf("%-12s %-20s %-10s\n", "------------", "-------------------", "----------");
+
+    // set the current block index to the first cluster of the parent directory
+    currentDirBlockIndex = parentDir->first_cluster_low;
+
+    // get the pointer to the current directory block
+    currentDirBlock = &blocks[currentDirBlockIndex];
+
+    // set the pointer to the first entry in the block
+    currentDirEntryIndex = 0;
+    currentDirEntry = (dirEntry*)&currentDirBlock->data[currentDirEntryIndex];
+
+    // iterate through the directory entries in the block until the last entry is found
+    while (currentDirEntry->isLast != LASTENTRY && currentDirEntry != NULL) {
+        // don't print the . and .. entries
+        if (strcmp(currentDirEntry->name, "..") == 0 || strcmp(currentDirEntry->name, ".") == 0) {
+            currentDirEntry = getNextEntry(currentDirEntry, parentDir);
+            continue;
+        }
+
+        // don't print the deleted entries
+        if (currentDirEntry->name[0] == 0x5F || currentDirEntry->attributes == ATTR_DELETED) {
+            currentDirEntry = getNextEntry(currentDirEntry, parentDir);
+            continue;
+        }
+
+        // convert the date and time to a readable format
+        convertDateTime(currentDirEntry->last_write_time, currentDirEntry->last_write_date, dateTimeStr);
+
+        // print the entry name
+        char name[12] = {0};
+        strncpy(name, currentDirEntry->name, 11);
+        if (currentDirEntry->attributes == ATTR_DIRECTORY) {
+            printf("%-12s %-20s %-10s\n", strcat(name, "/"), dateTimeStr, "0");
+        } else {
+            printf("%-12s %-20s %-10u\n", currentDirEntry->name, dateTimeStr, currentDirEntry->size);
+        }
+
+        // get the next entry in the directory
+        currentDirEntry = getNextEntry(currentDirEntry, parentDir);
+    }
+
+    // make sure we still have a currentDirEntry
+    if (currentDirEntry == NULL) {
+        return;
+    }
+
+    // don't print the . and .. entries
+    if (strcmp(currentDirEntry->name, "..") == 0 || strcmp(currentDirEntry->name, ".") == 0) {
+        return; // we can return here because we know that we are at the last entry
+    }
+
+    // don't print the deleted entries
+    if (currentDirEntry->name[0] == 0x5F || currentDirEntry->attributes == ATTR_DELETED) {
+        return; // we can return here because we know that we are at the last entry
+    }
+
+    // convert the last write date and time to a human-readable format
+    convertDateTime(currentDirEntry->last_write_time, currentDirEntry->last_write_date, dateTimeStr);
+
+    // print the last entry in the block
+    char name[12] = {0};
+    strncpy(name, currentDirEntry->name, 11);
+    if (currentDirEntry->attributes == ATTR_DIRECTORY) {
+        printf("%-12s %-20s %-10s\n", strcat(name, "/"), dateTimeStr, "0");
+    } else {
+        printf("%-12s %-20s %-10u\n", currentDirEntry->name, dateTimeStr, currentDirEntry->size);
+    }
+}
+
+
+void _printDirectoryTree(dirEntry* parentDir, int depth) {
+    unsigned short currentDirBlockIndex = USHRT_MAX;     // index on the FAT of the current working block
+    block* currentDirBlock = NULL;                       // pointer to the current directory block
+    dirEntry* currentDirEntry = NULL;                    // pointer to the current directory entry
+    unsigned short currentDirEntryIndex = USHRT_MAX;     // index of the current directory entry in the block
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    // set the current block index to the first cluster of the parent directory
+    currentDirBlockIndex = parentDir->first_cluster_low;
+
+    // get the pointer to the current directory block
+    currentDirBlock = &blocks[currentDirBlockIndex];
+
+    // set the pointer to the first entry in the block
+    currentDirEntryIndex = 0;
+    currentDirEntry = (dirEntry*)&currentDirBlock->data[currentDirEntryIndex];
+
+    // iterate through the directory entries in the block until the last entry is found
+    while (currentDirEntry->isLast != LASTENTRY && currentDirEntry != NULL) {
+        logMessage("Current entry: %s\n", currentDirEntry->name);
+        // don't print the . and .. entries and get the next entry
+        if (strcmp(currentDirEntry->name, "..") == 0 || strcmp(currentDirEntry->name, ".") == 0) {
+            currentDirEntry = getNextEntry(currentDirEntry, parentDir);
+            logMessage("Got next entry, %s\n", currentDirEntry->name);
+            continue;
+        }
+
+        // don't print the deleted entries
+        if (currentDirEntry->name[0] == 0x5F || currentDirEntry->attributes == ATTR_DELETED) {
+            currentDirEntry = getNextEntry(currentDirEntry, parentDir);
+            logMessage("Got next entry, %s\n", currentDirEntry->name);
+            continue;
+        }
+
+        if (currentDirEntry->attributes == ATTR_DIRECTORY)
+        {
+            printf("%*s", depth * 2, "");
+            printf("%s/\n", currentDirEntry->name);
+        }
+        else
+        {
+            printf("%*s", depth * 2, "");
+            printf("%s\n", currentDirEntry->name);
+        }
+
+        if (currentDirEntry->attributes == ATTR_DIRECTORY) {
+            // logMessage("Found subdirectory\n");
+            logMessage("Recursing into %s\n", currentDirEntry->name);
+            dirEntry* subDirEntry = (dirEntry*)&blocks[currentDirEntry->first_cluster_low];
+
+            // recursively list the contents of the subdirectory
+            _printDirectoryTree(subDirEntry, depth + 1);
+        }
+
+        // get the next entry in the directory
+        currentDirEntry = getNextEntry(currentDirEntry, parentDir);
+    }
+
+    // make sure we still have a currentDirEntry
+    if (currentDirEntry == NULL) {
+        return;
+    }
+
+    // don't print the . and .. entries
+    if (strcmp(currentDirEntry->name, "..") == 0 || strcmp(currentDirEntry->name, ".") == 0) {
+        return; // we can return here because we know that we are at the last entry
+    }
+
+    // don't print the deleted entries
+    if (currentDirEntry->name[0] == 0x5F || currentDirEntry->attributes == ATTR_DELETED) {
+        return; // we can return here because we know that we are at the last entry
+    }
+
+    // print the last entry in the block
+    if (currentDirEntry->attributes == ATTR_DIRECTORY)
+    {
+        printf("%*s", depth * 2, "");
+        printf("%s/\n", currentDirEntry->name);
+    }
+    else
+    {
+        printf("%*s", depth * 2, "");
+        printf("%s\n", currentDirEntry->name);
+    }
+
+    // check if the last entry is a directory
+    if (currentDirEntry->attributes == ATTR_DIRECTORY) {
+        logMessage("Found subdirectory in last entry. Recursing\n");
+        dirEntry* subDirEntry = (dirEntry*)&blocks[currentDirEntry->first_cluster_low];
+
+        // recursively list the contents of the subdirectory
+        _printDirectoryTree(subDirEntry, depth + 1);
+    }
+
+    logMessage("Directory listed. Exiting stack frame\n\n");
+}
+
+void printDirectoryTree(dirEntry* parentDir) {
+    _printDirectoryTree(parentDir, 0);
+}
+
+dirEntry* findEntryInDirectory(dirEntry* parentDir, char* entryName) {
+    unsigned short currentDirBlockIndex = USHRT_MAX;     // index on the FAT of the current working block
+    dirBlockScan scan;                                   // results of scanning the current block
+    dirIndexHeader* header = NULL;                       // index of the parent directory, if it has one
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    // indexed directories answer everything but . and .. from the index. those are always the first two entries
+    header = getDirectoryIndex(parentDir);
+    if (header != NULL && strcmp(entryName, ".") != 0 && strcmp(entryName, "..") != 0) {
+        return lookupIndexedEntry(header, entryName);
+    }
+
+    // set the current block index to the first cluster of the parent directory
+    currentDirBlockIndex = parentDir->first_cluster_low;
+
+    // check a block at a time until the last entry is found
+    while (currentDirBlockIndex != USHRT_MAX) {
+        scanDirectoryBlock(currentDirBlockIndex, entryName, &scan);
+
+        // check if an entry in the block has the name we are looking for
+        if (scan.match != USHRT_MAX) {
+            return (dirEntry*)&blocks[currentDirBlockIndex].data[scan.match * sizeof(dirEntry)];
+        }
+
+        // stop at the end of the directory
+        if (scan.last != USHRT_MAX) {
+            return NULL;
+        }
+
+        currentDirBlockIndex = FAT[currentDirBlockIndex];
+    }
+
+    return NULL;
+}
+
+void createEmptyFile(char* filename, dirEntry* parent) {
+    dirEntry* newEntry = NULL;                        // pointer to the new entry
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    // check if the file already exists
+    if (findEntryInDirectory(parent, filename) != NULL) {
+        fprintf(stderr, "File already exists\n");
+        return;
+    }
+
+    // check if the filename is too long
+    if (strlen(filename) > MAXFILENAME) {
+        fprintf(stderr, "Filename is too long\n");
+        return;
+    }
+
+    // get a slot for the new entry in the parent directory
+    newEntry = allocateDirectoryEntry(parent, filename);
+
+    // get the date and time
+    short create_time = 0;
+    char create_time_tenth = 0;
+    short create_date = 0;
+    getDateTime(&create_time, &create_time_tenth, &create_date);
+
+    // the file starts out packed, which for an empty file means it has no block at all
+    short clusterHigh = PACKEDFILE | (compressFiles ? COMPRESSEDFILE : 0);
+    short clusterLow = 0;
+    if (!(sb->features & FEATURE_PACKED)) {
+        sb->features |= FEATURE_PACKED;
+        writeSuperblock();
+    }
+
+     // initialize the new file entry
+    setDirEntry(newEntry, filename, ATTR_ARCHIVE,
+                create_time_tenth, create_time, create_date,
+                create_date, clusterHigh, create_time,
+                create_date, clusterLow, 0, newEntry->isLast);
+
+    logMessage("Added file entry for \"%s\" in directory \"%s\"\n", filename, parent->name);
+}
+
+unsigned short allocateFileBlocks(unsigned int numBlocks) {
+    unsigned short firstBlock = USHRT_MAX;            // first block of the chain
+    unsigned short lastBlock = USHRT_MAX;             // last block allocated so far
+    unsigned int numAllocated = 0;                    // number of blocks allocated so far
+
+    // allocate the blocks a run at a time, extending each run while the next block is free, so the
+    // file can be moved with a few large reads and writes. the caller checks there's room
+    while (numAllocated < numBlocks) {
+        unsigned short runStart = findFreeBlock();   // first block of the run
+        unsigned int runLength = 1;                  // number of blocks in the run
+
+        // link the run onto the end of the chain
+        if (lastBlock == USHRT_MAX) {
+            firstBlock = runStart;
+        }
+        else {
+            FAT[lastBlock] = runStart;
+        }
+        FAT[runStart] = USHRT_MAX;
+        lastBlock = runStart;
+
+        while (numAllocated + runLength < numBlocks && runStart + runLength < MAXBLOCKS &&
+               FAT[runStart + runLength] == 0) {
+            FAT[lastBlock] = runStart + runLength;
+            lastBlock = runStart + runLength;
+            FAT[lastBlock] = USHRT_MAX;
+            clearBlockChecksum(lastBlock);
+            sharableBlocks[lastBlock] = 0;
+            runLength++;
+        }
+        freeBlockHint = lastBlock + 1;
+
+        logMessage("\tblocks %d-%d\n", runStart, lastBlock);
+
+        numAllocated += runLength;
+    }
+
+    return firstBlock;
+}
+
+int readHostFile(int fd, unsigned short firstBlock, unsigned int size, off_t fileOffset) {
+    unsigned short block = firstBlock;                // block being read into
+    off_t offset = 0;                                 // offset in the file of the next read
+    int failed = 0;                                   // set once a read fails
+
+    // walk the chain, reading each run of adjacent blocks with one pread straight into the mapping. once
+    // a read fails the rest of the chain is only zeroed, so no stale data is left in the file. the file
+    // starts at fileOffset in fd, or at the current position if that's -1, for pipes
+    while (1) {
+        unsigned short runStart = block;             // first block of the run
+        unsigned int runLength = 1;                  // number of blocks in the run
+        size_t bytesToRead = 0;                      // bytes of the file that go in the run
+        size_t bytesRead = 0;                        // bytes read into the run so far
+
+        while (runLength < MAXIOBLOCKS && FAT[block] == block + 1) {
+            block = FAT[block];
+            runLength++;
+        }
+
+        // read the run
+        if (!failed) {
+            bytesToRead = size - offset < (off_t)runLength * BLOCKSIZE ? (size_t)(size - offset) : runLength * BLOCKSIZE;
+        }
+        while (bytesRead < bytesToRead) {
+            ssize_t result = fileOffset == -1 ?
+                read(fd, blocks[runStart].data + bytesRead, bytesToRead - bytesRead) :
+                pread(fd, blocks[runStart].data + bytesRead, bytesToRead - bytesRead, fileOffset + offset + bytesRead);
+            if (result == -1 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                failed = 1;
+                break;
+            }
+            bytesRead += result;
+        }
+
+        // don't leave stale data after the end of the file
+        bzero(blocks[runStart].data + bytesRead, runLength * BLOCKSIZE - bytesRead);
+        for (unsigned int i = 0; i < runLength; i++) {
+            setBlockChecksum(runStart + i);
+        }
+
+        offset += bytesRead;
+
+        // check if that was the end of the chain
+        if (FAT[block] == USHRT_MAX) {
+            break;
+        }
+        block = FAT[block];
+    }
+
+    return failed ? -1 : 0;
+}
+
+dirEntry* addFileEntry(dirEntry* parentDir, char* filename, unsigned short firstBlock, unsigned int size) {
+    dirEntry* newFileEntry = NULL;                    // pointer to the new file entry
+
+    // get a slot for the new entry in the parent directory
+    newFileEntry = allocateDirectoryEntry(parentDir, filename);
+
+    // get the time and date of creation
+    short create_time = 0;
+    char create_time_tenth = 0;
+    short create_date = 0;
+    getDateTime(&create_time, &create_time_tenth, &create_date);
+
+    // calculate the cluster number of the new file, and mark it to be compressed if new files are
+    short clusterHigh = ((firstBlock >> 16) & 0xFFFF) | (compressFiles ? COMPRESSEDFILE : 0);
+    short clusterLow = firstBlock & 0xFFFF;
+
+    // initialize the new file entry
+    setDirEntry(newFileEntry, filename, ATTR_ARCHIVE,
+                create_time_tenth, create_time, create_date,
+                create_date, clusterHigh, create_time,
+                create_date, clusterLow, size, newFileEntry->isLast);
+
+    logMessage("Added file entry for \"%s\" in directory \"%s\"\n", filename, parentDir->name);
+
+    return newFileEntry;
+}
+
+void _addFile(char* sourceFilename, char* intpath, dirEntry* parentDir) {
+    off_t fileSize = 0;                               // size of the file
+    unsigned short fileBlockIndex = USHRT_MAX;        // index on the FAT of the file block
+    unsigned int numBlocksToAllocate = 0;             // number of blocks to allocate for the file
+    char* filename = malloc(100);                     // name of the file
+    int fileContents = -1;                            // descriptor of the file contents
+    struct stat fileStat;                             // stat of the file, for its size
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    // get the filename from the source path
+    strcpy(filename, basename(sourceFilename));
+
+    // check if the name is too long
+    if (strlen(filename) > MAXFILENAME) {
+        fprintf(stderr, "File name is too long, cannot add file\n");
+        exit(1);
+    }
+
+    // check if the file already exists
+    if (findEntryInDirectory(parentDir, filename) != NULL) {
+        fprintf(stderr, "File, %s, already exists, cannot add file\n", filename);
+        exit(1);
+    }
+
+    // load reference to the file
+    fileContents = open(sourceFilename, O_RDONLY);
+
+    // check if the file was opened
+    if (fileContents == -1 || fstat(fileContents, &fileStat) == -1) {
+        fprintf(stderr, "Error opening file, cannot add file\n");
+        exit(1);
+    }
+
+    // get the file's size
+    fileSize = fileStat.st_size;
+
+    logMessage("Opened \"%s\" with size %lld\n", filename, (long long)fileSize);
+
+    // the size has to fit in the entry
+    if (fileSize > UINT_MAX) {
+        fprintf(stderr, "File, %s, is too large, cannot add file\n", filename);
+        exit(1);
+    }
+
+    // reserve space in the FAT for the file. even an empty file gets a block
+    numBlocksToAllocate = (fileSize + BLOCKSIZE - 1) / BLOCKSIZE;
+    if (numBlocksToAllocate == 0) {
+        numBlocksToAllocate = 1;
+    }
+
+    // check there's room before touching the FAT
+    if (numBlocksToAllocate > countFreeBlocks()) {
+        fprintf(stderr, "Not enough free blocks for %s, cannot add file\n", filename);
+        exit(1);
+    }
+
+    logMessage("Writing to %d blocks:\n", numBlocksToAllocate);
+    fileBlockIndex = allocateFileBlocks(numBlocksToAllocate);
+
+    // the file is read straight into its blocks, never into memory of our own
+    posix_fadvise(fileContents, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (readHostFile(fileContents, fileBlockIndex, fileSize, 0) == -1) {
+        fprintf(stderr, "Error reading %s, cannot add file\n", sourceFilename);
+        exit(1);
+    }
+
+    // add the entry once the data is in place, moving a small file into a pack block
+    packOrCompressFile(addFileEntry(parentDir, filename, fileBlockIndex, fileSize));
+
+    // close the file
+    close(fileContents);
+
+    // log that the file was added
+    logMessage("File \"%s\" added successfully\n", sourceFilename);
+}
+
+dirEntry* findParentFromPath(char* path, dirEntry* parentDir) {
+    char* token;                            // token for strtok
+    char filePath[MAXPATH];                 // path
+    dirEntry* currentDir = parentDir;       // start from the parent directory
+    dirEntry* foundEntry = NULL;            // pointer to the found entry
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    // copy the directory path to a local variable
+    strcpy(filePath, path);
+
+    // tokenize the path and find the directory to add the file to
+    token = strtok(filePath, "/");
+    while (token != NULL) {
+        dirEntry* foundEntry = findEntryInDirectory(currentDir, token);
+        if (foundEntry == NULL) {
+            fprintf(stderr, "Directory, %s, does not exist\n", token);
+            return NULL;
+        }
+        // move to the next directory in the path
+        currentDir = foundEntry;
+        token = strtok(NULL, "/");
+    }
+
+    return currentDir;
+}
+
+void extract_path(const char *filepath, char *path) {
+    const char *last_slash = strrchr(filepath, '/');
+    if (last_slash != NULL) {
+        size_t path_length = last_slash - filepath + 1;
+        strncpy(path, filepath, path_length);
+        path[path_length] = '\0';  // null-terminate the string
+    } else {
+        // no '/' found, assuming the entire input is the file name
+        strcpy(path, "");
+    }
+}
+
+void extract_filename(const char *filepath, char *filename) {
+    const char *last_slash = strrchr(filepath, '/');
+    if (last_slash != NULL) {
+        strcpy(filename, last_slash + 1);
+    } else {
+        // No '/' found, assuming the entire input is the file name
+        strcpy(filename, filepath);
+    }
+}
+
+int addFile(char* filename, char* intpath, dirEntry* parentDir) {
+    char* token;                            // token for strtok
+    char path[MAXPATH];                     // max path length
+    dirEntry* currentDir = parentDir;       // start from the parent directory
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    // copy the directory path to a local variable
+    strcpy(path, intpath);
+
+    // copy the filename to a local variable
+    char* file = malloc(strlen(filename));
+
+    // tokenize the path and find the directory to add the file to
+    token = strtok(path, "/");
+    while (token != NULL) {
+        dirEntry* foundEntry = findEntryInDirectory(currentDir, token);
+        if (foundEntry == NULL) {
+            fprintf(stderr, "Directory, %s, does not exist, cannot add file\n", token);
+            return -1;
+        }
+        // move to the next directory in the path
+        currentDir = foundEntry;
+        token = strtok(NULL, "/");
+    }
+
+    // check if the file name is too long
+    if (strlen(basename(filename)) > MAXFILENAME) {
+        fprintf(stderr, "File name is too long, cannot add file\n");
+        return -1;
+    }
+
+    // check if the file already exists
+    if (findEntryInDirectory(currentDir, filename) != NULL) {
+        fprintf(stderr, "File, %s, already exists, cannot add file\n", filename);
+        exit(1);
+    }
+
+    // add the file to the directory
+    logMessage("Adding file \"%s\" to %s\n", filename, intpath);
+    _addFile(filename, intpath, currentDir);
+
+    // free the filename
+    free(file);
+
+    return 0;
+}
+
+void runWorkerPool(void* (*worker)(void*), void* arg, unsigned int numJobs) {
+    pthread_t workers[MAXIOTHREADS];        // threads running the worker
+    long numWorkers = 0;                    // number of threads running the worker
+    long i = 0;                             // loop counter
+
+    // one thread per CPU, but no more than there are jobs for
+    numWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numWorkers > MAXIOTHREADS) {
+        numWorkers = MAXIOTHREADS;
+    }
+    if (numWorkers > numJobs) {
+        numWorkers = numJobs;
+    }
+    if (numWorkers < 1) {
+        numWorkers = 1;
+    }
+    logMessage("Running %u jobs on %ld threads\n", numJobs, numWorkers);
+
+    for (i = 0; i < numWorkers; i++) {
+        if (pthread_create(&workers[i], NULL, worker, arg) != 0) {
+            // make do with the threads that started
+            numWorkers = i;
+            break;
+        }
+    }
+
+    // if none started, do the work here
+    if (numWorkers == 0) {
+        worker(arg);
+    }
+
+    for (i = 0; i < numWorkers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+void walkHostDirectory(char* hostDir, int parent, importList* list) {
+    DIR* dir = NULL;                        // host directory being walked
+    struct dirent* hostEntry = NULL;        // entry read from the host directory
+    struct stat entryStat;                  // stat of the host entry
+    unsigned int firstChild = list->count;  // first entry queued for this directory
+    unsigned int numChildren = 0;           // number of entries queued for this directory
+    unsigned int i = 0;                     // loop counter
+
+    // open the host directory
+    dir = opendir(hostDir);
+    if (dir == NULL) {
+        fprintf(stderr, "Error opening directory \"%s\", skipping it\n", hostDir);
+        return;
+    }
+
+    // queue everything in the directory before going into its subdirectories, so its entries stay together
+    while ((hostEntry = readdir(dir)) != NULL) {
+        importEntry* entry = NULL;          // entry being queued
+        char* hostPath = NULL;              // path of the host entry
+
+        if (strcmp(hostEntry->d_name, ".") == 0 || strcmp(hostEntry->d_name, "..") == 0) {
+            continue;
+        }
+
+        // check if the name fits in an entry
+        if (strlen(hostEntry->d_name) > MAXFILENAME) {
+            fprintf(stderr, "Name of \"%s/%s\" is too long, skipping it\n", hostDir, hostEntry->d_name);
+            continue;
+        }
+
+        hostPath = malloc(strlen(hostDir) + strlen(hostEntry->d_name) + 2);
+        sprintf(hostPath, "%s/%s", hostDir, hostEntry->d_name);
+
+        // links aren't followed, and only files and directories can be stored
+        if (lstat(hostPath, &entryStat) == -1 || !(S_ISREG(entryStat.st_mode) || S_ISDIR(entryStat.st_mode))) {
+            fprintf(stderr, "\"%s\" is not a file or directory, skipping it\n", hostPath);
+            free(hostPath);
+            continue;
+        }
+
+        // the size has to fit in the entry
+        if (S_ISREG(entryStat.st_mode) && entryStat.st_size > UINT_MAX) {
+            fprintf(stderr, "\"%s\" is too large, skipping it\n", hostPath);
+            free(hostPath);
+            continue;
+        }
+
+        // make room in the list
+        if (list->count == list->capacity) {
+            list->capacity = list->capacity ? list->capacity * 2 : 64;
+            list->entries = realloc(list->entries, list->capacity * sizeof(importEntry));
+            if (list->entries == NULL) {
+                fprintf(stderr, "Out of memory while walking \"%s\"\n", hostDir);
+                exit(1);
+            }
+        }
+
+        entry = &list->entries[list->count++];
+        memset(entry, 0, sizeof(importEntry));
+        entry->hostPath = hostPath;
+        strcpy(entry->name, hostEntry->d_name);
+        entry->parent = parent;
+        entry->isDirectory = S_ISDIR(entryStat.st_mode);
+        entry->size = entry->isDirectory ? 0 : entryStat.st_size;
+        entry->firstBlock = USHRT_MAX;
+
+        // a file needs its data blocks, even when empty, and a directory its first block
+        list->numBlocks += entry->isDirectory ? 1 : (entry->size + BLOCKSIZE - 1) / BLOCKSIZE + (entry->size == 0);
+        numChildren++;
+    }
+    closedir(dir);
+
+    // the entries also need room in their directory
+    list->numBlocks += (numChildren + DIRENTRIES - 1) / DIRENTRIES;
+
+    // now walk the subdirectories. the list can move while they're walked, so go by index
+    for (i = firstChild; i < firstChild + numChildren; i++) {
+        if (list->entries[i].isDirectory) {
+            walkHostDirectory(list->entries[i].hostPath, i, list);
+        }
+    }
+}
+
+void* importWorker(void* arg) {
+    importList* list = (importList*)arg;    // the import being run
+
+    // take files off the list until there are none left. each file has its own blocks, so the
+    // workers never write to the same place
+    while (1) {
+        unsigned int i = __atomic_fetch_add(&list->nextEntry, 1, __ATOMIC_RELAXED);
+        importEntry* entry = NULL;          // file being read
+        int fd = -1;                        // descriptor of the host file
+
+        if (i >= list->count) {
+            break;
+        }
+        entry = &list->entries[i];
+        if (entry->isDirectory || entry->entry == NULL) {
+            continue;
+        }
+
+        // a file that can't be opened still has its blocks zeroed by the failed reads
+        fd = open(entry->hostPath, O_RDONLY);
+        if (fd != -1) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+        if (readHostFile(fd, entry->firstBlock, entry->size, 0) == -1) {
+            fprintf(stderr, "Error reading \"%s\", it was imported with zeroes\n", entry->hostPath);
+            __atomic_fetch_add(&list->numFailed, 1, __ATOMIC_RELAXED);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    return NULL;
+}
+
+void importTree(char* hostDir, char* intpath, dirEntry* rootDir) {
+    importList list;                        // everything found under the host directory
+    dirEntry* destination = NULL;           // directory the tree is imported into
+    unsigned int numFiles = 0;              // number of files imported
+    unsigned int numDirectories = 0;        // number of directories imported
+    unsigned long long numBytes = 0;        // bytes of file data imported
+    struct timespec start, end;             // when the import started and finished
+    double seconds = 0;                     // how long the import took
+    unsigned int i = 0;                     // loop counter
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // find the host files before changing anything
+    memset(&list, 0, sizeof(list));
+    walkHostDirectory(hostDir, -1, &list);
+
+    // check there's room for all of it
+    if (list.numBlocks > countFreeBlocks()) {
+        fprintf(stderr, "Not enough free blocks for \"%s\" (about %llu needed, %u free), cannot import\n",
+                hostDir, list.numBlocks, countFreeBlocks());
+        exit(1);
+    }
+
+    // find or create the destination
+    destination = findEntryFromPath(intpath, rootDir);
+    if (destination == NULL) {
+        addDirectory(intpath, rootDir);
+        destination = findEntryFromPath(intpath, rootDir);
+    }
+    if (destination == NULL || !(destination->attributes & ATTR_DIRECTORY)) {
+        fprintf(stderr, "%s is not a directory, cannot import\n", intpath);
+        exit(1);
+    }
+
+    // create the entries and reserve the files' blocks in one pass, a directory's worth at a time
+    for (i = 0; i < list.count; i++) {
+        importEntry* entry = &list.entries[i];                                      // entry being created
+        importEntry* parent = entry->parent < 0 ? NULL : &list.entries[entry->parent];  // directory it goes in
+        dirEntry* parentDir = parent == NULL ? destination : parent->entry;          // its directory in the image
+        int parentIsNew = parent != NULL && parent->isNew;                           // nothing can be in the way
+
+        // check if the directory was skipped
+        if (parentDir == NULL) {
+            continue;
+        }
+
+        // at the start of a directory's batch, index it first if the batch is going to make it
+        // large anyway, so the inserts don't scan it
+        if (i == 0 || list.entries[i - 1].parent != entry->parent) {
+            unsigned int batchEnd = i;      // one past the last entry of the batch
+
+            while (batchEnd < list.count && list.entries[batchEnd].parent == entry->parent) {
+                batchEnd++;
+            }
+            if (batchEnd - i >= DIRINDEXTHRESHOLD * DIRENTRIES && getDirectoryIndex(parentDir) == NULL) {
+                buildDirectoryIndex(parentDir);
+            }
+        }
+
+        // a directory the import made only holds what the import puts there, so it doesn't need checking
+        if (!parentIsNew) {
+            dirEntry* existing = findEntryInDirectory(parentDir, entry->name);
+
+            if (existing != NULL) {
+                // merge into directories that are already there
+                if (entry->isDirectory && (existing->attributes & ATTR_DIRECTORY)) {
+                    entry->entry = existing;
+                }
+                else {
+                    fprintf(stderr, "%s already exists, skipping \"%s\"\n", entry->name, entry->hostPath);
+                }
+                continue;
+            }
+        }
+
+        if (entry->isDirectory) {
+            entry->entry = _addDirectory(entry->name, parentDir);
+            entry->isNew = 1;
+            numDirectories++;
+        }
+        else {
+            entry->firstBlock = allocateFileBlocks(entry->size ? (entry->size + BLOCKSIZE - 1) / BLOCKSIZE : 1);
+            entry->entry = addFileEntry(parentDir, entry->name, entry->firstBlock, entry->size);
+            numFiles++;
+            numBytes += entry->size;
+        }
+    }
+
+    // read the files in parallel, then move the small ones into pack blocks
+    runWorkerPool(importWorker, &list, numFiles);
+    for (i = 0; i < list.count; i++) {
+        if (!list.entries[i].isDirectory && list.entries[i].entry != NULL) {
+            packOrCompressFile(list.entries[i].entry);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+
+    printf("Imported %u files and %u directories (%.1f MB) in %.3f s: %.0f files/s, %.1f MB/s\n",
+           numFiles, numDirectories, numBytes / 1e6, seconds, numFiles / seconds, numBytes / 1e6 / seconds);
+    if (list.numFailed > 0) {
+        fprintf(stderr, "%u files could not be read\n", list.numFailed);
+    }
+
+    // clean up
+    for (i = 0; i < list.count; i++) {
+        free(list.entries[i].hostPath);
+    }
+    free(list.entries);
+}
+
+dirEntry* findEntryFromPath(char* intpath, dirEntry* parentDir) {
+    char* token;                            // token for strtok
+    char path[MAXPATH];                     // max path length
+    char filename[MAXFILENAME + 1];         // name of the file to retrieve
+    dirEntry* currentDir = parentDir;       // start from the parent directory
+    dirEntry* file;                         // file to find
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    // copy the directory path to a local variable
+    logMessage("\tfindEntryFromPath: copying path, %s\n", intpath);
+    strcpy(path, intpath);
+
+    // check if the path is the root
+    if (strcmp(path, "/") == 0) {
+        dirEntry* root = (dirEntry*)&blocks[rootBlock];
+        return root;
+    }
+
+    // get the filename
+    logMessage("\tfindEntryFromPath: extracting filename from path, %s\n", intpath);
+    extract_filename(intpath, filename);
+    logMessage("\tfindEntryFromPath: extracted filename, %s\n", filename);
+
+    if (strcmp(filename, "") == 0) {
+        fprintf(stderr, "No filename provided\n");
+        return NULL;
+    }
+
+    // tokenize the path and find the directory to extract the file from
+    logMessage("Finding directory entry for file \"%s\" in %s\n", filename, intpath);
+    token = strtok(path, "/");
+    while (token != NULL) {
+        dirEntry* foundEntry = findEntryInDirectory(currentDir, token);
+        if (foundEntry == NULL) {
+            logMessage("Directory, %s, does not exist\n", token);
+            return NULL;
+        }
+        // check if we've found our file
+        if (strcmp(token, filename) == 0) {
+            file = foundEntry;
+            break;
+        }
+        // move to the next directory in the path
+        currentDir = foundEntry;
+        token = strtok(NULL, "/");
+    }
+
+    // check if the file exists
+    if (file == NULL) {
+        logMessage("Directory, %s, does not exist\n", token);
+        return NULL;
+    }
+
+    return file;
+}
+
+int writeHostBuffer(int fd, char* buffer, size_t length, off_t fileOffset) {
+    // write length bytes of buffer to fd at fileOffset, or at the current position if that's -1. returns
+    // 0, or -1 if the write failed
+    size_t offset = 0;                  // bytes written so far
+
+    while (offset < length) {
+        ssize_t written = fileOffset == -1 ? write(fd, buffer + offset, length - offset) :
+            pwrite(fd, buffer + offset, length - offset, fileOffset + offset);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        offset += written;
+    }
+
+    return 0;
+}
+
+int writeHostFile(int fd, dirEntry* file, off_t fileOffset) {
+    unsigned short block = file->first_cluster_low;      // first block of the file
+    unsigned int bytesToWrite = file->size;              // number of bytes left to queue for writing
+    off_t offset = 0;                                    // offset in the file of the next write
+    struct iovec runs[MAXIOBLOCKS];                      // contiguous runs of blocks waiting to be written
+    int numRuns = 0;                                     // number of runs waiting
+    size_t queuedBytes = 0;                              // bytes in the waiting runs
+    unsigned long long holeBytes = 0;                    // bytes of the hole being written
+    off_t skippedBytes = 0;                              // bytes of holes to step over once the runs are written
+
+    // walk the chain, merging blocks that follow each other on disk into runs. the runs are written
+    // straight from the mapping, several per pwritev. the file starts at fileOffset in fd, or at the
+    // current position if that's -1, for pipes. Holes are stepped over, so the host file gets holes
+    // too, except in a pipe where they are written out as zeroes
+    if (ISPACKED(file)) {
+        if (verifyBlock(file->first_cluster_low) != 0) {
+            return -1;
+        }
+        return writeHostBuffer(fd, packedFileData(file), file->size, fileOffset);
+    }
+
+    // a compressed file is decompressed a piece at a time, and written out whole
+    if (ISCOMPRESSED(file)) {
+        char* buffer = malloc(COMPRESSEDIOSIZE);        // decompressed data waiting to be written
+        int res = 0;                                    // result
+
+        if (buffer == NULL) {
+            return -1;
+        }
+        while (res == 0 && offset < file->size) {
+            int numBytes = readFileData(file, buffer, COMPRESSEDIOSIZE, offset);
+            res = numBytes < 0 ? -1 : writeHostBuffer(fd, buffer, numBytes, fileOffset == -1 ? -1 : fileOffset + offset);
+            offset += numBytes;
+        }
+        free(buffer);
+        return res;
+    }
+
+    while (bytesToWrite > 0 || queuedBytes > 0) {
+        // step over holes once what comes before them is written
+        if (skippedBytes > 0 && queuedBytes == 0) {
+            offset += skippedBytes;
+            skippedBytes = 0;
+        }
+
+        if (ISHOLE(block) && !ISREFERENCE(block) && holeBytes == 0 && bytesToWrite > 0) {
+            holeBytes = chainSpan(block) * (unsigned long long)BLOCKSIZE;
+            if (holeBytes > bytesToWrite) {
+                holeBytes = bytesToWrite;
+            }
+        }
+
+        if (holeBytes > 0 && fileOffset != -1) {
+            skippedBytes += holeBytes;
+            bytesToWrite -= holeBytes;
+            holeBytes = 0;
+            block = *chainLink(block);
+        }
+        else if (holeBytes > 0 && numRuns < MAXIOBLOCKS) {
+            runs[numRuns].iov_base = zeroBuffer;
+            runs[numRuns].iov_len = holeBytes < ZEROBUFFERSIZE ? holeBytes : ZEROBUFFERSIZE;
+            holeBytes -= runs[numRuns].iov_len;
+            bytesToWrite -= runs[numRuns].iov_len;
+            queuedBytes += runs[numRuns].iov_len;
+            numRuns++;
+            if (holeBytes == 0) {
+                block = *chainLink(block);
+            }
+        }
+        else if (bytesToWrite > 0 && skippedBytes == 0 && ISREFERENCE(block) && numRuns < MAXIOBLOCKS) {
+            unsigned short runStart = REFERENCEBLOCK(block);   // first of the shared blocks, which are a run
+            unsigned int runLength = chainSpan(block);         // number of them
+
+            for (unsigned int i = 0; i < runLength && i * BLOCKSIZE < bytesToWrite; i++) {
+                if (verifyBlock(runStart + i) != 0) {
+                    return -1;
+                }
+            }
+            runs[numRuns].iov_base = blocks[runStart].data;
+            runs[numRuns].iov_len = (runLength * BLOCKSIZE < bytesToWrite) ? runLength * BLOCKSIZE : bytesToWrite;
+            bytesToWrite -= runs[numRuns].iov_len;
+            queuedBytes += runs[numRuns].iov_len;
+            numRuns++;
+            block = *chainLink(block);
+        }
+        else if (bytesToWrite > 0 && skippedBytes == 0 && !ISHOLE(block) && numRuns < MAXIOBLOCKS) {
+            unsigned short runStart = block;             // first block of the run
+            unsigned int runLength = 1;                  // number of blocks in the run
+
+            // each block is checked as it's added
+            if (verifyBlock(block) != 0) {
+                return -1;
+            }
+            while (runLength * BLOCKSIZE < bytesToWrite && FAT[block] == block + 1) {
+                block = FAT[block];
+                runLength++;
+                if (verifyBlock(block) != 0) {
+                    return -1;
+                }
+            }
+
+            runs[numRuns].iov_base = blocks[runStart].data;
+            runs[numRuns].iov_len = (runLength * BLOCKSIZE < bytesToWrite) ? runLength * BLOCKSIZE : bytesToWrite;
+            bytesToWrite -= runs[numRuns].iov_len;
+            queuedBytes += runs[numRuns].iov_len;
+            numRuns++;
+            block = FAT[block];
+        }
+
+        // write the waiting runs once there's no room for more, nothing left to add, or a hole to step over
+        if (numRuns > 0 && (numRuns == MAXIOBLOCKS || bytesToWrite == 0 || skippedBytes > 0)) {
+            ssize_t written = 0;                         // bytes written by this call
+
+            // retry here on a signal, since the run array may be full
+            do {
+                written = fileOffset == -1 ? writev(fd, runs, numRuns) : pwritev(fd, runs, numRuns, fileOffset + offset);
+            } while (written == -1 && errno == EINTR);
+            if (written <= 0) {
+                return -1;
+            }
+            logMessage("\tWrote %zd bytes in %d runs to offset %lld\n", written, numRuns, (long long)offset);
+            offset += written;
+            queuedBytes -= written;
+
+            // drop the runs that were written, keeping what's left of a partial write
+            int runIndex = 0;
+            while (written > 0 && (size_t)written >= runs[runIndex].iov_len) {
+                written -= runs[runIndex].iov_len;
+                runIndex++;
+            }
+            if (written > 0) {
+                runs[runIndex].iov_base = (char*)runs[runIndex].iov_base + written;
+                runs[runIndex].iov_len -= written;
+            }
+            memmove(runs, &runs[runIndex], (numRuns - runIndex) * sizeof(struct iovec));
+            numRuns -= runIndex;
+        }
+    }
+
+    // a hole at the end leaves nothing to write, so give the host file its full size
+    if (skippedBytes > 0 && ftruncate(fd, fileOffset + offset + skippedBytes) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void setHostTimes(char* hostPath, dirEntry* entry) {
+    struct timespec times[2];               // access and modification times
+
+    // entries that were never written to have no time to give
+    if (entry->last_write_date == 0) {
+        return;
+    }
+
+    // only the date of the last access is kept
+    times[0].tv_sec = convertFATDateTime(entry->last_access_date ? entry->last_access_date : entry->last_write_date, 0);
+    times[0].tv_nsec = 0;
+    times[1].tv_sec = convertFATDateTime(entry->last_write_date, entry->last_write_time);
+    times[1].tv_nsec = 0;
+
+    if (utimensat(AT_FDCWD, hostPath, times, 0) == -1) {
+        logMessage("Could not set the times of \"%s\"\n", hostPath);
+    }
+}
+
+void _extractFile(dirEntry* file, char* outputDir) {
+    char name[MAXFILENAME + 1] = {0};                    // name of the file, null terminated
+    char outputPath[MAXPATH * 2];                        // where the file is written
+    int f = -1;                                          // file to write to
+
+    // check if the filesytem is loaded
+    fsLoadedCheck();
+
+    // check if the file is a directory
+    if (file->attributes == ATTR_DIRECTORY) {
+        fprintf(stderr, "Cannot extract directory, %s\n", file->name);
+        exit(1);
+    }
+
+    // work out where the file goes
+    strncpy(name, file->name, MAXFILENAME);
+    if (outputDir != NULL) {
+        snprintf(outputPath, sizeof(outputPath), "%s/%s", outputDir, name);
+    }
+    else {
+        snprintf(outputPath, sizeof(outputPath), "%s", name);
+    }
+
+    // open the file for writing, failing if it exists externally
+    if ((f = open(outputPath, O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1) {
+        if (errno == EEXIST) {
+            fprintf(stderr, "File \"%s\" already exists externally\n", outputPath);
+        }
+        else {
+            fprintf(stderr, "Error opening file \"%s\" for writing\n", outputPath);
+        }
+        exit(1);
+    }
+    logMessage("Opened file \"%s\" for writing\n", outputPath);
+
+    // write the file to the external file
+    logMessage("Starting write of file \"%s\"...\n", outputPath);
+    if (writeHostFile(f, file, 0) == -1) {
+        fprintf(stderr, "Error writing file \"%s\"\n", outputPath);
+        exit(1);
+    }
+
+    logMessage("Finished writing file \"%s\"\n", outputPath);
+
+    // close the file
+    close(f);
+
+    // keep the time it was last written in the image
+    setHostTimes(outputPath, file);
+}
+
+void queueExtractEntry(extractList* list, dirEntry* entry, char* hostPath) {
+    // make room in the list
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->entries = realloc(list->entries, list->capacity * sizeof(extractEntry));
+        if (list->entries == NULL) {
+            fprintf(stderr, "Out of memory while walking \"%s\"\n", hostPath);
+            exit(1);
+        }
+    }
+
+    list->entries[list->count].entry = entry;
+    list->entries[list->count].hostPath = hostPath;
+    list->count++;
+}
+
+void walkExtractDirectory(dirEntry* dir, char* hostDir, extractList* list) {
+    dirEntry* currentEntry = NULL;          // entry being looked at
+    struct stat hostStat;                   // stat of the host directory, if it's already there
+
+    // make the host directory, or use the one that's there
+    if (mkdir(hostDir, 0755) == -1 && !(errno == EEXIST && stat(hostDir, &hostStat) == 0 && S_ISDIR(hostStat.st_mode))) {
+        fprintf(stderr, "Error creating directory \"%s\", skipping it\n", hostDir);
+        free(hostDir);
+        return;
+    }
+    queueExtractEntry(list, dir, hostDir);
+
+    // queue every live entry, going into subdirectories as they come
+    currentEntry = (dirEntry*)&blocks[dir->first_cluster_low];
+    while (currentEntry != NULL) {
+        char name[MAXFILENAME + 1] = {0};   // name of the entry, null terminated
+        char* hostPath = NULL;              // where the entry goes
+
+        strncpy(name, currentEntry->name, MAXFILENAME);
+
+        // skip . and .., deleted entries and empty slots
+        if (name[0] == 0 || name[0] == 0x5F || currentEntry->attributes == ATTR_DELETED ||
+            strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            currentEntry = getNextEntry(currentEntry, dir);
+            continue;
+        }
+
+        hostPath = malloc(strlen(hostDir) + strlen(name) + 2);
+        sprintf(hostPath, "%s/%s", hostDir, name);
+
+        if (currentEntry->attributes & ATTR_DIRECTORY) {
+            walkExtractDirectory(currentEntry, hostPath, list);
+        }
+        else {
+            queueExtractEntry(list, currentEntry, hostPath);
+        }
+
+        currentEntry = getNextEntry(currentEntry, dir);
+    }
+}
+
+void* extractWorker(void* arg) {
+    extractList* list = (extractList*)arg;  // the extract being run
+
+    // take files off the list until there are none left. nothing in the image changes while they're
+    // written, so the workers only share the counter
+    while (1) {
+        unsigned int i = __atomic_fetch_add(&list->nextEntry, 1, __ATOMIC_RELAXED);
+        extractEntry* entry = NULL;         // file being written
+        int fd = -1;                        // descriptor of the host file
+
+        if (i >= list->count) {
+            break;
+        }
+        entry = &list->entries[i];
+        if (entry->entry->attributes & ATTR_DIRECTORY) {
             continue;
         }
 
-        if (currentDirEntry->attributes == ATTR_DIRECTORY)
-        {
-            printf("%*s", depth * 2, "");
-            printf("%s/\n", currentDirEntry->name);
+        // open the file for writing, failing if it exists externally
+        fd = open(entry->hostPath, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "Error creating \"%s\"%s, skipping it\n", entry->hostPath, errno == EEXIST ? ", it already exists" : "");
+            __atomic_fetch_add(&list->numFailed, 1, __ATOMIC_RELAXED);
+            continue;
         }
-        else
-        {
-            printf("%*s", depth * 2, "");
-            printf("%s\n", currentDirEntry->name);
+        if (entry->entry->size > 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
         }
+        if (writeHostFile(fd, entry->entry, 0) == -1) {
+            fprintf(stderr, "Error writing \"%s\"\n", entry->hostPath);
+            __atomic_fetch_add(&list->numFailed, 1, __ATOMIC_RELAXED);
+        }
+        close(fd);
+        setHostTimes(entry->hostPath, entry->entry);
+    }
 
-        if (currentDirEntry->attributes == ATTR_DIRECTORY) {
-            // logMessage("Found subdirectory\n");
-            logMessage("Recursing into %s\n", currentDirEntry->name);
-            dirEntry* subDirEntry = (dirEntry*)&blocks[currentDirEntry->first_cluster_low];
+    return NULL;
+}
 
-            // recursively list the contents of the subdirectory
-            _printDirectoryTree(subDirEntry, depth + 1);
+void extractTree(dirEntry* dir, char* hostDir) {
+    extractList list;                       // everything found under the directory
+    unsigned int numFiles = 0;              // number of files extracted
+    unsigned int numDirectories = 0;        // number of directories extracted
+    unsigned long long numBytes = 0;        // bytes of file data extracted
+    struct timespec start, end;             // when the extract started and finished
+    double seconds = 0;                     // how long the extract took
+    unsigned int i = 0;                     // loop counter
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // make the directories and find the files
+    memset(&list, 0, sizeof(list));
+    walkExtractDirectory(dir, strdup(hostDir), &list);
+    for (i = 0; i < list.count; i++) {
+        if (list.entries[i].entry->attributes & ATTR_DIRECTORY) {
+            numDirectories++;
+        }
+        else {
+            numFiles++;
+            numBytes += list.entries[i].entry->size;
         }
+    }
 
-        // get the next entry in the directory
-        currentDirEntry = getNextEntry(currentDirEntry, parentDir);
+    // write the files in parallel
+    runWorkerPool(extractWorker, &list, numFiles);
+
+    // give the directories their times, deepest first, now that nothing more is written into them
+    for (i = list.count; i > 0; i--) {
+        if (list.entries[i - 1].entry->attributes & ATTR_DIRECTORY) {
+            setHostTimes(list.entries[i - 1].hostPath, list.entries[i - 1].entry);
+        }
     }
 
-    // make sure we still have a currentDirEntry
-    if (currentDirEntry == NULL) {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+
+    printf("Extracted %u files and %u directories (%.1f MB) in %.3f s: %.0f files/s, %.1f MB/s\n",
+           numFiles - list.numFailed, numDirectories, numBytes / 1e6, seconds, numFiles / seconds, numBytes / 1e6 / seconds);
+    if (list.numFailed > 0) {
+        fprintf(stderr, "%u files could not be written\n", list.numFailed);
+    }
+
+    // clean up
+    for (i = 0; i < list.count; i++) {
+        free(list.entries[i].hostPath);
+    }
+    free(list.entries);
+}
+
+int extractFile(char* intpath, dirEntry* parentDir, char* outputDir) {
+    dirEntry* file = NULL;                     // file to extract
+    char name[MAXFILENAME + 1] = {0};          // name of a directory to extract, null terminated
+    char hostDir[MAXPATH * 2];                 // where a directory is extracted to
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    // find the file to extract
+    file = findEntryFromPath(intpath, parentDir);
+
+    // check if the file exists
+    if (file == NULL) {
+        fprintf(stderr, "File, %s, does not exist\n", intpath);
+        return -1;
+    }
+
+    // directories are extracted with everything in them. the root's contents go straight into the
+    // output directory
+    if (file->attributes & ATTR_DIRECTORY) {
+        strncpy(name, file->name, MAXFILENAME);
+        if (file == (dirEntry*)&blocks[rootBlock]) {
+            snprintf(hostDir, sizeof(hostDir), "%s", outputDir != NULL ? outputDir : ".");
+        }
+        else if (outputDir != NULL) {
+            snprintf(hostDir, sizeof(hostDir), "%s/%s", outputDir, name);
+        }
+        else {
+            snprintf(hostDir, sizeof(hostDir), "%s", name);
+        }
+        logMessage("Extracting directory \"%s\" to \"%s\"\n", intpath, hostDir);
+        extractTree(file, hostDir);
+        return 0;
+    }
+
+    // extract the file
+    logMessage("Extracting file \"%s\"\n", intpath);
+    _extractFile(file, outputDir);
+
+    printf("Extracted file \"%s\"\n", intpath);
+    return 0;
+}
+
+int readFully(int fd, char* buffer, size_t length) {
+    size_t bytesRead = 0;                   // bytes read so far
+
+    // pipes hand data over in pieces, so keep reading until there's enough or the input ends
+    while (bytesRead < length) {
+        ssize_t result = read(fd, buffer + bytesRead, length - bytesRead);
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result == -1) {
+            return -1;
+        }
+        if (result == 0) {
+            break;
+        }
+        bytesRead += result;
+    }
+
+    return bytesRead;
+}
+
+int writeFully(int fd, char* buffer, size_t length) {
+    size_t bytesWritten = 0;                // bytes written so far
+
+    while (bytesWritten < length) {
+        ssize_t result = write(fd, buffer + bytesWritten, length - bytesWritten);
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return -1;
+        }
+        bytesWritten += result;
+    }
+
+    return 0;
+}
+
+unsigned int tarChecksum(tarHeader* header) {
+    unsigned char* bytes = (unsigned char*)header;   // the header as bytes
+    unsigned int sum = 0;                            // sum of the bytes
+    unsigned int i = 0;                              // loop counter
+
+    // the checksum is the sum of the header's bytes, counting its own field as spaces
+    for (i = 0; i < TARRECORDSIZE; i++) {
+        if (i >= offsetof(tarHeader, checksum) && i < offsetof(tarHeader, checksum) + sizeof(header->checksum)) {
+            sum += ' ';
+        }
+        else {
+            sum += bytes[i];
+        }
+    }
+
+    return sum;
+}
+
+unsigned long long parseTarNumber(char* field, int length) {
+    unsigned long long value = 0;           // value of the field
+    int i = 0;                              // loop counter
+
+    // large values are stored in base 256, flagged by the top bit of the first byte
+    if ((unsigned char)field[0] & 0x80) {
+        value = (unsigned char)field[0] & 0x7F;
+        for (i = 1; i < length; i++) {
+            value = (value << 8) | (unsigned char)field[i];
+        }
+        return value;
+    }
+
+    // otherwise it's octal, padded with spaces or zeroes
+    for (i = 0; i < length && field[i] == ' '; i++);
+    for (; i < length && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = (value << 3) | (field[i] - '0');
+    }
+
+    return value;
+}
+
+dirEntry* makeDirectoryPath(dirEntry* dir, char* path) {
+    char pathCopy[MAXPATH * 2];             // copy of the path for strtok
+    char* token = NULL;                     // token for strtok
+
+    // check every name fits before creating anything
+    snprintf(pathCopy, sizeof(pathCopy), "%s", path);
+    for (token = strtok(pathCopy, "/"); token != NULL; token = strtok(NULL, "/")) {
+        if (strlen(token) > MAXFILENAME || strcmp(token, "..") == 0) {
+            return NULL;
+        }
+    }
+
+    // walk down the path, creating the directories that aren't there
+    snprintf(pathCopy, sizeof(pathCopy), "%s", path);
+    for (token = strtok(pathCopy, "/"); token != NULL; token = strtok(NULL, "/")) {
+        dirEntry* foundEntry = NULL;        // entry for this part of the path
+
+        if (strcmp(token, ".") == 0) {
+            continue;
+        }
+
+        foundEntry = findEntryInDirectory(dir, token);
+        if (foundEntry == NULL) {
+            foundEntry = _addDirectory(token, dir);
+        }
+        else if (!(foundEntry->attributes & ATTR_DIRECTORY)) {
+            return NULL;
+        }
+        dir = foundEntry;
+    }
+
+    return dir;
+}
+
+void importTar(int fd, char* intpath, dirEntry* rootDir) {
+    tarHeader header;                       // header of the current member
+    char path[MAXPATH * 2];                 // path of the current member in the archive
+    char longName[MAXPATH * 2];             // path given by a long name or pax member for the next one
+    char extended[MAXPATH * 4];             // data of a long name or pax member
+    int haveLongName = 0;                   // set if longName applies to the next member
+    char skipBuffer[TARRECORDSIZE];         // records that aren't kept are read into here
+    dirEntry* destination = NULL;           // directory the archive is imported into
+    unsigned int numFiles = 0;              // number of files imported
+    unsigned int numDirectories = 0;        // number of directories imported
+    unsigned long long numBytes = 0;        // bytes of file data imported
+    struct timespec start, end;             // when the import started and finished
+    double seconds = 0;                     // how long the import took
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // find or create the destination
+    destination = makeDirectoryPath(rootDir, intpath);
+    if (destination == NULL) {
+        fprintf(stderr, "%s is not a directory, cannot import\n", intpath);
+        exit(1);
+    }
+
+    while (1) {
+        unsigned long long size = 0;                // size of the member's data
+        unsigned long long numRecords = 0;          // records the data is padded out to
+        int keep = 0;                               // set if the data was stored
+        int result = readFully(fd, (char*)&header, TARRECORDSIZE);
+        char* name = NULL;                          // last part of the path
+        dirEntry* parentDir = NULL;                 // directory the member goes in
+
+        // the archive ends with zeroed records, but a missing end is tolerated
+        if (result == 0) {
+            break;
+        }
+        if (result != TARRECORDSIZE) {
+            fprintf(stderr, "Archive is truncated, stopping\n");
+            exit(1);
+        }
+        if (header.name[0] == 0 && tarChecksum(&header) == ' ' * sizeof(header.checksum)) {
+            break;
+        }
+        if (parseTarNumber(header.checksum, sizeof(header.checksum)) != tarChecksum(&header)) {
+            fprintf(stderr, "Not a tar archive, or it is damaged, stopping\n");
+            exit(1);
+        }
+
+        size = parseTarNumber(header.size, sizeof(header.size));
+        numRecords = (size + TARRECORDSIZE - 1) / TARRECORDSIZE;
+
+        // work out the member's path, dropping leading and trailing slashes and ./
+        if (haveLongName) {
+            snprintf(path, sizeof(path), "%s", longName);
+            haveLongName = 0;
+        }
+        else if (header.prefix[0] != 0 && memcmp(header.magic, "ustar", 5) == 0) {
+            snprintf(path, sizeof(path), "%.*s/%.*s", (int)sizeof(header.prefix), header.prefix, (int)sizeof(header.name), header.name);
+        }
+        else {
+            snprintf(path, sizeof(path), "%.*s", (int)sizeof(header.name), header.name);
+        }
+        while (path[0] == '/' || (path[0] == '.' && path[1] == '/')) {
+            memmove(path, path + (path[0] == '/' ? 1 : 2), strlen(path));
+        }
+        while (strlen(path) > 0 && path[strlen(path) - 1] == '/') {
+            path[strlen(path) - 1] = 0;
+        }
+
+        // GNU tar puts long paths in a member of their own just before the one they belong to, and pax
+        // puts them in a "path" record of an extended header
+        if (header.typeflag == 'L' || header.typeflag == 'x') {
+            unsigned long long i = 0;       // loop counter
+            size_t length = 0;              // bytes of the data kept
+            char* record = extended;        // pax record being read
+
+            for (i = 0; i < numRecords; i++) {
+                if (readFully(fd, skipBuffer, TARRECORDSIZE) != TARRECORDSIZE) {
+                    fprintf(stderr, "Archive is truncated, stopping\n");
+                    exit(1);
+                }
+                if (length < sizeof(extended) - 1) {
+                    size_t part = sizeof(extended) - 1 - length;
+                    part = part < TARRECORDSIZE ? part : TARRECORDSIZE;
+                    memcpy(extended + length, skipBuffer, part);
+                    length += part;
+                }
+            }
+            length = length < size ? length : size;
+            extended[length] = 0;
+
+            if (header.typeflag == 'L') {
+                snprintf(longName, sizeof(longName), "%.*s", (int)sizeof(longName) - 1, extended);
+                haveLongName = 1;
+            }
+
+            // pax records are "<length> <key>=<value>\n"
+            while (header.typeflag == 'x' && record < extended + length) {
+                char* key = NULL;           // start of the key
+                long recordLength = strtol(record, &key, 10);
+
+                if (recordLength <= 0 || record + recordLength > extended + length || *key != ' ') {
+                    break;
+                }
+                key++;
+                if (strncmp(key, "path=", 5) == 0) {
+                    snprintf(longName, sizeof(longName), "%.*s", (int)(record + recordLength - 1 - (key + 5)), key + 5);
+                    haveLongName = 1;
+                }
+                record += recordLength;
+            }
+            continue;
+        }
+
+        if (header.typeflag == '5') {
+            // directories are made along with every directory above them
+            if (path[0] != 0 && makeDirectoryPath(destination, path) == NULL) {
+                fprintf(stderr, "Cannot make directory %s, skipping it\n", path);
+            }
+            else if (path[0] != 0) {
+                numDirectories++;
+            }
+        }
+        else if (header.typeflag == '0' || header.typeflag == '\0' || header.typeflag == '7') {
+            // split the path into the directory and the name
+            name = strrchr(path, '/');
+            if (name != NULL) {
+                *name = 0;
+                name++;
+                parentDir = makeDirectoryPath(destination, path);
+            }
+            else {
+                name = path;
+                parentDir = destination;
+            }
+
+            if (parentDir == NULL || strlen(name) == 0 || strlen(name) > MAXFILENAME) {
+                fprintf(stderr, "Cannot store %s%s%s, skipping it\n", name == path ? "" : path, name == path ? "" : "/", name);
+            }
+            else if (findEntryInDirectory(parentDir, name) != NULL) {
+                fprintf(stderr, "%s already exists, skipping it\n", name);
+            }
+            else if (size > UINT_MAX) {
+                fprintf(stderr, "%s is too large, skipping it\n", name);
+            }
+            else {
+                unsigned int numBlocks = numRecords ? numRecords : 1;     // blocks for the file, even an empty one
+                unsigned short firstBlock = USHRT_MAX;                     // first block of the file
+                dirEntry* newEntry = NULL;                                 // entry for the file
+                size_t padding = numRecords * TARRECORDSIZE - size;        // zeroes after the data
+
+                // the stream can't be rewound, so stop if the file won't fit
+                if (numBlocks > countFreeBlocks()) {
+                    fprintf(stderr, "Not enough free blocks for %s, stopping\n", name);
+                    exit(1);
+                }
+
+                // read the data straight into the file's blocks, then step over the padding
+                firstBlock = allocateFileBlocks(numBlocks);
+                if (readHostFile(fd, firstBlock, size, -1) == -1 || readFully(fd, skipBuffer, padding) != (int)padding) {
+                    freeBlockChain(firstBlock);
+                    fprintf(stderr, "Archive is truncated, stopping\n");
+                    exit(1);
+                }
+
+                // add the entry, with the time it was last written
+                newEntry = addFileEntry(parentDir, name, firstBlock, size);
+                toFATDateTime((time_t)parseTarNumber(header.mtime, sizeof(header.mtime)), &newEntry->last_write_time, &newEntry->last_write_date);
+                newEntry->last_access_date = newEntry->last_write_date;
+                packOrCompressFile(newEntry);
+
+                numFiles++;
+                numBytes += size;
+                keep = 1;
+            }
+        }
+        else if (header.typeflag != 'g') {
+            // links, devices and the like have nowhere to go. global pax headers are skipped quietly
+            fprintf(stderr, "%s is not a file or directory, skipping it\n", path);
+        }
+
+        // step over data that wasn't stored
+        if (!keep) {
+            unsigned long long i = 0;       // loop counter
+
+            for (i = 0; i < numRecords; i++) {
+                if (readFully(fd, skipBuffer, TARRECORDSIZE) != TARRECORDSIZE) {
+                    fprintf(stderr, "Archive is truncated, stopping\n");
+                    exit(1);
+                }
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+
+    printf("Imported %u files and %u directories (%.1f MB) from the archive in %.3f s: %.0f files/s, %.1f MB/s\n",
+           numFiles, numDirectories, numBytes / 1e6, seconds, numFiles / seconds, numBytes / 1e6 / seconds);
+}
+
+int writeTarHeader(int fd, dirEntry* entry, char* path) {
+    tarHeader header;                       // header being written
+    size_t pathLength = strlen(path);       // length of the path
+    char* split = NULL;                     // slash the path is split at, if it's too long for the name field
+    int isDirectory = (entry->attributes & ATTR_DIRECTORY) != 0;
+
+    memset(&header, 0, sizeof(header));
+
+    // paths that don't fit in the name field are split at a slash, with the front going in the prefix
+    if (pathLength > sizeof(header.name)) {
+        split = path + pathLength - sizeof(header.name) - 1;
+        while (*split != 0 && *split != '/') {
+            split++;
+        }
+        if (*split == 0 || split - path > (long)sizeof(header.prefix)) {
+            return -1;
+        }
+        memcpy(header.prefix, path, split - path);
+        memcpy(header.name, split + 1, strlen(split + 1));
+    }
+    else {
+        memcpy(header.name, path, pathLength);
+    }
+
+    snprintf(header.mode, sizeof(header.mode), "%07o", isDirectory ? 0755 : 0644);
+    snprintf(header.uid, sizeof(header.uid), "%07o", 0);
+    snprintf(header.gid, sizeof(header.gid), "%07o", 0);
+    snprintf(header.size, sizeof(header.size), "%011o", isDirectory ? 0 : entry->size);
+    snprintf(header.mtime, sizeof(header.mtime), "%011llo",
+             entry->last_write_date ? (unsigned long long)convertFATDateTime(entry->last_write_date, entry->last_write_time) : 0ULL);
+    header.typeflag = isDirectory ? '5' : '0';
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+    snprintf(header.checksum, sizeof(header.checksum), "%06o", tarChecksum(&header));
+    header.checksum[7] = ' ';
+
+    return writeFully(fd, (char*)&header, TARRECORDSIZE);
+}
+
+void exportTarEntry(int fd, dirEntry* entry, char* path, unsigned int* numFiles, unsigned long long* numBytes) {
+    static char zeroes[TARRECORDSIZE];      // padding after file data
+    dirEntry* currentEntry = NULL;          // entry being looked at in a directory
+
+    // write the header. the root has none, its contents go at the top of the archive
+    if (path[0] != 0 && writeTarHeader(fd, entry, path) == -1) {
+        fprintf(stderr, "Error writing %s to the archive, stopping\n", path);
+        exit(1);
+    }
+
+    // files are written straight from the mapping, then padded out to a whole record
+    if (!(entry->attributes & ATTR_DIRECTORY)) {
+        if (writeHostFile(fd, entry, -1) == -1 ||
+            writeFully(fd, zeroes, (TARRECORDSIZE - entry->size % TARRECORDSIZE) % TARRECORDSIZE) == -1) {
+            fprintf(stderr, "Error writing %s to the archive, stopping\n", path);
+            exit(1);
+        }
+        (*numFiles)++;
+        *numBytes += entry->size;
         return;
     }
 
-    // don't print the . and .. entries
-    if (strcmp(currentDirEntry->name, "..") == 0 || strcmp(currentDirEntry->name, ".") == 0) {
-        return; // we can return here because we know that we are at the last entry
+    // go through every live entry in the directory
+    currentEntry = (dirEntry*)&blocks[entry->first_cluster_low];
+    while (currentEntry != NULL) {
+        char name[MAXFILENAME + 1] = {0};   // name of the entry, null terminated
+        char childPath[MAXPATH * 2];        // path of the entry in the archive
+
+        strncpy(name, currentEntry->name, MAXFILENAME);
+
+        // skip . and .., deleted entries and empty slots
+        if (name[0] != 0 && name[0] != 0x5F && currentEntry->attributes != ATTR_DELETED &&
+            strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+            snprintf(childPath, sizeof(childPath), "%s%s%s", path, path[0] != 0 ? "/" : "", name);
+            exportTarEntry(fd, currentEntry, childPath, numFiles, numBytes);
+        }
+
+        currentEntry = getNextEntry(currentEntry, entry);
     }
+}
 
-    // don't print the deleted entries
-    if (currentDirEntry->name[0] == 0x5F || currentDirEntry->attributes == ATTR_DELETED) {
-        return; // we can return here because we know that we are at the last entry
+void exportTar(int fd, char* intpath, dirEntry* rootDir) {
+    dirEntry* entry = NULL;                 // file or directory being exported
+    char name[MAXFILENAME + 1] = {0};       // its name, null terminated
+    char endRecords[2 * TARRECORDSIZE];     // the two zeroed records that end an archive
+    unsigned int numFiles = 0;              // number of files exported
+    unsigned long long numBytes = 0;        // bytes of file data exported
+    struct timespec start, end;             // when the export started and finished
+    double seconds = 0;                     // how long the export took
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // find what's being exported
+    entry = findEntryFromPath(intpath, rootDir);
+    if (entry == NULL) {
+        fprintf(stderr, "%s does not exist, cannot export\n", intpath);
+        exit(1);
     }
 
-    // print the last entry in the block
-    if (currentDirEntry->attributes == ATTR_DIRECTORY)
-    {
-        printf("%*s", depth * 2, "");
-        printf("%s/\n", currentDirEntry->name);
+    // members are named from the exported entry down, and the root's contents go at the top
+    if (entry != (dirEntry*)&blocks[rootBlock]) {
+        strncpy(name, entry->name, MAXFILENAME);
     }
-    else
-    {
-        printf("%*s", depth * 2, "");
-        printf("%s\n", currentDirEntry->name);
+    exportTarEntry(fd, entry, name, &numFiles, &numBytes);
+
+    memset(endRecords, 0, sizeof(endRecords));
+    if (writeFully(fd, endRecords, sizeof(endRecords)) == -1) {
+        fprintf(stderr, "Error writing the end of the archive\n");
+        exit(1);
     }
 
-    // check if the last entry is a directory
-    if (currentDirEntry->attributes == ATTR_DIRECTORY) {
-        logMessage("Found subdirectory in last entry. Recursing\n");
-        dirEntry* subDirEntry = (dirEntry*)&blocks[currentDirEntry->first_cluster_low];
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
 
-        // recursively list the contents of the subdirectory
-        _printDirectoryTree(subDirEntry, depth + 1);
+    // the archive is on stdout, so the summary goes to stderr
+    fprintf(stderr, "Exported %u files (%.1f MB) to the archive in %.3f s: %.0f files/s, %.1f MB/s\n",
+            numFiles, numBytes / 1e6, seconds, numFiles / seconds, numBytes / 1e6 / seconds);
+}
+
+int isDirectoryEmpty(dirEntry* entry) {
+    dirEntry* dotEntry = NULL;                              // pointer to the . entry of the directory
+    dirEntry* currentEntry = NULL;                          // pointer to the current entry
+    dirIndexHeader* header = NULL;                          // index of the directory, if it has one
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    // indexed directories keep count
+    header = getDirectoryIndex(entry);
+    if (header != NULL) {
+        return header->numEntries == 0;
+    }
+
+    // get the '..' entry
+    dotEntry = (dirEntry*)&blocks[entry->first_cluster_low];
+    currentEntry = findEntryInDirectory(entry, "..");
+    if (currentEntry == NULL) {
+        fprintf(stderr, "An error occurred while checking if the directory is empty\n");
+        return 0;
     }
 
-    logMessage("Directory listed. Exiting stack frame\n\n");
-}
+    // look for a live entry after .. (the last entry may be a deleted one)
+    currentEntry = getNextEntry(currentEntry, dotEntry);
+    while (currentEntry != NULL) {
+        if (currentEntry->attributes != ATTR_DELETED) {
+            return 0;
+        }
+        currentEntry = getNextEntry(currentEntry, dotEntry);
+    }
 
-void printDirectoryTree(dirEntry* parentDir) {
-    _printDirectoryTree(parentDir, 0);
+    return 1;
 }
 
-dirEntry* findEntryInDirectory(dirEntry* parentDir, char* entryName) {
-    unsigned short currentDirBlockIndex = USHRT_MAX;     // index on the FAT of the current working block
-    block* currentDirBlock = NULL;                       // pointer to the current directory block
-    dirEntry* currentDirEntry = NULL;                    // pointer to the current directory entry
-    unsigned short currentDirEntryIndex = USHRT_MAX;     // index of the current directory entry in the block
+int removeDirectoryEntry(char* intpath, dirEntry* rootDir) {
+    char* parentPath = malloc(MAXPATH);                           // path to the parent directory
+    dirEntry* entry = findEntryFromPath(intpath, rootDir);        // find the directory entry to remove
+    dirEntry* previousEntry = NULL;                               // pointer to the previous entry in the directory
+    dirEntry* parentDir = NULL;                                   // pointer to the parent directory
+    unsigned short blockIndex = USHRT_MAX;                        // index of the parent directory
+    unsigned short entryIndex = 0;                                // index of the current entry in the block
+    block* currentBlock = NULL;                                   // pointer to the current block
+    unsigned short isLast = 0;                                    // flag to indicate if the entry is the last in the block
+    dirIndexHeader* header = NULL;                                // index of the parent directory, if it has one
 
     // check if the file system is loaded
     fsLoadedCheck();
 
-    // set the current block index to the first cluster of the parent directory
-    currentDirBlockIndex = parentDir->first_cluster_low;
+    // get the parent directory of the entry and the block index
+    extract_path(intpath, parentPath);  // get the parent directory path (without the filename)
+    parentDir = findParentFromPath(parentPath, rootDir);
 
-    // get the pointer to the current directory block
-    currentDirBlock = &blocks[currentDirBlockIndex];
+    // check if the parent directory exists
+    if (parentDir == NULL) {
+        fprintf(stderr, "Parent directory of \"%s\" does not exist, cannot remove\n", intpath);
+        return -1;
+    }
 
-    // set the pointer to the first entry in the block
-    currentDirEntryIndex = 0;
-    currentDirEntry = (dirEntry*)&currentDirBlock->data[currentDirEntryIndex];
+    blockIndex = parentDir->first_cluster_low;
 
-    // iterate through the directory entries in the block until the last entry is found
-    while (currentDirEntry->isLast != LASTENTRY && currentDirEntry != NULL) {
-        // check if the entry name matches the name we are looking for
-        if (strcmp(currentDirEntry->name, entryName) == 0) {
-            return currentDirEntry;
+    // check if the entry is valid
+    if (entry == NULL) {
+        fprintf(stderr, "File or directory \"%s\" does not exist, cannot remove\n", intpath);
+        return -1;
+    }
+
+    // check if the entry is a directory, check if it is empty
+    if (entry->attributes == ATTR_DIRECTORY) {
+        if (!isDirectoryEmpty(entry)) {
+            fprintf(stderr, "Directory \"%s\" is not empty, cannot remove\n", intpath);
+            return -1;
         }
+    }
 
-        // get the next entry in the directory
-        currentDirEntry = getNextEntry(currentDirEntry, parentDir);
+    // a removed directory must not be compacted later, its blocks are about to be reused. its index goes with it
+    if (entry->attributes == ATTR_DIRECTORY) {
+        cancelDirectoryCompaction(entry->first_cluster_low);
+        dropDirectoryIndex(entry);
     }
 
-    // make sure we still have a currentDirEntry
-    if (currentDirEntry == NULL) {
-        return NULL;
+    // an indexed parent already pointed us at the entry. take it out of the index while it still has its
+    // name, and leave the deleted slot where it is for the next entry added
+    header = getDirectoryIndex(parentDir);
+    if (header != NULL) {
+        unindexDirectoryEntry(header, entry);
+
+        blockIndex = ((char*)entry - (char*)blocks) / BLOCKSIZE;
+        if (!ISPACKED(entry)) {
+            orphanChain(entry->first_cluster_low, blockIndex, ((char*)entry - blocks[blockIndex].data) / sizeof(dirEntry));
+        }
+        entry->attributes = ATTR_DELETED;
+        entry->name[0] = '_';
+        entry->name_hash = nameHashByte(entry->name);
+        if (ISPACKED(entry)) {
+            freePackUnits(entry);
+        }
+
+        scheduleDirectoryCompaction(parentDir->first_cluster_low);
+
+        logMessage("Entry \"%s\" removed successfully\n", intpath);
+        free(parentPath);
+        return 0;
     }
 
-    // check if the last entry is the one we are looking for
-    if (strcmp(currentDirEntry->name, entryName) == 0) {
-        return currentDirEntry;
+    // find the entry in the directory and mark it as deleted
+    while (blockIndex != USHRT_MAX) {
+        currentBlock = &blocks[blockIndex];
+        for (entryIndex = 0; entryIndex < BLOCKSIZE; entryIndex += sizeof(dirEntry)) {
+            dirEntry* currentEntry = (dirEntry*)&currentBlock->data[entryIndex];
+            if (currentEntry == entry) {
+                // hand the blocks used by the file or directory to the orphan list, then cut them off
+                if (!ISPACKED(currentEntry)) {
+                    orphanChain(currentEntry->first_cluster_low, blockIndex, entryIndex / sizeof(dirEntry));
+                }
+                currentEntry->attributes = ATTR_DELETED;  // mark the entry as deleted
+
+                // change the first character of the name to '_'
+                currentEntry->name[0] = '_';
+                currentEntry->name_hash = nameHashByte(currentEntry->name);
+
+                // a packed file's units are given back once nothing points at them
+                if (ISPACKED(currentEntry)) {
+                    freePackUnits(currentEntry);
+                }
+
+                logMessage("Entry \"%s\" marked as deleted\n", intpath);
+
+                // if the entry is the last one, update the previous entry's isLast flag. The deleted slot
+                // (and any deleted ones before it) are then past the end of the directory, free for appends
+                if (currentEntry->isLast == LASTENTRY) {
+                    if (previousEntry != NULL) {
+                        previousEntry->isLast = LASTENTRY;
+                        currentEntry->isLast = NOTLASTENTRY;
+                    }
+                }
+
+                // get rid of the deleted entries once enough of them pile up
+                scheduleDirectoryCompaction(parentDir->first_cluster_low);
+
+                logMessage("Entry \"%s\" removed successfully\n", intpath);
+                free(parentPath);
+                return 0;
+            }
+            if (currentEntry->isLast == LASTENTRY) {
+                isLast = 1;
+                break;
+            }
+            // Update previousEntry only if currentEntry is not deleted
+            if (currentEntry->attributes != ATTR_DELETED) {
+                previousEntry = currentEntry;
+            }
+        }
+        if (isLast) break;
+        blockIndex = FAT[blockIndex];
     }
 
-    return NULL;
+    free(parentPath);
+    fprintf(stderr, "Failed to remove entry \"%s\"\n", intpath);
+    return -1;
 }
 
-void createEmptyFile(char* filename, dirEntry* parent) {
-    unsigned short currentBlockIndex = USHRT_MAX;     // index on the FAT of the current working block
-    unsigned short fileBlockIndex = USHRT_MAX;        // index on the FAT of the file block
-    unsigned short finalDirIndex = USHRT_MAX;         // index of the last entry in the parent directory
-    unsigned short newEntryIndex = USHRT_MAX;         // index of the new entry in the parent directory
-    block* currentBlock = NULL;                       // pointer to the current working block
-    dirEntry* newEntry = NULL;                        // pointer to the new entry
-    dirEntry* previousEntry = NULL;                   // pointer to the previous entry in the parent directory
+void compactDirectory(unsigned short firstBlockIndex) {
+    // packs the live entries of a directory at the front of its blocks and frees the blocks left over
+    // at the end of the chain. The first block keeps . and .. in place, so pointers to a directory's
+    // . entry (like the root) stay valid, but any other pointer into the directory may move
+    unsigned short readBlockIndex = firstBlockIndex;     // index on the FAT of the block being read
+    unsigned short readEntryIndex = 0;                   // index of the entry being read in its block
+    unsigned short writeBlockIndex = firstBlockIndex;    // index on the FAT of the block being written
+    unsigned short writeEntryIndex = 0;                  // index of the entry being written in its block
+    unsigned short lastBlockIndex = firstBlockIndex;     // index on the FAT of the block holding the last entry
+    unsigned short nextBlockIndex = USHRT_MAX;           // first block past the end of the directory
+    dirEntry* entry = NULL;                              // entry being read
+    dirEntry* lastEntry = NULL;                          // last live entry after compaction
+    unsigned int deadSlots = 0;                          // deleted entries and unused slots in trailing blocks
+    int isLastEntry = 0;                                 // flag to indicate the end of the directory was read
+    dirIndexHeader* header = NULL;                       // index of the directory, if it has one
 
     // check if the file system is loaded
     fsLoadedCheck();
 
-    // check if the file already exists
-    if (findEntryInDirectory(parent, filename) != NULL) {
-        fprintf(stderr, "File already exists\n");
+    // make sure the block still holds a directory. it may have been removed since it was scheduled
+    entry = (dirEntry*)&blocks[firstBlockIndex];
+    if (FAT[firstBlockIndex] == 0 || strcmp(entry->name, ".") != 0 || entry->first_cluster_low != firstBlockIndex) {
+        logMessage("Block %d no longer holds a directory, not compacting\n", firstBlockIndex);
         return;
     }
 
-    // check if the filename is too long
-    if (strlen(filename) > MAXFILENAME) {
-        fprintf(stderr, "Filename is too long\n");
+    // indexed directories keep count of their deleted entries. big ones are only worth rewriting once a
+    // good share of them is dead, since the index is rebuilt afterwards
+    header = getDirectoryIndex(entry);
+    if (header != NULL) {
+        if (header->numDeleted < DIRCOMPACTTHRESHOLD || header->numDeleted < header->numEntries / 4) {
+            logMessage("Indexed directory at block %d has %d deleted entries, not compacting\n", firstBlockIndex, header->numDeleted);
+            return;
+        }
+        dropDirectoryIndex(entry);
+    }
+
+    // count the deleted entries up to the end of the directory
+    do {
+        entry = (dirEntry*)&blocks[readBlockIndex].data[readEntryIndex * sizeof(dirEntry)];
+        isLastEntry = entry->isLast == LASTENTRY;
+        if (entry->attributes == ATTR_DELETED) {
+            deadSlots++;
+        }
+        if (++readEntryIndex == DIRENTRIES && !isLastEntry) {
+            readEntryIndex = 0;
+            readBlockIndex = FAT[readBlockIndex];
+        }
+    } while (!isLastEntry && readBlockIndex != USHRT_MAX);
+
+    // blocks past the one holding the last entry are all dead space
+    if (readBlockIndex != USHRT_MAX) {
+        for (nextBlockIndex = FAT[readBlockIndex]; nextBlockIndex != USHRT_MAX; nextBlockIndex = FAT[nextBlockIndex]) {
+            deadSlots += DIRENTRIES;
+        }
+    }
+
+    // check if a rewrite is worth it
+    if (header == NULL && deadSlots < DIRCOMPACTTHRESHOLD) {
+        logMessage("Directory at block %d has %u dead slots, not compacting\n", firstBlockIndex, deadSlots);
         return;
     }
 
-    // reserve a block for the new file
-    fileBlockIndex = findFreeBlock();
-    FAT[fileBlockIndex] = USHRT_MAX;
+    // slide every live entry down over the deleted ones, in directory order
+    readBlockIndex = firstBlockIndex;
+    readEntryIndex = 0;
+    do {
+        entry = (dirEntry*)&blocks[readBlockIndex].data[readEntryIndex * sizeof(dirEntry)];
+        isLastEntry = entry->isLast == LASTENTRY;
 
-    // find the final dir entry in the last block of the parent directory
-    currentBlockIndex = findLastBlockOfParent(parent->first_cluster_low);
-    finalDirIndex = findLastEntryInBlock(currentBlockIndex);
+        if (entry->attributes != ATTR_DELETED) {
+            dirEntry* destination = (dirEntry*)&blocks[writeBlockIndex].data[writeEntryIndex * sizeof(dirEntry)];
+            if (destination != entry) {
+                memcpy(destination, entry, sizeof(dirEntry));
+            }
+            destination->isLast = NOTLASTENTRY;
+            lastEntry = destination;
+            lastBlockIndex = writeBlockIndex;
+
+            // move the write position along. it never passes the read position
+            if (++writeEntryIndex == DIRENTRIES) {
+                writeEntryIndex = 0;
+                writeBlockIndex = FAT[writeBlockIndex];
+            }
+        }
 
-    // get the pointer to the last entry in the parent directory
-    currentBlock = &blocks[currentBlockIndex];
-    if (finalDirIndex == (BLOCKSIZE / sizeof(dirEntry) - 1)) {
-        // no space left in block. last entry is at the end of the block
+        if (++readEntryIndex == DIRENTRIES) {
+            readEntryIndex = 0;
+            readBlockIndex = FAT[readBlockIndex];
+        }
+    } while (!isLastEntry && readBlockIndex != USHRT_MAX);
 
-        // get the pointer to the current last entry in the block
-        previousEntry = (dirEntry*)&blocks[currentBlockIndex].data[finalDirIndex * sizeof(dirEntry)];
+    // mark the new end of the directory and clear the rest of its block
+    lastEntry->isLast = LASTENTRY;
+    bzero(lastEntry + 1, (char*)&blocks[lastBlockIndex + 1] - (char*)(lastEntry + 1));
 
-        // allocate a new block for the parent directory
-        currentBlockIndex = allocateNewBlock(currentBlockIndex);
+    // give the blocks past the end back to the FAT
+    nextBlockIndex = FAT[lastBlockIndex];
+    FAT[lastBlockIndex] = USHRT_MAX;
+    freeBlockChain(nextBlockIndex);
 
-        // get the pointer to the new entry in the new block
-        newEntry = (dirEntry*)&blocks[currentBlockIndex];
-        logMessage("Allocated new block for parent directory at %d\n", currentBlockIndex);
+    // the entries have moved, so index them again
+    if (header != NULL) {
+        buildDirectoryIndex((dirEntry*)&blocks[firstBlockIndex]);
+    }
+
+    logMessage("Compacted directory at block %d, reclaimed %u slots\n", firstBlockIndex, deadSlots);
+}
+
+void scheduleDirectoryCompaction(unsigned short firstBlockIndex) {
+    // queue a directory for compaction. The worker thread picks it up when mounted, otherwise it is
+    // compacted by compactPendingDirectories before the program exits
+    for (int i = 0; i < numPendingCompactions; i++) {
+        if (pendingCompactions[i] == firstBlockIndex) {
+            return;
+        }
     }
-    else {
-        // have space left in block
 
-        // get the index of the new entry in the block
-        newEntryIndex = (finalDirIndex * sizeof(dirEntry)) + sizeof(dirEntry);
+    // if the queue is full, drop it. the next removal in the directory will queue it again
+    if (numPendingCompactions == MAXPENDINGCOMPACTIONS) {
+        logMessage("Compaction queue full, skipping directory at block %d\n", firstBlockIndex);
+        return;
+    }
 
-        // set the pointer to the next space after the last entry
-        newEntry = (dirEntry*)&blocks[currentBlockIndex].data[newEntryIndex];
+    pendingCompactions[numPendingCompactions++] = firstBlockIndex;
+    pthread_cond_signal(&compactionCond);
+}
 
-        // set the pointer to the current last entry in the block
-        previousEntry = (dirEntry*)&blocks[currentBlockIndex].data[finalDirIndex * sizeof(dirEntry)];
+void cancelDirectoryCompaction(unsigned short firstBlockIndex) {
+    // remove a directory from the compaction queue
+    for (int i = 0; i < numPendingCompactions; i++) {
+        if (pendingCompactions[i] == firstBlockIndex) {
+            pendingCompactions[i] = pendingCompactions[--numPendingCompactions];
+            return;
+        }
+    }
+}
 
-        logMessage("Space left in block. Adding file to current block\n");
+void compactPendingDirectories() {
+    // compact everything in the queue right away
+    while (numPendingCompactions > 0) {
+        compactDirectory(pendingCompactions[--numPendingCompactions]);
     }
+}
 
-    // update the current last entry in the block to indicate that it is not the last entry
-    previousEntry->isLast = NOTLASTENTRY;
+void* compactionWorker(void* arg) {
+    // background thread used while mounted. It waits for directories to be queued, and compacts them
+    // while holding fsLock so no FUSE callback is looking at the directory at the same time. Once no
+    // directories are waiting it frees orphaned chains ORPHANBATCH blocks at a time, then removes the
+    // snapshots marked for removal SNAPSHOTBATCH entries at a time, and then punches out the blocks freed
+    // so far, all in one go. With nothing else left it defragments files DEFRAGBATCH blocks at a time, if
+    // asked to, sleeping after each piece so it moves no more than defragRate MB a second
+    (void) arg;
+
+    pthread_mutex_lock(&fsLock);
+    while (compactionWorkerRunning) {
+        if (numPendingCompactions == 0 && numOrphans == 0 && numDeletingSnapshots == 0 && numPendingHoles == 0 &&
+            !(defragOnline && defragPending)) {
+            pthread_cond_wait(&compactionCond, &fsLock);
+            continue;
+        }
 
-    // get the date and time
-    short create_time = 0;
-    char create_time_tenth = 0;
-    short create_date = 0;
-    getDateTime(&create_time, &create_time_tenth, &create_date);
+        if (numPendingCompactions > 0) {
+            compactDirectory(pendingCompactions[--numPendingCompactions]);
+        }
+        else if (numOrphans > 0) {
+            freeOrphanBlocks(ORPHANBATCH);
+        }
+        else if (numDeletingSnapshots > 0) {
+            deleteSnapshots(SNAPSHOTBATCH);
+        }
+        else if (numPendingHoles > 0) {
+            reclaimFreedBlocks();
+        }
+        else {
+            unsigned int numMoved = defragDirectory((dirEntry*)&blocks[rootBlock], DEFRAGBATCH);  // blocks moved
 
-    // calculate the cluster number of the new file
-    short clusterHigh = (fileBlockIndex >> 16) & 0xFFFF;
-    short clusterLow = fileBlockIndex & 0xFFFF;
+            // a pass over the whole tree that moved nothing means there's nothing left to do until files are written
+            if (numMoved == 0) {
+                defragPending = 0;
+            }
+            else if (defragRate > 0) {
+                // a MB a second is a byte a microsecond
+                pthread_mutex_unlock(&fsLock);
+                usleep((useconds_t)numMoved * BLOCKSIZE / defragRate);
+                pthread_mutex_lock(&fsLock);
+                continue;
+            }
+        }
 
-     // initialize the new file entry
-    setDirEntry(newEntry, filename, ATTR_ARCHIVE,
-                create_time_tenth, create_time, create_date,
-                create_date, clusterHigh, create_time,
-                create_date, clusterLow, 0, LASTENTRY);
+        // let waiting callbacks in between pieces of work
+        pthread_mutex_unlock(&fsLock);
+        pthread_mutex_lock(&fsLock);
+    }
+    pthread_mutex_unlock(&fsLock);
 
-    logMessage("Added file entry for \"%s\" in directory \"%s\" at block %d\n", filename, parent->name, currentBlockIndex);
+    return NULL;
 }
 
-void _addFile(char* sourceFilename, char* intpath, dirEntry* parentDir) {
-    unsigned int fileSize = 0;                        // size of the file
-    unsigned short currentBlockIndex = USHRT_MAX;     // index on the FAT of the current working block
-    unsigned short fileBlockIndex = USHRT_MAX;        // index on the FAT of the file block
-    unsigned short tempBlock = USHRT_MAX;             // temporary index on the FAT
-    unsigned short finalDirIndex = USHRT_MAX;         // index of the last entry in the parent directory
-    unsigned short newEntryIndex = USHRT_MAX;         // index of the new entry in the parent directory
-    unsigned short numBlocksToAllocate = 0;           // number of blocks to allocate for the file
-    char* filename = malloc(100);                     // name of the file
-    block* currentBlock = NULL;                       // pointer to the current working block
-    dirEntry* currentDir = parentDir;                 // start from the parent directory
-    dirEntry* newFileEntry = NULL;                    // pointer to the new file entry
-    dirEntry* lastEntry = NULL;                       // pointer to the last entry in the parent directory
-    FILE* fileContents = NULL;                        // pointer to the file contents
+int orphanOwnerHoldsChain(orphan* record) {
+    // checks if whatever the chain was detached from still points at it, which means the program stopped
+    // between recording the orphan and detaching it
+    if (record->ownerSlot == ORPHANFATLINK) {
+        return *chainLink(record->ownerBlock) == record->head;
+    }
 
-    // check if the file system is loaded
-    fsLoadedCheck();
+    dirEntry* owner = (dirEntry*)&blocks[record->ownerBlock].data[record->ownerSlot * sizeof(dirEntry)];
+    return owner->attributes != ATTR_DELETED && (unsigned short)owner->first_cluster_low == record->head;
+}
 
-    // get the filename from the source path
-    strcpy(filename, basename(sourceFilename));
+void orphanChain(unsigned short firstBlockIndex, unsigned short ownerBlock, unsigned short ownerSlot) {
+    // record a chain of blocks that is about to be detached from its file, so the caller only has to cut
+    // one link and the blocks are freed later. ownerBlock and ownerSlot say where the link is, the caller
+    // cuts it right after this returns
+    orphan* record = NULL;                  // free slot in the superblock
 
-    // check if the name is too long
-    if (strlen(filename) > MAXFILENAME) {
-        fprintf(stderr, "File name is too long, cannot add file\n");
-        exit(1);
+    if (firstBlockIndex == USHRT_MAX) {
+        return;
     }
 
-    // check if the file already exists
-    if (findEntryInDirectory(parentDir, filename) != NULL) {
-        fprintf(stderr, "File, %s, already exists, cannot add file\n", filename);
-        exit(1);
+    // with every slot taken, free what is waiting now. the caller holds fsLock if anyone else could be looking
+    if (numOrphans == MAXORPHANS) {
+        logMessage("Orphan list full, freeing it now\n");
+        freeOrphanBlocks(UINT_MAX);
     }
 
-    // load reference to the file
-    fileContents = fopen(sourceFilename, "r");
-
-    // check if the file was opened
-    if (fileContents == NULL) {
-        fprintf(stderr, "Error opening file, cannot add file\n");
-        exit(1);
+    for (int i = 0; i < MAXORPHANS; i++) {
+        if (sb->orphans[i].head == 0) {
+            record = &sb->orphans[i];
+            break;
+        }
     }
 
-    // get the file's size
-    fseek(fileContents, 0, SEEK_END);
-    fileSize = ftell(fileContents);
-    fseek(fileContents, 0, SEEK_SET);
+    // fill the slot in before it goes live, so a half written record is never read back
+    record->ownerBlock = ownerBlock;
+    record->ownerSlot = ownerSlot;
+    record->lastFreed = 0;
+    ORDERSTORES();
+    record->head = firstBlockIndex;
+    ORDERSTORES();
+
+    numOrphans++;
+    pthread_cond_signal(&compactionCond);
+    logMessage("Orphaned chain at block %d\n", firstBlockIndex);
+}
 
-    logMessage("Opened \"%s\" with size %d\n", filename, fileSize);
+unsigned int freeOrphanBlocks(unsigned int maxBlocks) {
+    // free up to maxBlocks blocks from the orphan list, returning how many were freed. A block is only
+    // freed after the record has moved past it, and the record remembers it until the next one, so the
+    // list can be picked up again wherever the program stops
+    unsigned int numFreed = 0;              // number of blocks freed so far
+    unsigned short runStart = 0;            // first block of the run of adjacent blocks being freed
+    unsigned int runLength = 0;             // number of blocks in the run
 
-    // reserve space in the FAT for the file
-    if (fileSize % BLOCKSIZE == 0) {
-        numBlocksToAllocate = fileSize / BLOCKSIZE;
-    }
-    else {
-        numBlocksToAllocate = fileSize / BLOCKSIZE + 1;
-    }
+    for (int i = 0; i < MAXORPHANS && numOrphans > 0 && numFreed < maxBlocks; i++) {
+        orphan* record = &sb->orphans[i];
 
-    // allocate the blocks for the file
-    fileBlockIndex = findFreeBlock();
-    FAT[fileBlockIndex] = USHRT_MAX;
+        if (record->head == 0) {
+            continue;
+        }
+
+        while (record->head != USHRT_MAX && numFreed < maxBlocks) {
+            unsigned short blockIndex = record->head;   // block being freed
+
+            record->lastFreed = blockIndex;
+            ORDERSTORES();
+            record->head = *chainLink(blockIndex);
+            ORDERSTORES();
 
-    tempBlock = fileBlockIndex;
-    for (int i = 0; i < numBlocksToAllocate - 1; i++) {
-        logMessage("\t%d", tempBlock);
-        unsigned short newBlock = findFreeBlock();
-        FAT[tempBlock] = newBlock;
-        FAT[newBlock] = USHRT_MAX;
-        tempBlock = newBlock;
+            // holes, references and blocks still shared have no blocks to hand on
+            if (!releaseLink(blockIndex)) {
+                continue;
+            }
+
+            // hand the freed blocks on a run at a time, so they can be punched out of the image
+            if (runLength > 0 && blockIndex != runStart + runLength) {
+                queueFreedBlocks(runStart, runLength);
+                runLength = 0;
+            }
+            if (runLength == 0) {
+                runStart = blockIndex;
+            }
+            runLength++;
+            numFreed++;
+        }
 
-        // every 5 blocks, print a newline
-        if ((i + 1) % 5 == 0) {
-            logMessage("\n");
+        // the whole chain is free, give the slot back
+        if (record->head == USHRT_MAX) {
+            record->head = 0;
+            numOrphans--;
         }
     }
-    logMessage("\t%d\n", tempBlock);
+    queueFreedBlocks(runStart, runLength);
 
-    dirEntry* previousEntry = NULL;
-    currentBlockIndex = findLastBlockOfParent(parentDir->first_cluster_low);
+    if (numFreed > 0) {
+        logMessage("Freed %d orphaned blocks\n", numFreed);
+    }
 
-    // find the final dir entry in the last block of the parent directory
-    finalDirIndex = findLastEntryInBlock(currentBlockIndex);
+    return numFreed;
+}
 
-    // check if there is space in the parent directory
-    if (finalDirIndex == USHRT_MAX) {
-        fprintf(stderr, "No space left in parent directory, cannot add directory\n");
-        exit(1);
-    }
+void recoverOrphans() {
+    // pick the orphan list of a freshly loaded image back up, undoing whatever a stopped program left half
+    // done. The blocks themselves are freed with the rest of the deferred work
+    numOrphans = 0;
 
-    // get the pointer to the last entry in the block
-    if (finalDirIndex == (BLOCKSIZE / sizeof(dirEntry) - 1)) {
-        // no space left in block. last entry is at the end of the block
+    for (int i = 0; i < MAXORPHANS; i++) {
+        orphan* record = &sb->orphans[i];
 
-        // get the pointer to the current last entry in the block
-        previousEntry = (dirEntry*)&blocks[currentBlockIndex].data[finalDirIndex * sizeof(dirEntry)];
+        if (record->head == 0) {
+            continue;
+        }
 
-        // allocate a new block for the parent directory
-        currentBlockIndex = allocateNewBlock(currentBlockIndex);
+        // the last block freed may still be allocated and linked to the head. nothing else can link to
+        // the head, since it hasn't been freed yet
+        if (record->lastFreed != 0 && chainSpan(record->lastFreed) != 0 && *chainLink(record->lastFreed) == record->head) {
+            releaseLink(record->lastFreed);
+        }
 
-        // get the pointer to the new entry in the new block
-        newFileEntry = (dirEntry*)&blocks[currentBlockIndex];
+        // recorded, but never detached. the file still owns the blocks
+        if (record->lastFreed == 0 && record->head != USHRT_MAX && orphanOwnerHoldsChain(record)) {
+            logMessage("Dropping orphan record for chain at block %d, it was never detached\n", record->head);
+            record->head = 0;
+            continue;
+        }
 
-        logMessage("Allocated new block for parent directory at %d\n", currentBlockIndex);
-    }
-    else {
-        // have space left in block
+        // stopped after freeing the last block
+        if (record->head == USHRT_MAX) {
+            record->head = 0;
+            continue;
+        }
 
-        // get the index of the new entry in the block
-        newEntryIndex = (finalDirIndex * sizeof(dirEntry)) + sizeof(dirEntry);
+        numOrphans++;
+    }
 
-        // set the pointer to the next space after the last entry
-        newFileEntry = (dirEntry*)&blocks[currentBlockIndex].data[newEntryIndex];
+    if (numOrphans > 0) {
+        logMessage("Found %d orphaned chains to free\n", numOrphans);
+    }
+}
 
-        // set the pointer to the current last entry in the block
-        previousEntry = (dirEntry*)&blocks[currentBlockIndex].data[finalDirIndex * sizeof(dirEntry)];
+void queueFreedBlocks(unsigned short firstBlockIndex, unsigned int numBlocks) {
+    // remember a run of blocks that was just freed, so its part of the image can be punched out. The
+    // worker picks it up when mounted, otherwise reclaimFreedBlocks does before the program exits
+    if (!punchHoles || numBlocks == 0) {
+        return;
+    }
 
-        logMessage("Space left in block. Adding directory to current block\n");
+    // grow the last run if this one carries straight on from it
+    if (numPendingHoles > 0 && pendingHoles[numPendingHoles - 1].start + pendingHoles[numPendingHoles - 1].count == firstBlockIndex) {
+        pendingHoles[numPendingHoles - 1].count += numBlocks;
+        return;
     }
 
-    // update the current last entry in the block to indicate that it is not the last entry
-    previousEntry->isLast = NOTLASTENTRY;
+    // if the queue is full, empty it now. the caller holds fsLock if anyone else could be looking
+    if (numPendingHoles == MAXPENDINGHOLES) {
+        reclaimFreedBlocks();
+    }
 
-    // get the time and date of creation
-    short create_time = 0;
-    char create_time_tenth = 0;
-    short create_date = 0;
-    getDateTime(&create_time, &create_time_tenth, &create_date);
+    pendingHoles[numPendingHoles].start = firstBlockIndex;
+    pendingHoles[numPendingHoles].count = numBlocks;
+    numPendingHoles++;
+    pthread_cond_signal(&compactionCond);
+}
 
-    // calculate the cluster number of the new file
-    short clusterHigh = (fileBlockIndex >> 16) & 0xFFFF;
-    short clusterLow = fileBlockIndex & 0xFFFF;
+int compareBlockRanges(const void* a, const void* b) {
+    // orders runs of blocks by where they start
+    return (int)((const blockRange*)a)->start - (int)((const blockRange*)b)->start;
+}
 
-    // initialize the new file entry
-    setDirEntry(newFileEntry, filename, ATTR_ARCHIVE,
-                create_time_tenth, create_time, create_date,
-                create_date, clusterHigh, create_time,
-                create_date, clusterLow, fileSize, LASTENTRY);
+unsigned int punchFreeBlocks(unsigned int firstBlockIndex, unsigned int endBlockIndex) {
+    unsigned int numPunched = 0;            // number of blocks punched out
+    unsigned int block = firstBlockIndex;   // block being looked at
 
-    logMessage("Added file entry for \"%s\" in directory \"%s\" at block %d\n", filename, parentDir->name, currentBlockIndex);
+    // punch out every run of free blocks in the range. blocks can be handed out again between being
+    // freed and getting here, so the FAT has the final say
+    while (block < endBlockIndex) {
+        unsigned int runStart = block + findZeroEntry(&FAT[block], endBlockIndex - block);   // first free block
+        unsigned int runEnd = runStart;                                                     // block after the run
 
-    // write the file contents to the file block
-    fileBlockIndex = newFileEntry->first_cluster_low;
+        if (runStart >= endBlockIndex) {
+            break;
+        }
+        while (runEnd < endBlockIndex && FAT[runEnd] == 0) {
+            runEnd++;
+        }
 
-    // read the file contents
-    char* buffer = malloc(fileSize);
-    int bytesLeft = fileSize;
+        // the kernel zeroes the parts of pages shared with blocks in use, and frees whole pages
+        if (fallocate(fsfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (char*)&blocks[runStart] - fs,
+                      (off_t)(runEnd - runStart) * BLOCKSIZE) == -1) {
+            fprintf(stderr, "Could not punch holes in the image (%s), leaving freed blocks in place\n", strerror(errno));
+            punchHoles = 0;
+            return numPunched;
+        }
+        logMessage("Punched out blocks %d-%d\n", runStart, runEnd - 1);
 
-    // Read the file contents and write them to the blocks
-    fread(buffer, 1, fileSize, fileContents);
+        numPunched += runEnd - runStart;
+        block = runEnd;
+    }
 
-    logMessage("Writing to %d blocks:\n", numBlocksToAllocate);
+    return numPunched;
+}
 
-    int offset = 0;
-    while (bytesLeft > 0) {
-        int bytesToWrite = (bytesLeft > BLOCKSIZE) ? BLOCKSIZE : bytesLeft;
-        logMessage("\tBytes to write: %d\n", bytesToWrite);
-        memcpy(blocks[fileBlockIndex].data, buffer + offset, bytesToWrite);
-        logMessage("\tCopied %d bytes to block %d\n", bytesToWrite, fileBlockIndex);
-        bytesLeft -= bytesToWrite;
-        logMessage("\tBytes left: %d\n", bytesLeft);
-        offset += bytesToWrite;
-        logMessage("\tOffset: %d\n", offset);
+void reclaimFreedBlocks() {
+    int numMerged = 0;                      // number of runs left after merging
+    int i = 0;                              // loop counter
 
-        // logMessage("\tWrote %d bytes to block %d\n", bytesToWrite, fileBlockIndex);
+    // a transaction's image only reaches the file when it is committed, and holes would go straight in
+    if (privateMapping || fsfd == -1) {
+        numPendingHoles = 0;
+        return;
+    }
 
-        // Move to the next block if necessary
-        if (bytesLeft > 0) {
-            fileBlockIndex = FAT[fileBlockIndex];
-            logMessage("\tNext block: %d\n\n", fileBlockIndex);
+    // sort the runs and merge the ones that touch or overlap, so each stretch is punched once
+    qsort(pendingHoles, numPendingHoles, sizeof(blockRange), compareBlockRanges);
+    for (i = 0; i < numPendingHoles; i++) {
+        if (numMerged > 0 && pendingHoles[i].start <= pendingHoles[numMerged - 1].start + pendingHoles[numMerged - 1].count) {
+            unsigned int end = pendingHoles[i].start + pendingHoles[i].count;
+            if (end > pendingHoles[numMerged - 1].start + pendingHoles[numMerged - 1].count) {
+                pendingHoles[numMerged - 1].count = end - pendingHoles[numMerged - 1].start;
+            }
+        }
+        else {
+            pendingHoles[numMerged++] = pendingHoles[i];
         }
     }
 
-    // free the buffer
-    free(buffer);
+    for (i = 0; i < numMerged && punchHoles; i++) {
+        punchFreeBlocks(pendingHoles[i].start, pendingHoles[i].start + pendingHoles[i].count);
+    }
+    numPendingHoles = 0;
+}
+
+void trimfs() {
+    struct stat before, after;              // space the image took before and after
+    unsigned int numPunched = 0;            // number of blocks punched out
+
+    // check if the file system is loaded
+    fsLoadedCheck();
+
+    if (privateMapping) {
+        fprintf(stderr, "Cannot trim inside a transaction\n");
+        return;
+    }
+
+    // punch out every free block in the image, like fstrim does for a disk
+    fstat(fsfd, &before);
+    punchHoles = 1;
+    numPunched = punchFreeBlocks(0, MAXBLOCKS);
+    fstat(fsfd, &after);
 
-    // close the file
-    fclose(fileContents);
+    printf("Trimmed %u free blocks, the image now takes %lld KB on disk (was %lld KB)\n",
+           numPunched, (long long)after.st_blocks / 2, (long long)before.st_blocks / 2);
+}
 
-    // log that the file was added
-    logMessage("File \"%s\" added successfully\n", sourceFilename);
+unsigned short compactedLink(unsigned short* map, unsigned short link) {
+    // where a link points once the blocks have moved. holes and the ends of chains stay as they are
+    return link < MAXBLOCKS ? map[link] : link;
 }
 
-dirEntry* findParentFromPath(char* path, dirEntry* parentDir) {
-    char* token;                            // token for strtok
-    char filePath[MAXPATH];                 // path
-    dirEntry* currentDir = parentDir;       // start from the parent directory
-    dirEntry* foundEntry = NULL;            // pointer to the found entry
+void collectMetaBlocks(dirEntry* dir, compactJob* job) {
+    // add the blocks of dir and of its index, and those of the directories under it, to the ones whose
+    // links the workers rewrite
+    dirEntry* currentEntry = (dirEntry*)&blocks[dir->first_cluster_low];   // entry being looked at
+    dirIndexHeader* header = getDirectoryIndex(dir);                        // its index, if it has one
 
-    // check if the file system is loaded
-    fsLoadedCheck();
+    for (unsigned short link = dir->first_cluster_low; link != USHRT_MAX; link = FAT[link]) {
+        job->metaBlocks[job->numMetaBlocks] = link;
+        job->metaKinds[job->numMetaBlocks++] = COMPACTDIRECTORY;
+    }
+    if (header != NULL) {
+        unsigned short headerBlock = ((dirEntry*)&blocks[dir->first_cluster_low])->size;  // start of the index chain
 
-    // copy the directory path to a local variable
-    strcpy(filePath, path);
+        for (unsigned short link = headerBlock; link != USHRT_MAX; link = FAT[link]) {
+            unsigned char kind = link == headerBlock ? COMPACTINDEXHEADER : COMPACTINDEXBUCKET;   // what the block holds
 
-    // tokenize the path and find the directory to add the file to
-    token = strtok(filePath, "/");
-    while (token != NULL) {
-        dirEntry* foundEntry = findEntryInDirectory(currentDir, token);
-        if (foundEntry == NULL) {
-            fprintf(stderr, "Directory, %s, does not exist\n", token);
-            return NULL;
+            for (int i = 0; i < MAXINDEXTABLEBLOCKS && kind == COMPACTINDEXBUCKET; i++) {
+                if (header->tableBlocks[i] == link) {
+                    kind = COMPACTINDEXTABLE;
+                }
+            }
+            job->metaBlocks[job->numMetaBlocks] = link;
+            job->metaKinds[job->numMetaBlocks++] = kind;
         }
-        // move to the next directory in the path
-        currentDir = foundEntry;
-        token = strtok(NULL, "/");
     }
 
-    return currentDir;
+    while (currentEntry != NULL) {
+        char name[MAXFILENAME + 1] = {0};   // name of the entry, null terminated
+
+        strncpy(name, currentEntry->name, MAXFILENAME);
+
+        // go into subdirectories, but not back up through . and ..
+        if (name[0] != 0 && name[0] != 0x5F && currentEntry->attributes != ATTR_DELETED &&
+            (currentEntry->attributes & ATTR_DIRECTORY) && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+            collectMetaBlocks(currentEntry, job);
+        }
+
+        currentEntry = getNextEntry(currentEntry, dir);
+    }
 }
 
-void extract_path(const char *filepath, char *path) {
-    const char *last_slash = strrchr(filepath, '/');
-    if (last_slash != NULL) {
-        size_t path_length = last_slash - filepath + 1;
-        strncpy(path, filepath, path_length);
-        path[path_length] = '\0';  // null-terminate the string
-    } else {
-        // no '/' found, assuming the entire input is the file name
-        strcpy(path, "");
+void startCompactJob(compactJob* job, unsigned short* map) {
+    // set up a rewrite of the links to the blocks map moves, finding the blocks of every directory and
+    // index, live and in snapshots, while the links to them still point where they are
+    static unsigned short metaBlocks[MAXBLOCKS];        // blocks of directories and indexes
+    static unsigned char metaKinds[MAXBLOCKS];          // what each of them holds
+
+    memset(job, 0, sizeof(compactJob));
+    job->map = map;
+    job->metaBlocks = metaBlocks;
+    job->metaKinds = metaKinds;
+    collectMetaBlocks((dirEntry*)&blocks[0], job);
+    for (int i = 0; i < MAXSNAPSHOTS; i++) {
+        if (snapshots[i].state == SNAPSHOTLIVE) {
+            collectMetaBlocks((dirEntry*)&blocks[snapshots[i].root], job);
+        }
     }
 }
 
-void extract_filename(const char *filepath, char *filename) {
-    const char *last_slash = strrchr(filepath, '/');
-    if (last_slash != NULL) {
-        strcpy(filename, last_slash + 1);
-    } else {
-        // No '/' found, assuming the entire input is the file name
-        strcpy(filename, filepath);
+void rewriteLinks(compactJob* job, unsigned int numBlocks) {
+    // point every link at where its block went, on as many threads as there are CPUs. Only the FAT
+    // entries of the first numBlocks blocks are looked at
+    job->numFATRanges = (numBlocks + COMPACTRANGE - 1) / COMPACTRANGE;
+    job->numHoleRanges = (MAXHOLES + COMPACTRANGE - 1) / COMPACTRANGE;
+    runWorkerPool(compactWorker, job, job->numFATRanges + job->numHoleRanges +
+                  (job->numMetaBlocks + COMPACTRANGE - 1) / COMPACTRANGE);
+    for (int i = 0; i < MAXSNAPSHOTS; i++) {
+        if (snapshots[i].state == SNAPSHOTLIVE) {
+            snapshots[i].root = job->map[snapshots[i].root];
+        }
     }
+
+    // chunks are cached by the block they start at
+    chunkGeneration++;
 }
 
-void addFile(char* filename, char* intpath, dirEntry* parentDir) {
-    char* token;                            // token for strtok
-    char path[MAXPATH];                     // max path length
-    dirEntry* currentDir = parentDir;       // start from the parent directory
+void* compactWorker(void* arg) {
+    compactJob* job = (compactJob*)arg;     // the compaction being run
+    unsigned short* map = job->map;         // where each block in use went
 
-    // check if the file system is loaded
-    fsLoadedCheck();
+    // take ranges until there are none left, rewriting the links in each to where their blocks went. The
+    // ranges don't overlap, so nothing needs a lock
+    while (1) {
+        unsigned int range = __atomic_fetch_add(&job->nextRange, 1, __ATOMIC_RELAXED);    // range to rewrite
 
-    // copy the directory path to a local variable
-    strcpy(path, intpath);
+        if (range < job->numFATRanges) {
+            for (unsigned int i = range * COMPACTRANGE; i < (range + 1) * COMPACTRANGE && i < MAXBLOCKS; i++) {
+                if (FAT[i] != 0) {
+                    FAT[i] = compactedLink(map, FAT[i]);
+                }
+            }
+            continue;
+        }
+        range -= job->numFATRanges;
 
-    // copy the filename to a local variable
-    char* file = malloc(strlen(filename));
+        if (range < job->numHoleRanges) {
+            for (unsigned int i = range * COMPACTRANGE; i < (range + 1) * COMPACTRANGE && i < MAXHOLES; i++) {
+                // freed slots are left alone
+                if (holes[i].length == 0) {
+                    continue;
+                }
+                holes[i].next = compactedLink(map, holes[i].next);
+                if (holes[i].compressedSize & REFERENCE) {
+                    holes[i].compressedSize = REFERENCE | map[holes[i].compressedSize & ~REFERENCE];
+                }
+            }
+            continue;
+        }
+        range -= job->numHoleRanges;
 
-    // tokenize the path and find the directory to add the file to
-    token = strtok(path, "/");
-    while (token != NULL) {
-        dirEntry* foundEntry = findEntryInDirectory(currentDir, token);
-        if (foundEntry == NULL) {
-            fprintf(stderr, "Directory, %s, does not exist, cannot add file\n", token);
-            return;
+        if (range * COMPACTRANGE >= job->numMetaBlocks) {
+            break;
         }
-        // move to the next directory in the path
-        currentDir = foundEntry;
-        token = strtok(NULL, "/");
-    }
+        for (unsigned int i = range * COMPACTRANGE; i < (range + 1) * COMPACTRANGE && i < job->numMetaBlocks; i++) {
+            block* blk = &blocks[map[job->metaBlocks[i]]];      // the block, where it is now
 
-    // check if the file name is too long
-    if (strlen(basename(filename)) > MAXFILENAME) {
-        fprintf(stderr, "File name is too long, cannot add file\n");
-        return;
-    }
+            if (job->metaKinds[i] == COMPACTDIRECTORY) {
+                for (unsigned int j = 0; j < DIRENTRIES; j++) {
+                    dirEntry* entry = (dirEntry*)&blk->data[j * sizeof(dirEntry)];
 
-    // check if the file already exists
-    if (findEntryInDirectory(currentDir, filename) != NULL) {
-        fprintf(stderr, "File, %s, already exists, cannot add file\n", filename);
-        exit(1);
-    }
+                    if (entry->name[0] != 0 && entry->attributes != ATTR_DELETED) {
+                        entry->first_cluster_low = compactedLink(map, entry->first_cluster_low);
 
-    // add the file to the directory
-    logMessage("Adding file \"%s\" to %s\n", filename, intpath);
-    _addFile(filename, intpath, currentDir);
+                        // the . entry of an indexed directory holds where the index starts
+                        if (j == 0 && strcmp(entry->name, ".") == 0 && entry->size != 0) {
+                            entry->size = compactedLink(map, entry->size);
+                        }
+                    }
+                    if (entry->isLast == LASTENTRY) {
+                        break;
+                    }
+                }
+            }
+            else if (job->metaKinds[i] == COMPACTINDEXHEADER) {
+                dirIndexHeader* header = (dirIndexHeader*)blk;
+
+                header->lastIndexBlock = map[header->lastIndexBlock];
+                header->lastDirBlock = map[header->lastDirBlock];
+                for (int k = 0; k < MAXINDEXTABLEBLOCKS; k++) {
+                    if (header->tableBlocks[k] != 0) {
+                        header->tableBlocks[k] = map[header->tableBlocks[k]];
+                    }
+                }
+                for (int k = 0; k < header->numFreeSlots; k++) {
+                    header->freeSlots[k].block = map[header->freeSlots[k].block];
+                }
+            }
+            else if (job->metaKinds[i] == COMPACTINDEXTABLE) {
+                unsigned short* table = (unsigned short*)blk;
 
-    // free the filename
-    free(file);
+                for (unsigned int k = 0; k < TABLEENTRIES; k++) {
+                    if (table[k] != 0) {
+                        table[k] = map[table[k]];
+                    }
+                }
+            }
+            else {
+                dirIndexBucket* bucket = (dirIndexBucket*)blk;
+
+                for (unsigned int k = 0; k < bucket->count; k++) {
+                    bucket->refs[k].block = map[bucket->refs[k].block];
+                }
+            }
+        }
+    }
+
+    return NULL;
 }
 
-dirEntry* findEntryFromPath(char* intpath, dirEntry* parentDir) {
-    char* token;                            // token for strtok
-    char path[MAXPATH];                     // max path length
-    char filename[MAXFILENAME];             // name of the file to retrieve
-    dirEntry* currentDir = parentDir;       // start from the parent directory
-    dirEntry* file;                         // file to find
+int compactfs(char* fsname) {
+    // move every block in use to the front of the image, keeping them in order, and write the image out
+    // again without the free blocks after them. The blocks move in runs, as few copies as there are gaps
+    // between them, and the links to them are rewritten on as many threads as there are CPUs. returns 0,
+    // or -1 if the image can't be compacted now
+    static unsigned short map[MAXBLOCKS];               // where each block in use goes
+    compactJob job;                                     // the rewriting, shared with the workers
+    unsigned int numUsed = 0;                           // blocks in use, which end up at the front
+    unsigned int numMoved = 0;                          // blocks that had to move
+    unsigned int numCopies = 0;                         // runs they were copied in
+    struct stat before, after;                          // space the image took before and after
+    struct timespec start, moved, end;                  // when the steps started and finished
 
     // check if the file system is loaded
     fsLoadedCheck();
 
-    // copy the directory path to a local variable
-    logMessage("\tfindEntryFromPath: copying path, %s\n", intpath);
-    strcpy(path, intpath);
-
-    // check if the path is the root
-    if (strcmp(path, "/") == 0) {
-        dirEntry* root = (dirEntry*)&blocks[0];
-        return root;
+    if (privateMapping) {
+        fprintf(stderr, "Cannot compact inside a transaction\n");
+        return -1;
+    }
+    if (readOnly) {
+        fprintf(stderr, "Cannot compact a snapshot\n");
+        return -1;
+    }
+
+    // finish the deferred work first, so everything that isn't free is in use and nothing is queued
+    compactPendingDirectories();
+    deleteSnapshots(UINT_MAX);
+    freeOrphanBlocks(UINT_MAX);
+    reclaimFreedBlocks();
+    if (numOrphans > 0) {
+        fprintf(stderr, "Cannot compact while chains are waiting to be freed\n");
+        return -1;
+    }
+
+    // work on a private mapping of the image, which only reaches the file once it's all done
+    msync(fs, FSSIZE, MS_SYNC);
+    fstat(fsfd, &before);
+    munmap(fs, FSSIZE);
+    fs = NULL;
+    privateMapping = 1;
+    loadfs(fsname);
+    privateMapping = 0;
+
+    // the blocks past the end of the volume stay reserved where they are
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned int i = 0; i < volumeBlocks; i++) {
+        if (FAT[i] != 0) {
+            map[i] = numUsed++;
+        }
     }
 
-    // get the filename
-    logMessage("\tfindEntryFromPath: extracting filename from path, %s\n", intpath);
-    extract_filename(intpath, filename);
-    logMessage("\tfindEntryFromPath: extracted filename, %s\n", filename);
+    // find the directories and indexes while the links to them still point where they are
+    startCompactJob(&job, map);
 
-    if (strcmp(filename, "") == 0) {
-        fprintf(stderr, "No filename provided\n");
-        return NULL;
-    }
+    // slide each run of blocks in use down over the gap before it, with its FAT entries, checksums and
+    // reference counts. Runs only ever move down, so going from the front overwrites nothing still needed
+    for (unsigned int runStart = 0; runStart < volumeBlocks; ) {
+        unsigned int runEnd = runStart;     // block after the run
 
-    // tokenize the path and find the directory to extract the file from
-    logMessage("Finding directory entry for file \"%s\" in %s\n", filename, intpath);
-    token = strtok(path, "/");
-    while (token != NULL) {
-        dirEntry* foundEntry = findEntryInDirectory(currentDir, token);
-        if (foundEntry == NULL) {
-            logMessage("Directory, %s, does not exist\n", token);
-            return NULL;
+        if (FAT[runStart] == 0) {
+            runStart++;
+            continue;
         }
-        // check if we've found our file
-        if (strcmp(token, filename) == 0) {
-            file = foundEntry;
-            break;
+        while (runEnd < volumeBlocks && FAT[runEnd] != 0) {
+            runEnd++;
         }
-        // move to the next directory in the path
-        currentDir = foundEntry;
-        token = strtok(NULL, "/");
-    }
-
-    // check if the file exists
-    if (file == NULL) {
-        logMessage("Directory, %s, does not exist\n", token);
-        return NULL;
-    }
+        if (map[runStart] != runStart) {
+            unsigned int dest = map[runStart];          // where the run goes
+            unsigned int length = runEnd - runStart;    // blocks in it
+
+            memmove(&blocks[dest], &blocks[runStart], (size_t)length * BLOCKSIZE);
+            memmove(&FAT[dest], &FAT[runStart], length * sizeof(unsigned short));
+            memmove(&checksums[dest], &checksums[runStart], length * sizeof(unsigned int));
+            memmove(&refcounts[dest], &refcounts[runStart], length);
+            numMoved += length;
+            numCopies++;
+        }
+        runStart = runEnd;
+    }
+    memset(&FAT[numUsed], 0, (volumeBlocks - numUsed) * sizeof(unsigned short));
+    memset(&checksums[numUsed], 0, (volumeBlocks - numUsed) * sizeof(unsigned int));
+    memset(&refcounts[numUsed], 0, volumeBlocks - numUsed);
+    clock_gettime(CLOCK_MONOTONIC, &moved);
+
+    // then point every link at where its block went
+    rewriteLinks(&job, numUsed);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // the blocks after the ones in use are free, and left out of the new image
+    writeImageFile(fsname, (char*)&blocks[numUsed] - fs, HOLETABLEOFFSET);
+    munmap(fs, FSSIZE);
+    fs = NULL;
+    loadfs(fsname);
+    fstat(fsfd, &after);
+
+    printf("Moved %u of %u blocks in use (%.1f MB) to the front in %u copies, %.3f s, and rewrote the links to them in %.3f s\n",
+           numMoved, numUsed, numMoved * (double)BLOCKSIZE / 1e6, numCopies,
+           (moved.tv_sec - start.tv_sec) + (moved.tv_nsec - start.tv_nsec) / 1e9,
+           (end.tv_sec - moved.tv_sec) + (end.tv_nsec - moved.tv_nsec) / 1e9);
+    printf("The image now takes %lld KB on disk (was %lld KB), and blocks from %u on are free\n",
+           (long long)after.st_blocks / 2, (long long)before.st_blocks / 2, numUsed);
 
-    return file;
+    return 0;
 }
 
-void writeBlockToFile(FILE* f, unsigned short block, unsigned short numBytes) {
-    unsigned char* buffer = malloc(BLOCKSIZE);    // buffer to read the block into
-    struct block* b = NULL;                       // block to read
+unsigned int parseVolumeSize(char* text) {
+    // the number of blocks in a volume of the size given, in bytes or with a K, M or G after it, rounded up
+    // to whole blocks. returns 0 if it isn't a size
+    char* end = NULL;                                   // first character after the number
+    unsigned long long size = strtoull(text, &end, 10);  // size in bytes
+    unsigned int shift = 0;                             // bits the unit shifts the number by
 
-    // check if the filesystem is loaded
-    fsLoadedCheck();
+    if (end == text) {
+        return 0;
+    }
+    if (*end == 'K' || *end == 'k') {
+        shift = 10;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        shift = 20;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        shift = 30;
+        end++;
+    }
+    // the number is checked before it's shifted, so a huge one can't wrap around to a size that fits
+    if (*end != '\0' || size > ((unsigned long long)MAXBLOCKS * BLOCKSIZE) >> shift) {
+        return 0;
+    }
+    size <<= shift;
+    return (size + BLOCKSIZE - 1) / BLOCKSIZE;
+}
 
-    // set the block pointer to the block to read
-    b = &blocks[block];
+int resizefs(unsigned int numBlocks) {
+    // make the volume numBlocks blocks long, while mounted or not. Growing hands the reserved blocks after
+    // the end back to the FAT. Shrinking copies the blocks in use past the new end into free ones before
+    // it, points every link at the copies, then reserves everything past the end and punches it out of the
+    // image. Only the FAT entries of the blocks that move and the ones past the end change, so the free
+    // space is never recounted. returns 0, -EINVAL if numBlocks is out of range, -EROFS for a snapshot,
+    // -EBUSY if chains are waiting to be freed, or -ENOSPC if the blocks in use don't fit
+    static unsigned short map[MAXBLOCKS];               // where each block that moves goes
+    compactJob job;                                     // the rewriting, shared with the workers
+    unsigned int oldBlocks = volumeBlocks;              // blocks in the volume before
+    unsigned int moveStart = numBlocks;                 // first block that moves
+    unsigned int numFree = 0;                           // free blocks before the new end
+    unsigned int numMoving = 0;                         // blocks in use that have to move
+    unsigned int numMoved = 0;                          // blocks copied so far
+    unsigned int block = 0;                             // loop counter
+    struct timespec start, end;                         // when the resize started and finished
 
-    // copy the entire block to the buffer
-    memcpy(buffer, b->data, BLOCKSIZE);
+    // check if the file system is loaded
+    fsLoadedCheck();
 
-    // write the block to the file
-    fwrite(buffer, 1, numBytes, f);
+    if (numBlocks == 0 || numBlocks > MAXBLOCKS) {
+        return -EINVAL;
+    }
+    if (readOnly) {
+        return -EROFS;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    // free the buffer
-    free(buffer);
-}
+    // growing. the reserved blocks were punched out or zeroed when they were reserved, so they're free as
+    // they are
+    if (numBlocks >= volumeBlocks) {
+        for (block = volumeBlocks; block < numBlocks; block++) {
+            FAT[block] = 0;
+        }
+        volumeBlocks = numBlocks;
+        logMessage("Grew the volume from %u to %u blocks\n", oldBlocks, numBlocks);
+        return 0;
+    }
 
-void _extractFile(dirEntry* file) {
-    unsigned short block = file->first_cluster_low;      // first block of the file
-    unsigned int size = file->size;                      // size of the file
-    unsigned int bytesToWrite = size;                    // number of bytes to write
-    long int offset = 0;                                 // offset in the file
-    FILE* f = NULL;                                      // file to write to
+    // finish the deferred work first, so nothing queued points past the new end
+    compactPendingDirectories();
+    deleteSnapshots(UINT_MAX);
+    freeOrphanBlocks(UINT_MAX);
+    reclaimFreedBlocks();
+    if (numOrphans > 0) {
+        return -EBUSY;
+    }
 
-    // check if the filesytem is loaded
-    fsLoadedCheck();
+    // a reference stands for blocks in a row, so a run of shared blocks that crosses the new end moves
+    // whole. Count what has to move against what's free to take it
+    while (moveStart > 0 && FAT[moveStart - 1] != 0 && (refcounts[moveStart - 1] > 0 || FAT[moveStart - 1] == SHAREDBLOCK) &&
+           FAT[numBlocks] != 0 && (refcounts[numBlocks] > 0 || FAT[numBlocks] == SHAREDBLOCK)) {
+        moveStart--;
+    }
+    numFree = countZeroEntries(FAT, numBlocks);
+    numMoving = (volumeBlocks - moveStart) - countZeroEntries(&FAT[moveStart], volumeBlocks - moveStart);
+    if (numMoving > numFree) {
+        return -ENOSPC;
+    }
 
-    // check if the file is a directory
-    if (file->attributes == ATTR_DIRECTORY) {
-        fprintf(stderr, "Cannot extract directory, %s\n", file->name);
-        exit(1);
+    // reserve the free blocks past the new end straight away, so nothing gets handed out there
+    for (block = numBlocks; block < volumeBlocks; block++) {
+        if (FAT[block] == 0) {
+            FAT[block] = RESERVEDBLOCK;
+        }
     }
 
-    // check if the file exists externally
-    if (access(file->name, F_OK) != -1) {
-        fprintf(stderr, "File \"%s\" already exists externally\n", file->name);
-        exit(1);
+    // copy each block in use that moves into a free one, with its FAT entry, checksum and reference count.
+    // Nothing links to the copies yet, so until the links are rewritten the old blocks are what's read
+    for (block = 0; block < MAXBLOCKS; block++) {
+        map[block] = block;
     }
+    freeBlockHint = 0;
+    for (block = moveStart; block < volumeBlocks; ) {
+        unsigned int length = 1;            // blocks that move together
+        unsigned int dest = 0;              // where they go
 
-    // open the file for writing
-    if((f = fopen(file->name, "wb")) == NULL) {
-        fprintf(stderr, "Error opening file \"%s\" for writing\n", file->name);
-        exit(1);
+        if (FAT[block] == RESERVEDBLOCK) {
+            block++;
+            continue;
+        }
+        if (refcounts[block] > 0 || FAT[block] == SHAREDBLOCK) {
+            while (block + length < volumeBlocks && FAT[block + length] != RESERVEDBLOCK &&
+                   (refcounts[block + length] > 0 || FAT[block + length] == SHAREDBLOCK)) {
+                length++;
+            }
+            dest = findFreeRun(length);
+            if (dest == MAXBLOCKS || dest + length > numBlocks || countZeroEntries(&FAT[dest], length) != length) {
+                // no free run is long enough. drop the copies, which nothing links to, and give the end back
+                for (unsigned int i = moveStart; i < block; i++) {
+                    if (map[i] != i) {
+                        FAT[map[i]] = 0;
+                        checksums[map[i]] = 0;
+                        refcounts[map[i]] = 0;
+                    }
+                }
+                for (unsigned int i = numBlocks; i < volumeBlocks; i++) {
+                    if (FAT[i] == RESERVEDBLOCK) {
+                        FAT[i] = 0;
+                    }
+                }
+                return -ENOSPC;
+            }
+        }
+        else {
+            dest = findFreeBlock();
+        }
+
+        memcpy(&blocks[dest], &blocks[block], (size_t)length * BLOCKSIZE);
+        for (unsigned int i = 0; i < length; i++) {
+            FAT[dest + i] = FAT[block + i];
+            checksums[dest + i] = checksums[block + i];
+            refcounts[dest + i] = refcounts[block + i];
+            sharableBlocks[dest + i] = 0;
+            map[block + i] = dest + i;
+        }
+        numMoved += length;
+        block += length;
     }
-    logMessage("Opened file \"%s\" for writing\n", file->name);
 
-    // write the file to the external file
-    logMessage("Starting write of file \"%s\"...\n", file->name);
+    // the copies have to be in place before anything links to them
+    ORDERSTORES();
 
-    // loop through the blocks and write them to the file
-    while (bytesToWrite > 0) {
-        unsigned int numBytes = (bytesToWrite > BLOCKSIZE) ? BLOCKSIZE : bytesToWrite;
-        fseek(f, offset, SEEK_SET);
-        writeBlockToFile(f, block, numBytes);
-        logMessage("\tWrote %d bytes to offset %ld\n", numBytes, offset);
-        offset += numBytes;
-        bytesToWrite -= numBytes;
-        block = FAT[block];
+    // point every link at where its block went. The directories and indexes are found through the old
+    // links, which still work since the old blocks are untouched
+    if (numMoved > 0) {
+        startCompactJob(&job, map);
+        rewriteLinks(&job, numBlocks);
+        if (packBlockHint < MAXBLOCKS) {
+            packBlockHint = map[packBlockHint];
+        }
     }
+    ORDERSTORES();
 
-    logMessage("Finished writing file \"%s\"\n", file->name);
+    // nothing links to the old blocks now. The ones before the new end are free, and the rest reserved
+    for (block = moveStart; block < numBlocks; block++) {
+        FAT[block] = 0;
+        checksums[block] = 0;
+        refcounts[block] = 0;
+        sharableBlocks[block] = 0;
+    }
+    if (numBlocks > moveStart) {
+        queueFreedBlocks(moveStart, numBlocks - moveStart);
+    }
+    for (block = numBlocks; block < oldBlocks; block++) {
+        FAT[block] = RESERVEDBLOCK;
+        checksums[block] = 0;
+        refcounts[block] = 0;
+        sharableBlocks[block] = 0;
+    }
+    volumeBlocks = numBlocks;
+    freeBlockHint = 0;
 
-    // close the file
-    fclose(f);
+    // give the space past the end back to the host. a transaction's image only reaches the file when it's
+    // committed, and there the blocks are zeroed so the writer leaves them out
+    if (privateMapping || fsfd == -1 ||
+        fallocate(fsfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (char*)&blocks[numBlocks] - fs,
+                  (off_t)(oldBlocks - numBlocks) * BLOCKSIZE) == -1) {
+        bzero(&blocks[numBlocks], (size_t)(oldBlocks - numBlocks) * BLOCKSIZE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
+    logMessage("Shrank the volume from %u to %u blocks, moving %u blocks in %.3f s\n", oldBlocks, numBlocks, numMoved,
+               (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    return 0;
 }
 
-void extractFile(char* intpath, dirEntry* parentDir) {
-    dirEntry* file = NULL;                     // file to extract
+void* scrubWorker(void* arg) {
+    scrubJob* job = (scrubJob*)arg;         // the scrub being run
 
-    // check if the file system is loaded
-    fsLoadedCheck();
+    // take ranges of blocks until there are none left, checking every block in use that has a checksum,
+    // and every FAT entry for a link that points nowhere. nothing in the image changes meanwhile
+    while (1) {
+        unsigned int first = __atomic_fetch_add(&job->nextBlock, SCRUBRANGE, __ATOMIC_RELAXED);   // first block of the range
+        unsigned int numChecked = 0;        // blocks in the range with a checksum
+        unsigned int numBad = 0;            // blocks in the range found bad
 
-    // find the file to extract
-    file = findEntryFromPath(intpath, parentDir);
+        if (first >= MAXBLOCKS) {
+            break;
+        }
+        for (unsigned int block = first; block < first + SCRUBRANGE && block < MAXBLOCKS; block++) {
+            unsigned short link = FAT[block];       // what the block links to
 
-    // check if the file exists
-    if (file == NULL) {
-        fprintf(stderr, "File, %s, does not exist\n", intpath);
-        return;
+            if (link == 0) {
+                continue;
+            }
+            if (link != USHRT_MAX && link != SHAREDBLOCK && link != RESERVEDBLOCK && link >= MAXBLOCKS && !ISHOLE(link)) {
+                job->bad[block] = SCRUBBADLINK;
+                numBad++;
+                continue;
+            }
+            if (checksums[block] != 0) {
+                numChecked++;
+                if (crc32c(0, blocks[block].data, BLOCKSIZE) != checksums[block]) {
+                    job->bad[block] = SCRUBBADCHECKSUM;
+                    numBad++;
+                }
+            }
+        }
+        __atomic_fetch_add(&job->numChecked, numChecked, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&job->numBad, numBad, __ATOMIC_RELAXED);
     }
 
-    // extract the file
-    logMessage("Extracting file \"%s\"\n", intpath);
-    _extractFile(file);
-
-    printf("Extracted file \"%s\"\n", intpath);
-    return;
+    return NULL;
 }
 
-int isDirectoryEmpty(dirEntry* entry) {
-    unsigned short blockIndex = entry->first_cluster_low;   // index of the block
-    block* currentBlock = NULL;                             // pointer to the current block
-    dirEntry* currentEntry = NULL;                          // pointer to the current entry
-    unsigned short isLast = 0;                              // flag to indicate if the entry is the last in the block
+void reportBadBlocks(dirEntry* dir, char* path, unsigned char* bad) {
+    // say which files and directories the bad blocks found by a scrub belong to
+    dirEntry* currentEntry = (dirEntry*)&blocks[dir->first_cluster_low];   // entry being looked at
 
-    // check if the file system is loaded
-    fsLoadedCheck();
+    while (currentEntry != NULL) {
+        char name[MAXFILENAME + 1] = {0};   // name of the entry, null terminated
+        char entryPath[MAXPATH * 2];       // path of the entry
+        unsigned short link = currentEntry->first_cluster_low;   // link of its chain being looked at
+        unsigned int numLinks = 0;          // links walked, so a damaged chain can't loop forever
+
+        strncpy(name, currentEntry->name, MAXFILENAME);
 
-    // get the block pointer
-    currentBlock = &blocks[blockIndex];
+        // skip . and .., deleted entries and empty slots
+        if (name[0] == 0 || name[0] == 0x5F || currentEntry->attributes == ATTR_DELETED ||
+            strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            currentEntry = getNextEntry(currentEntry, dir);
+            continue;
+        }
+        snprintf(entryPath, sizeof(entryPath), "%s/%s", strcmp(path, "/") == 0 ? "" : path, name);
+
+        // a packed file only has its share of the pack block, and an empty one has nothing
+        if (ISPACKED(currentEntry)) {
+            if (currentEntry->size > 0 && bad[link]) {
+                printf("  block %d, shared by %s: %s\n", link, entryPath,
+                       bad[link] == SCRUBBADLINK ? "links outside the image" : "does not match its checksum");
+            }
+            currentEntry = getNextEntry(currentEntry, dir);
+            continue;
+        }
+
+        while (link != USHRT_MAX && numLinks++ < MAXBLOCKS + MAXHOLES) {
+            if (!ISHOLE(link) && link >= MAXBLOCKS) {
+                break;
+            }
+            if (!ISHOLE(link) && bad[link]) {
+                printf("  block %d of %s: %s\n", link, entryPath,
+                       bad[link] == SCRUBBADLINK ? "links outside the image" : "does not match its checksum");
+                if (bad[link] == SCRUBBADLINK) {
+                    break;
+                }
+            }
+
+            // the blocks a reference stands for are the file's too, shared with others
+            if (ISREFERENCE(link)) {
+                for (unsigned int i = 0; i < chainSpan(link) && REFERENCEBLOCK(link) + i < MAXBLOCKS; i++) {
+                    if (bad[REFERENCEBLOCK(link) + i]) {
+                        printf("  block %d, shared by %s: does not match its checksum\n", REFERENCEBLOCK(link) + i,
+                               entryPath);
+                    }
+                }
+            }
+            link = *chainLink(link);
+        }
 
-    // get the '..' entry
-    currentEntry = findEntryInDirectory(entry, "..");
-    if (currentEntry == NULL) {
-        fprintf(stderr, "An error occurred while checking if the directory is empty\n");
-    }
+        if ((currentEntry->attributes & ATTR_DIRECTORY) && (unsigned short)currentEntry->first_cluster_low < MAXBLOCKS &&
+            !bad[currentEntry->first_cluster_low]) {
+            reportBadBlocks(currentEntry, entryPath, bad);
+        }
 
-    // check if .. is the last entry in the directory
-    if(currentEntry->isLast == LASTENTRY) {
-        return 1;
+        currentEntry = getNextEntry(currentEntry, dir);
     }
-
-    return 0;
 }
 
-void removeDirectoryEntry(char* intpath, dirEntry* rootDir) {
-    char* parentPath = malloc(MAXPATH);                           // path to the parent directory
-    dirEntry* entry = findEntryFromPath(intpath, rootDir);        // find the directory entry to remove
-    dirEntry* previousEntry = NULL;                               // pointer to the previous entry in the directory
-    dirEntry* parentDir = NULL;                                   // pointer to the parent directory
-    unsigned short blockIndex = USHRT_MAX;                        // index of the parent directory
-    unsigned short entryIndex = 0;                                // index of the current entry in the block
-    block* currentBlock = NULL;                                   // pointer to the current block
-    unsigned short isLast = 0;                                    // flag to indicate if the entry is the last in the block
+unsigned int scrubfs() {
+    // check every block of file data against its checksum, on as many threads as there are CPUs, and
+    // every FAT entry for links that point nowhere. Any bad blocks are listed with the files they belong
+    // to. returns how many were found
+    scrubJob job;                           // the scrub, shared with the workers
+    struct timespec start, end;             // when the scrub started and finished
+    double seconds = 0;                     // how long it took
 
     // check if the file system is loaded
     fsLoadedCheck();
 
-    // get the parent directory of the entry and the block index
-    extract_path(intpath, parentPath);  // get the parent directory path (without the filename)
-    parentDir = findParentFromPath(parentPath, rootDir);
-
-    // check if the parent directory exists
-    if (parentDir == NULL) {
-        fprintf(stderr, "Parent directory of \"%s\" does not exist, cannot remove\n", intpath);
-        return;
+    if (!(sb->features & FEATURE_CHECKSUMS)) {
+        printf("This image was made before checksums, only its FAT is checked\n");
     }
 
-    blockIndex = parentDir->first_cluster_low;
-
-    // check if the entry is valid
-    if (entry == NULL) {
-        fprintf(stderr, "File or directory \"%s\" does not exist, cannot remove\n", intpath);
-        return;
+    memset(&job, 0, sizeof(job));
+    job.bad = calloc(MAXBLOCKS, 1);
+    if (job.bad == NULL) {
+        fprintf(stderr, "Out of memory, exiting\n");
+        exit(1);
     }
 
-    // check if the entry is a directory, check if it is empty
-    if (entry->attributes == ATTR_DIRECTORY) {
-        if (!isDirectoryEmpty(entry)) {
-            fprintf(stderr, "Directory \"%s\" is not empty, cannot remove\n", intpath);
-            return;
-        }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    runWorkerPool(scrubWorker, &job, (MAXBLOCKS + SCRUBRANGE - 1) / SCRUBRANGE);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (seconds <= 0) {
+        seconds = 1e-9;
     }
 
-    // find the entry in the directory and mark it as deleted
-    while (blockIndex != USHRT_MAX) {
-        currentBlock = &blocks[blockIndex];
-        for (entryIndex = 0; entryIndex < BLOCKSIZE; entryIndex += sizeof(dirEntry)) {
-            dirEntry* currentEntry = (dirEntry*)&currentBlock->data[entryIndex];
-            if (currentEntry->attributes != ATTR_DELETED && strcmp(currentEntry->name, entry->name) == 0) {
-                currentEntry->attributes = ATTR_DELETED;  // mark the entry as deleted
-
-                // change the first character of the name to '_'
-                currentEntry->name[0] = '_';
-
-                logMessage("Entry \"%s\" marked as deleted\n", intpath);
-
-                // if the entry is the last one, update the previous entry's isLast flag
-                if (currentEntry->isLast == LASTENTRY) {
-                    if (previousEntry != NULL) {
-                        previousEntry->isLast = LASTENTRY;
-                    }
-                }
+    printf("Scrubbed %u blocks (%.1f MB) in %.3f s: %.1f MB/s, %u bad\n", job.numChecked,
+           job.numChecked * (double)BLOCKSIZE / 1e6, seconds, job.numChecked * (double)BLOCKSIZE / 1e6 / seconds, job.numBad);
+    if (job.numBad > 0) {
+        if (job.bad[0]) {
+            printf("  block 0 of /: %s\n", job.bad[0] == SCRUBBADLINK ? "links outside the image" : "does not match its checksum");
+        }
+        reportBadBlocks((dirEntry*)&blocks[0], "/", job.bad);
 
-                // free the blocks used by the file or directory
-                unsigned short blockToFree = currentEntry->first_cluster_low;
-                while (blockToFree != USHRT_MAX) {
-                    unsigned short nextBlock = FAT[blockToFree];
-                    FAT[blockToFree] = 0;
-                    blockToFree = nextBlock;
-                }
-                logMessage("Blocks used by entry \"%s\" freed\n", intpath);
+        // files in snapshots are listed under the snapshot's name
+        for (int i = 0; i < MAXSNAPSHOTS; i++) {
+            char snapshotPath[MAXFILENAME + 2];     // @ and the snapshot's name
 
-                logMessage("Entry \"%s\" removed successfully\n", intpath);
-                free(parentPath);
-                return;
-            }
-            if (currentEntry->isLast == LASTENTRY) {
-                isLast = 1;
-                break;
-            }
-            // Update previousEntry only if currentEntry is not deleted
-            if (currentEntry->attributes != ATTR_DELETED) {
-                previousEntry = currentEntry;
+            if (snapshots[i].state != SNAPSHOTLIVE || snapshots[i].root >= MAXBLOCKS || job.bad[snapshots[i].root]) {
+                continue;
             }
+            snprintf(snapshotPath, sizeof(snapshotPath), "@%.11s", snapshots[i].name);
+            reportBadBlocks((dirEntry*)&blocks[snapshots[i].root], snapshotPath, job.bad);
         }
-        if (isLast) break;
-        blockIndex = FAT[blockIndex];
     }
 
-    free(parentPath);
-    fprintf(stderr, "Failed to remove entry \"%s\"\n", intpath);
+    free(job.bad);
+    return job.numBad;
 }
 
-void catFile(char* intpath, dirEntry* parentDir) {
+int catFile(char* intpath, dirEntry* parentDir) {
     dirEntry* file = NULL;                     // file to read
-    unsigned short block = 0;                  // first block of the file
     unsigned int size = 0;                     // size of the file
     unsigned int bytesRead = 0;                // number of bytes read
-    unsigned int bytesToRead = 0;              // number of bytes to read
+    int bytesToRead = 0;                       // number of bytes to read
     char buffer[BLOCKSIZE];                    // buffer to read the file data
 
     // check if the file system is loaded
@@ -1597,21 +7673,24 @@ void catFile(char* intpath, dirEntry* parentDir) {
         exit(1);
     }
 
-    // get the file's size and first block
+    // get the file's size
     size = file->size;
-    block = file->first_cluster_low;
 
     // read and print the file contents block by block
-    while (size > 0) {
-        bytesToRead = (size > BLOCKSIZE) ? BLOCKSIZE : size;
-        memcpy(buffer, blocks[block].data, bytesToRead);
+    while (bytesRead < size) {
+        bytesToRead = readFileData(file, buffer, BLOCKSIZE, bytesRead);
+        if (bytesToRead < 0) {
+            fprintf(stderr, "\nError reading \"%s\" at byte %u\n", intpath, bytesRead);
+            return -1;
+        }
         fwrite(buffer, 1, bytesToRead, stdout);
-        size -= bytesToRead;
-        block = FAT[block];
+        bytesRead += bytesToRead;
     }
 
     // print a newline at the end
     printf("\n");
+
+    return 0;
 }
 
 
@@ -1662,10 +7741,151 @@ void touchFile(char* intpath, dirEntry* parentDir) {
     logMessage("File \"%s\" timestamp updated\n", intpath);
 }
 
-void interactiveShell(char* fsname) {
-    char command[256];
+int runShellCommand(char* command, char* fsname, dirEntry** root, dirEntry** currentDir) {
+    // returns 0, 1 for exit, -1 for an unknown command, or -2 for a command that failed
     char arg1[256];
     char arg2[256];
+    int res = 0;
+
+    if (strcmp(command, "exit") == 0) {
+        return 1;
+    } else if (strcmp(command, "help") == 0) {
+        printf("Available commands:\n");
+        printf("  help                            - Show this help message\n");
+        printf("  exit                            - Exit the shell\n");
+        printf("  ls                              - List the contents of the current directory\n");
+        printf("  cd <internal path>              - Change the current directory\n");
+        printf("  cat <internal path>             - Display the contents of a file\n");
+        printf("  rm <internal path>              - Remove a file or directory from the file system\n");
+        printf("  mkdir <internal path>           - Add a directory to the file system\n");
+        printf("  mkdir -x <internal path>        - Add a directory indexed by name, for many entries\n");
+        printf("  tree                            - List the contents of the file system\n");
+        printf("  addfile <path> <internal path>  - Add a file to the file system\n");
+        printf("  import <path> <internal path>   - Import a host directory tree into the file system\n");
+        printf("  touch <internal path>           - Create a new file/update the timestamp of a file\n");
+        printf("  extract <internal path> [dir]   - Extract a file or directory tree from the file system, into dir if given\n");
+        printf("  createfs <fsname>               - Create a new file system\n");
+        printf("  loadfs <fsname>                 - Load a file system\n");
+        printf("  mount <mountpath>               - Mount the file system at the specified path\n");
+        printf("  trim                            - Punch every free block out of the image\n");
+        printf("  map <internal path>             - Show where a file has data and where it has holes\n");
+        printf("  compress <internal path>        - Compress a file, and keep it compressed when it's written\n");
+        printf("  scrub                           - Check every block of file data against its checksum\n");
+        printf("  dedup                           - Share every block of file data with identical ones\n");
+        printf("  defrag                          - Move the blocks of every file into one run each\n");
+        printf("  compact                         - Move every block in use to the front, and shrink the image on disk\n");
+        printf("  resize <size>                   - Grow or shrink the volume to size bytes, or K, M or G with a suffix\n");
+        printf("  clone <internal path> <internal path> - Copy a file inside the file system, sharing its blocks\n");
+        printf("  snapshot <name>                 - Take a snapshot of the whole file system\n");
+        printf("  rmsnapshot <name>               - Remove a snapshot\n");
+        printf("  snapshots                       - List the snapshots\n");
+    } else if (strcmp(command, "tree") == 0) {
+        printDirectoryTree(*currentDir);
+        printf("\n");
+    } else if (strcmp(command, "ls") == 0) {
+        listDirectory(*currentDir);
+        printf("\n");
+    } else if (strcmp(command, "trim") == 0) {
+        trimfs();
+    } else if (strcmp(command, "scrub") == 0) {
+        res = scrubfs() > 0 ? -2 : 0;
+    } else if (strcmp(command, "dedup") == 0) {
+        dedupfs();
+    } else if (strcmp(command, "defrag") == 0) {
+        defragfs();
+    } else if (strcmp(command, "compact") == 0) {
+        res = compactfs(fsname) != 0 ? -2 : 0;
+        // the directories have moved
+        *root = (dirEntry*)&blocks[0];
+        *currentDir = *root;
+    } else if (sscanf(command, "resize %s", arg1) == 1) {
+        unsigned int numBlocks = parseVolumeSize(arg1);
+        res = numBlocks != 0 ? resizefs(numBlocks) : -EINVAL;
+        if (res != 0) {
+            fprintf(stderr, "Cannot resize to %s: %s\n", arg1, strerror(-res));
+            res = -2;
+        }
+        else {
+            printf("Resized the volume to %u blocks (%.1f MB), %u free\n", volumeBlocks,
+                   volumeBlocks * (double)BLOCKSIZE / 1e6, countFreeBlocks());
+        }
+        // the current directory may have moved
+        *currentDir = *root;
+    } else if (sscanf(command, "clone %s %s", arg1, arg2) == 2) {
+        res = clonePath(arg1, arg2, *root);
+        if (res != 0) {
+            fprintf(stderr, "Cannot clone %s to %s: %s\n", arg1, arg2, strerror(-res));
+            res = -2;
+        }
+    } else if (strcmp(command, "snapshots") == 0) {
+        listSnapshots();
+    } else if (sscanf(command, "snapshot %s", arg1) == 1) {
+        res = takeSnapshot(arg1);
+        if (res != 0) {
+            fprintf(stderr, "Cannot take snapshot %s: %s\n", arg1, strerror(-res));
+            res = -2;
+        }
+    } else if (sscanf(command, "rmsnapshot %s", arg1) == 1) {
+        if (removeSnapshot(arg1) != 0) {
+            fprintf(stderr, "Snapshot %s does not exist\n", arg1);
+            res = -2;
+        }
+        deleteSnapshots(UINT_MAX);
+    } else if (sscanf(command, "map %s", arg1) == 1) {
+        res = mapFile(arg1, *currentDir) != 0 ? -2 : 0;
+    } else if (sscanf(command, "compress %s", arg1) == 1) {
+        res = compressPath(arg1, *currentDir) != 0 ? -2 : 0;
+    } else if (sscanf(command, "cat %s", arg1)) {
+        res = catFile(arg1, *currentDir) != 0 ? -2 : 0;
+    } else if (sscanf(command, "addfile %s %s", arg1, arg2) == 2) {
+        res = addFile(arg1, arg2, *root) != 0 ? -2 : 0;
+    } else if (sscanf(command, "import %s %s", arg1, arg2) == 2) {
+        importTree(arg1, arg2, *root);
+    } else if (sscanf(command, "touch %s", arg1)) {
+        touchFile(arg1, *currentDir);
+    } else if (sscanf(command, "mkdir -x %s", arg1) == 1) {
+        indexDirectories = 1;
+        addDirectory(arg1, *root);
+        indexDirectories = 0;
+    } else if (sscanf(command, "mkdir %s", arg1) == 1) {
+        addDirectory(arg1, *root);
+    } else if (sscanf(command, "rm %s", arg1) == 1) {
+        res = removeDirectoryEntry(arg1, *root) != 0 ? -2 : 0;
+    } else if (sscanf(command, "extract %s %s", arg1, arg2) == 2) {
+        res = extractFile(arg1, *root, arg2) != 0 ? -2 : 0;
+    } else if (sscanf(command, "extract %s", arg1) == 1) {
+        res = extractFile(arg1, *root, NULL) != 0 ? -2 : 0;
+    } else if (sscanf(command, "createfs %s", arg1) == 1) {
+        createfs(arg1);
+        printf("Created new file system '%s'\n", arg1);
+    } else if (sscanf(command, "loadfs %s", arg1) == 1) {
+        loadfs(arg1);
+        *root = (dirEntry*)&blocks[0];
+        *currentDir = *root;
+        printf("Loaded file system '%s'\n", arg1);
+    } else if (sscanf(command, "cd %s", arg1) == 1) {
+        // if the path starts with '/', start from the root
+        if (arg1[0] == '/') {
+            *currentDir = *root;
+        }
+        dirEntry* newDir = findEntryFromPath(arg1, *currentDir);
+        if (newDir != NULL && newDir->attributes & ATTR_DIRECTORY) {
+            *currentDir = newDir;
+        } else {
+            printf("Directory not found: %s\n", arg1);
+            res = -2;
+        }
+    } else if (sscanf(command, "mount %s", arg1) == 1) {
+        res = mountfs(arg1, fsname) != 0 ? -2 : 0;
+    } else {
+        return -1;
+    }
+
+    return res;
+}
+
+void interactiveShell(char* fsname) {
+    char command[256];
     dirEntry* root = NULL;
     dirEntry* currentDir = NULL;
     char fullPath[MAXPATH] = "/";
@@ -1683,6 +7903,8 @@ void interactiveShell(char* fsname) {
     printf("Interactive shell for filesystem %s. Type 'help' for a list of commands.\n", fsname);
 
     while (1) {
+        int result = 0;
+
         getFullPath(currentDir, fullPath);
         printf("%s > ", fullPath);
         if (fgets(command, sizeof(command), stdin) == NULL) {
@@ -1693,68 +7915,120 @@ void interactiveShell(char* fsname) {
         // Remove trailing newline
         command[strcspn(command, "\n")] = 0;
 
-        if (strcmp(command, "exit") == 0) {
+        result = runShellCommand(command, fsname, &root, &currentDir);
+        if (result == 1) {
             printf("Exiting shell.\n");
             break;
-        } else if (strcmp(command, "help") == 0) {
-            printf("Available commands:\n");
-            printf("  help                            - Show this help message\n");
-            printf("  exit                            - Exit the shell\n");
-            printf("  ls                              - List the contents of the current directory\n");
-            printf("  cd <internal path>              - Change the current directory\n");
-            printf("  cat <internal path>             - Display the contents of a file\n");
-            printf("  rm <internal path>              - Remove a file or directory from the file system\n");
-            printf("  mkdir <internal path>           - Add a directory to the file system\n");
-            printf("  tree                            - List the contents of the file system\n");
-            printf("  addfile <path> <internal path>  - Add a file to the file system\n");
-            printf("  touch <internal path>           - Create a new file/update the timestamp of a file\n");
-            printf("  extract <internal path>         - Extract a file from the file system\n");
-            printf("  createfs <fsname>               - Create a new file system\n");
-            printf("  loadfs <fsname>                 - Load a file system\n");
-            printf("  mount <mountpath>               - Mount the file system at the specified path\n");
-        } else if (strcmp(command, "tree") == 0) {
-            printDirectoryTree(currentDir);
-            printf("\n");
-        } else if (strcmp(command, "ls") == 0) {
-            listDirectory(currentDir);
-            printf("\n");
-        } else if (sscanf(command, "cat %s", arg1)) {
-            catFile(arg1, currentDir);
-        } else if (sscanf(command, "addfile %s %s", arg1, arg2) == 2) {
-            addFile(arg1, arg2, root);
-        } else if (sscanf(command, "touch %s", arg1)) {
-            touchFile(arg1, currentDir);
-        } else if (sscanf(command, "mkdir %s", arg1) == 1) {
-            addDirectory(arg1, root);
-        } else if (sscanf(command, "rm %s", arg1) == 1) {
-            removeDirectoryEntry(arg1, root);
-        } else if (sscanf(command, "extract %s", arg1) == 1) {
-            extractFile(arg1, root);
-        } else if (sscanf(command, "createfs %s", arg1) == 1) {
-            createfs(arg1);
-            printf("Created new file system '%s'\n", arg1);
-        } else if (sscanf(command, "loadfs %s", arg1) == 1) {
-            loadfs(arg1);
-            root = (dirEntry*)&blocks[0];
-            currentDir = root;
-            printf("Loaded file system '%s'\n", arg1);
-        } else if (sscanf(command, "cd %s", arg1) == 1) {
-            // if the path starts with '/', start from the root
-            if (arg1[0] == '/') {
-                currentDir = root;
-            }
-            dirEntry* newDir = findEntryFromPath(arg1, currentDir);
-            if (newDir != NULL && newDir->attributes & ATTR_DIRECTORY) {
-                currentDir = newDir;
-            } else {
-                printf("Directory not found: %s\n", arg1);
-            }
-        } else if (sscanf(command, "mount %s", arg1) == 1) {
-            mountfs(arg1, fsname);
-        } else {
+        } else if (result == -1) {
             printf("Unknown command. Type 'help' for a list of commands.\n");
         }
     }
+
+    // compact the directories left behind by rm, now that nothing points into them
+    if (fs != NULL) {
+        compactPendingDirectories();
+        deleteSnapshots(UINT_MAX);
+        freeOrphanBlocks(UINT_MAX);
+        reclaimFreedBlocks();
+    }
+}
+
+void runBatch(char* scriptPath, char* fsname, int transactional) {
+    char command[MAXPATH * 2 + 32];         // line read from the script
+    FILE* script = NULL;                    // script being run
+    dirEntry* root = NULL;                  // root directory of the loaded file system
+    dirEntry* currentDir = NULL;            // directory cd has moved to
+    unsigned int lineNumber = 0;            // line of the script being run
+    unsigned int numCommands = 0;           // number of commands run
+    struct timespec start, end;             // when the batch started and finished
+    double seconds = 0;                     // how long the batch took
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // open the script, - meaning stdin
+    if (strcmp(scriptPath, "-") == 0) {
+        script = stdin;
+    }
+    else if ((script = fopen(scriptPath, "r")) == NULL) {
+        fprintf(stderr, "Error opening script \"%s\", exiting\n", scriptPath);
+        exit(1);
+    }
+
+    // a transaction works on a private copy of the image, so nothing reaches the file until the end.
+    // anything that fails with exit() just leaves the file as it was
+    if (transactional) {
+        if (fsname == NULL) {
+            fprintf(stderr, "A transaction needs a file system given with -f, exiting\n");
+            exit(1);
+        }
+        privateMapping = 1;
+    }
+
+    // everything runs against the one mapping
+    if (fsname != NULL) {
+        loadfs(fsname);
+        root = (dirEntry*)&blocks[0];
+        currentDir = root;
+    }
+
+    while (fgets(command, sizeof(command), script) != NULL) {
+        int result = 0;                     // what the command did
+        char* line = command;               // the command without leading blanks
+
+        lineNumber++;
+
+        // Remove trailing newline, and skip blank lines and comments
+        command[strcspn(command, "\r\n")] = 0;
+        while (*line == ' ' || *line == '\t') {
+            line++;
+        }
+        if (*line == 0 || *line == '#') {
+            continue;
+        }
+
+        // the image can't be swapped out from under a transaction
+        if (transactional && (strncmp(line, "createfs", 8) == 0 || strncmp(line, "loadfs", 6) == 0 ||
+                              strncmp(line, "mount", 5) == 0)) {
+            fprintf(stderr, "Line %u: \"%s\" cannot be used in a transaction, nothing was written\n", lineNumber, line);
+            exit(1);
+        }
+
+        logMessage("Line %u: %s\n", lineNumber, line);
+        result = runShellCommand(line, fsname, &root, &currentDir);
+        if (result == 1) {
+            break;
+        } else if (result == -1) {
+            fprintf(stderr, "Line %u: unknown command \"%s\"%s\n", lineNumber, line,
+                    transactional ? ", nothing was written" : "");
+            exit(1);
+        } else if (result == -2 && transactional) {
+            // the command said why. nothing has reached the file, and nothing will
+            fprintf(stderr, "Line %u: \"%s\" failed, nothing was written\n", lineNumber, line);
+            exit(1);
+        }
+        numCommands++;
+    }
+
+    if (script != stdin) {
+        fclose(script);
+    }
+
+    // compact the directories left behind by rm, now that nothing points into them
+    if (fs != NULL) {
+        compactPendingDirectories();
+        deleteSnapshots(UINT_MAX);
+        freeOrphanBlocks(UINT_MAX);
+        reclaimFreedBlocks();
+    }
+
+    if (transactional) {
+        commitfs(fsname);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("Ran %u commands in %.3f s%s\n", numCommands, seconds, transactional ? " and committed them" : "");
 }
 
 int getNumSubdirs(dirEntry* dir) {
@@ -1786,7 +8060,7 @@ int getNumSubdirs(dirEntry* dir) {
 
 dirEntry* fuseRoot = NULL;
 
-static int fs_getattr(const char *path, struct stat *st) {
+static int _fs_getattr(const char *path, struct stat *st) {
     int res = 0;
     char* localpath = malloc(strlen(path));
     dirEntry* file = NULL;
@@ -1819,6 +8093,15 @@ static int fs_getattr(const char *path, struct stat *st) {
         st->st_mode = S_IFREG | 0644;
         st->st_nlink = 1;
         st->st_size = file->size;
+        // only stored blocks count, so du sees the holes. without any there's no need to walk the chain. a
+        // packed file takes part of a block, which is counted as a whole 512 byte one
+        if (ISPACKED(file)) {
+            st->st_blocks = file->size > 0;
+        }
+        else {
+            st->st_blocks = (sb->features & FEATURE_HOLES) ? countFileBlocks(file) * (BLOCKSIZE / 512) :
+                            (file->size ? (file->size + BLOCKSIZE - 1) / BLOCKSIZE : 1) * (BLOCKSIZE / 512);
+        }
     }
 
     logMessage("Attributes for %s: mode: %d, nlink: %d, size: %d\n", path, st->st_mode, st->st_nlink, st->st_size);
@@ -1832,7 +8115,7 @@ static int fs_getattr(const char *path, struct stat *st) {
     return res;
 }
 
-static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+static int _fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
     // function is very similar to listDirectory, but uses the FUSE filler function to add entries to the directory
     // see listDirectory for more detailed comments
 
@@ -1919,13 +8202,10 @@ static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t
     return 0;
 }
 
-static int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+static int _fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
     dirEntry* file = NULL;                     // file to read
-    unsigned short block = 0;                  // first block of the file
     unsigned int fileSize = 0;                 // size of the file
-    unsigned int bytesRead = 0;                // number of bytes read
-    unsigned int bytesToRead = 0;              // number of bytes to read
-    unsigned int blockOffset = 0;              // offset within the block
+    int bytesRead = 0;                         // number of bytes read, or an error
     char* localpath = strdup(path);            // duplicate the path for manipulation
 
     // check if the file system is loaded
@@ -1946,9 +8226,8 @@ static int fs_read(const char *path, char *buf, size_t size, off_t offset, struc
         return -EISDIR;
     }
 
-    // get the file's size and first block
+    // get the file's size
     fileSize = file->size;
-    block = file->first_cluster_low;
 
     // check if offset is beyond file size
     if (offset >= fileSize) {
@@ -1961,37 +8240,14 @@ static int fs_read(const char *path, char *buf, size_t size, off_t offset, struc
         size = fileSize - offset;
     }
 
-    // navigate to the correct block based on the offset
-    while (offset >= BLOCKSIZE) {
-        block = FAT[block];
-        offset -= BLOCKSIZE;
-    }
-
-    blockOffset = offset; // offset within the block
-    bytesRead = 0;
-
-    // read data block by block
-    while (size > 0) {
-        bytesToRead = (size > (BLOCKSIZE - blockOffset)) ? (BLOCKSIZE - blockOffset) : size;
-        memcpy(buf + bytesRead, blocks[block].data + blockOffset, bytesToRead);
-        size -= bytesToRead;
-        bytesRead += bytesToRead;
-        blockOffset = 0; // reset block offset for subsequent reads
-
-        // move to the next block if necessary
-        if (size > 0) {
-            block = FAT[block];
-            if (block == USHRT_MAX) {
-                break;
-            }
-        }
-    }
+    // read data block by block, with zeroes for holes
+    bytesRead = readFileData(file, buf, size, offset);
 
     free(localpath);
     return bytesRead;
 }
 
-static int fs_open(const char *path, struct fuse_file_info *fi) {
+static int _fs_open(const char *path, struct fuse_file_info *fi) {
     char* localpath = malloc(strlen(path));
     dirEntry* file = NULL;
 
@@ -2005,13 +8261,19 @@ static int fs_open(const char *path, struct fuse_file_info *fi) {
         return -ENOENT;
     }
 
+    // a snapshot can only be read
+    if (readOnly && (fi->flags & O_ACCMODE) != O_RDONLY) {
+        free(localpath);
+        return -EROFS;
+    }
+
     fi->fh = (uint64_t)file;
 
     free(localpath);
     return 0;
 }
 
-static int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+static int _fs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
     // function to create a new file
     // this function is very similar to createEmptyFile
     // see createEmptyFile for more detailed comments
@@ -2019,11 +8281,17 @@ static int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
     char *localpath = malloc(strlen(path));
     dirEntry *parentDir = NULL;
     char parentPath[MAXPATH];
-    char filename[MAXFILENAME];
+    char filename[MAXFILENAME + 1];
 
     (void) mode;
     (void) fi;
 
+    // a snapshot can only be read
+    if (readOnly) {
+        free(localpath);
+        return -EROFS;
+    }
+
     logMessage("Creating file %s\n", path);
 
     strcpy(localpath, path);
@@ -2043,14 +8311,20 @@ static int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
     return 0;
 }
 
-static int fs_mkdir(const char* path, mode_t mode) {
+static int _fs_mkdir(const char* path, mode_t mode) {
     char *localpath = malloc(strlen(path));
     dirEntry *parentDir = NULL;
     char parentPath[MAXPATH];
-    char dirname[MAXFILENAME];
+    char dirname[MAXFILENAME + 1];
 
     (void) mode;
 
+    // a snapshot can only be read
+    if (readOnly) {
+        free(localpath);
+        return -EROFS;
+    }
+
     logMessage("Creating directory %s\n", path);
 
     strcpy(localpath, path);
@@ -2070,15 +8344,23 @@ static int fs_mkdir(const char* path, mode_t mode) {
     return 0;
 }
 
-static int fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+static int _fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
     unsigned short block = USHRT_MAX;
+    unsigned int position = 0;
     unsigned int bytesToWrite = 0;
     unsigned int bytesWritten = 0;
     char *localpath = malloc(strlen(path));
     dirEntry *file = NULL;
+    int res = 0;
 
     (void) fi;
 
+    // a snapshot can only be read
+    if (readOnly) {
+        free(localpath);
+        return -EROFS;
+    }
+
     strcpy(localpath, path);
 
     logMessage("Writing to file %s\n", localpath);
@@ -2086,23 +8368,43 @@ static int fs_write(const char *path, const char *buf, size_t size, off_t offset
 
     logMessage("Offset: %ld\n", offset);
     logMessage("Size: %ld\n", size);
-    logMessage("File size: %d\n", file->size);
     if (file == NULL || file->attributes & ATTR_DIRECTORY) {
         logMessage("File not found\n");
         free(localpath);
         return -ENOENT;
     }
+    logMessage("File size: %d\n", file->size);
+
+    // sizes are kept in 32 bits
+    if (offset + size > UINT_MAX) {
+        free(localpath);
+        return -EFBIG;
+    }
 
-    // TODO: this doesn't account for if the block was not fully written to and space is left in the block
-    if (offset > file->size) {
-        logMessage("Offset greater than file size\n");
+    // a packed file gets its own block back while it's being written, and is packed again when closed
+    res = unpackFile(file);
+    if (res != 0) {
         free(localpath);
-        return 0;
+        return res;
     }
 
-    if (offset + size > file->size) {
-        logMessage("Expanding file size\n");
-        file->size = offset + size;
+    // so do the compressed chunks the write touches, along with the last one if it's past the end
+    if (size > 0) {
+        res = expandFileRange(file, offset > file->size && file->size > 0 ? file->size - 1 : offset, offset + size);
+        if (res != 0) {
+            free(localpath);
+            return res;
+        }
+    }
+
+    // writing past the end leaves a hole between the old end and the offset
+    if (offset > file->size) {
+        logMessage("Offset greater than file size, leaving a hole\n");
+        res = growFile(file, offset);
+        if (res != 0) {
+            free(localpath);
+            return res;
+        }
     }
 
     block = file->first_cluster_low;
@@ -2116,22 +8418,7 @@ static int fs_write(const char *path, const char *buf, size_t size, off_t offset
     logMessage("Block offset: %d\n", blockOffset);
     logMessage("Local offset: %d\n", localOffset);
 
-    // loop through the allocated blocks to find the block at the offset
-    for (int i = 0; i < blockOffset; i++) {
-        // if the block is the last block, allocate a new block
-        if (FAT[block] == USHRT_MAX) {
-            logMessage("Allocating new block\n");
-            unsigned short newBlock = findFreeBlock();
-            FAT[block] = newBlock;
-            FAT[newBlock] = USHRT_MAX;
-        }
-
-        block = FAT[block];
-    }
-
-    logMessage("Starting write at block %d\n", block);
-
-    // write the data
+    // write the data, giving blocks in holes or past the end storage as they are reached
     bytesToWrite = size;
     while (bytesToWrite > 0) {
         unsigned int numBytes = (bytesToWrite > (BLOCKSIZE - localOffset)) ? (BLOCKSIZE - localOffset) : bytesToWrite;
@@ -2140,32 +8427,40 @@ static int fs_write(const char *path, const char *buf, size_t size, off_t offset
         logMessage("\tBytes written: %d\n", bytesWritten);
         logMessage("\tBytes to write: %d\n", bytesToWrite);
 
+        if (fileBlockForWrite(&block, &position, blockOffset) == USHRT_MAX) {
+            logMessage("\tNo free block or hole left to split\n");
+            break;
+        }
+        logMessage("\tWriting to block %d\n", block);
+
         memcpy(&blocks[block].data[localOffset], buf + bytesWritten, numBytes);
+        setBlockChecksum(block);
 
         bytesWritten += numBytes;
         bytesToWrite -= numBytes;
+        blockOffset++;
+        localOffset = 0;
+    }
 
-        if (bytesToWrite > 0) {
-            if (FAT[block] == USHRT_MAX) {
-                logMessage("\tAllocating new block\n");
-                unsigned short newBlock = findFreeBlock();
-                FAT[block] = newBlock;
-                FAT[newBlock] = USHRT_MAX;
-            }
-            logMessage("\tMoving to block %d\n", FAT[block]);
-            block = FAT[block];
-            localOffset = 0;
-        }
+    if (offset + bytesWritten > file->size) {
+        logMessage("Expanding file size\n");
+        file->size = offset + bytesWritten;
     }
 
     free(localpath);
-    return size;
+    return bytesWritten > 0 || size == 0 ? (int)bytesWritten : -ENOSPC;
 }
 
-static int fs_rmdir(const char *path) {
+static int _fs_rmdir(const char *path) {
     dirEntry *entry;
     char *localpath = malloc(strlen(path));
 
+    // a snapshot can only be read
+    if (readOnly) {
+        free(localpath);
+        return -EROFS;
+    }
+
     logMessage("Removing directory %s\n", path);
 
     strcpy(localpath, path);
@@ -2186,10 +8481,16 @@ static int fs_rmdir(const char *path) {
     return 0;
 }
 
-static int fs_unlink(const char *path) {
+static int _fs_unlink(const char *path) {
     dirEntry *entry;
     char *localpath = malloc(strlen(path));
 
+    // a snapshot can only be read
+    if (readOnly) {
+        free(localpath);
+        return -EROFS;
+    }
+
     logMessage("Unlinking file %s\n", path);
 
     strcpy(localpath, path);
@@ -2205,7 +8506,7 @@ static int fs_unlink(const char *path) {
     return 0;
 }
 
-static int fs_statfs(const char *path, struct statvfs *st) {
+static int _fs_statfs(const char *path, struct statvfs *st) {
     (void) path;
 
     logMessage("Getting filesystem stats\n");
@@ -2216,26 +8517,22 @@ static int fs_statfs(const char *path, struct statvfs *st) {
     // Fill the statvfs structure with information about the filesystem
     st->f_bsize = BLOCKSIZE;                // Filesystem block size
     st->f_frsize = BLOCKSIZE;               // Fragment size
-    st->f_blocks = MAXBLOCKS;               // Total number of blocks
+    st->f_blocks = volumeBlocks;            // Total number of blocks
     st->f_bfree = 0;                        // Total number of free blocks
     st->f_bavail = 0;                       // Number of free blocks available to non-privileged processes
     st->f_files = 0;                        // Total number of file nodes (inodes)
     st->f_ffree = 0;                        // Total number of free file nodes
     st->f_favail = 0;                       // Number of free file nodes available to non-privileged processes
     st->f_fsid = 0;                         // Filesystem ID
-    st->f_flag = 0;                         // Mount flags
+    st->f_flag = readOnly ? ST_RDONLY : 0;  // Mount flags
     st->f_namemax = MAXFILENAME;            // Maximum length of filenames
 
-    // Calculate the number of free blocks and file nodes
-    for (int i = 0; i < MAXBLOCKS; i++) {
-        if (FAT[i] == 0) {
-            st->f_bfree++;
-            st->f_bavail++;
-        }
-    }
+    // Calculate the number of free blocks
+    st->f_bfree = countFreeBlocks();
+    st->f_bavail = st->f_bfree;
 
     // Calculate the number of file nodes
-    for (int i = 0; i < MAXBLOCKS * (BLOCKSIZE / sizeof(dirEntry)); i++) {
+    for (unsigned int i = 0; i < volumeBlocks * (BLOCKSIZE / sizeof(dirEntry)); i++) {
         dirEntry *entry = (dirEntry *)&blocks[i / (BLOCKSIZE / sizeof(dirEntry))].data[(i % (BLOCKSIZE / sizeof(dirEntry))) * sizeof(dirEntry)];
         if (entry->name[0] == 0 || entry->attributes == ATTR_DELETED) {
             st->f_ffree++;
@@ -2248,14 +8545,28 @@ static int fs_statfs(const char *path, struct statvfs *st) {
     return 0;
 }
 
-static int fs_release(const char *path, struct fuse_file_info *fi) {
-    (void) path;
+static int _fs_release(const char *path, struct fuse_file_info *fi) {
+    char* localpath = strdup(path);            // duplicate the path for manipulation
+    dirEntry* file = NULL;                     // file being closed
+
     (void) fi;
+
+    // a small file written while it was open goes back into a pack block, and a big one may need defragmenting
+    file = findEntryFromPath(localpath, fuseRoot);
+    if (file != NULL && !(file->attributes & ATTR_DIRECTORY) && !readOnly) {
+        packOrCompressFile(file);
+        if (defragOnline) {
+            defragPending = 1;
+            pthread_cond_signal(&compactionCond);
+        }
+    }
+
+    free(localpath);
     logMessage("File released\n");
     return 0;
 }
 
-static int fs_getxattr(const char *path, const char *name, char *value, size_t size) {
+static int _fs_getxattr(const char *path, const char *name, char *value, size_t size) {
     dirEntry *file;
     char *localpath = malloc(strlen(path));
 
@@ -2286,6 +8597,40 @@ static int fs_getxattr(const char *path, const char *name, char *value, size_t s
     } else if (strcmp(name, "user.size") == 0) {
         free(localpath);
         return file->size;
+    } else if (strcmp(name, "user.index") == 0 && (file->attributes & ATTR_DIRECTORY)) {
+        // "1" if the directory is indexed by name, "0" if it is searched entry by entry
+        free(localpath);
+        if (size == 0) {
+            return 1;
+        }
+        value[0] = getDirectoryIndex(file) != NULL ? '1' : '0';
+        return 1;
+    } else if (strcmp(name, "user.compress") == 0 && !(file->attributes & ATTR_DIRECTORY)) {
+        // "1" if the file's chunks are compressed, "0" if it's stored as it is
+        free(localpath);
+        if (size == 0) {
+            return 1;
+        }
+        value[0] = ISCOMPRESSED(file) ? '1' : '0';
+        return 1;
+    } else if (strcmp(name, "user.snapshots") == 0) {
+        // the names of the image's snapshots, one per line
+        char list[MAXSNAPSHOTS * (MAXFILENAME + 1) + 1] = "";
+        size_t length = 0;
+        free(localpath);
+        for (int i = 0; i < MAXSNAPSHOTS; i++) {
+            if (snapshots[i].state == SNAPSHOTLIVE) {
+                length += sprintf(list + length, "%.11s\n", snapshots[i].name);
+            }
+        }
+        if (size == 0) {
+            return length;
+        }
+        if (size < length) {
+            return -ERANGE;
+        }
+        memcpy(value, list, length);
+        return length;
     } else if (strcmp(name, "security.capability") == 0) {
         free(localpath);
         return 0; // No capabilities
@@ -2295,10 +8640,18 @@ static int fs_getxattr(const char *path, const char *name, char *value, size_t s
     return -ENODATA; // Attribute not found
 }
 
-static int fs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
+static int _fs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
     dirEntry *file;
+    dirEntry *parentDir = NULL;
+    char parentPath[MAXPATH];
     char *localpath = malloc(strlen(path));
 
+    // a snapshot can only be read
+    if (readOnly) {
+        free(localpath);
+        return -EROFS;
+    }
+
     logMessage("Setting xattr %s for file %s\n", name, path);
 
     strcpy(localpath, path);
@@ -2315,23 +8668,148 @@ static int fs_setxattr(const char *path, const char *name, const char *value, si
             return -ENOSPC;
         }
 
+        // an indexed parent files the entry under its name, so index it again after the rename
+        extract_path(localpath, parentPath);
+        parentDir = findParentFromPath(parentPath, fuseRoot);
+        if (parentDir != NULL && getDirectoryIndex(parentDir) == NULL) {
+            parentDir = NULL;
+        }
+        if (parentDir != NULL) {
+            dropDirectoryIndex(parentDir);
+        }
+
         strncpy(file->name, value, size);
         file->name[size] = '\0'; // Null terminate the string
+        file->name_hash = nameHashByte(file->name);
+
+        if (parentDir != NULL) {
+            buildDirectoryIndex(parentDir);
+        }
+        free(localpath);
+        return 0;
+    } else if (strcmp(name, "user.index") == 0) {
+        // "1" indexes a directory by name, "0" turns it back into a plain one
+        free(localpath);
+        if (!(file->attributes & ATTR_DIRECTORY)) {
+            return -ENOTDIR;
+        }
+        if (size == 1 && value[0] == '1') {
+            buildDirectoryIndex(file);
+        } else if (size == 1 && value[0] == '0') {
+            dropDirectoryIndex(file);
+        } else {
+            return -EINVAL;
+        }
+        return 0;
+    } else if (strcmp(name, "user.compress") == 0) {
+        // "1" compresses a file, now and whenever it's written, "0" turns its chunks back into plain blocks
+        int res = 0;
+        free(localpath);
+        if (file->attributes & ATTR_DIRECTORY) {
+            return -EISDIR;
+        }
+        if (size == 1 && value[0] == '1') {
+            file->first_cluster_high |= COMPRESSEDFILE;
+            compressFile(file);
+        } else if (size == 1 && value[0] == '0') {
+            res = expandFileRange(file, 0, file->size);
+            if (res == 0) {
+                file->first_cluster_high &= ~COMPRESSEDFILE;
+            }
+        } else {
+            return -EINVAL;
+        }
+        return res;
+    } else if (strcmp(name, "user.clone") == 0) {
+        // makes the file a copy of the one at the path given, sharing its blocks, since FUSE 2 can't pass
+        // copy_file_range or FICLONE through
+        char sourcePath[MAXPATH];
+        dirEntry* source = NULL;
+        free(localpath);
+        if (size == 0 || size >= MAXPATH) {
+            return -EINVAL;
+        }
+        memcpy(sourcePath, value, size);
+        sourcePath[size] = '\0';
+        source = findEntryFromPath(sourcePath, fuseRoot);
+        if (source == NULL) {
+            return -ENOENT;
+        }
+        return cloneFile(source, file);
+    } else if (strcmp(name, "user.snapshot") == 0 || strcmp(name, "user.rmsnapshot") == 0) {
+        // takes a snapshot of the whole image, or removes one, with the name given, whichever path it's set on
+        char snapshotName[MAXFILENAME + 1];
+        free(localpath);
+        if (size == 0 || size > MAXFILENAME) {
+            return -EINVAL;
+        }
+        memcpy(snapshotName, value, size);
+        snapshotName[size] = '\0';
+        if (strcmp(name, "user.snapshot") == 0) {
+            return takeSnapshot(snapshotName);
+        }
+        return removeSnapshot(snapshotName);
+    } else if (strcmp(name, "user.defrag") == 0) {
+        // a number of MB a second has the worker defragment files in the background no faster than that,
+        // 0 for as fast as it can, and "off" stops it, whichever path it's set on
+        char rate[16];
+        char* end = NULL;
         free(localpath);
+        if (readOnly) {
+            return -EROFS;
+        }
+        if (size == 0 || size >= sizeof(rate)) {
+            return -EINVAL;
+        }
+        memcpy(rate, value, size);
+        rate[size] = '\0';
+        if (strcmp(rate, "off") == 0) {
+            defragOnline = 0;
+            return 0;
+        }
+        defragRate = strtoul(rate, &end, 10);
+        if (*end != '\0') {
+            return -EINVAL;
+        }
+        defragOnline = 1;
+        defragPending = 1;
+        pthread_cond_signal(&compactionCond);
         return 0;
+    } else if (strcmp(name, "user.resize") == 0) {
+        // grows or shrinks the volume to the size given, in bytes or with a K, M or G after it, whichever
+        // path it's set on
+        char sizeText[32];
+        unsigned int numBlocks = 0;
+        free(localpath);
+        if (size == 0 || size >= sizeof(sizeText)) {
+            return -EINVAL;
+        }
+        memcpy(sizeText, value, size);
+        sizeText[size] = '\0';
+        numBlocks = parseVolumeSize(sizeText);
+        if (numBlocks == 0) {
+            return -EINVAL;
+        }
+        return resizefs(numBlocks);
     }
 
     free(localpath);
     return -ENOTSUP; // Operation not supported
 }
 
-static int fs_utimens(const char *path, const struct timespec tv[2]) {
+static int _fs_utimens(const char *path, const struct timespec tv[2]) {
     dirEntry *file;
     char *localpath = malloc(strlen(path));
     struct tm *tm;
     time_t t;
     short date, time;
 
+    // a snapshot can only be read
+    if (readOnly) {
+        free(localpath);
+        return -EROFS;
+    }
+
     logMessage("Updating timestamps for file %s\n", path);
 
     strcpy(localpath, path);
@@ -2366,11 +8844,18 @@ static int fs_utimens(const char *path, const struct timespec tv[2]) {
     return 0;
 }
 
-static int fs_truncate(const char *path, off_t size) {
+static int _fs_truncate(const char *path, off_t size) {
     char* localpath = malloc(strlen(path));
     dirEntry* file = NULL;
+    int res = 0;
     (void) size;
 
+    // a snapshot can only be read
+    if (readOnly) {
+        free(localpath);
+        return -EROFS;
+    }
+
     strcpy(localpath, path);
 
     logMessage("Truncating file %s to size %ld\n", path, size);
@@ -2385,58 +8870,322 @@ static int fs_truncate(const char *path, off_t size) {
 
     logMessage("Truncating file %s to size %ld\n", path, size);
 
+    // a packed file is cut or grown in a block of its own, then packed again if it's still small
+    if (size > UINT_MAX) {
+        free(localpath);
+        return -EFBIG;
+    }
+    res = unpackFile(file);
+    if (res != 0) {
+        free(localpath);
+        return res;
+    }
+
+    // the compressed chunk the file will end in goes back to plain blocks, so it can be cut or grown
+    if (size > 0 && file->size > 0) {
+        unsigned long long end = (unsigned long long)size < file->size ? (unsigned long long)size : file->size;
+        res = expandFileRange(file, end - 1, end);
+        if (res != 0) {
+            free(localpath);
+            return res;
+        }
+    }
+
     if (size == 0) {
-        // free the blocks used by the file
+        // keep the first block, and leave the rest of the chain to be freed in the background. Nothing
+        // past the size is ever read, so the blocks don't need clearing
         unsigned short firstBlock = file->first_cluster_low;
-        unsigned short blockToFree = firstBlock;
         logMessage("\tTruncate: first block: %d\n", firstBlock);
-        logMessage("\tTruncate: size: %d\n", size);
-        while (blockToFree != USHRT_MAX) {
-            unsigned short nextBlock = FAT[blockToFree];
-            // 0 out the block
-            memset(&blocks[blockToFree].data, 0, BLOCKSIZE);
-            FAT[blockToFree] = 0;
-            logMessage("\tFreeing block %d\n", blockToFree);
-            blockToFree = nextBlock;
-        }
+        orphanChain(FAT[firstBlock], firstBlock, ORPHANFATLINK);
         FAT[firstBlock] = USHRT_MAX;
 
         file->size = 0;
+        packOrCompressFile(file);
 
         free(localpath);
         return 0;
     }
 
+    // growing only adds a hole
+    if (size > file->size) {
+        res = growFile(file, size);
+        packOrCompressFile(file);
+        free(localpath);
+        return res;
+    }
+
     // Implement the logic to truncate the file to the specified size
     if (size < file->size) {
-        unsigned short block = file->first_cluster_low;
-        off_t offset = size;
-        while (offset > BLOCKSIZE) {
-            block = FAT[block];
-            offset -= BLOCKSIZE;
+        unsigned short link = file->first_cluster_low;
+        unsigned int position = 0;
+        unsigned int lastBlock = (size - 1) / BLOCKSIZE;
+        while (position + chainSpan(link) <= lastBlock) {
+            position += chainSpan(link);
+            link = *chainLink(link);
         }
 
-        if (offset > 0) {
-            memset(&blocks[block].data[offset], 0, BLOCKSIZE - offset);
+        // a hole the new end falls in is cut short, a block has the rest of it cleared
+        if (ISHOLE(link) && !ISREFERENCE(link)) {
+            holes[link - HOLEBASE].length = lastBlock - position + 1;
         }
-
-        block = FAT[block];
-        while (block != USHRT_MAX) {
-            unsigned short next_block = FAT[block];
-            FAT[block] = 0;
-            block = next_block;
+        else if (size % BLOCKSIZE > 0) {
+            memset(&blocks[link].data[size % BLOCKSIZE], 0, BLOCKSIZE - size % BLOCKSIZE);
+            setBlockChecksum(link);
         }
+
+        // end the chain at the last link kept, and leave the rest to be freed in the background
+        orphanChain(*chainLink(link), link, ORPHANFATLINK);
+        *chainLink(link) = USHRT_MAX;
     }
 
     file->size = size;
+    packOrCompressFile(file);
 
     free(localpath);
     return 0;
 }
 
+static int _fs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    dirEntry* file = NULL;                          // file to allocate space for
+    unsigned long long end = offset + length;       // byte after the range
+    int res = 0;                                    // result
+    char* localpath = strdup(path);                 // duplicate the path for manipulation
+
+    (void) fi;
+
+    logMessage("Allocating %ld bytes at %ld in %s, mode %d\n", length, offset, path, mode);
+
+    file = findEntryFromPath(localpath, fuseRoot);
+    free(localpath);
+
+    if (file == NULL) {
+        return -ENOENT;
+    }
+    if (readOnly) {
+        return -EROFS;
+    }
+    if (file->attributes & ATTR_DIRECTORY) {
+        return -EISDIR;
+    }
+    if (offset < 0 || length <= 0) {
+        return -EINVAL;
+    }
+    if (end > UINT_MAX) {
+        return -EFBIG;
+    }
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+        return -EOPNOTSUPP;
+    }
+
+    // space asked for is kept in blocks of the file's own, so a packed file stays unpacked
+    res = unpackFile(file);
+    if (res != 0) {
+        return res;
+    }
+
+    // punching a hole never changes the size. the compressed chunks next to the range go back to plain
+    // blocks along with the ones in it, since the new hole could end up against theirs
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        if (!(mode & FALLOC_FL_KEEP_SIZE) || (mode & FALLOC_FL_ZERO_RANGE)) {
+            return -EOPNOTSUPP;
+        }
+        if (end > file->size) {
+            end = file->size;
+        }
+        if ((unsigned long long)offset >= end) {
+            return 0;
+        }
+        res = expandFileRange(file, offset > BLOCKSIZE ? offset - BLOCKSIZE : 0, end + BLOCKSIZE);
+        return res == 0 ? punchFileRange(file, offset, end) : res;
+    }
+
+    // so do the ones in the range, and the last one if the file grows
+    if (file->size > 0) {
+        res = expandFileRange(file, (unsigned long long)offset < file->size ? offset : file->size - 1, end);
+        if (res != 0) {
+            return res;
+        }
+    }
+
+    // reserve the blocks, in one run if possible, then grow the file unless asked not to. Growing comes
+    // second so a failed call leaves the size alone; blocks it did reserve past the end are kept, as with
+    // FALLOC_FL_KEEP_SIZE. Once the chain reaches the end, growing needs no hole and can't fail
+    res = allocateFileRange(file, offset / BLOCKSIZE, (end + BLOCKSIZE - 1) / BLOCKSIZE - offset / BLOCKSIZE);
+    if (res == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && end > file->size) {
+        res = growFile(file, end);
+    }
+
+    // blocks that were already stored keep their data unless the range is to be zeroed
+    if (res == 0 && (mode & FALLOC_FL_ZERO_RANGE)) {
+        zeroFileRange(file, offset, end);
+    }
+
+    return res;
+}
+
+// Locked entry points. FUSE runs callbacks on several threads and the compaction worker rewrites
+// directory blocks in the background, so every callback holds fsLock for its whole duration
+
+static void* fs_init(struct fuse_conn_info *conn) {
+    (void) conn;
+
+    // start the background workers here and not in mountfs, since fuse_main forks into the background.
+    // files written before the mount may need defragmenting too
+    compactionWorkerRunning = 1;
+    defragPending = defragOnline && !readOnly;
+    pthread_create(&compactionThread, NULL, compactionWorker, NULL);
+
+    return NULL;
+}
+
+static void fs_destroy(void *private_data) {
+    (void) private_data;
+
+    // stop the worker, then finish whatever it didn't get to
+    pthread_mutex_lock(&fsLock);
+    compactionWorkerRunning = 0;
+    pthread_cond_signal(&compactionCond);
+    pthread_mutex_unlock(&fsLock);
+    pthread_join(compactionThread, NULL);
+
+    compactPendingDirectories();
+    deleteSnapshots(UINT_MAX);
+    freeOrphanBlocks(UINT_MAX);
+    reclaimFreedBlocks();
+}
+
+static int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    int ret;
+    pthread_mutex_lock(&fsLock);
+    ret = _fs_create(path, mode, fi);
+    pthread_mutex_unlock(&fsLock);
+    return ret;
+}
+
+static int fs_getattr(const char *path, struct stat *st) {
+    int ret;
+    pthread_mutex_lock(&fsLock);
+    ret = _fs_getattr(path, st);
+    pthread_mutex_unlock(&fsLock);
+    return ret;
+}
+
+static int fs_getxattr(const char *path, const char *name, char *value, size_t size) {
+    int ret;
+    pthread_mutex_lock(&fsLock);
+    ret = _fs_getxattr(path, name, value, size);
+    pthread_mutex_unlock(&fsLock);
+    return ret;
+}
+
+static int fs_mkdir(const char* path, mode_t mode) {
+    int ret;
+    pthread_mutex_lock(&fsLock);
+    ret = _fs_mkdir(path, mode);
+    pthread_mutex_unlock(&fsLock);
+    return ret;
+}
+
+static int fs_open(const char *path, struct fuse_file_info *fi) {
+    int ret;
+    pthread_mutex_lock(&fsLock);
+    ret = _fs_open(path, fi);
+    pthread_mutex_unlock(&fsLock);
+    return ret;
+}
+
+static int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    int ret;
+    pthread_mutex_lock(&fsLock);
+    ret = _fs_read(path, buf, size, offset, fi);
+    pthread_mutex_unlock(&fsLock);
+    return ret;
+}
+
+static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    int ret;
+    pthread_mutex_lock(&fsLock);
+    ret = _fs_readdir(path, buf, filler, offset, fi);
+    pthread_mutex_unlock(&fsLock);
+    return ret;
+}
+
+static int fs_release(const char *path, struct fuse_file_info *fi) {
+    int ret;
+    pthread_mutex_lock(&fsLock);
+    ret = _fs_release(path, fi);
+    pthread_mutex_unlock(&fsLock);
+    return ret;
+}
+
+static int fs_rmdir(const char *path) {
+    int ret;
+    pthread_mutex_lock(&fsLock);
+    ret = _fs_rmdir(path);
+    pthread_mutex_unlock(&fsLock);
+    return ret;
+}
+
+static int fs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
+    int ret;
+    pthread_mutex_lock(&fsLock);
+    ret = _fs_setxattr(path, name, value, size, flags);
+    pthread_mutex_unlock(&fsLock);
+    return ret;
+}
+
+static int fs_statfs(const char *path, struct statvfs *st) {
+    int ret;
+    pthread_mutex_lock(&fsLock);
+    ret = _fs_statfs(path, st);
+    pthread_mutex_unlock(&fsLock);
+    return ret;
+}
+
+static int fs_truncate(const char *path, off_t size) {
+    int ret;
+    pthread_mutex_lock(&fsLock);
+    ret = _fs_truncate(path, size);
+    pthread_mutex_unlock(&fsLock);
+    return ret;
+}
+
+static int fs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    int ret;
+    pthread_mutex_lock(&fsLock);
+    ret = _fs_fallocate(path, mode, offset, length, fi);
+    pthread_mutex_unlock(&fsLock);
+    return ret;
+}
+
+static int fs_unlink(const char *path) {
+    int ret;
+    pthread_mutex_lock(&fsLock);
+    ret = _fs_unlink(path);
+    pthread_mutex_unlock(&fsLock);
+    return ret;
+}
+
+static int fs_utimens(const char *path, const struct timespec tv[2]) {
+    int ret;
+    pthread_mutex_lock(&fsLock);
+    ret = _fs_utimens(path, tv);
+    pthread_mutex_unlock(&fsLock);
+    return ret;
+}
+
+static int fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    int ret;
+    pthread_mutex_lock(&fsLock);
+    ret = _fs_write(path, buf, size, offset, fi);
+    pthread_mutex_unlock(&fsLock);
+    return ret;
+}
+
 static struct fuse_operations fuse_ops = {
     .getattr = fs_getattr,
     .truncate = fs_truncate,
+    .fallocate = fs_fallocate,
     .readdir = fs_readdir,
     .open = fs_open,
     .read = fs_read,
@@ -2449,18 +9198,20 @@ static struct fuse_operations fuse_ops = {
     .release = fs_release,
     .getxattr = fs_getxattr,
     .setxattr = fs_setxattr,
-    .utimens = fs_utimens
+    .utimens = fs_utimens,
+    .init = fs_init,
+    .destroy = fs_destroy
 };
 
 
 int mountfs(char* mountpath, char* filesystem) {
     int fuse_argc;
-    char* fuse_argv[3];
+    char* fuse_argv[5];
     int ret;
 
     fprintf(stderr, "Mounting filesystem %s at %s\n", filesystem, mountpath);
 
-    fuseRoot = (dirEntry*)&blocks[0];
+    fuseRoot = (dirEntry*)&blocks[rootBlock];
 
     fuse_argv[0] = "cfs";
     fuse_argv[1] = mountpath;
@@ -2473,6 +9224,12 @@ int mountfs(char* mountpath, char* filesystem) {
         fuse_argc = 2;
     }
 
+    // a snapshot is mounted read only, so the kernel refuses changes before they get here
+    if (readOnly) {
+        fuse_argv[fuse_argc++] = "-o";
+        fuse_argv[fuse_argc++] = "ro";
+    }
+
     ret = fuse_main(fuse_argc, fuse_argv, &fuse_ops, NULL);
 
     return ret;
@@ -2485,19 +9242,38 @@ int main(int argc, char *argv[]) {
     int add_flag = 0;           // flag to check if we need to add a file to the file system
     int remove_flag = 0;        // flag to check if we need to remove a file from the file system
     int add_dir_flag = 0;       // flag to check if we need to add a directory to the file system
+    int import_flag = 0;        // flag to check if we need to import a host directory tree
+    int tar_import_flag = 0;    // flag to check if we need to import a tar archive from stdin
+    int tar_export_flag = 0;    // flag to check if we need to export a tar archive to stdout
     int extract_flag = 0;       // flag to check if we need to extract a file from the file system
     int interactive_flag = 0;   // flag to check if we need to start the interactive shell
+    int transaction_flag = 0;   // flag to check if a batch should only be written if all of it succeeds
+    int trim_flag = 0;          // flag to check if we need to punch every free block out of the image
+    int scrub_flag = 0;         // flag to check if we need to check every block against its checksum
+    int numBadBlocks = 0;       // blocks the scrub found bad
+    int dedup_flag = 0;         // flag to check if we need to share identical blocks across the image
+    int defrag_flag = 0;        // flag to check if we need to defragment the files
+    int compact_flag = 0;       // flag to check if we need to move every block in use to the front
+    char* resizeSize = NULL;    // size to grow or shrink the volume to
+    int list_snapshots_flag = 0; // flag to check if we need to list the snapshots
     int mount_flag = 0;         // flag to check if we need to mount the file system
     int opt;                    // option for the command line arguments
     char* fsname = NULL;        // name of the file system
     char* filename = NULL;      // name of the file to add
     char* intpath = NULL;       // internal path of the file to add
     char* mountpath = NULL;     // path to mount the file system
+    char* outputDir = NULL;     // directory to extract files into
+    char* hostDir = NULL;       // host directory tree to import
+    char* exportPath = NULL;    // internal path to export as a tar archive
+    char* scriptPath = NULL;    // script of shell commands to run
+    char* takeName = NULL;      // name of a snapshot to take
+    char* removeName = NULL;    // name of a snapshot to remove
+    char* snapshotName = NULL;  // name of the snapshot to look at instead of the file system
     FILE* fsfile = NULL;        // file system file
     dirEntry* root = NULL;      // pointer to the root directory
 
     // parse the command line arguments
-    while ((opt = getopt(argc, argv, "f:clvi:a:r:d:e:Im:h")) != -1) {
+    while ((opt = getopt(argc, argv, "f:clvi:a:r:d:R:TE:xzDun:N:LS:Fg:KZ:e:o:Ib:tpsCk:m:h")) != -1) {
         switch (opt) {
         case 'f': // file system name
             fsname = malloc(strlen(optarg));
@@ -2530,13 +9306,91 @@ int main(int argc, char *argv[]) {
             filename = malloc(strlen(optarg));
             strcpy(filename, optarg);
             break;
+        case 'R': // import a host directory tree
+            import_flag = 1;
+            hostDir = strdup(optarg);
+            break;
+        case 'T': // import a tar archive from stdin
+            tar_import_flag = 1;
+            break;
+        case 'E': // export a tar archive to stdout
+            tar_export_flag = 1;
+            exportPath = strdup(optarg);
+            break;
+        case 'x': // index new directories by name
+            indexDirectories = 1;
+            break;
+        case 'z': // compress new files
+            compressFiles = 1;
+            break;
+        case 'D': // share the blocks of files as they're written
+            dedupFiles = 1;
+            break;
+        case 'u': // share identical blocks across the image
+            dedup_flag = 1;
+            break;
+        case 'n': // take a snapshot
+            takeName = strdup(optarg);
+            break;
+        case 'N': // remove a snapshot
+            removeName = strdup(optarg);
+            break;
+        case 'L': // list the snapshots
+            list_snapshots_flag = 1;
+            break;
+        case 'S': // look at a snapshot
+            snapshotName = strdup(optarg);
+            break;
+        case 'F': // defragment the files
+            defrag_flag = 1;
+            break;
+        case 'g': // defragment the files in the background while mounted
+            defragOnline = 1;
+            defragRate = strtoul(optarg, NULL, 10);
+            break;
+        case 'K': // compact the image
+            compact_flag = 1;
+            break;
+        case 'Z': // resize the volume
+            resizeSize = strdup(optarg);
+            break;
         case 'e': // extract a file from the file system
             extract_flag = 1;
             intpath = strdup(optarg);
             break;
+        case 'o': // directory to extract into
+            outputDir = strdup(optarg);
+            break;
         case 'I': // interactive shell
             interactive_flag = 1;
             break;
+        case 'b': // batch of shell commands
+            scriptPath = strdup(optarg);
+            break;
+        case 't': // run the batch as a transaction
+            transaction_flag = 1;
+            break;
+        case 'p': // punch freed blocks out of the image
+            punchHoles = 1;
+            break;
+        case 's': // trim the image
+            trim_flag = 1;
+            break;
+        case 'C': // scrub the image
+            scrub_flag = 1;
+            break;
+        case 'k': // when to check blocks against their checksums
+            if (strcmp(optarg, "always") == 0) {
+                verifyChecksums = VERIFYALWAYS;
+            } else if (strcmp(optarg, "sampled") == 0) {
+                verifyChecksums = VERIFYSAMPLED;
+            } else if (strcmp(optarg, "off") == 0) {
+                verifyChecksums = VERIFYOFF;
+            } else {
+                fprintf(stderr, "Unknown checksum mode %s, use always, sampled or off\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
         case 'm': // mount the file system
             mount_flag = 1;
             mountpath = strdup(optarg);
@@ -2552,7 +9406,7 @@ int main(int argc, char *argv[]) {
     }
 
     // check if the file system name is provided
-    if (fsname == NULL && !interactive_flag && !create_flag) {
+    if (fsname == NULL && !interactive_flag && !create_flag && scriptPath == NULL) {
         fprintf(stderr, "No file system name provided, exiting\n");
         fprintf(stderr, "Use %s -h for help\n", argv[0]);
         exit(1);
@@ -2565,6 +9419,16 @@ int main(int argc, char *argv[]) {
         exit(EXIT_SUCCESS);
     }
 
+    // check if we need to run a batch
+    if (scriptPath != NULL) {
+        runBatch(scriptPath, fsname, transaction_flag);
+        exit(EXIT_SUCCESS);
+    }
+    else if (transaction_flag) {
+        fprintf(stderr, "-t only applies to a batch given with -b, exiting\n");
+        exit(1);
+    }
+
     // check if we need to create the fs
     if (create_flag) {
       // create the file system
@@ -2578,8 +9442,19 @@ int main(int argc, char *argv[]) {
     // check if a file system is loaded
     fsLoadedCheck();
 
+    // a snapshot can be listed, extracted, exported and mounted, but not changed
+    if (snapshotName != NULL) {
+        if (create_flag || add_flag || add_dir_flag || import_flag || tar_import_flag || remove_flag || dedup_flag ||
+            takeName != NULL || removeName != NULL || defrag_flag || defragOnline || compact_flag ||
+            resizeSize != NULL) {
+            fprintf(stderr, "A snapshot can't be changed, exiting\n");
+            exit(1);
+        }
+        selectSnapshot(snapshotName);
+    }
+
     // set the root directory
-    root = (dirEntry*)&blocks[0];
+    root = (dirEntry*)&blocks[rootBlock];
 
     // check if we are adding a directory
     if (add_dir_flag && filename != NULL) {
@@ -2611,6 +9486,33 @@ int main(int argc, char *argv[]) {
         printf("Added %s to %s\n", filename, intpath);
     }
 
+    // check if we are importing a host directory tree
+    if (import_flag) {
+        // check that we're not adding a file as well
+        if (add_flag) {
+            fprintf(stderr, "Cannot add a file and import a directory at the same time, exiting\n");
+            exit(1);
+        }
+
+        importTree(hostDir, intpath != NULL ? intpath : "/", root);
+    }
+
+    // check if we are importing a tar archive
+    if (tar_import_flag) {
+        importTar(STDIN_FILENO, intpath != NULL ? intpath : "/", root);
+    }
+
+    // check if we are exporting a tar archive
+    if (tar_export_flag) {
+        // verbose output goes to stdout too, and would end up in the archive
+        if (verbose) {
+            fprintf(stderr, "Cannot be verbose while exporting to standard output, exiting\n");
+            exit(1);
+        }
+
+        exportTar(STDOUT_FILENO, exportPath, root);
+    }
+
     // check if we are extracting a file
     if (extract_flag) {
         // check that the filename is set
@@ -2626,7 +9528,7 @@ int main(int argc, char *argv[]) {
         }
 
         // extract the file
-        extractFile(intpath, root);
+        extractFile(intpath, root, outputDir);
     }
 
     // check if we need to list the contents of the file system
@@ -2653,6 +9555,70 @@ int main(int argc, char *argv[]) {
         removeDirectoryEntry(intpath, root);
     }
 
+    // check if we need to share identical blocks across the image
+    if (dedup_flag) {
+        dedupfs();
+    }
+
+    // check if we need to remove a snapshot. its entries go with the rest of the deferred work below
+    if (removeName != NULL && removeSnapshot(removeName) != 0) {
+        fprintf(stderr, "Snapshot %s does not exist, exiting\n", removeName);
+        exit(1);
+    }
+
+    // check if we need to take a snapshot, of everything this run has done
+    if (takeName != NULL) {
+        int res = takeSnapshot(takeName);
+        if (res != 0) {
+            fprintf(stderr, "Cannot take snapshot %s: %s, exiting\n", takeName, strerror(-res));
+            exit(1);
+        }
+        printf("Took snapshot %s\n", takeName);
+    }
+
+    // compact the directories left behind by the removal, and punch out what was freed
+    compactPendingDirectories();
+    deleteSnapshots(UINT_MAX);
+    freeOrphanBlocks(UINT_MAX);
+    reclaimFreedBlocks();
+
+    // check if we need to defragment the files, once whatever this run freed is free
+    if (defrag_flag) {
+        defragfs();
+    }
+
+    // check if we need to compact the image
+    if (compact_flag) {
+        compactfs(fsname);
+    }
+
+    // check if we need to resize the volume, after compacting so there's as little left to move as can be
+    if (resizeSize != NULL) {
+        unsigned int numBlocks = parseVolumeSize(resizeSize);
+        int res = numBlocks != 0 ? resizefs(numBlocks) : -EINVAL;
+        if (res != 0) {
+            fprintf(stderr, "Cannot resize to %s: %s, exiting\n", resizeSize, strerror(-res));
+            exit(1);
+        }
+        printf("Resized the volume to %u blocks (%.1f MB), %u free\n", volumeBlocks,
+               volumeBlocks * (double)BLOCKSIZE / 1e6, countFreeBlocks());
+    }
+
+    // check if we need to list the snapshots
+    if (list_snapshots_flag) {
+        listSnapshots();
+    }
+
+    // check if we need to trim the image
+    if (trim_flag) {
+        trimfs();
+    }
+
+    // check if we need to scrub the image
+    if (scrub_flag) {
+        numBadBlocks = scrubfs();
+    }
+
     // check if we need to mount the file system
     if (mount_flag) {
         // check that the mount path is set
@@ -2670,5 +9636,6 @@ int main(int argc, char *argv[]) {
     free(filename);
     free(intpath);
 
-    return 0;
+    // a scrub that found bad blocks fails the run, so scripts can notice
+    return numBadBlocks > 0 ? 1 : 0;
 }